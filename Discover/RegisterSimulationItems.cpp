@@ -10,6 +10,7 @@
 
 #include "AdaptiveMeshAmrvacFile.hpp"
 #include "AdaptiveMeshAsciiFile.hpp"
+#include "AdaptiveMeshBinaryFile.hpp"
 #include "AdaptiveMeshDustDistribution.hpp"
 #include "AdaptiveMeshDustGrid.hpp"
 #include "AdaptiveMeshGeometry.hpp"
@@ -52,6 +53,7 @@
 #include "DustGrid.hpp"
 #include "DustMassDustCompNormalization.hpp"
 #include "DustMixPopulation.hpp"
+#include "DynamicAssigner.hpp"
 #include "EdgeOnDustCompNormalization.hpp"
 #include "EinastoGeometry.hpp"
 #include "ElectronDustMix.hpp"
@@ -178,6 +180,7 @@
 #include "VoronoiDustGrid.hpp"
 #include "VoronoiGeometry.hpp"
 #include "VoronoiMeshAsciiFile.hpp"
+#include "VoronoiMeshBinaryFile.hpp"
 #include "VoronoiStellarComp.hpp"
 #include "WeingartnerDraineDustMix.hpp"
 #include "XDustCompNormalization.hpp"
@@ -332,9 +335,11 @@ void RegisterSimulationItems::registerAll()
     // mesh file representations
     add<AdaptiveMeshFile>(false);
     add<AdaptiveMeshAsciiFile>();
+    add<AdaptiveMeshBinaryFile>();
     add<AdaptiveMeshAmrvacFile>();
     add<VoronoiMeshFile>(false);
     add<VoronoiMeshAsciiFile>();
+    add<VoronoiMeshBinaryFile>();
 
     // meshes for the dust grids
     add<Mesh>(false);
@@ -446,6 +451,7 @@ void RegisterSimulationItems::registerAll()
     add<IdenticalAssigner>();
     add<StaggeredAssigner>();
     add<SequentialAssigner>();
+    add<DynamicAssigner>();
     add<RandomAssigner>();
 }
 
@@ -5,21 +5,30 @@
 
 #include "AdjustableSkirtSimulation.hpp"
 
+#include "ConfigurationHash.hpp"
 #include "DoublePropertyHandler.hpp"
+#include "DustSystem.hpp"
+#include "FITSInOut.hpp"
 #include "FatalError.hpp"
 #include "FilePaths.hpp"
 #include "FitScheme.hpp"
 #include "InstrumentFrame.hpp"
 #include "InstrumentSystem.hpp"
+#include "ItemListPropertyHandler.hpp"
+#include "ItemPropertyHandler.hpp"
 #include "Log.hpp"
+#include "MonteCarloSimulation.hpp"
 #include "MultiFrameInstrument.hpp"
 #include "ParallelFactory.hpp"
 #include "Simulation.hpp"
+#include "SimulationItemDiscovery.hpp"
 #include "StellarSystem.hpp"
 #include "Units.hpp"
 #include "WavelengthGrid.hpp"
 #include "XmlHierarchyCreator.hpp"
 
+#include <cmath>
+#include <QDir>
 #include <QFile>
 #include <QFileInfo>
 #include <QSharedPointer>
@@ -27,7 +36,7 @@
 ////////////////////////////////////////////////////////////////////
 
 AdjustableSkirtSimulation::AdjustableSkirtSimulation()
-    :_units(0)
+    :_reuseSetup(true), _verifyReuse(false), _units(0)
 {
 }
 
@@ -66,17 +75,7 @@ void AdjustableSkirtSimulation::setupSelfBefore()
     QSharedPointer<Simulation> simulation( creator.createHierarchy<Simulation>(adjustedSkiContent()) );
 
     // setup any simulation attributes that are not loaded from the ski content
-    // copy file paths
-    FilePaths* myfilepaths = find<FilePaths>();
-    FilePaths* itsfilepaths = simulation->filePaths();
-    itsfilepaths->setOutputPrefix(myfilepaths->outputPrefix() + "_def");
-    itsfilepaths->setInputPath(myfilepaths->inputPath());
-    itsfilepaths->setOutputPath(myfilepaths->outputPath());
-    // copy number of threads
-    int threads = find<FitScheme>()->parallelThreadCount();
-    if (threads > 0) simulation->parallelFactory()->setMaxThreadCount(threads);
-    // suppress log messages
-    simulation->log()->setLowestLevel(Log::Error);
+    copyAttributes(simulation.data(), "def");
 
     // run the simulation
     find<Log>()->info("Performing the simulation with default attribute values...");
@@ -116,6 +115,34 @@ QString AdjustableSkirtSimulation::skiName() const
 
 ////////////////////////////////////////////////////////////////////
 
+void AdjustableSkirtSimulation::setReuseSetup(bool value)
+{
+    _reuseSetup = value;
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool AdjustableSkirtSimulation::reuseSetup() const
+{
+    return _reuseSetup;
+}
+
+////////////////////////////////////////////////////////////////////
+
+void AdjustableSkirtSimulation::setVerifyReuse(bool value)
+{
+    _verifyReuse = value;
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool AdjustableSkirtSimulation::verifyReuse() const
+{
+    return _verifyReuse;
+}
+
+////////////////////////////////////////////////////////////////////
+
 void AdjustableSkirtSimulation::performWith(AdjustableSkirtSimulation::ReplacementDict replacements,
                                             QString prefix)
 {
@@ -125,10 +152,52 @@ void AdjustableSkirtSimulation::performWith(AdjustableSkirtSimulation::Replaceme
                                                 adjustedSkiContent(replacements)) );
 
     // setup any simulation attributes that are not loaded from the ski content
+    copyAttributes(simulation.data(), prefix);
+
+    // if the setup should not be reused, simply run the new simulation
+    if (!_reuseSetup)
+    {
+        simulation->setupAndRun();
+        return;
+    }
+
+    // calculate the configuration keys before the simulation is setup
+    ConfigurationKeys keys = configurationKeys(simulation.data());
+
+    // obtain a simulation retained by a previous invocation, if any; other invocations may be running concurrently
+    RetainedSimulation retained;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (!_retainedv.isEmpty()) retained = _retainedv.takeLast();
+    }
+
+    // move the changed items into the retained simulation, if possible; otherwise use the new simulation
+    bool reused = retained.simulation && adjustRetained(retained, simulation.data(), keys);
+    if (reused)
+        retained.simulation->filePaths()->setOutputPrefix(simulation->filePaths()->outputPrefix());
+    else
+        retained.simulation = simulation;
+    retained.keys = keys;
+
+    // run the simulation (if this throws an exception, the simulation is not retained)
+    retained.simulation->setupAndRun();
+
+    // if requested, verify the results of a reused simulation against a fresh simulation
+    if (reused && _verifyReuse) verifyRerun(retained.simulation.data(), replacements, prefix);
+
+    // retain the simulation for subsequent invocations
+    std::unique_lock<std::mutex> lock(_mutex);
+    _retainedv << retained;
+}
+
+////////////////////////////////////////////////////////////////////
+
+void AdjustableSkirtSimulation::copyAttributes(Simulation* simulation, QString suffix)
+{
     // copy file paths
     FilePaths* myfilepaths = find<FilePaths>();
     FilePaths* itsfilepaths = simulation->filePaths();
-    itsfilepaths->setOutputPrefix(myfilepaths->outputPrefix() + "_" + prefix);
+    itsfilepaths->setOutputPrefix(myfilepaths->outputPrefix() + "_" + suffix);
     itsfilepaths->setInputPath(myfilepaths->inputPath());
     itsfilepaths->setOutputPath(myfilepaths->outputPath());
     // copy number of threads
@@ -136,8 +205,123 @@ void AdjustableSkirtSimulation::performWith(AdjustableSkirtSimulation::Replaceme
     if (threads > 0) simulation->parallelFactory()->setMaxThreadCount(threads);
     // suppress log messages
     simulation->log()->setLowestLevel(Log::Error);
-    // run the simulation
-    simulation->setupAndRun();
+}
+
+////////////////////////////////////////////////////////////////////
+
+AdjustableSkirtSimulation::ConfigurationKeys AdjustableSkirtSimulation::configurationKeys(Simulation* simulation)
+{
+    ConfigurationKeys keys;
+
+    // the type and property values of the simulation itself
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    ConfigurationHash::addProperties(hash, simulation);
+    keys[QByteArray()] = hash.result();
+
+    // the configuration of the items held by each item property or item list property
+    foreach (PropertyHandlerPtr handler, SimulationItemDiscovery::createPropertyHandlersList(simulation))
+    {
+        QList<SimulationItem*> items;
+        ItemPropertyHandler* itemhandler = dynamic_cast<ItemPropertyHandler*>(handler.data());
+        if (itemhandler && itemhandler->value()) items << itemhandler->value();
+        ItemListPropertyHandler* itemlisthandler = dynamic_cast<ItemListPropertyHandler*>(handler.data());
+        if (itemlisthandler) items = itemlisthandler->value();
+        if (itemhandler || itemlisthandler)
+        {
+            QCryptographicHash itemhash(QCryptographicHash::Sha1);
+            foreach (SimulationItem* item, items) ConfigurationHash::add(itemhash, item);
+            keys[handler->name()] = itemhash.result();
+        }
+    }
+    return keys;
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool AdjustableSkirtSimulation::adjustRetained(RetainedSimulation& retained, Simulation* simulation,
+                                               const ConfigurationKeys& keys)
+{
+    // the type and property values of the simulation itself must be identical
+    MonteCarloSimulation* target = dynamic_cast<MonteCarloSimulation*>(retained.simulation.data());
+    if (!target || keys.value(QByteArray()) != retained.keys.value(QByteArray())) return false;
+
+    // determine the items to be replaced, and verify that no other items have changed
+    QHash<QByteArray, PropertyHandlerPtr> sources = SimulationItemDiscovery::createPropertyHandlersDict(simulation);
+    QList<QPair<ItemPropertyHandler*,SimulationItem*> > replacements;
+    foreach (PropertyHandlerPtr handler, SimulationItemDiscovery::createPropertyHandlersList(target))
+    {
+        QByteArray name = handler->name();
+        if (!keys.contains(name)) continue;  // not an item property
+
+        // the instrument system, and a dust system storing absorption rates, hold results of the previous run
+        ItemPropertyHandler* itemhandler = dynamic_cast<ItemPropertyHandler*>(handler.data());
+        SimulationItem* item = itemhandler ? itemhandler->value() : 0;
+        DustSystem* ds = dynamic_cast<DustSystem*>(item);
+        bool holdsResults = dynamic_cast<InstrumentSystem*>(item) || (ds && ds->storeabsorptionrates());
+        if (holdsResults || keys.value(name) != retained.keys.value(name))
+        {
+            // other items may be used by the rest of the simulation, so they can't be replaced
+            if (!dynamic_cast<InstrumentSystem*>(item) && !dynamic_cast<StellarSystem*>(item) && !ds) return false;
+            ItemPropertyHandler* source = dynamic_cast<ItemPropertyHandler*>(sources.value(name).data());
+            SimulationItem* replacement = source ? source->value() : 0;
+            if (!replacement) return false;
+            replacements << qMakePair(itemhandler, replacement);
+        }
+    }
+
+    // move the new items into the retained simulation; the setters delete the items being replaced
+    for (int i=0; i<replacements.size(); i++)
+    {
+        if (!replacements[i].first->setValue(replacements[i].second))
+            throw FATALERROR("Could not move a simulation item into the retained simulation");
+    }
+    target->prepareRerun();
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+
+void AdjustableSkirtSimulation::verifyRerun(Simulation* reused, ReplacementDict replacements, QString prefix)
+{
+    // construct, setup and run a fresh simulation with the same configuration, using a different output prefix
+    XmlHierarchyCreator creator;
+    QSharedPointer<Simulation> fresh( creator.createHierarchy<Simulation>(adjustedSkiContent(replacements)) );
+    copyAttributes(fresh.data(), prefix + "_fresh");
+    fresh->setupAndRun();
+
+    // get the FITS files written by the reused simulation (excluding those written by the fresh simulation)
+    QFileInfo reusedbase(reused->filePaths()->output(""));
+    QString freshname = QFileInfo(fresh->filePaths()->output("")).fileName();
+    QStringList filenames = reusedbase.dir().entryList(QStringList() << reusedbase.fileName() + "*.fits", QDir::Files);
+
+    // compare the data in each of these files with the data in the corresponding file of the fresh simulation
+    int Nfiles = 0;
+    double maxdiff = 0.;
+    foreach (QString filename, filenames)
+    {
+        if (filename.startsWith(freshname)) continue;
+        QString name = filename.mid(reusedbase.fileName().length());
+        Array reusedv, freshv;
+        int nx, ny, nz, freshnx, freshny, freshnz;
+        FITSInOut::read(reused->filePaths()->output(name), reusedv, nx, ny, nz);
+        FITSInOut::read(fresh->filePaths()->output(name), freshv, freshnx, freshny, freshnz);
+        if (nx != freshnx || ny != freshny || nz != freshnz)
+            throw FATALERROR("Reused and fresh simulations produced frames of different size for " + name);
+        size_t n = reusedv.size();
+        for (size_t i=0; i<n; i++)
+        {
+            double diff = fabs(reusedv[i]-freshv[i]);
+            if (diff > 0.) maxdiff = qMax(maxdiff, diff / qMax(fabs(reusedv[i]), fabs(freshv[i])));
+        }
+        Nfiles++;
+    }
+
+    if (!Nfiles) find<Log>()->warning("No output files to verify for reused simulation " + prefix);
+    else if (maxdiff > 1e-10)
+        throw FATALERROR("The results of reused simulation " + prefix + " differ from those of a fresh simulation"
+                         " (largest relative difference " + QString::number(maxdiff) + ")");
+    else find<Log>()->info("Verified " + QString::number(Nfiles) + " output files of reused simulation " + prefix
+                           + " (largest relative difference " + QString::number(maxdiff) + ")");
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -6,17 +6,26 @@
 #ifndef ADJUSTABLESKIRTSIMULATION_HPP
 #define ADJUSTABLESKIRTSIMULATION_HPP
 
+#include <mutex>
 #include <QHash>
 #include <QPair>
+#include <QSharedPointer>
 #include "SimulationItem.hpp"
 
+class Simulation;
 class Units;
 
 ////////////////////////////////////////////////////////////////////
 
 /** The AdjustableSkirtSimulation class allows performing a SKIRT simulation loaded from a ski
     file. The contents of the ski file can be adjusted before the simulation hierarchy is actually
-    created, as described for the performWith() function. */
+    created, as described for the performWith() function.
+
+    Because a fit usually adjusts only a few parameters of a single part of the simulation (e.g.
+    the geometry of the stellar components), the simulation hierarchies constructed for previous
+    invocations of performWith() can be retained, so that the result of their setup can be reused
+    for the parts of the configuration that did not change. See performWith() for more
+    information. */
 class AdjustableSkirtSimulation : public SimulationItem
 {
     Q_OBJECT
@@ -25,13 +34,25 @@ class AdjustableSkirtSimulation : public SimulationItem
     Q_CLASSINFO("Property", "skiName")
     Q_CLASSINFO("Title", "the name of the ski file specifying the SKIRT simulation")
 
+    Q_CLASSINFO("Property", "reuseSetup")
+    Q_CLASSINFO("Title", "reuse the setup of unchanged simulation components between evaluations")
+    Q_CLASSINFO("Default", "yes")
+    Q_CLASSINFO("Silent", "true")
+
+    Q_CLASSINFO("Property", "verifyReuse")
+    Q_CLASSINFO("Title", "verify the results of each reused simulation against a fresh simulation")
+    Q_CLASSINFO("Default", "no")
+    Q_CLASSINFO("RelevantIf", "reuseSetup")
+    Q_CLASSINFO("Silent", "true")
+
     //======== Construction - Setup - Run - Destruction  ===========
 
 public:
     /** The default constructor. */
     Q_INVOKABLE AdjustableSkirtSimulation();
 
-    /** The destructor deletes the simulation items stolen from the default simulation. */
+    /** The destructor deletes the simulation items stolen from the default simulation, and the
+        simulations retained from previous invocations of performWith(). */
     ~AdjustableSkirtSimulation();
 
 protected:
@@ -51,6 +72,25 @@ public:
         the SKIRT simulation. */
     Q_INVOKABLE QString skiName() const;
 
+    /** Sets the flag that indicates whether the setup of the simulation components that are not
+        affected by the replacements should be reused between invocations of performWith(). The
+        default value is true. */
+    Q_INVOKABLE void setReuseSetup(bool value);
+
+    /** Returns the flag that indicates whether the setup of the simulation components that are
+        not affected by the replacements should be reused between invocations of performWith(). */
+    Q_INVOKABLE bool reuseSetup() const;
+
+    /** Sets the flag that indicates whether the results of each simulation that reuses the setup
+        of a retained simulation should be verified against a fresh simulation with the same
+        configuration (see verifyRerun()). This regression check doubles the run time of these
+        evaluations; the default value is false. */
+    Q_INVOKABLE void setVerifyReuse(bool value);
+
+    /** Returns the flag that indicates whether the results of each simulation that reuses the
+        setup of a retained simulation should be verified against a fresh simulation. */
+    Q_INVOKABLE bool verifyReuse() const;
+
     //====================== Other functions =======================
 
 public:
@@ -125,7 +165,33 @@ public:
         This function replaces each labeled attribute value by a regular value (i.e. without the
         brackets and the label). If the label matches one of the keys in the replacement dictionary
         handed to this function, the corresponding value is substituted in the ski file. If there
-        is no match, the value provided in the ski file (after the colon) serves as a default. */
+        is no match, the value provided in the ski file (after the colon) serves as a default.
+
+        If the reuseSetup() flag is enabled, the function retains the simulation after it has been
+        run, and it reuses such a retained simulation in a subsequent invocation, rather than
+        setting up the newly constructed simulation hierarchy from scratch. To this end, the
+        configuration of the new simulation is compared to the configuration of the retained
+        simulation for each of the simulation items held by the simulation (see
+        ConfigurationHash). Changed stellar and dust systems are moved from the new hierarchy into
+        the retained simulation, replacing the corresponding items, and only these items are
+        setup. Unchanged items, such as the wavelength grid, a dust system with its dust mixes,
+        grid and cell densities, or a stellar system, retain the result of their previous setup.
+        The instrument system, and a dust system that stores absorption rates, are always
+        replaced because they hold the results of the previous run. If any other part of the
+        configuration changes, e.g. the wavelength grid or the number of photon packages, the
+        retained simulation is discarded and the new simulation is setup from scratch. Before it
+        is run again, the retained simulation resets its random streams and the run-time state it
+        keeps in the retained items (see MonteCarloSimulation::prepareRerun()). Because the photon
+        packages are then launched with the same random streams in both cases, the results do not
+        depend on whether a simulation has been reused.
+
+        Multiple invocations of this function may be performed concurrently from different
+        threads. Each concurrent invocation uses a separate retained simulation, so that the
+        number of retained simulations equals the largest number of concurrent invocations.
+
+        If the verifyReuse() flag is enabled as well, the results of each run that reuses a
+        retained simulation are verified against a fresh simulation with the same configuration.
+        */
     void performWith(ReplacementDict replacements, QString prefix=QString());
 
 private:
@@ -136,11 +202,60 @@ private:
         ski file. */
     QByteArray adjustedSkiContent(ReplacementDict replacements = ReplacementDict());
 
+    /** This private function sets the attributes of the specified newly constructed simulation
+        that are not loaded from the ski content: the input and output paths, the output prefix
+        composed of our own output prefix and the specified suffix, the number of parallel
+        threads, and the lowest log level. */
+    void copyAttributes(Simulation* simulation, QString suffix);
+
+    /** A shorthand type definition for the configuration keys of a simulation as returned by
+        configurationKeys(). */
+    typedef QHash<QByteArray, QByteArray> ConfigurationKeys;
+
+    /** This private function returns the configuration keys for the specified simulation, which
+        must not yet have been setup (because setup may add items to the hierarchy). The key with
+        an empty name is a hash of the type and the property values of the simulation itself;
+        there is an additional key for each property of the simulation holding simulation items,
+        with the name of the property, which is a hash of the configuration of these items and
+        their descendants (see ConfigurationHash). */
+    static ConfigurationKeys configurationKeys(Simulation* simulation);
+
+    /** A RetainedSimulation holds a simulation that has been setup and run by a previous
+        invocation of performWith(), and the configuration keys of the simulation. */
+    struct RetainedSimulation
+    {
+        QSharedPointer<Simulation> simulation;
+        ConfigurationKeys keys;
+    };
+
+    /** This private function attempts to adjust the specified retained simulation so that it can
+        be run with the configuration of the specified newly constructed simulation, which has the
+        specified configuration keys. If the configurations differ only in the stellar system
+        and/or the dust system, the function moves the changed items (and the instrument system)
+        from the new simulation into the retained simulation, prepares the retained simulation for
+        another run, and returns true. Otherwise it leaves both simulations untouched and returns
+        false. */
+    static bool adjustRetained(RetainedSimulation& retained, Simulation* simulation, const ConfigurationKeys& keys);
+
+    /** This private function verifies the results of the specified simulation, which reused the
+        setup of a retained simulation and has just been run by performWith() with the specified
+        replacements, against those of a fresh simulation. It constructs a new simulation
+        hierarchy from the adjusted ski content, sets it up from scratch and runs it, writing its
+        output files with the suffix "_fresh" appended to the specified prefix. It then reads each
+        FITS file written by the reused simulation and the corresponding file written by the fresh
+        simulation, and compares the data values. Because the detected luminosities may be summed
+        in a different order when multiple threads are used, the values are compared with a
+        relative tolerance of \f$10^{-10}\f$ rather than bitwise. The function throws a fatal error
+        if the frames differ, and logs the largest relative difference otherwise. */
+    void verifyRerun(Simulation* reused, ReplacementDict replacements, QString prefix);
+
     //======================== Data Members ========================
 
 private:
     // data members
     QString _skiName;         // the name of the ski file
+    bool _reuseSetup;         // true if the setup of unchanged simulation components should be reused
+    bool _verifyReuse;        // true if the results of reused simulations should be verified
     QByteArray _skiContent;   // the content of the ski file, without modifications
 
     Units* _units;                      // the units system stolen from the default simulation hierarchy
@@ -151,6 +266,8 @@ private:
     QList<double> _xpress;              // the x increment stolen from the default simulation hierarchy
     QList<double> _ypress;              // the y increment stolen from the default simulation hierarchy
 
+    QList<RetainedSimulation> _retainedv;   // the simulations that are not being used by an invocation of performWith()
+    std::mutex _mutex;                      // the mutex guarding the list of retained simulations
 };
 
 ////////////////////////////////////////////////////////////////////
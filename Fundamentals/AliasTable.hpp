@@ -0,0 +1,130 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#ifndef ALIASTABLE_HPP
+#define ALIASTABLE_HPP
+
+#include <vector>
+#include "Array.hpp"
+
+////////////////////////////////////////////////////////////////////
+
+/** An AliasTable instance allows drawing random indices \f$i=0,\dots,N-1\f$ from a discrete
+    probability distribution \f$p_i\f$ in constant time, regardless of the number of points
+    \f$N\f$. This is in contrast to the classic approach of performing a binary search on the
+    cumulative distribution (see NR::cdf() and NR::locate_clip()), which takes \f${\mathcal
+    O}(\log N)\f$ time per draw.
+
+    The table is constructed using the algorithm of Walker (1977) in the numerically stable
+    formulation by Vose (1991). The distribution is partitioned into \f$N\f$ bins of equal
+    probability \f$1/N\f$. Each bin \f$i\f$ contains (part of) the probability of point \f$i\f$,
+    expressed as a fraction \f$q_i\f$ of the bin, and the remainder of the bin is assigned to a
+    single other point, the alias \f$a_i\f$. Drawing an index then requires selecting a bin
+    uniformly, and choosing between the bin's own point and its alias based on the fraction
+    \f$q_i\f$. Both choices are derived from a single uniform deviate. Construction takes
+    \f${\mathcal O}(N)\f$ time.
+
+    Points with zero probability are never returned. All implementations are provided inline in
+    the header. */
+class AliasTable
+{
+public:
+    /** The default constructor creates an empty table. The table must be initialized through the
+        initialize() function before it can be used. */
+    AliasTable() { }
+
+    /** This constructor creates a table for the distribution specified as an array of
+        non-negative values. See the corresponding initialize() function. */
+    explicit AliasTable(const Array& pv) { initialize(pv); }
+
+    /** This function (re-)initializes the table for the distribution specified as an array of
+        non-negative values with at least one element. The distribution does not need to be
+        normalized; however, the sum of the values must be positive. */
+    void initialize(const Array& pv)
+    {
+        initialize(pv.size(), [&pv](int i){ return pv[i]; });
+    }
+
+    /** This function (re-)initializes the table for the distribution discretized over \f$N>0\f$
+        points specified by a function object with signature double pv(int i). The source function
+        is called once for each index \f$i=0,\dots,N-1\f$ and must return a non-negative value. The
+        distribution does not need to be normalized; however, the sum of the values must be
+        positive. */
+    template<typename Functor> void initialize(int n, Functor pv)
+    {
+        // get the source distribution and its normalization
+        _qv.resize(n);
+        double sum = 0.;
+        for (int i=0; i<n; i++)
+        {
+            _qv[i] = pv(i);
+            sum += _qv[i];
+        }
+
+        // scale the values so that the average bin contains exactly one unit of probability
+        _qv *= n/sum;
+
+        // initialize each bin as being fully occupied by its own point
+        _av.resize(n);
+        for (int i=0; i<n; i++) _av[i] = i;
+
+        // partition the points in under-full and over-full bins; the under-full list is processed as a queue,
+        // and the points with zero probability are placed at the front of that queue, so that these points
+        // are guaranteed to receive an alias even if round-off errors exhaust the over-full list prematurely
+        std::vector<int> smallv, largev;
+        smallv.reserve(n);
+        largev.reserve(n);
+        for (int i=0; i<n; i++) if (_qv[i] == 0.) smallv.push_back(i);
+        for (int i=0; i<n; i++)
+        {
+            if (_qv[i] >= 1.) largev.push_back(i);
+            else if (_qv[i] > 0.) smallv.push_back(i);
+        }
+
+        // fill each under-full bin with probability from an over-full point,
+        // moving the latter to the under-full queue when it drops below one unit
+        size_t s = 0;
+        while (s < smallv.size() && !largev.empty())
+        {
+            int small = smallv[s++];
+            int large = largev.back();
+            _av[small] = large;
+            _qv[large] -= 1. - _qv[small];
+            if (_qv[large] < 1.)
+            {
+                largev.pop_back();
+                smallv.push_back(large);
+            }
+        }
+
+        // any remaining bins are full up to round-off errors
+        while (s < smallv.size()) _qv[smallv[s++]] = 1.;
+        for (int large : largev) _qv[large] = 1.;
+    }
+
+    /** This function returns the number of points \f$N\f$ in the distribution, or zero if the table
+        has not been initialized. */
+    int size() const { return _av.size(); }
+
+    /** This function returns a random index drawn from the distribution, given a uniform deviate
+        \f$X\f$ in the range \f$[0,1[\f$. The integer part of \f$NX\f$ selects the bin, and the
+        fractional part selects either the bin's own point or its alias. */
+    int sample(double X) const
+    {
+        int n = _av.size();
+        double u = X*n;
+        int i = static_cast<int>(u);
+        if (i >= n) i = n-1;
+        return u-i < _qv[i] ? i : _av[i];
+    }
+
+private:
+    Array _qv;              // the fraction of each bin occupied by its own point
+    std::vector<int> _av;   // the alias point occupying the remainder of each bin
+};
+
+////////////////////////////////////////////////////////////////////
+
+#endif // ALIASTABLE_HPP
@@ -27,6 +27,7 @@ include(../BuildUtils/EnableMemory.pri)
 #--------------------------------------------------
 
 HEADERS += \
+    AliasTable.hpp \
     Array.hpp \
     ArrayTable.hpp \
     Box.hpp \
@@ -4,6 +4,10 @@
 ///////////////////////////////////////////////////////////////// */
 
 #include "MemoryStatistics.hpp"
+#ifdef BUILDING_MEMORY
+#include <cstdlib>
+#include <new>
+#endif
 
 ////////////////////////////////////////////////////////////////////
 
@@ -287,3 +291,41 @@ QString MemoryStatistics::reportCurrent(bool showinfo)
 }
 
 ////////////////////////////////////////////////////////////////////
+
+#ifdef BUILDING_MEMORY
+
+namespace
+{
+    // the number of heap allocations performed by the current thread through the global operator new
+    thread_local size_t allocationCount = 0;
+}
+
+// replace the global allocation function so that each allocation is counted for the calling thread;
+// the array and nothrow versions of operator new and all versions of operator delete forward to these
+void* operator new(size_t size)
+{
+    ++allocationCount;
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////
+
+size_t MemoryStatistics::threadAllocations()
+{
+#ifdef BUILDING_MEMORY
+    return allocationCount;
+#else
+    return 0;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
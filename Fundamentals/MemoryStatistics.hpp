@@ -40,6 +40,12 @@ namespace MemoryStatistics
     /** Returns a string that reports the current memory usage in a form ready for human
         consumption. */
     QString reportCurrent(bool showinfo = false);
+
+    /** Returns the number of heap allocations performed through the global operator new (which is
+        used by the Array class and by the standard library containers) by the calling thread
+        since it was started. The count is maintained only if the code is compiled with the
+        BUILDING_MEMORY option; otherwise the function always returns zero. */
+    size_t threadAllocations();
 }
 
 ////////////////////////////////////////////////////////////////////
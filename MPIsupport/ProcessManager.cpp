@@ -14,6 +14,14 @@
 
 std::atomic<int> ProcessManager::requests(0);
 
+#ifdef BUILDING_WITH_MPI
+namespace
+{
+    qint64 counterValue = 0;    // the value of the shared counter (used only on the root process)
+    MPI_Win counterWindow;      // the window exposing the shared counter to all processes
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////
 
 void ProcessManager::initialize(int *argc, char ***argv)
@@ -23,7 +31,10 @@ void ProcessManager::initialize(int *argc, char ***argv)
     MPI_Initialized(&initialized);
     if (!initialized)
     {
-        MPI_Init(argc, argv);
+        // threads may perform one-sided communication (e.g. on the shared counter), one at a time;
+        // the level of thread support actually provided is verified by the code relying on it (see isThreadSerialized())
+        int provided;
+        MPI_Init_thread(argc, argv, MPI_THREAD_SERIALIZED, &provided);
     }
 #else
     Q_UNUSED(argc) Q_UNUSED(argv)
@@ -163,6 +174,106 @@ void ProcessManager::broadcast(int* value, int root)
 
 //////////////////////////////////////////////////////////////////////
 
+void ProcessManager::gather_all(double* my_array, int my_nvalues, double* result_array, int* nvalues, int* displs)
+{
+#ifdef BUILDING_WITH_MPI
+    MPI_Allgatherv(my_array, my_nvalues, MPI_DOUBLE, result_array, nvalues, displs, MPI_DOUBLE, MPI_COMM_WORLD);
+#else
+    Q_UNUSED(my_array) Q_UNUSED(my_nvalues) Q_UNUSED(result_array) Q_UNUSED(nvalues) Q_UNUSED(displs)
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void ProcessManager::gather_all(int* my_array, int my_nvalues, int* result_array, int* nvalues, int* displs)
+{
+#ifdef BUILDING_WITH_MPI
+    MPI_Allgatherv(my_array, my_nvalues, MPI_INT, result_array, nvalues, displs, MPI_INT, MPI_COMM_WORLD);
+#else
+    Q_UNUSED(my_array) Q_UNUSED(my_nvalues) Q_UNUSED(result_array) Q_UNUSED(nvalues) Q_UNUSED(displs)
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void ProcessManager::exchange(int* my_values, int* result_values)
+{
+#ifdef BUILDING_WITH_MPI
+    MPI_Alltoall(my_values, 1, MPI_INT, result_values, 1, MPI_INT, MPI_COMM_WORLD);
+#else
+    Q_UNUSED(my_values) Q_UNUSED(result_values)
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void ProcessManager::exchange(double* my_array, int* my_nvalues, int* my_displs,
+                              double* result_array, int* nvalues, int* displs)
+{
+#ifdef BUILDING_WITH_MPI
+    MPI_Alltoallv(my_array, my_nvalues, my_displs, MPI_DOUBLE,
+                  result_array, nvalues, displs, MPI_DOUBLE, MPI_COMM_WORLD);
+#else
+    Q_UNUSED(my_array) Q_UNUSED(my_nvalues) Q_UNUSED(my_displs)
+    Q_UNUSED(result_array) Q_UNUSED(nvalues) Q_UNUSED(displs)
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void ProcessManager::exchange(qint64* my_array, int* my_nvalues, int* my_displs,
+                              qint64* result_array, int* nvalues, int* displs)
+{
+#ifdef BUILDING_WITH_MPI
+    MPI_Alltoallv(my_array, my_nvalues, my_displs, MPI_INT64_T,
+                  result_array, nvalues, displs, MPI_INT64_T, MPI_COMM_WORLD);
+#else
+    Q_UNUSED(my_array) Q_UNUSED(my_nvalues) Q_UNUSED(my_displs)
+    Q_UNUSED(result_array) Q_UNUSED(nvalues) Q_UNUSED(displs)
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void ProcessManager::createCounter()
+{
+#ifdef BUILDING_WITH_MPI
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    counterValue = 0;
+    MPI_Win_create(&counterValue, rank==0 ? sizeof(qint64) : 0, sizeof(qint64),
+                   MPI_INFO_NULL, MPI_COMM_WORLD, &counterWindow);
+    MPI_Win_lock_all(0, counterWindow);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+
+qint64 ProcessManager::fetchAddCounter(qint64 increment)
+{
+#ifdef BUILDING_WITH_MPI
+    qint64 result;
+    MPI_Fetch_and_op(&increment, &result, MPI_INT64_T, 0, 0, MPI_SUM, counterWindow);
+    MPI_Win_flush(0, counterWindow);
+    return result;
+#else
+    Q_UNUSED(increment)
+    return 0;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void ProcessManager::freeCounter()
+{
+#ifdef BUILDING_WITH_MPI
+    MPI_Win_unlock_all(counterWindow);
+    MPI_Win_free(&counterWindow);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+
 bool ProcessManager::isRoot()
 {
 #ifdef BUILDING_WITH_MPI
@@ -188,3 +299,16 @@ bool ProcessManager::isMultiProc()
 }
 
 //////////////////////////////////////////////////////////////////////
+
+bool ProcessManager::isThreadSerialized()
+{
+#ifdef BUILDING_WITH_MPI
+    int provided;
+    MPI_Query_thread(&provided);
+    return provided >= MPI_THREAD_SERIALIZED;
+#else
+    return true;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
@@ -99,6 +99,59 @@ public:
         root during the communication. */
     static void broadcast(int* value, int root);
 
+    /** This function is used to gather a number of double values from each process into a single
+        array, which is stored on every process. The values contributed by this process are passed
+        as the first argument and their number as the second. The resulting array, passed as the
+        third argument, must be large enough to hold the values of all processes. The last two
+        arguments specify, for each process rank, the number of values contributed by that process
+        and the offset of these values in the resulting array. All processes must call this
+        function for the communication to proceed. */
+    static void gather_all(double* my_array, int my_nvalues, double* result_array, int* nvalues, int* displs);
+
+    /** This function is used to gather a number of integer values from each process into a single
+        array, which is stored on every process. The arguments have the same meaning as for the
+        version of this function that operates on double values. */
+    static void gather_all(int* my_array, int my_nvalues, int* result_array, int* nvalues, int* displs);
+
+    /** This function is used to send a single integer value from each process to each other
+        process. The first argument points to an array containing, for each process rank, the value
+        to be sent to that process. The second argument points to an array that receives, for each
+        process rank, the value sent by that process. All processes must call this function for the
+        communication to proceed. */
+    static void exchange(int* my_values, int* result_values);
+
+    /** This function is used to send a number of double values from each process to each other
+        process. The values to be sent are stored in the first array; the second and third
+        arguments specify, for each process rank, the number of values to be sent to that process
+        and their offset in the first array. Similarly, the received values are stored in the
+        fourth array, where the last two arguments specify, for each process rank, the number of
+        values received from that process and their offset in the array. All processes must call
+        this function for the communication to proceed. */
+    static void exchange(double* my_array, int* my_nvalues, int* my_displs,
+                         double* result_array, int* nvalues, int* displs);
+
+    /** This function is used to send a number of 64-bit integer values from each process to each
+        other process, with arguments as for the version of this function that sends double
+        values. All processes must call this function for the communication to proceed. */
+    static void exchange(qint64* my_array, int* my_nvalues, int* my_displs,
+                         qint64* result_array, int* nvalues, int* displs);
+
+    /** This function creates a shared counter with an initial value of zero, held by the root
+        process and accessible by all processes through one-sided communication. There can be only
+        one such counter at any time. All processes must call this function for the communication
+        to proceed. */
+    static void createCounter();
+
+    /** This function atomically adds the specified increment to the shared counter created by
+        createCounter(), and returns the value of the counter before the addition. The operation
+        does not require the participation of any other process. If the function is called from
+        multiple threads in the same process, the calls must be serialized by the caller. */
+    static qint64 fetchAddCounter(qint64 increment);
+
+    /** This function releases the shared counter created by createCounter(). All processes must
+        call this function for the communication to proceed. */
+    static void freeCounter();
+
     /** This function returns a boolean indicating whether the process is assigned as root or not.
         The rank of the process is always the 'true' rank, irrespective of whether the object that
         calls this function has acquired the MPI resource or not. */
@@ -110,6 +163,11 @@ public:
         resource or not. */
     static bool isMultiProc();
 
+    /** This function returns true if the MPI library allows the threads of a process to call MPI
+        functions, provided these calls are serialized (i.e. if the level of thread support is at
+        least MPI_THREAD_SERIALIZED), and false otherwise. Without MPI, the function returns true. */
+    static bool isThreadSerialized();
+
 private:
     static std::atomic<int> requests;   // This atomic integer is used to store the number of active requests for MPI
 
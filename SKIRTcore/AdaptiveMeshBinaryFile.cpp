@@ -0,0 +1,93 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#include "AdaptiveMeshBinaryFile.hpp"
+#include "ColumnBinaryFile.hpp"
+#include "FatalError.hpp"
+#include "FilePaths.hpp"
+#include "Log.hpp"
+
+////////////////////////////////////////////////////////////////////
+
+AdaptiveMeshBinaryFile::AdaptiveMeshBinaryFile()
+    : _infile(0), _row(0)
+{
+}
+
+//////////////////////////////////////////////////////////////////////
+
+AdaptiveMeshBinaryFile::~AdaptiveMeshBinaryFile()
+{
+    close();
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void AdaptiveMeshBinaryFile::open()
+{
+    // open the data file and verify that it has room for the numbers of child nodes
+    close();
+    QString filepath = find<FilePaths>()->input(_filename);
+    _infile = new ColumnBinaryFile(filepath);
+    if (_infile->numColumns() < 3) throw FATALERROR("Insufficient number of columns in mesh data");
+    find<Log>()->info("Reading adaptive mesh data from binary file " + filepath + "...");
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void AdaptiveMeshBinaryFile::close()
+{
+    delete _infile;
+    _infile = 0;
+    _row = 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+bool AdaptiveMeshBinaryFile::read()
+{
+    if (!_infile || _row >= _infile->numRows())
+    {
+        _row = 0;
+        return false;
+    }
+    _row++;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+bool AdaptiveMeshBinaryFile::isNonLeaf() const
+{
+    return _row && _infile->value(_row-1,0) > 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void AdaptiveMeshBinaryFile::numChildNodes(int &nx, int &ny, int &nz) const
+{
+    // get the column values; a missing record defaults to zero
+    nx = _row ? static_cast<int>(_infile->value(_row-1,0)) : 0;
+    ny = _row ? static_cast<int>(_infile->value(_row-1,1)) : 0;
+    nz = _row ? static_cast<int>(_infile->value(_row-1,2)) : 0;
+
+    // we expect three positive integers
+    if (nx<1 || ny<1 || nz<1) throw FATALERROR("Invalid nonleaf record in mesh data");
+}
+
+//////////////////////////////////////////////////////////////////////
+
+double AdaptiveMeshBinaryFile::value(int g) const
+{
+    // verify index range
+    if (g < 0) throw FATALERROR("Field index out of range");
+    if (static_cast<size_t>(g)+3 >= _infile->numColumns())
+        throw FATALERROR("Insufficient number of field values in mesh data");
+
+    // get the appropriate column value
+    return _row ? _infile->value(_row-1, g+3) : 0.;
+}
+
+//////////////////////////////////////////////////////////////////////
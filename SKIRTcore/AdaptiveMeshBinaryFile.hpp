@@ -0,0 +1,82 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#ifndef ADAPTIVEMESHBINARYFILE_HPP
+#define ADAPTIVEMESHBINARYFILE_HPP
+
+#include "AdaptiveMeshFile.hpp"
+class ColumnBinaryFile;
+
+////////////////////////////////////////////////////////////////////
+
+/** The AdaptiveMeshBinaryFile class can read the relevant information on a cartesian
+    three-dimensional (3D) Adaptive Mesh Refinement (AMR) grid from a file in the column binary
+    format described for the ColumnBinaryFile class. The file is mapped into memory rather than
+    parsed, which makes this format much faster than the ASCII format for large meshes.
+
+    Each row in the file describes a tree node (nonleaf or leaf), and the rows are given in Morton
+    order, just like the lines in the format of the AdaptiveMeshAsciiFile class. The first three
+    columns specify the number of child nodes \f$N_x,N_y,N_z\f$ carried by a nonleaf node in each
+    spatial direction, or zero for a leaf node. For a leaf node, subsequent columns provide the
+    \f$N_{fields}\f$ values of the fields in the cell represented by the node; for a nonleaf node,
+    these columns are ignored. A file in the ASCII format can be converted to the binary format
+    with the command line option <tt>-c</tt> of SKIRT. */
+class AdaptiveMeshBinaryFile : public AdaptiveMeshFile
+{
+    Q_OBJECT
+    Q_CLASSINFO("Title", "an adaptive mesh data file in column binary format")
+
+    //================= Construction - Destruction =================
+
+public:
+    /** The default constructor. */
+    Q_INVOKABLE AdaptiveMeshBinaryFile();
+
+    /** The destructor closes the file if it is still open. */
+    ~AdaptiveMeshBinaryFile();
+
+    //======================== Other Functions =======================
+
+public:
+    /** This function opens the adaptive mesh data file and maps it into memory, or throws a fatal
+        error if the file can't be opened or is not a valid column binary file. It does not yet
+        read any records. */
+    void open();
+
+    /** This function closes the adaptive mesh data file. */
+    void close();
+
+    /** This function advances to the next record in the file, and holds its information ready for
+        inspection through the other functions of this class. The function returns true if there
+        was a next record, or false if the end of the file was reached. */
+    bool read();
+
+    /** This function returns true if the current record represents a nonleaf node, or false if
+        the current record represents a leaf node. If there is no current record, the result is
+        undefined. */
+    bool isNonLeaf() const;
+
+    /** If the current record represents a nonleaf node, this function returns \f$N_x,N_y,N_z\f$,
+        i.e. the number of child nodes carried by the node in each spatial direction. If the
+        current record represents a leaf node or if there is no current record, the result is
+        undefined. */
+    void numChildNodes(int& nx, int& ny, int& nz) const;
+
+    /** If the current record represents a leaf node, this function returns the value \f$F_g\f$ of
+        the field with given zero-based index \f$0\le g \le N_{fields}-1\f$. If the index is out of
+        range, a fatal error is thrown. If the current record represents a nonleaf node or if there
+        is no current record, the result is undefined. */
+    double value(int g) const;
+
+    //========================= Data members =======================
+
+private:
+    ColumnBinaryFile* _infile;   // the input file, or null if the file is not open
+    size_t _row;                 // the index of the current record plus one, or zero if there is no current record
+};
+
+////////////////////////////////////////////////////////////////////
+
+#endif // ADAPTIVEMESHBINARYFILE_HPP
@@ -0,0 +1,190 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <QSysInfo>
+#include "ColumnBinaryFile.hpp"
+#include "FatalError.hpp"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    // the tag identifying a column binary file (including the format version)
+    const char tag[8] = { 'S', 'K', 'I', 'R', 'T', 'C', 'B', '1' };
+
+    // a value that is written in little-endian byte order to detect byte order mismatches
+    const quint64 check = 0x0102030405060708ULL;
+
+    // the size of the header in bytes
+    const size_t headersize = 32;
+
+    // returns the number of whitespace-separated items in the specified null-terminated text
+    size_t countValues(const char* text)
+    {
+        size_t count = 0;
+        while (true)
+        {
+            while (*text == ' ' || *text == '\t' || *text == '\r') text++;
+            if (!*text) return count;
+            count++;
+            while (*text && *text != ' ' && *text != '\t' && *text != '\r') text++;
+        }
+    }
+
+    // parses the whitespace-separated floating point values in the specified null-terminated text and appends
+    // them to the specified vector; returns the number of values or throws an error for invalid text
+    size_t parseValues(const char* text, vector<double>& values)
+    {
+        size_t count = 0;
+        while (true)
+        {
+            while (*text == ' ' || *text == '\t' || *text == '\r') text++;
+            if (!*text) return count;
+            char* end;
+            double value = strtod(text, &end);
+            if (end == text || (*end && *end != ' ' && *end != '\t' && *end != '\r'))
+                throw FATALERROR("Input text is not formatted as a floating point number");
+            values.push_back(value);
+            count++;
+            text = end;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+ColumnBinaryFile::ColumnBinaryFile(QString filepath)
+    : _map(0), _data(0), _Ncols(0), _Nrows(0)
+{
+    // open and map the file
+    _file.setFileName(filepath);
+    if (!_file.open(QIODevice::ReadOnly)) throw FATALERROR("Could not open the binary data file " + filepath);
+    size_t size = _file.size();
+    if (size < headersize) throw FATALERROR("The binary data file " + filepath + " is truncated");
+    _map = _file.map(0, size);
+    if (!_map) throw FATALERROR("Could not map the binary data file " + filepath + " into memory");
+
+    // verify the header
+    if (memcmp(_map, tag, sizeof(tag)) != 0)
+        throw FATALERROR("The file " + filepath + " is not in the column binary format");
+    if (memcmp(_map+8, &check, sizeof(check)) != 0)
+        throw FATALERROR("The binary data file " + filepath + " has an unsupported byte order");
+    quint64 info[2];
+    memcpy(info, _map+16, sizeof(info));
+    _Ncols = info[0];
+    _Nrows = info[1];
+    if (_Nrows && _Ncols > (size-headersize) / sizeof(double) / _Nrows)
+        throw FATALERROR("The binary data file " + filepath + " is truncated");
+    if (size != headersize + _Ncols*_Nrows*sizeof(double))
+        throw FATALERROR("The size of the binary data file " + filepath + " does not match its header");
+
+    // the mapping starts at a page boundary, so the values are properly aligned
+    _data = reinterpret_cast<const double*>(_map + headersize);
+}
+
+////////////////////////////////////////////////////////////////////
+
+ColumnBinaryFile::~ColumnBinaryFile()
+{
+    if (_map) _file.unmap(_map);
+    _file.close();
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool ColumnBinaryFile::isColumnBinaryFile(QString filepath)
+{
+    QFile file(filepath);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+    char header[sizeof(tag)];
+    return file.read(header, sizeof(tag)) == sizeof(tag) && memcmp(header, tag, sizeof(tag)) == 0;
+}
+
+////////////////////////////////////////////////////////////////////
+
+void ColumnBinaryFile::convert(QString textpath, QString binarypath, size_t& Nrows, size_t& Ncols)
+{
+    if (QSysInfo::ByteOrder != QSysInfo::LittleEndian)
+        throw FATALERROR("Column binary files can be written only on little-endian platforms");
+
+    // open the text file
+    ifstream in(textpath.toLocal8Bit().constData());
+    if (!in.is_open()) throw FATALERROR("Could not open the text data file " + textpath);
+
+    // in a first pass, count the rows and the values on each row, without converting the values,
+    // so that the size of the binary file is known before any values are written
+    Nrows = 0;
+    size_t maxvalues = 0;
+    bool adaptive = false;
+    string line;
+    while (getline(in, line))
+    {
+        size_t pos = line.find_first_not_of(" \t\r");
+        if (pos == string::npos || line[pos] == '#') continue;
+        Nrows++;
+        if (line[pos] == '!') adaptive = true;
+        else maxvalues = max(maxvalues, countValues(line.c_str()+pos));
+    }
+    Ncols = adaptive ? maxvalues+3 : maxvalues;
+
+    // create the binary file with its final size, write the header, and map the data section into memory;
+    // missing values remain zero because the file is extended with zeroes
+    QFile out(binarypath);
+    if (!out.open(QIODevice::ReadWrite | QIODevice::Truncate))
+        throw FATALERROR("Could not create the binary data file " + binarypath);
+    quint64 info[2] = { Ncols, Nrows };
+    if (out.write(tag, sizeof(tag)) != sizeof(tag)
+            || out.write(reinterpret_cast<const char*>(&check), sizeof(check)) != sizeof(check)
+            || out.write(reinterpret_cast<const char*>(info), sizeof(info)) != sizeof(info))
+        throw FATALERROR("Could not write the binary data file " + binarypath);
+    size_t datasize = Ncols*Nrows*sizeof(double);
+    if (!datasize) return;
+    if (!out.resize(headersize + datasize)) throw FATALERROR("Could not write the binary data file " + binarypath);
+    uchar* map = out.map(0, headersize + datasize);
+    if (!map) throw FATALERROR("Could not map the binary data file " + binarypath + " into memory");
+    double* data = reinterpret_cast<double*>(map + headersize);
+
+    // in a second pass, convert the values on each row and store them in the appropriate columns;
+    // for nonleaf rows in the adaptive mesh format, the values are the three numbers of child nodes
+    in.clear();
+    in.seekg(0);
+    vector<double> values;
+    size_t r = 0;
+    while (getline(in, line))
+    {
+        size_t pos = line.find_first_not_of(" \t\r");
+        if (pos == string::npos || line[pos] == '#') continue;
+        if (r == Nrows) throw FATALERROR("The text data file " + textpath + " changed during the conversion");
+
+        bool nonleaf = line[pos] == '!';
+        if (nonleaf) pos++;
+        values.clear();
+        size_t count = parseValues(line.c_str()+pos, values);
+        if (nonleaf)
+        {
+            if (count != 3) throw FATALERROR("Invalid nonleaf line in mesh data");
+            for (size_t i=0; i<3; i++)
+                if (values[i] < 1 || values[i] != static_cast<int>(values[i]))
+                    throw FATALERROR("Invalid nonleaf line in mesh data");
+        }
+        else if (count > maxvalues) throw FATALERROR("The text data file " + textpath + " changed during the conversion");
+
+        size_t first = adaptive && !nonleaf ? 3 : 0;
+        for (size_t i=0; i<count; i++) data[(first+i)*Nrows + r] = values[i];
+        r++;
+    }
+    if (r != Nrows) throw FATALERROR("The text data file " + textpath + " changed during the conversion");
+    out.unmap(map);
+    out.close();
+}
+
+////////////////////////////////////////////////////////////////////
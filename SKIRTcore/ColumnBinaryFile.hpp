@@ -0,0 +1,101 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#ifndef COLUMNBINARYFILE_HPP
+#define COLUMNBINARYFILE_HPP
+
+#include <QFile>
+#include <QString>
+
+////////////////////////////////////////////////////////////////////
+
+/** This class provides read access to a table of floating point values stored in the SKIRT
+    column binary format, and offers a function to convert a column text file to this format.
+    The format is intended for large input files, such as SPH particle lists and Voronoi or
+    adaptive mesh data, which take a long time to parse in text form.
+
+    A column binary file consists of a 32-byte header followed by the data. The header contains
+    four 8-byte fields: the tag "SKIRTCB1" identifying the format and its version, the 64-bit
+    integer 0x0102030405060708 allowing to detect a mismatch in byte order, the number of columns
+    \f$N_\text{cols}\f$ as a 64-bit integer, and the number of rows \f$N_\text{rows}\f$ as a
+    64-bit integer. The data consists of \f$N_\text{cols}\f$ columns, stored one after the other,
+    each containing \f$N_\text{rows}\f$ values in 64-bit IEEE floating point format. All values
+    are stored in little-endian byte order, and the file size must equal \f$32 + 8
+    N_\text{cols} N_\text{rows}\f$ bytes. The columns have the same meaning as the columns of the
+    corresponding text format.
+
+    The complete file is mapped into memory when it is opened, so that the values of each column
+    can be accessed directly without copying or parsing. The operating system loads the contents
+    of the file on demand. */
+class ColumnBinaryFile
+{
+    //=============== Construction - Destruction  ==================
+
+public:
+    /** The constructor opens the column binary file with the specified path and maps it into
+        memory. If the file can't be opened or mapped, or if it does not have a valid header, or if
+        its size does not match the header, a FatalError is thrown. */
+    ColumnBinaryFile(QString filepath);
+
+    /** The destructor unmaps and closes the file. */
+    ~ColumnBinaryFile();
+
+    //====================== Other functions =======================
+
+public:
+    /** This function returns true if the file with the specified path exists and starts with the
+        tag identifying the column binary format, and false otherwise. It does not verify the
+        remainder of the file. */
+    static bool isColumnBinaryFile(QString filepath);
+
+    /** This function converts the column text file with path \em textpath to a column binary file
+        with path \em binarypath. Empty lines and lines starting with a hash character are
+        ignored. Any other line provides a row of the table. The number of columns in the binary
+        file equals the largest number of values on a row; missing values at the end of shorter
+        rows are replaced by zeroes. As a special case, a line starting with an exclamation mark
+        represents a nonleaf node in the format of the AdaptiveMeshAsciiFile class. If the text
+        file contains such lines, the binary file gets three additional leading columns, holding
+        the numbers of child nodes \f$N_x,N_y,N_z\f$ for nonleaf rows and zeroes for leaf rows;
+        the remaining columns of a nonleaf row are set to zero. The function returns the number
+        of rows and columns written in the output arguments. A FatalError is thrown if one of the
+        files can't be opened, or if the text file contains improperly formatted values.
+
+        The text file is streamed rather than loaded into memory. A first pass counts the rows and
+        the number of values on each row, so that the binary file can be created with its final
+        size and mapped into memory. A second pass converts the values on each row and stores them
+        directly into the appropriate columns of the mapping. Thus the memory used by the
+        conversion does not depend on the size of the file, apart from the pages of the mapping,
+        which the operating system writes to disk as needed. */
+    static void convert(QString textpath, QString binarypath, size_t& Nrows, size_t& Ncols);
+
+    /** This function returns the number of columns in the file. */
+    size_t numColumns() const { return _Ncols; }
+
+    /** This function returns the number of rows in the file. */
+    size_t numRows() const { return _Nrows; }
+
+    /** This function returns a pointer to the first of the \f$N_\text{rows}\f$ consecutive values
+        in the column with zero-based index \em c, which must be smaller than the number of
+        columns. The values reside in the memory mapped file, so the pointer remains valid as
+        long as this object exists. */
+    const double* column(size_t c) const { return _data + c*_Nrows; }
+
+    /** This function returns the value in the row with zero-based index \em r and the column
+        with zero-based index \em c, which must be in range. */
+    double value(size_t r, size_t c) const { return _data[c*_Nrows + r]; }
+
+    //======================== Data Members ========================
+
+private:
+    QFile _file;
+    uchar* _map;            // the mapped file contents
+    const double* _data;    // the first value of the first column in the mapped file contents
+    size_t _Ncols;
+    size_t _Nrows;
+};
+
+////////////////////////////////////////////////////////////////////
+
+#endif // COLUMNBINARYFILE_HPP
@@ -0,0 +1,140 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#include <cstring>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QMetaClassInfo>
+#include <QMetaMethod>
+#include <QMetaObject>
+#include "ConfigurationHash.hpp"
+#include "FilePaths.hpp"
+#include "SimulationItem.hpp"
+
+////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    // adds the specified value to the hash as a sequence of raw bytes
+    template<typename T> void addValue(QCryptographicHash& hash, const T& value)
+    {
+        hash.addData(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    // adds the specified string to the hash, preceded by its length so that consecutive strings can't be confused
+    void addString(QCryptographicHash& hash, QByteArray value)
+    {
+        addValue(hash, value.size());
+        hash.addData(value);
+    }
+
+    // returns true if the specified type name is the name of an enumeration declared for the specified item
+    bool isEnum(const QMetaObject* object, QByteArray type)
+    {
+        for (int index = 0; index < object->enumeratorCount(); index++)
+        {
+            if (strcmp(object->enumerator(index).name(), type.constData()) == 0) return true;
+        }
+        return false;
+    }
+
+    // adds the value of the specified property of the specified item to the hash
+    void addProperty(QCryptographicHash& hash, const SimulationItem* item, QByteArray property)
+    {
+        SimulationItem* target = const_cast<SimulationItem*>(item);  // cast away const to invoke the getter
+        const QMetaObject* object = item->metaObject();
+
+        // discover the type of the property from its getter method, which should have the same name
+        int index = object->indexOfMethod((property + "()").constData());
+        if (index < 0) return;
+        QByteArray type = object->method(index).typeName();
+
+        addString(hash, property);
+        if (type == "bool")
+        {
+            bool value = false;
+            QMetaObject::invokeMethod(target, property.constData(), QGenericReturnArgument("bool", &value));
+            addValue(hash, value);
+        }
+        else if (type == "int")
+        {
+            int value = 0;
+            QMetaObject::invokeMethod(target, property.constData(), QGenericReturnArgument("int", &value));
+            addValue(hash, value);
+        }
+        else if (type == "double")
+        {
+            double value = 0;
+            QMetaObject::invokeMethod(target, property.constData(), QGenericReturnArgument("double", &value));
+            addValue(hash, value);
+        }
+        else if (type == "QList<double>")
+        {
+            QList<double> value;
+            QMetaObject::invokeMethod(target, property.constData(), QGenericReturnArgument("QList<double>", &value));
+            addValue(hash, value.size());
+            foreach (double x, value) addValue(hash, x);
+        }
+        else if (type == "QString")
+        {
+            QString value;
+            QMetaObject::invokeMethod(target, property.constData(), QGenericReturnArgument("QString", &value));
+            addString(hash, value.toUtf8());
+
+            // if the string names an input file, include the size and time stamp of the file
+            if (!value.isEmpty())
+            {
+                QFileInfo info(item->find<FilePaths>()->input(value));
+                if (info.isFile())
+                {
+                    addValue(hash, info.size());
+                    addValue(hash, info.lastModified().toMSecsSinceEpoch());
+                }
+            }
+        }
+        else if (isEnum(object, type))
+        {
+            int value = 0;
+            QMetaObject::invokeMethod(target, property.constData(), QGenericReturnArgument(type.constData(), &value));
+            addValue(hash, value);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+void ConfigurationHash::add(QCryptographicHash& hash, const SimulationItem* item)
+{
+    // add the item type and its property values
+    addProperties(hash, item);
+
+    // add the children, which include the items held by item properties
+    foreach (QObject* child, item->children())
+    {
+        const SimulationItem* childitem = dynamic_cast<const SimulationItem*>(child);
+        if (childitem) add(hash, childitem);
+    }
+
+    // mark the end of the item, so that the hash reflects the structure of the hierarchy
+    addString(hash, QByteArray());
+}
+
+////////////////////////////////////////////////////////////////////
+
+void ConfigurationHash::addProperties(QCryptographicHash& hash, const SimulationItem* item)
+{
+    // add the item type
+    const QMetaObject* object = item->metaObject();
+    addString(hash, object->className());
+
+    // add the property values declared by the item's class and its base classes
+    for (int index = 0; index < object->classInfoCount(); index++)
+    {
+        QMetaClassInfo info = object->classInfo(index);
+        if (strcmp(info.name(), "Property") == 0) addProperty(hash, item, info.value());
+    }
+}
+
+////////////////////////////////////////////////////////////////////
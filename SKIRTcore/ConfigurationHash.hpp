@@ -0,0 +1,42 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#ifndef CONFIGURATIONHASH_HPP
+#define CONFIGURATIONHASH_HPP
+
+#include <QCryptographicHash>
+class SimulationItem;
+
+////////////////////////////////////////////////////////////////////
+
+/** This namespace offers functions to calculate a hash (a digital fingerprint) of the
+    configuration of a simulation item hierarchy, i.e. of the types of the simulation items and
+    the values of their discoverable properties. Two hierarchies with the same configuration yield
+    the same hash, and changing any property value almost certainly changes the hash. This can be
+    used, for example, to detect whether data calculated during setup of a previous simulation can
+    be reused in the current simulation.
+
+    The property values are obtained by invoking the property getters through the Qt meta-object
+    system, using the property declarations in the Q_CLASSINFO entries of each class. Properties
+    of type bool, int, double, QString, QList<double>, and enumeration types contribute to the
+    hash; properties that hold simulation items are represented by the items themselves, which are
+    visited as children in the hierarchy. If the value of a string property is the name of an
+    existing file in the input path, the size and the last modification time of that file are
+    included in the hash as well, so that changes to an input file invalidate the hash. */
+namespace ConfigurationHash
+{
+    /** This function adds the type and the property values of the specified simulation item and
+        of all its descendants in the simulation hierarchy to the specified hash. */
+    void add(QCryptographicHash& hash, const SimulationItem* item);
+
+    /** This function adds the type and the property values of the specified simulation item to
+        the specified hash, without considering its descendants. Properties that hold simulation
+        items are thus represented only by their name. */
+    void addProperties(QCryptographicHash& hash, const SimulationItem* item);
+}
+
+////////////////////////////////////////////////////////////////////
+
+#endif // CONFIGURATIONHASH_HPP
@@ -9,6 +9,7 @@
 #include "ISRF.hpp"
 #include "Log.hpp"
 #include "PanDustSystem.hpp"
+#include "PeerToPeerCommunicator.hpp"
 #include "WavelengthGrid.hpp"
 
 using namespace std;
@@ -55,18 +56,27 @@ std::vector<int> Dim1DustLib::mapping() const
     // calculate the properties of the ISRF in all cells of the dust system;
     // remember the minimum and maximum values of the strength of the ISRF
     double JtotMW = ( ISRF::mathis(lambdagrid) * lambdagrid->dlambdav() ).sum();
+    // if the absorption tables are distributed, each process handles the cells it holds
+    Array Ucellv(Ncells);
+    for (int m=0; m<Ncells; m++)
+    {
+        if (ds->ownscell(m))
+        {
+            double Jtot = ( ds->meanintensityv(m) * lambdagrid->dlambdav() ).sum();
+            double U = Jtot/JtotMW;
+            // ignore cells with extremely small radiation fields (compared to the average in the Milky Way)
+            // to avoid wasting library grid points on fields that won't change simulation results anyway
+            if (U > 1e-6) Ucellv[m] = U;
+        }
+    }
+    if (ds->distributedtables()) find<PeerToPeerCommunicator>()->sum_all(Ucellv);
     double Umin = DBL_MAX;
     double Umax = 0.0;
-    vector<double> Ucellv(Ncells);
     for (int m=0; m<Ncells; m++)
     {
-        double Jtot = ( ds->meanintensityv(m) * lambdagrid->dlambdav() ).sum();
-        double U = Jtot/JtotMW;
-        // ignore cells with extremely small radiation fields (compared to the average in the Milky Way)
-        // to avoid wasting library grid points on fields that won't change simulation results anyway
-        if (U > 1e-6)
+        double U = Ucellv[m];
+        if (U > 0.0)
         {
-            Ucellv[m] = U;
             Umin = min(Umin,U);
             Umax = max(Umax,U);
         }
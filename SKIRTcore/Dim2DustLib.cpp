@@ -9,6 +9,7 @@
 #include "FatalError.hpp"
 #include "Log.hpp"
 #include "PanDustSystem.hpp"
+#include "PeerToPeerCommunicator.hpp"
 #include "Units.hpp"
 #include "WavelengthGrid.hpp"
 
@@ -88,7 +89,8 @@ std::vector<int> Dim2DustLib::mapping() const
     Array lambdameanv(Ncells);
     for (int m=0; m<Ncells; m++)
     {
-        if (ds->Labs(m) > 0.0)
+        // if the absorption tables are distributed, each process handles the cells it holds
+        if (ds->Labs(m) > 0.0 && ds->ownscell(m))
         {
             const Array& Jv = ds->meanintensityv(m);
             double sumrho = 0.;
@@ -111,7 +113,18 @@ std::vector<int> Dim2DustLib::mapping() const
             }
             Tmeanv[m] /= sumrho;
             lambdameanv[m] /= sumrho;
-
+        }
+    }
+    if (ds->distributedtables())
+    {
+        PeerToPeerCommunicator* comm = find<PeerToPeerCommunicator>();
+        comm->sum_all(Tmeanv);
+        comm->sum_all(lambdameanv);
+    }
+    for (int m=0; m<Ncells; m++)
+    {
+        if (ds->Labs(m) > 0.0)
+        {
             Tmin = min(Tmin,Tmeanv[m]);
             Tmax = max(Tmax,Tmeanv[m]);
             lambdamin = min(lambdamin,lambdameanv[m]);
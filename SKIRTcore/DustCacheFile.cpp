@@ -0,0 +1,190 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#include <QDir>
+#include "DustCacheFile.hpp"
+#include "FatalError.hpp"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    // the tag identifying a cache file (including the format version)
+    const char tag[8] = { 'S', 'K', 'D', 'C', 'A', 'C', 'H', '1' };
+
+    // a value that is written in native byte order to detect byte order mismatches
+    const quint64 check = 0x0102030405060708ULL;
+
+    // returns the specified number of bytes rounded up to a multiple of 8
+    size_t padded(size_t bytes)
+    {
+        return (bytes + 7) & ~static_cast<size_t>(7);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+DustCacheFile::DustCacheFile(QString filepath, QByteArray key)
+    : _filepath(filepath), _key(key), _writing(false), _data(0), _size(0), _pos(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////
+
+DustCacheFile::~DustCacheFile()
+{
+    if (_data) _file.unmap(const_cast<uchar*>(_data));
+    if (_file.isOpen())
+    {
+        _file.close();
+        if (_writing) _file.remove();
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool DustCacheFile::openForReading()
+{
+    _file.setFileName(_filepath);
+    if (!_file.open(QIODevice::ReadOnly)) return false;
+    _size = _file.size();
+    if (_size < sizeof(tag) + sizeof(check)) return false;
+    _data = _file.map(0, _size);
+    if (!_data) return false;
+    _pos = 0;
+
+    // verify the tag and the check value
+    if (memcmp(_data, tag, sizeof(tag)) != 0) return false;
+    if (memcmp(_data+sizeof(tag), &check, sizeof(check)) != 0) return false;
+    _pos = sizeof(tag) + sizeof(check);
+
+    // verify the key
+    vector<char> key;
+    read(key);
+    return key.size() == static_cast<size_t>(_key.size())
+            && (key.empty() || memcmp(&key[0], _key.constData(), key.size()) == 0);
+}
+
+////////////////////////////////////////////////////////////////////
+
+void DustCacheFile::read(Array& v)
+{
+    size_t n = readBlockHeader(sizeof(double));
+    v.resize(n);
+    if (n) memcpy(begin(v), readBlockData(n*sizeof(double)), n*sizeof(double));
+}
+
+////////////////////////////////////////////////////////////////////
+
+size_t DustCacheFile::readBlockHeader(size_t elementsize)
+{
+    const char* header = readBlockData(2*sizeof(quint64));
+    quint64 info[2];
+    memcpy(info, header, sizeof(info));
+    if (info[1] != elementsize) throw FATALERROR("Unexpected data type in cache file " + _filepath);
+    if (info[0]*elementsize > _size - _pos) throw FATALERROR("Cache file " + _filepath + " is truncated");
+    return info[0];
+}
+
+////////////////////////////////////////////////////////////////////
+
+const char* DustCacheFile::readBlockData(size_t bytes)
+{
+    if (!_data || padded(bytes) > _size - _pos) throw FATALERROR("Cache file " + _filepath + " is truncated");
+    const char* result = reinterpret_cast<const char*>(_data + _pos);
+    _pos += padded(bytes);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////
+
+void DustCacheFile::openForWriting()
+{
+    _file.setFileName(_filepath + ".tmp");
+    if (!_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        throw FATALERROR("Could not create cache file " + _file.fileName());
+    _writing = true;
+
+    // write the header
+    writeBytes(tag, sizeof(tag));
+    writeBytes(&check, sizeof(check));
+    writeBlock(_key.constData(), _key.size(), sizeof(char));
+}
+
+////////////////////////////////////////////////////////////////////
+
+void DustCacheFile::write(const Array& v)
+{
+    writeBlock(begin(v), v.size(), sizeof(double));
+}
+
+////////////////////////////////////////////////////////////////////
+
+void DustCacheFile::writeBlock(const void* data, size_t n, size_t elementsize)
+{
+    quint64 info[2] = { n, elementsize };
+    writeBytes(info, sizeof(info));
+    size_t bytes = n*elementsize;
+    if (bytes) writeBytes(data, bytes);
+    const char zeros[8] = { 0 };
+    if (padded(bytes) > bytes) writeBytes(zeros, padded(bytes)-bytes);
+}
+
+////////////////////////////////////////////////////////////////////
+
+void DustCacheFile::writeBytes(const void* data, size_t bytes)
+{
+    if (_file.write(static_cast<const char*>(data), bytes) != static_cast<qint64>(bytes))
+        throw FATALERROR("Could not write cache file " + _file.fileName());
+}
+
+////////////////////////////////////////////////////////////////////
+
+void DustCacheFile::close()
+{
+    if (_data)
+    {
+        _file.unmap(const_cast<uchar*>(_data));
+        _data = 0;
+    }
+    if (_file.isOpen())
+    {
+        _file.close();
+        if (_writing)
+        {
+            _writing = false;
+            QFile::remove(_filepath);
+            if (!QFile::rename(_filepath + ".tmp", _filepath))
+                throw FATALERROR("Could not rename temporary cache file to " + _filepath);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+QString DustCacheFile::filepath() const
+{
+    return _filepath;
+}
+
+////////////////////////////////////////////////////////////////////
+
+QStringList DustCacheFile::removeOldest(QString directory, QString filter, int maxFiles)
+{
+    // list the matching files, most recently modified first
+    QFileInfoList infov = QDir(directory).entryInfoList(QStringList(filter), QDir::Files, QDir::Time);
+
+    QStringList removed;
+    for (int i=maxFiles; i<infov.size(); i++)
+    {
+        QString filepath = infov[i].absoluteFilePath();
+        if (QFile::remove(filepath)) removed << filepath;
+    }
+    return removed;
+}
+
+////////////////////////////////////////////////////////////////////
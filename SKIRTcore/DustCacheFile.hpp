@@ -0,0 +1,140 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#ifndef DUSTCACHEFILE_HPP
+#define DUSTCACHEFILE_HPP
+
+#include <cstring>
+#include <vector>
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <QStringList>
+#include "Array.hpp"
+
+////////////////////////////////////////////////////////////////////
+
+/** This class represents a binary file that caches the results of the dust system setup (the
+    structure of the dust grid and the densities in the dust cells) across simulations. A cache
+    file is identified by a key, usually a hash of the configuration that determines the cached
+    data (see ConfigurationHash). The key is stored in the file, and a cache file is accepted for
+    reading only if its key matches the requested key.
+
+    The file consists of a header followed by a sequence of blocks, each holding a contiguous
+    array of elements of a fixed-size type in native byte order. The header contains an
+    identifying tag, a check value that detects a mismatch in byte order, and the key. Each block
+    contains the number of elements and the size of an element as 64-bit integers, followed by the
+    raw element data padded to a multiple of 8 bytes. As a result, the data in each block is
+    properly aligned when the file is mapped into memory. The blocks must be read in the order in
+    which they were written; the file does not contain any information on the meaning of the
+    blocks.
+
+    For reading, the complete file is mapped into memory, and the data is copied directly from the
+    mapped memory into the receiving arrays. For writing, the data is written to a temporary file,
+    which replaces the cache file only when it is closed after all data has been written, so that
+    other simulations never see a partially written cache file. */
+class DustCacheFile
+{
+    //=============== Construction - Destruction  ==================
+
+public:
+    /** The constructor initializes a cache file object for the file with the specified path and
+        the specified key. The file is not yet opened. */
+    DustCacheFile(QString filepath, QByteArray key);
+
+    /** The destructor unmaps and closes the file if it is still open. If the file was opened for
+        writing but not properly closed, the temporary file is removed and the existing cache file
+        (if any) remains untouched. */
+    ~DustCacheFile();
+
+    //====================== Reading =======================
+
+public:
+    /** This function opens the cache file for reading and maps it into memory. It returns true if
+        the file exists and has a valid header with a key equal to the key of this object, and
+        false otherwise. */
+    bool openForReading();
+
+    /** This function reads the next block from the file into the specified vector, resizing it as
+        needed. The function throws a fatal error if the element size in the block does not match
+        the element type of the vector or if the file is truncated. */
+    template<typename T> void read(std::vector<T>& v)
+    {
+        size_t n = readBlockHeader(sizeof(T));
+        v.resize(n);
+        if (n) memcpy(&v[0], readBlockData(n*sizeof(T)), n*sizeof(T));
+    }
+
+    /** This function reads the next block from the file into the specified array, resizing it as
+        needed. The function throws a fatal error if the block does not contain double values or
+        if the file is truncated. */
+    void read(Array& v);
+
+    //====================== Writing =======================
+
+public:
+    /** This function creates a temporary file for writing the cache contents, and writes the
+        header including the key of this object. The function throws a fatal error if the file
+        cannot be created. */
+    void openForWriting();
+
+    /** This function writes the specified vector as the next block to the file. */
+    template<typename T> void write(const std::vector<T>& v)
+    {
+        writeBlock(v.empty() ? 0 : &v[0], v.size(), sizeof(T));
+    }
+
+    /** This function writes the specified array as the next block to the file. */
+    void write(const Array& v);
+
+    //====================== Other functions =======================
+
+public:
+    /** This function closes the file. If the file was opened for writing, the temporary file
+        replaces the cache file. */
+    void close();
+
+    /** This function returns the path of the cache file. */
+    QString filepath() const;
+
+    /** This function removes the oldest files (by modification time) with a name matching the
+        specified wildcard filter from the specified directory, so that at most \em maxFiles such
+        files remain. It returns the paths of the removed files. A file that cannot be removed,
+        e.g. because it is being used by another process on a system that does not allow this,
+        is skipped. On systems that do allow it, a simulation that has mapped a removed file into
+        memory can continue to read it. */
+    static QStringList removeOldest(QString directory, QString filter, int maxFiles);
+
+private:
+    /** This function reads the block header at the current position and returns the number of
+        elements in the block, after verifying the element size. */
+    size_t readBlockHeader(size_t elementsize);
+
+    /** This function returns a pointer to the block data with the specified number of bytes at
+        the current position, and advances the current position to the next block. */
+    const char* readBlockData(size_t bytes);
+
+    /** This function writes a block containing \em n elements of the specified size. */
+    void writeBlock(const void* data, size_t n, size_t elementsize);
+
+    /** This function writes the specified number of bytes to the file, throwing a fatal error if
+        the operation fails. */
+    void writeBytes(const void* data, size_t bytes);
+
+    //======================== Data Members ========================
+
+private:
+    QString _filepath;
+    QByteArray _key;
+    QFile _file;
+    bool _writing;
+    const uchar* _data;     // the mapped file contents when reading
+    size_t _size;           // the size of the mapped file contents
+    size_t _pos;            // the current read position
+};
+
+////////////////////////////////////////////////////////////////////
+
+#endif // DUSTCACHEFILE_HPP
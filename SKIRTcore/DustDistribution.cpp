@@ -26,3 +26,21 @@ int DustDistribution::indexformix(const DustMix* dustmix)
 }
 
 //////////////////////////////////////////////////////////////////////
+
+void DustDistribution::densities(int h, const vector<Position>& bfrv, Array& rhov) const
+{
+    size_t n = bfrv.size();
+    rhov.resize(n);
+    for (size_t i=0; i<n; i++) rhov[i] = density(h, bfrv[i]);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void DustDistribution::densities(const vector<Position>& bfrv, Array& rhov) const
+{
+    size_t n = bfrv.size();
+    rhov.resize(n);
+    for (size_t i=0; i<n; i++) rhov[i] = density(bfrv[i]);
+}
+
+//////////////////////////////////////////////////////////////////////
@@ -6,6 +6,8 @@
 #ifndef DUSTDISTRIBUTION_HPP
 #define DUSTDISTRIBUTION_HPP
 
+#include <vector>
+#include "Array.hpp"
 #include "Position.hpp"
 #include "SimulationItem.hpp"
 
@@ -59,6 +61,22 @@ public:
         distribution at the position \f${\bf{r}}\f$. */
     virtual double density(Position bfr) const = 0;
 
+    /** This function calculates the mass density \f$\rho_h({\bf{r}})\f$ of the \f$h\f$'th
+        component of the dust distribution at each of the positions in the specified list, and
+        stores the results in the \em rhov array, which is resized as needed. The default
+        implementation simply calls density(int, Position) for each position. Subclasses that can
+        evaluate the density for a batch of positions more efficiently (e.g. because the positions
+        are close to each other) may override this function. The result must be identical to
+        calling density(int, Position) for each position. */
+    virtual void densities(int h, const std::vector<Position>& bfrv, Array& rhov) const;
+
+    /** This function calculates the total mass density \f$\rho({\bf{r}})\f$ of the dust
+        distribution at each of the positions in the specified list, and stores the results in the
+        \em rhov array, which is resized as needed. The default implementation simply calls
+        density(Position) for each position. Subclasses may override this function as described
+        for the densities(int, ...) version. */
+    virtual void densities(const std::vector<Position>& bfrv, Array& rhov) const;
+
     /** This pure virtual function generates a random position from the dust distribution, by
         drawing a random point from the three-dimensional probability density \f$p({\bf{r}})\,
         {\text{d}}{\bf{r}} = \rho({\bf{r}})\, {\text{d}}{\bf{r}}\f$, where \f$\rho({\bf{r}})\f$ is
@@ -13,6 +13,15 @@ DustEmissivity::DustEmissivity()
 
 ////////////////////////////////////////////////////////////////////
 
+void DustEmissivity::emissivities(const DustMix* mix, const ArrayTable<2>& Jvv, ArrayTable<2>& evv) const
+{
+    size_t Nfields = Jvv.size(0);
+    evv.resize(Nfields,0);
+    for (size_t k=0; k<Nfields; k++) evv[k] = emissivity(mix, Jvv[k]);
+}
+
+////////////////////////////////////////////////////////////////////
+
 int DustEmissivity::logfrequency() const
 {
     return 0;
@@ -6,7 +6,7 @@
 #ifndef DUSTEMISSIVITY_HPP
 #define DUSTEMISSIVITY_HPP
 
-#include "Array.hpp"
+#include "ArrayTable.hpp"
 #include "SimulationItem.hpp"
 class DustMix;
 
@@ -37,6 +37,14 @@ public:
         field \f$J_\ell\f$, assuming the simulation's wavelength grid. */
     virtual Array emissivity(const DustMix* mix, const Array& Jv) const = 0;
 
+    /** This function calculates the dust emissivity \f$\varepsilon_{k,\ell}\f$ for a dust mix of
+        the specified type residing in each of the mean radiation fields \f$J_{k,\ell}\f$ given
+        as the rows of the input table, and stores the results in the corresponding rows of the
+        output table, which is resized as needed. The implementation in this class simply invokes
+        emissivity() for each field. Subclasses can override this function to handle a number of
+        fields more efficiently than one at a time. */
+    virtual void emissivities(const DustMix* mix, const ArrayTable<2>& Jvv, ArrayTable<2>& evv) const;
+
     /** The return value of this function indicates a meaningful frequency for console-logging when
         repeatly invoking emissivity(). A value of zero means that the calculation is fast and thus
         there should be no logging. A value of one means that the calculation is slow and thus
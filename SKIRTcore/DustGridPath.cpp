@@ -20,17 +20,28 @@ namespace
 //////////////////////////////////////////////////////////////////////
 
 DustGridPath::DustGridPath(const Position& bfr, const Direction& bfk)
-    : _bfr(bfr), _bfk(bfk), _s(0)
+    : _bfr(bfr), _bfk(bfk), _s(0), _valid(false), _columnvalid(false), _columndistance(0)
 {
-    _v.reserve(INITIAL_CAPACITY);
+    reserve();
 }
 
 //////////////////////////////////////////////////////////////////////
 
 DustGridPath::DustGridPath()
-    : _s(0)
+    : _s(0), _valid(false), _columnvalid(false), _columndistance(0)
 {
-    _v.reserve(INITIAL_CAPACITY);
+    reserve();
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void DustGridPath::reserve()
+{
+    _mv.reserve(INITIAL_CAPACITY);
+    _dsv.reserve(INITIAL_CAPACITY);
+    _sv.reserve(INITIAL_CAPACITY);
+    _dtauv.reserve(INITIAL_CAPACITY);
+    _tauv.reserve(INITIAL_CAPACITY);
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -38,7 +49,13 @@ DustGridPath::DustGridPath()
 void DustGridPath::clear()
 {
     _s = 0;
-    _v.clear();
+    _valid = false;
+    _columnvalid = false;
+    _mv.clear();
+    _dsv.clear();
+    _sv.clear();
+    _dtauv.clear();
+    _tauv.clear();
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -48,7 +65,9 @@ void DustGridPath::addSegment(int m, double ds)
     if (ds>0)
     {
         _s += ds;
-        _v.push_back(Segment{m,ds,_s,0,0});
+        _mv.push_back(m);
+        _dsv.push_back(ds);
+        _sv.push_back(_s);
     }
 }
 
@@ -153,21 +172,21 @@ Position DustGridPath::moveInside(const Box& box, double eps)
 
 double DustGridPath::tau() const
 {
-    int N = _v.size();
-    return N ? _v[N-1].tau : 0;
+    int N = _tauv.size();
+    return N ? _tauv[N-1] : 0;
 }
 
 //////////////////////////////////////////////////////////////////////
 
 double DustGridPath::pathlength(double tau) const
 {
-    int N = _v.size();
+    int N = _tauv.size();
     if (N>0 && tau>0)
     {
-        int i = NR::locate(_v,Segment{0,0,0,0,tau});
-        if (i<0) return NR::interpolate_linlin(tau, 0, _v[0].tau, 0, _v[0].s);
-        if (i<N-1) return NR::interpolate_linlin(tau, _v[i].tau, _v[i+1].tau, _v[i].s, _v[i+1].s);
-        return _v[N-1].s;
+        int i = NR::locate(_tauv,tau);
+        if (i<0) return NR::interpolate_linlin(tau, 0, _tauv[0], 0, _sv[0]);
+        if (i<N-1) return NR::interpolate_linlin(tau, _tauv[i], _tauv[i+1], _sv[i], _sv[i+1]);
+        return _sv[N-1];
     }
     return 0;
 }
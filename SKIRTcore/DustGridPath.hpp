@@ -23,7 +23,14 @@ class Box;
     properties in each cell (at a particular wavelength), one can also calculate optical depth
     information for the path. A DustGridPath object keeps record of the optical depth
     \f$\Delta\tau\f$ along the path segment within each cell, and the optical depth \f$\tau\f$
-    along the entire path up to the end of the cell. */
+    along the entire path up to the end of the cell.
+
+    The segment properties are stored in separate contiguous arrays (one for each property), rather
+    than in a single array of structures, so that the loops over the segments of long paths (e.g.
+    through \f$10^4\f$ or more cells of a Voronoi grid) access only the properties they need and
+    can be vectorized by the compiler. The arrays retain their capacity when the path is cleared,
+    so that a path object that is reused by a parallel thread for many photon packages requires no
+    further memory allocations once it has grown to the required size. */
 class DustGridPath
 {
 public:
@@ -72,18 +79,34 @@ public:
     Position moveInside(const Box &box, double eps);
 
     /** This function returns the number of cells crossed along the path. */
-    int size() const { return _v.size(); }
+    int size() const { return _mv.size(); }
 
     /** This function returns the cell number \f$m\f$ for segment \f$i\f$ in the path. */
-    int m(int i) const { return _v[i].m; }
+    int m(int i) const { return _mv[i]; }
 
     /** This function returns the path length covered within the cell in segment \f$i\f$ in the
         path. */
-    double ds(int i) const { return _v[i].ds; }
+    double ds(int i) const { return _dsv[i]; }
 
     /** This function returns the path length covered from the initial position of the path until
         the end point of the cell in segment \f$i\f$ in the path. */
-    double s(int i) const { return _v[i].s; }
+    double s(int i) const { return _sv[i]; }
+
+    /** This function records that the path segments currently stored in the path have been
+        calculated for the current initial position and propagation direction, so that they can be
+        reused for subsequent calculations along the same half-ray (see hasValidSegments()). */
+    void setValidSegments() { _valid = true; _validbfr = _bfr; _validbfk = _bfk; }
+
+    /** This function returns true if setValidSegments() has been called after the most recent
+        call to clear(), and the initial position and the propagation direction of the path have
+        not been changed (to a different value) since that call. In other words, it returns true
+        if the path segments currently stored in the path are known to be valid for the current
+        half-ray through the dust grid. */
+    bool hasValidSegments() const
+    {
+        return _valid && _bfr.x() == _validbfr.x() && _bfr.y() == _validbfr.y() && _bfr.z() == _validbfr.z()
+                && _bfk.x() == _validbfk.x() && _bfk.y() == _validbfk.y() && _bfk.z() == _validbfk.z();
+    }
 
     // ------- Handling data on optical depth -------
 
@@ -96,46 +119,80 @@ public:
         information in the path is neither used nor stored. */
     template<typename Functor> double opticalDepth(Functor kapparho, double distance=DBL_MAX) const
     {
-        int N = _v.size();
+        int N = _mv.size();
         double tau = 0;
         for (int i=0; i<N; i++)
         {
-            const Segment& segment = _v[i];
-            tau += kapparho(segment.m) * segment.ds;
-            if (segment.s > distance) break;
+            tau += kapparho(_mv[i]) * _dsv[i];
+            if (_sv[i] > distance) break;
         }
         return tau;
     }
 
+    /** This function returns a pointer to an array with the column density \f[ \Sigma_h =
+        \sum_i (\Delta s)_i\, \rho_{m_i,h} \f] along the path for each of the \em Ncomp dust
+        components \f$h\f$, for the specified distance along the path (or, if the last argument is
+        missing, for the complete path), using the same convention for the distance as the
+        opticalDepth() function. The densities \f$\rho_{m,h}\f$ are provided by the caller
+        through a call-back function with the signature "double density(int m, int h)". Because
+        the column densities do not depend on wavelength, the optical depth at any wavelength can
+        be obtained from them as \f$\tau_\ell = \sum_h \kappa_{\ell,h}\Sigma_h\f$. The result
+        is cached in the path object, and subsequent calls for the same number of components and
+        the same distance return the cached values without traversing the path segments, until
+        the path is cleared. Hence the caller must ensure that the densities do not change while
+        the path is being reused. */
+    template<typename Functor> const double* columnDensities(Functor density, int Ncomp, double distance=DBL_MAX)
+    {
+        if (!_columnvalid || _columndistance != distance || static_cast<int>(_columnv.size()) != Ncomp)
+        {
+            _columnv.assign(Ncomp, 0.);
+            int N = _mv.size();
+            for (int i=0; i<N; i++)
+            {
+                for (int h=0; h<Ncomp; h++) _columnv[h] += density(_mv[i], h) * _dsv[i];
+                if (_sv[i] > distance) break;
+            }
+            _columnvalid = true;
+            _columndistance = distance;
+        }
+        return &_columnv[0];
+    }
+
     /** This function calculates and stores the optical depth details for the path \f[
         (\Delta\tau)_i = (\Delta s)_i \times (\kappa\rho)_{m_i}, \f] \f[ \tau_i = \sum_{j=0}^i
         (\Delta\tau)_j,\f] using the path segment lengths \f$\Delta s_i\f$ already stored within
         the path object, and the multiplication factors \f$(\kappa\rho)_{m_i}\f$ provided by the
         caller through a call-back function, where \f$m_i\f$ is the number of the dust cell being
         crossed in path segment \f$i\f$. The call-back function must have the signature "double
-        kapparho(int m)". */
+        kapparho(int m)". The optical depths of the segments are gathered in a first loop, which
+        has no dependencies between iterations, and accumulated in a second loop. The gather loop
+        can be vectorized only if the call-back function does not branch, so it should handle the
+        cell number -1 (outside the grid) without a condition, e.g. through a zero sentinel entry
+        in front of a table of values. */
     template<typename Functor> inline void fillOpticalDepth(Functor kapparho)
     {
-        int N = _v.size();
+        int N = _mv.size();
+        _dtauv.resize(N);
+        _tauv.resize(N);
+        double* dtauv = _dtauv.data();
+        double* tauv = _tauv.data();
+        gatherOpticalDepth(kapparho, N, _mv.data(), _dsv.data(), dtauv);
         double tau = 0;
         for (int i=0; i<N; i++)
         {
-            Segment& segment = _v[i];
-            double dtau = kapparho(segment.m) * segment.ds;
-            tau += dtau;
-            segment.dtau = dtau;
-            segment.tau = tau;
+            tau += dtauv[i];
+            tauv[i] = tau;
         }
     }
 
     /** This function returns the optical depth covered within the cell in segment $i$ in the path.
         It assumes that the fillOpticalDepth() function was previously invoked for the path. */
-    double dtau(int i) const { return _v[i].dtau; }
+    double dtau(int i) const { return _dtauv[i]; }
 
     /** This function returns the optical depth covered from the initial position of the path until
         the end point of the cell in segment $i$ in the path. It assumes that the
         fillOpticalDepth() function was previously invoked for the path. */
-    double tau(int i) const { return _v[i].tau; }
+    double tau(int i) const { return _tauv[i]; }
 
     /** This function returns the total optical depth along the entire path. It assumes that the
         fillOpticalDepth() function was previously invoked for the path. */
@@ -146,11 +203,28 @@ public:
         \f$\tau\f$ to a physical path length \f$s\f$. The function assumes that the
         fillOpticalDepth() function was previously invoked for the path. We have to determine the
         first cell along the path for which the cumulative optical depth \f$\tau_{m}\f$ becomes
-        larger than \f$\tau\f$. This means that the position we are looking for lies within the
+        larger than \f$\tau\f$, which is done with a binary search in the array of cumulative
+        optical depths. This means that the position we are looking for lies within the
         \f$m\f$'th dust cell. The exact path length corresponding to \f$\tau\f$ is then found by
         linear interpolation within this cell. */
     double pathlength(double tau) const;
 
+private:
+    /** This function reserves an initial capacity for the arrays holding the segment properties,
+        to avoid frequent reallocation while a path is being constructed. */
+    void reserve();
+
+    /** This function performs the gather loop for the fillOpticalDepth() function. The arrays are
+        passed as restricted pointers, telling the compiler that the call-back function does not
+        read the array being written, so that the loop can be vectorized. */
+    template<typename Functor> static inline void gatherOpticalDepth(Functor& kapparho, int N,
+                                                                     const int* __restrict mv,
+                                                                     const double* __restrict dsv,
+                                                                     double* __restrict dtauv)
+    {
+        for (int i=0; i<N; i++) dtauv[i] = kapparho(mv[i]) * dsv[i];
+    }
+
     // ------- Data members -------
 
 protected:
@@ -158,13 +232,17 @@ protected:
     Direction _bfk;
 private:
     double _s;
-    struct Segment
-    {
-        int m;
-        double ds, s, dtau, tau;
-        bool operator<(Segment other) const { return tau < other.tau; }
-    };
-    std::vector<Segment> _v;
+    bool _valid;            // true if the segments are valid for _validbfr and _validbfk
+    Position _validbfr;
+    Direction _validbfk;
+    bool _columnvalid;      // true if _columnv holds the column densities for the current segments and _columndistance
+    double _columndistance;
+    std::vector<double> _columnv;
+    std::vector<int> _mv;           // the cell number for each segment
+    std::vector<double> _dsv;       // the path length covered within the cell for each segment
+    std::vector<double> _sv;        // the path length up to the end of each segment
+    std::vector<double> _dtauv;     // the optical depth within the cell for each segment
+    std::vector<double> _tauv;      // the optical depth up to the end of each segment
 };
 
 //////////////////////////////////////////////////////////////////////
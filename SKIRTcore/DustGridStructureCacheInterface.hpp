@@ -0,0 +1,41 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#ifndef DUSTGRIDSTRUCTURECACHEINTERFACE_HPP
+#define DUSTGRIDSTRUCTURECACHEINTERFACE_HPP
+
+class DustCacheFile;
+
+////////////////////////////////////////////////////////////////////
+
+/** DustGridStructureCacheInterface is a pure interface. It is implemented by dust grids that
+    construct their structure during setup through an expensive procedure, and that can store this
+    structure in a DustCacheFile and restore it from such a file. If the DustSystem class has been
+    configured to use a cache file, and it detects a dust grid that implements this interface, it
+    offers the grid structure stored in a matching cache file to the dust grid before the dust
+    grid is being setup, so that the grid can skip the construction procedure. */
+class DustGridStructureCacheInterface
+{
+protected:
+    /** The empty constructor for the interface. */
+    DustGridStructureCacheInterface() { }
+
+public:
+    /** The empty destructor for the interface. */
+    virtual ~DustGridStructureCacheInterface() { }
+
+    /** This function writes the structure of the dust grid to the specified cache file. It is
+        called after setup of the dust grid has been completed. */
+    virtual void writeStructure(DustCacheFile& file) const = 0;
+
+    /** This function reads the structure of the dust grid from the specified cache file. It is
+        called before the dust grid is being setup. The dust grid should remember the structure,
+        and use it instead of constructing the grid during setup. */
+    virtual void readStructure(DustCacheFile& file) = 0;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+
+#endif // DUSTGRIDSTRUCTURECACHEINTERFACE_HPP
@@ -3,6 +3,7 @@
 ////       © Astronomical Observatory, Ghent University         ////
 ///////////////////////////////////////////////////////////////// */
 
+#include <algorithm>
 #include <QMultiHash>
 #include <QTime>
 #include "DustLib.hpp"
@@ -13,6 +14,7 @@
 #include "Parallel.hpp"
 #include "ParallelFactory.hpp"
 #include "PeerToPeerCommunicator.hpp"
+#include "RootAssigner.hpp"
 #include "StaggeredAssigner.hpp"
 #include "TimeLogger.hpp"
 #include "WavelengthGrid.hpp"
@@ -56,12 +58,17 @@ ProcessAssigner* DustLib::assigner() const
 
 namespace
 {
+    // the number of library entries handled together by a single invocation of the emission calculator body
+    const int Nbatch = 8;
+
     class EmissionCalculator : public ParallelTarget
     {
     private:
         // data members initialized in constructor
         ArrayTable<2>& _Lvv;        // output luminosities indexed on m or n and ell (writable reference)
         QMultiHash<int,int> _mh;    // hash map <n,m> of cells for each library entry
+        const vector<int>& _entryv; // the library entries to be calculated, in batches of consecutive items
+        const Table<2>* _Jsumvv;    // the summed mean intensities of the cells for each library entry, or null
         Log* _log;
         PanDustSystem* _ds;
         DustEmissivity* _de;
@@ -72,8 +79,9 @@ namespace
 
     public:
         // constructor
-        EmissionCalculator(ArrayTable<2>& Lvv, vector<int>& nv, int Nlib, SimulationItem* item)
-            : _Lvv(Lvv)
+        EmissionCalculator(ArrayTable<2>& Lvv, vector<int>& nv, int Nlib, const vector<int>& entryv,
+                           const Table<2>* Jsumvv, SimulationItem* item)
+            : _Lvv(Lvv), _entryv(entryv), _Jsumvv(Jsumvv)
         {
             // get basic information about the wavelength grid and the dust system
             _log = item->find<Log>();
@@ -102,15 +110,17 @@ namespace
             _timer.start();
         }
 
-        // the parallized loop body; calculates the emission for a single library entry
-        void body(size_t n)
+        // the parallized loop body; calculates the emission for a batch of library entries
+        void body(size_t b)
         {
-            // get the list of dust cells that map to this library entry
-            QList<int> mv = _mh.values(n);
-            int Nmapped = mv.size();
-
-            // if this library entry is used by at least one cell, calculate the emission for those cells
-            if (Nmapped > 0)
+            // determine the library entries in this batch
+            size_t first = b*Nbatch;
+            size_t last = min(_entryv.size(), first+Nbatch);
+            vector<int> nv(_entryv.begin()+first, _entryv.begin()+last);
+            int Nentries = nv.size();
+
+            // if at least one library entry is used, calculate the emission for the corresponding cells
+            if (Nentries > 0)
             {
                 if (_de->logfrequency())
                 {
@@ -119,51 +129,70 @@ namespace
                     if (_timer.elapsed() > 5000)
                     {
                         _timer.restart();
-                        _log->info("Calculating emission for library entry " + QString::number(n+1) + "...");
+                        _log->info("Calculating emission for library entry " + QString::number(nv[0]+1) + "...");
                     }
                 }
 
-                // calculate the average ISRF for this library entry from the ISRF of all dust cells that map to it
-                Array Jv(_Nlambda);
-                foreach (int m, mv) Jv += _ds->meanintensityv(m);
-                Jv /= Nmapped;
+                // calculate the average ISRF for each library entry from the ISRF of all dust cells that map to it
+                ArrayTable<2> Jvv(Nentries,_Nlambda);
+                for (int i=0; i<Nentries; i++)
+                {
+                    QList<int> mv = _mh.values(nv[i]);
+                    if (_Jsumvv) for (int ell=0; ell<_Nlambda; ell++) Jvv(i,ell) = (*_Jsumvv)(nv[i],ell);
+                    else foreach (int m, mv) Jvv[i] += _ds->meanintensityv(m);
+                    Jvv[i] /= mv.size();
+                }
 
                 // multiple dust components: calculate emission for each dust cell separately
                 if (_Ncomp > 1)
                 {
                     // get emissivity for each dust component (i.e. for the corresponding dust mix)
-                    ArrayTable<2> evv(_Ncomp,0);
-                    for (int h=0; h<_Ncomp; h++) evv[h] = _de->emissivity(_ds->mix(h),Jv);
+                    // and for each library entry in the batch
+                    ArrayTable<3> evvv(_Ncomp,Nentries,0);
+                    for (int h=0; h<_Ncomp; h++)
+                    {
+                        ArrayTable<2> evv;
+                        _de->emissivities(_ds->mix(h),Jvv,evv);
+                        for (int i=0; i<Nentries; i++) evvv(h,i) = evv[i];
+                    }
 
                     // combine emissivities into SED for each dust cell, and store the normalized SEDs
-                    foreach (int m, mv)
+                    for (int i=0; i<Nentries; i++)
                     {
-                        // get a reference to the output array for this dust cell
-                        Array& Lv = _Lvv[m];
-
-                        // calculate the emission for this cell
-                        for (int h=0; h<_Ncomp; h++) Lv += evv[h] * _ds->density(m,h);
-
-                        // convert to luminosities and normalize the result
-                        Lv *= _lambdagrid->dlambdav();
-                        double total = Lv.sum();
-                        if (total>0) Lv /= total;
+                        foreach (int m, _mh.values(nv[i]))
+                        {
+                            // get a reference to the output array for this dust cell
+                            Array& Lv = _Lvv[m];
+
+                            // calculate the emission for this cell
+                            for (int h=0; h<_Ncomp; h++) Lv += evvv(h,i) * _ds->density(m,h);
+
+                            // convert to luminosities and normalize the result
+                            Lv *= _lambdagrid->dlambdav();
+                            double total = Lv.sum();
+                            if (total>0) Lv /= total;
+                        }
                     }
                 }
 
                 // single dust component: remember just the libary template, which serves for all mapped cells
                 else
                 {
-                    // get a reference to the output array for this library entry
-                    Array& Lv = _Lvv[n];
+                    // get the emissivity of the library entries
+                    ArrayTable<2> evv;
+                    _de->emissivities(_ds->mix(0),Jvv,evv);
 
-                    // get the emissivity of the library entry
-                    Lv = _de->emissivity(_ds->mix(0),Jv);
+                    for (int i=0; i<Nentries; i++)
+                    {
+                        // get a reference to the output array for this library entry
+                        Array& Lv = _Lvv[nv[i]];
+                        Lv = evv[i];
 
-                    // convert to luminosities and normalize the result
-                    Lv *= _lambdagrid->dlambdav();
-                    double total = Lv.sum();
-                    if (total>0) Lv /= total;
+                        // convert to luminosities and normalize the result
+                        Lv *= _lambdagrid->dlambdav();
+                        double total = Lv.sum();
+                        if (total>0) Lv /= total;
+                    }
                 }
             }
         }
@@ -177,21 +206,77 @@ void DustLib::calculate()
     // get mapping from cells to library entries
     int Nlib = entries();
     _nv = mapping();
+    int Ncells = _nv.size();
+
+    // determine the number of cells that map to each library entry
+    vector<int> countv(Nlib);
+    for (int m=0; m<Ncells; m++) if (_nv[m] >= 0) countv[_nv[m]]++;
+    int Nmax = Nlib ? *max_element(countv.begin(), countv.end()) : 0;
+
+    // determine the library entries to be calculated by this process, and how these are assigned;
+    // if the absorption tables are distributed over the processes, the mean intensity of the radiation field
+    // is available only for the cells held by the process, and thus:
+    // - if each library entry serves a single cell, the entry is calculated by the process holding that cell
+    // - otherwise, the mean intensities of the cells mapping to each entry are first summed across processes
+    PanDustSystem* ds = find<PanDustSystem>();
+    PeerToPeerCommunicator* comm = find<PeerToPeerCommunicator>();
+    bool local = ds->distributedtables() && Nmax <= 1;
+    vector<int> entryv;
+    Table<2> Jsumvv;
+    if (local)
+    {
+        for (int m=0; m<Ncells; m++) if (_nv[m] >= 0 && ds->ownscell(m)) entryv.push_back(_nv[m]);
+    }
+    else
+    {
+        for (int n=0; n<Nlib; n++) if (countv[n]) entryv.push_back(n);
 
-    // assign each process to a set of library entries
-    _assigner->assign(Nlib);
+        if (ds->distributedtables())
+        {
+            int Nlambda = find<WavelengthGrid>()->Nlambda();
+            Jsumvv.resize(Nlib,Nlambda);
+            for (int m=0; m<Ncells; m++)
+            {
+                int n = _nv[m];
+                if (n >= 0 && ds->ownscell(m))
+                {
+                    const Array& Jv = ds->meanintensityv(m);
+                    for (int ell=0; ell<Nlambda; ell++) Jsumvv(n,ell) += Jv[ell];
+                }
+            }
+            comm->sum_all(Jsumvv.getArray());
+        }
+    }
+
+    // assign each process to a set of library entry batches; when each process calculates the entries
+    // for its own cells, a private assigner without communicator assigns all of these batches to this process
+    RootAssigner localassigner(0);
+    ProcessAssigner* assigner = local ? &localassigner : _assigner;
+    assigner->assign((entryv.size()+Nbatch-1)/Nbatch);
 
     // calculate the emissivity for each library entry assigned to this process
-    EmissionCalculator calc(_Lvv, _nv, Nlib, this);
+    EmissionCalculator calc(_Lvv, _nv, Nlib, entryv, Jsumvv.size(0) ? &Jsumvv : 0, this);
     Parallel* parallel = find<ParallelFactory>()->parallel();
-    parallel->call(&calc, _assigner);
+    parallel->call(&calc, assigner);
 
     // Wait for the other processes to reach this point
-    PeerToPeerCommunicator* comm = find<PeerToPeerCommunicator>();
     comm->wait("the emission spectra calculation");
 
     // assemble _Lvv from the information stored at different processes, if the work is done in parallel processes
-    if (_assigner->parallel()) assemble();
+    if (local || _assigner->parallel())
+    {
+        // determine the rank of the process that calculated each library entry in use
+        vector<int> rankv(Nlib,-1);
+        if (local)
+        {
+            for (int m=0; m<Ncells; m++) if (_nv[m] >= 0) rankv[_nv[m]] = ds->cellrank(m);
+        }
+        else
+        {
+            for (size_t k=0; k<entryv.size(); k++) rankv[entryv[k]] = _assigner->rankForIndex(k/Nbatch);
+        }
+        assemble(rankv);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -212,7 +297,7 @@ double DustLib::luminosity(int m, int ell) const
 
 ////////////////////////////////////////////////////////////////////
 
-void DustLib::assemble()
+void DustLib::assemble(const vector<int>& rankv)
 {
     // Get a pointer to the PeerToPeerCommunicator of this simulation
     PeerToPeerCommunicator* comm = find<PeerToPeerCommunicator>();
@@ -220,28 +305,19 @@ void DustLib::assemble()
     Log* log = find<Log>();
     TimeLogger logger(log->verbose() && comm->isMultiProc() ? log : 0, "communication of the dust emission spectra");
 
+    // determine for each row of _Lvv which process calculated the emission SED
     size_t Ncells = _nv.size();
     if (_Lvv.size(0) == Ncells)     // _Lvv is indexed on m, the index of the dust cells
     {
-        for (size_t m = 0; m < Ncells; m++) // for each dust cell
-        {
-            size_t n = _nv[m];                      // get the library index for this dust cell ..
-            int rank = _assigner->rankForIndex(n);    // .. to determine which process calculated the emission SED
-
-            // finally, broadcast the emission SED from that process to all the other processes
-            comm->broadcast(_Lvv[m],rank);
-        }
-
+        // cells not mapped to a library entry remain zero
+        vector<int> ranks(Ncells);
+        for (size_t m = 0; m < Ncells; m++) ranks[m] = _nv[m]>=0 ? rankv[_nv[m]] : -1;
+        comm->gather_all(_Lvv, ranks);
     }
     else    // _Lvv is indexed on n, the library entry index
     {
-        for (size_t n = 0; n < _Lvv.size(0); n++)   // for each library entry
-        {
-            int rank = _assigner->rankForIndex(n);    // determine which process calculated the emission SED of this entry
-
-            // broadcast the emission SED from that process to all the other processes
-            comm->broadcast(_Lvv[n],rank);
-        }
+        // entries not used by any dust cell remain zero
+        comm->gather_all(_Lvv, rankv);
     }
 }
 
@@ -69,17 +69,19 @@ public:
         function first calls the entries() and mapping() functions, implemented in each subclass. The
         first gives the total number of library entries. The second function is called to obtain the
         mapping from each dust cell \f$m\f$ to the corresponding library entry \f$n\f$. Next, the
-        assign function of the ProcessAssigner class is called, with the number of library entries
-        provided as an argument. The appropriate ProcessAssigner subclass will then, based on this
-        number, assign different library entries to different processes. The subsequent calculations
+        assign function of the ProcessAssigner class is called, with the number of batches of library
+        entries in use (i.e. entries to which at least one dust cell is mapped) provided as an
+        argument. The appropriate ProcessAssigner subclass will then, based on this number, assign
+        different library entries to different processes. The subsequent calculations
         are then performed in parallel by the different processes, which in turn use an instance of the
         Parallel class to distribute the work amongst different threads. The smallest unit of
-        parallelization here is obviously the calculation of the %SED for one particular library entry.
-        The calculation itself is implemented in a helper class, called EmissionCalculator. For a
-        particular library entry, the EmissionCalculator object first determines the mean %ISRF by
-        averaging the ISRFs of all the dust cells that map onto it. Then, it calls on the
+        parallelization here is the calculation of the %SEDs for a small batch of library entries, so
+        that the DustEmissivity object can process the radiation fields for these entries
+        together. The calculation itself is implemented in a helper class, called EmissionCalculator.
+        For each library entry in a batch, the EmissionCalculator object first determines the mean
+        %ISRF by averaging the ISRFs of all the dust cells that map onto it. Then, it calls on the
         DustEmissivity object held by the dust system to actually calculate the emissivities
-        corresponding to the library entry. If the dust system contains multiple dust components
+        corresponding to the library entries. If the dust system contains multiple dust components
         \f$h\f$, each with its own dust mix, the emissivity \f$\varepsilon_{n,h,\ell}\f$ is calculated
         for each dust component \f$h\f$ seperately, and the results are combined into the complete
         emission spectrum for a dust cell \f$m\f$ through \f[ j_{m,\ell} =
@@ -102,7 +104,14 @@ public:
         communication between the processes is required. Another ProcessAssigner can be chosen which
         assigns each process to the same library entries, avoiding the need for communication
         afterwards. Whether or not the assemble function has to be called is determined by the parallel
-        function of the ProcessAssigner. */
+        function of the ProcessAssigner.
+
+        If the dust system distributes its absorption tables over the processes, the mean %ISRF is
+        available only for the dust cells held by each process. If each library entry serves at most
+        a single dust cell, each process then calculates the entries for its own cells, and the
+        ProcessAssigner is not used. Otherwise, the ISRFs of the cells held by each process are summed
+        per library entry, and these sums are added across processes before the calculation proceeds
+        as described above. */
     void calculate();
 
     /** This function returns the luminosity fraction \f$L_\ell\f$ at the wavelength index
@@ -118,18 +127,16 @@ private:
         only the emission luminosities for a particular set of library entries or dust cells (depending
         on which DustLib subclass is used and whether or not multiple dust components are present). In
         order to perform the simulation of thermal photon packages, each process needs the emission %SED
-        for all dust cells (or all library entries). This function uses the PeerToPeerCommunicator to
-        broadcast the SEDs of the dust cells (or library entries) assigned to a particular process to
-        all other processes and storing them in the appropriate place in the list. This is implemented
-        as a loop over all dust cells (or all library entries), where for each dust cell (library
-        entry) the ProcessAssigner is called to determine which process was assigned to it. Next, the
-        broadcast function of the PeerToPeerCommunicator class is called, passing the %SED of that dust
-        cell (library entry) and rank of that process as arguments. Only for that process, the %SED
-        contains actual luminosities, whereas for the other processes the %SED is zero. When the
-        broadcast function returns, the luminosities from the former process have been copied in the
-        memory of the other processes. When this is done for each dust cell (library entry), the
-        assembly is complete. */
-    void assemble();
+        for all dust cells (or all library entries). The argument specifies, for each library entry,
+        the rank of the process that calculated its emission %SED, or -1 if the entry is not in use;
+        this information is known to all processes without communication. The SEDs are then
+        exchanged by the PeerToPeerCommunicator, which packs the SEDs held by each process into a
+        single buffer and distributes these buffers to all processes in a single collective
+        operation (or a few of them for very large grids). As a result, the amount of communication
+        scales with the volume of the data rather than with the number of dust cells. Dust cells
+        that do not map to a library entry, and library entries that are not used by any dust cell,
+        are not communicated since their luminosities are zero on all processes. */
+    void assemble(const std::vector<int>& rankv);
 
 protected:
     /** This function returns the number of entries in the library. It must be implemented by each
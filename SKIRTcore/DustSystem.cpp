@@ -5,9 +5,15 @@
 
 #include <cmath>
 #include <fstream>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFileInfo>
+#include "ConfigurationHash.hpp"
+#include "DustCacheFile.hpp"
 #include "DustDistribution.hpp"
 #include "DustGridDensityInterface.hpp"
 #include "DustGridPath.hpp"
+#include "DustGridStructureCacheInterface.hpp"
 #include "DustGrid.hpp"
 #include "DustMix.hpp"
 #include "DustSystem.hpp"
@@ -17,7 +23,6 @@
 #include "FilePaths.hpp"
 #include "FITSInOut.hpp"
 #include "Log.hpp"
-#include "NR.hpp"
 #include "IdenticalAssigner.hpp"
 #include "Image.hpp"
 #include "Parallel.hpp"
@@ -31,16 +36,24 @@
 #include "TimeLogger.hpp"
 #include "Units.hpp"
 #include "WavelengthGrid.hpp"
-#include <QVarLengthArray>
 
 using namespace std;
 
 //////////////////////////////////////////////////////////////////////
 
+namespace
+{
+    // a precomputed extinction table larger than this size (in MB) triggers a warning during setup
+    const double LARGE_EXTINCTION_TABLE = 4000.;
+}
+
+//////////////////////////////////////////////////////////////////////
+
 DustSystem::DustSystem()
-    : _dd(0), _grid(0), _gdi(0), _Nrandom(100),
+    : _dd(0), _grid(0), _gdi(0), _Nrandom(100), _cacheGrid(false), _cacheLimit(10), _extinctionTable(Factorized),
       _writeConvergence(true), _writeDensity(true), _writeDepthMap(false),
-      _writeQuality(false), _writeCellProperties(false), _writeCellsCrossed(false), _assigner(0)
+      _writeQuality(false), _writeCellProperties(false), _writeCellsCrossed(false), _assigner(0),
+      _cached(false), _random(0)
 {
 }
 
@@ -56,6 +69,13 @@ void DustSystem::setupSelfBefore()
 
     // If no assigner was set, use a StaggeredAssigner as default
     if (!_assigner) setAssigner(new StaggeredAssigner(this));
+
+    // Cache the random generator, which is used in the photon life cycle
+    _random = find<Random>();
+
+    // If requested, read the grid structure and the cell densities from the cache file for the current
+    // configuration (if it exists); this must happen before the dust grid is being setup
+    if (_cacheGrid) readcache();
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -75,9 +95,29 @@ void DustSystem::setupSelfAfter()
             throw FATALERROR("All dust mixes must consistenly support polarization, or not support polarization");
     }
 
-    // Resize the tables that hold essential dust cell properties
+    // Copy the opacities of the dust mixes into tables indexed on wavelength and dust component,
+    // so that the photon life cycle can obtain them for all components at once through a simple lookup
+    int Nlambda = find<WavelengthGrid>()->Nlambda();
+    _kappascavv.resize(Nlambda,_Ncomp);
+    _kappaextvv.resize(Nlambda,_Ncomp);
+    for (int h=0; h<_Ncomp; h++)
+    {
+        DustMix* mix = _dd->mix(h);
+        for (int ell=0; ell<Nlambda; ell++)
+        {
+            _kappascavv(ell,h) = mix->kappasca(ell);
+            _kappaextvv(ell,h) = mix->kappaext(ell);
+        }
+    }
+
+    // Resize the tables that hold essential dust cell properties, unless the densities were read from the cache
+    if (_cached && (_rhovv.size(0) != static_cast<size_t>(_Ncells+1) || _rhovv.size(1) != static_cast<size_t>(_Ncomp)))
+    {
+        find<Log>()->warning("The cell densities in the cache file do not match the dust grid; recalculating");
+        _cached = false;
+    }
     _volumev.resize(_Ncells);
-    _rhovv.resize(_Ncells,_Ncomp);
+    if (!_cached) _rhovv.resize(_Ncells+1,_Ncomp);
 
     // Set the volume of the cells (parallelized over different threads, except when multiprocessing is enabled)
     find<Log>()->info("Calculating the volume of the cells...");
@@ -91,7 +131,11 @@ void DustSystem::setupSelfAfter()
 
     // Calculate and set the density of the cells that are assigned to this process
     _gdi = _grid->interface<DustGridDensityInterface>();
-    if (_gdi)
+    if (_cached)
+    {
+        find<Log>()->info("Using the density in the cells read from the cache file...");
+    }
+    else if (_gdi)
     {
         // if the dust grid offers a special interface, use it
         find<Log>()->info("Setting the value of the density in the cells using grid interface...");
@@ -111,7 +155,32 @@ void DustSystem::setupSelfAfter()
     RootAssigner* writeassigner = new RootAssigner(this);
 
     // Obtain the densities in all dust cells, if the calculation has been performed by parallel processes
-    if (_assigner->parallel()) assemble();
+    if (!_cached && _assigner->parallel()) assemble();
+
+    // Write the grid structure and the cell densities to the cache file, if requested and not yet available
+    if (_cacheGrid && !_cached && comm->isRoot()) writecache();
+
+    // Precompute the extinction coefficient for each wavelength and each cell, if requested
+    double megabytes = static_cast<double>(_Ncells) * Nlambda * (_extinctionTable==SinglePrecision ? 4 : 8) / 1e6;
+    if (_extinctionTable == Factorized)
+    {
+        find<Log>()->info("Evaluating extinction from " + QString::number(_Ncomp) + " dust component(s) per cell"
+                          + " (a precomputed table would use " + QString::number(megabytes,'f',1) + " MB)");
+    }
+    else
+    {
+        find<Log>()->info("Precomputing the extinction table for " + QString::number(Nlambda) + " wavelengths"
+                          + " (using " + QString::number(megabytes,'f',1) + " MB in "
+                          + (_extinctionTable==SinglePrecision ? "single" : "double") + " precision)...");
+        if (megabytes > LARGE_EXTINCTION_TABLE)
+            find<Log>()->warning("The precomputed extinction table uses more than "
+                                 + QString::number(LARGE_EXTINCTION_TABLE,'f',0) + " MB in each process;"
+                                 + " consider the Factorized option if memory is insufficient");
+        if (_extinctionTable == SinglePrecision) _kapparhofv.resize(static_cast<size_t>(_Ncells+1) * Nlambda);
+        else _kapparhodv.resize(static_cast<size_t>(_Ncells+1) * Nlambda);
+        assigner->assign(Nlambda);
+        find<ParallelFactory>()->parallel()->call(this, &DustSystem::setExtinctionTableBody, assigner);
+    }
 
     // Perform a convergence check on the grid.
     if (_writeConvergence) writeconvergence();
@@ -143,7 +212,7 @@ void DustSystem::setVolumeBody(size_t m)
 void DustSystem::setGridDensityBody(size_t m)
 {
     for (int h=0; h<_Ncomp; h++)
-        _rhovv(m,h) = _gdi->density(h,m);
+        _rhovv(m+1,h) = _gdi->density(h,m);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -159,20 +228,115 @@ void DustSystem::setSampleDensityBody(size_t m)
     double weight = _grid->weight(m);
     if (weight > 0)
     {
-        Array sumv(_Ncomp);
-        for (int n=0; n<_Nrandom; n++)
-        {
-            Position bfr = _grid->randomPositionInCell(m);
-            for (int h=0; h<_Ncomp; h++) sumv[h] += _dd->density(h,bfr);
-        }
+        // generate all random positions before evaluating the density, so that the dust distribution
+        // can handle these nearby positions as a single batch
+        vector<Position> bfrv(_Nrandom);
+        for (int n=0; n<_Nrandom; n++) bfrv[n] = _grid->randomPositionInCell(m);
+        Array rhov;
         for (int h=0; h<_Ncomp; h++)
         {
-            _rhovv(m,h) = weight*sumv[h]/_Nrandom;
+            _dd->densities(h, bfrv, rhov);
+            double sum = 0.;
+            for (int n=0; n<_Nrandom; n++) sum += rhov[n];
+            _rhovv(m+1,h) = weight*sum/_Nrandom;
         }
     }
     else
     {
-        for (int h=0; h<_Ncomp; h++) _rhovv(m,h) = 0;
+        for (int h=0; h<_Ncomp; h++) _rhovv(m+1,h) = 0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+void DustSystem::readcache()
+{
+    // calculate a hash of the configuration that determines the grid structure and the cell densities
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    ConfigurationHash::add(hash, _dd);
+    ConfigurationHash::add(hash, _grid);
+    ConfigurationHash::add(hash, find<Random>());
+    hash.addData(reinterpret_cast<const char*>(&_Nrandom), sizeof(_Nrandom));
+    _cachekey = hash.result();
+
+    // place the cache file in the cache directory, if one has been specified, or in the output path
+    QString directory = find<FilePaths>()->outputPath();
+    if (!_cacheDirectory.isEmpty())
+    {
+        directory = QDir::isAbsolutePath(_cacheDirectory) ? _cacheDirectory : directory + _cacheDirectory;
+        if (!QDir().mkpath(directory)) throw FATALERROR("Could not create cache directory " + directory);
+        if (!directory.endsWith("/")) directory += "/";
+    }
+    _cachepath = directory + "dustcache_" + QString(_cachekey.toHex()) + ".dat";
+
+    // read the cache file, if it exists and matches the configuration
+    DustCacheFile file(_cachepath, _cachekey);
+    if (file.openForReading())
+    {
+        find<Log>()->info("Reading dust grid and densities from cache file " + _cachepath + "...");
+        DustGridStructureCacheInterface* gsci = _grid->interface<DustGridStructureCacheInterface>();
+        if (gsci) gsci->readStructure(file);
+        vector<int> sizev;
+        file.read(sizev);
+        if (sizev.size() != 2) throw FATALERROR("Cache file " + _cachepath + " is inconsistent");
+        Array rhov;
+        file.read(rhov);
+        if (rhov.size() != static_cast<size_t>(sizev[0])*sizev[1])
+            throw FATALERROR("Cache file " + _cachepath + " is inconsistent");
+        file.close();
+
+        // the file holds the rows for the actual cells, without the zero row in front of the density table
+        _rhovv.resize(sizev[0]+1, sizev[1]);
+        if (rhov.size()) std::copy(begin(rhov), end(rhov), &_rhovv(1,0));
+        _cached = true;
+    }
+    else
+    {
+        find<Log>()->info("No matching dust cache file " + _cachepath + "; the cache will be created");
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+void DustSystem::writecache()
+{
+    find<Log>()->info("Writing dust grid and densities to cache file " + _cachepath + "...");
+    DustCacheFile file(_cachepath, _cachekey);
+    file.openForWriting();
+    DustGridStructureCacheInterface* gsci = _grid->interface<DustGridStructureCacheInterface>();
+    if (gsci) gsci->writeStructure(file);
+    vector<int> sizev;
+    sizev.push_back(_Ncells);
+    sizev.push_back(_Ncomp);
+    file.write(sizev);
+    Array rhov(static_cast<size_t>(_Ncells)*_Ncomp);
+    if (rhov.size()) std::copy(&_rhovv(1,0), &_rhovv(1,0)+rhov.size(), begin(rhov));
+    file.write(rhov);
+    file.close();
+
+    // remove the oldest cache files beyond the retention limit
+    if (_cacheLimit > 0)
+    {
+        QStringList removed = DustCacheFile::removeOldest(QFileInfo(_cachepath).absolutePath(),
+                                                          "dustcache_*.dat", _cacheLimit);
+        for (QString filepath : removed) find<Log>()->info("Removed old dust cache file " + filepath);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+// parallelized body used above
+void DustSystem::setExtinctionTableBody(size_t ell)
+{
+    const double* kappaextv = this->kappaextv(ell);
+    // like the density table, the row for each wavelength starts with a zero entry for the cell number -1
+    size_t offset = ell * (_Ncells+1);
+    for (int k=0; k<=_Ncells; k++)
+    {
+        double kapparho = 0;
+        for (int h=0; h<_Ncomp; h++) kapparho += kappaextv[h] * _rhovv(k,h);
+        if (_extinctionTable == SinglePrecision) _kapparhofv[offset+k] = kapparho;
+        else _kapparhodv[offset+k] = kapparho;
     }
 }
 
@@ -468,15 +632,13 @@ namespace
         // data members initialized in constructor
         const DustSystem* _ds;
         int _Ncomp;
-        QVarLengthArray<double,8> _kappaextv;
+        const double* _kappaextv;
 
     public:
         // constructor
-        // stores the extinction coefficients at the specified wavelength for all dust mixes
-        KappaRho(const DustSystem* ds, int ell) : _ds(ds), _Ncomp(ds->Ncomp()), _kappaextv(_Ncomp)
+        // remembers the extinction coefficients at the specified wavelength for all dust mixes
+        KappaRho(const DustSystem* ds, int ell) : _ds(ds), _Ncomp(ds->Ncomp()), _kappaextv(ds->kappaextv(ell))
         {
-            for (int h=0; h<_Ncomp; h++)
-                _kappaextv[h] = _ds->mix(h)->kappaext(ell);
         }
 
         // call-back function
@@ -741,6 +903,62 @@ int DustSystem::sampleCount() const
 
 ////////////////////////////////////////////////////////////////////
 
+void DustSystem::setCacheGrid(bool value)
+{
+    _cacheGrid = value;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+bool DustSystem::cacheGrid() const
+{
+    return _cacheGrid;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void DustSystem::setCacheDirectory(QString value)
+{
+    _cacheDirectory = value;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+QString DustSystem::cacheDirectory() const
+{
+    return _cacheDirectory;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void DustSystem::setCacheLimit(int value)
+{
+    _cacheLimit = value;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+int DustSystem::cacheLimit() const
+{
+    return _cacheLimit;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void DustSystem::setExtinctionTable(DustSystem::ExtinctionTable value)
+{
+    _extinctionTable = value;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+DustSystem::ExtinctionTable DustSystem::extinctionTable() const
+{
+    return _extinctionTable;
+}
+
+//////////////////////////////////////////////////////////////////////
+
 void DustSystem::setWriteConvergence(bool value)
 {
     _writeConvergence = value;
@@ -876,6 +1094,20 @@ DustMix* DustSystem::mix(int h) const
 
 //////////////////////////////////////////////////////////////////////
 
+const double* DustSystem::kappascav(int ell) const
+{
+    return &_kappascavv(ell,0);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+const double* DustSystem::kappaextv(int ell) const
+{
+    return &_kappaextvv(ell,0);
+}
+
+//////////////////////////////////////////////////////////////////////
+
 DustMix* DustSystem::randomMixForPosition(Position bfr, int ell) const
 {
     int hmix = 0;
@@ -884,9 +1116,21 @@ DustMix* DustSystem::randomMixForPosition(Position bfr, int ell) const
         int m = whichcell(bfr);
         if (m>=0)
         {
-            Array Xv;
-            NR::cdf(Xv, _Ncomp, [this,ell,m](int h){return mix(h)->kappasca(ell)*density(m,h);} );
-            hmix = NR::locate_clip(Xv, find<Random>()->uniform());
+            // the number of dust components is small, so a linear search over the unnormalized
+            // cumulative distribution is faster than constructing a table, and it needs no temporary memory
+            const double* kappav = kappascav(ell);
+            double total = 0.;
+            for (int h=0; h<_Ncomp; h++) total += kappav[h]*_rhovv(m+1,h);
+            if (total>0)
+            {
+                double X = _random->uniform()*total;
+                double cumulative = 0.;
+                for (hmix=0; hmix<_Ncomp-1; hmix++)
+                {
+                    cumulative += kappav[hmix]*_rhovv(m+1,hmix);
+                    if (X<cumulative) break;
+                }
+            }
         }
     }
     return mix(hmix);
@@ -917,7 +1161,8 @@ double DustSystem::volume(int m) const
 
 double DustSystem::density(int m, int h) const
 {
-    return m >= 0 ? _rhovv(m,h) : 0;
+    // the first row of the table holds zero densities for the cell number -1 (outside the grid)
+    return _rhovv(m+1,h);
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -925,8 +1170,7 @@ double DustSystem::density(int m, int h) const
 double DustSystem::density(int m) const
 {
     double rho = 0;
-    if (m >= 0)
-        for (int h=0; h<_Ncomp; h++) rho += _rhovv(m,h);
+    for (int h=0; h<_Ncomp; h++) rho += _rhovv(m+1,h);
     return rho;
 }
 
@@ -970,8 +1214,27 @@ void DustSystem::fillOpticalDepth(PhotonPackage* pp)
         _crossed[index] += 1;
     }
 
-    // calculate and store the optical depth details in the photon package
-    pp->fillOpticalDepth(KappaRho(this, pp->ell()));
+    // calculate and store the optical depth details in the photon package, using the precomputed table if available
+    // (the table row for each wavelength starts with a zero entry for the cell number -1, so that the call-back
+    // functions need no branch and the gather loop in DustGridPath::fillOpticalDepth() can be vectorized)
+    size_t offset = static_cast<size_t>(pp->ell()) * (_Ncells+1) + 1;
+    switch (_extinctionTable)
+    {
+    case SinglePrecision:
+        {
+            const float* kapparhov = &_kapparhofv[offset];
+            pp->fillOpticalDepth([kapparhov](int m){ return static_cast<double>(kapparhov[m]); });
+        }
+        break;
+    case DoublePrecision:
+        {
+            const double* kapparhov = &_kapparhodv[offset];
+            pp->fillOpticalDepth([kapparhov](int m){ return kapparhov[m]; });
+        }
+        break;
+    default:
+        pp->fillOpticalDepth(KappaRho(this, pp->ell()));
+    }
 
     // verify that the result makes sense
     double tau = pp->tau();
@@ -983,20 +1246,38 @@ void DustSystem::fillOpticalDepth(PhotonPackage* pp)
 
 double DustSystem::opticaldepth(PhotonPackage* pp, double distance)
 {
-    // determine the path and store the geometric details in the photon package
-    _grid->path(pp);
-
-    // if such statistics are requested, keep track of the number of cells crossed
-    if (_writeCellsCrossed)
+    // determine the path and store the geometric details in the photon package, unless the photon package
+    // still holds the path for the same position and direction (e.g. for consecutive instruments at the same
+    // observer direction, or for the same instrument at another wavelength)
+    if (!pp->hasValidSegments())
     {
-        std::unique_lock<std::mutex> lock(_crossedMutex);
-        unsigned int index = pp->size();
-        if (index >= _crossed.size()) _crossed.resize(index+1);
-        _crossed[index] += 1;
+        _grid->path(pp);
+        pp->setValidSegments();
+
+        // if such statistics are requested, keep track of the number of cells crossed
+        if (_writeCellsCrossed)
+        {
+            std::unique_lock<std::mutex> lock(_crossedMutex);
+            unsigned int index = pp->size();
+            if (index >= _crossed.size()) _crossed.resize(index+1);
+            _crossed[index] += 1;
+        }
     }
 
-    // calculate and return the optical depth at the specified distance
-    return pp->opticalDepth(KappaRho(this, pp->ell()), distance);
+    // calculate and return the optical depth at the specified distance from the column density of each dust
+    // component, which is calculated only once for a given path and distance, regardless of the wavelength
+    const double* Sigmav = pp->columnDensities([this](int m, int h){ return density(m,h); }, _Ncomp, distance);
+    const double* kappaextv = this->kappaextv(pp->ell());
+    double tau = 0;
+    for (int h=0; h<_Ncomp; h++) tau += kappaextv[h] * Sigmav[h];
+    return tau;
+}
+
+////////////////////////////////////////////////////////////////////
+
+void DustSystem::clearstatistics()
+{
+    _crossed.clear();
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -19,6 +19,7 @@ class DustGridDensityInterface;
 class DustMix;
 class PhotonPackage;
 class ProcessAssigner;
+class Random;
 
 //////////////////////////////////////////////////////////////////////
 
@@ -49,6 +50,33 @@ class DustSystem : public SimulationItem
     Q_CLASSINFO("MaxValue", "1000")
     Q_CLASSINFO("Default", "100")
 
+    Q_CLASSINFO("Property", "cacheGrid")
+    Q_CLASSINFO("Title", "cache the dust grid and cell densities for reuse by later simulations")
+    Q_CLASSINFO("Default", "no")
+    Q_CLASSINFO("Silent", "true")
+
+    Q_CLASSINFO("Property", "cacheDirectory")
+    Q_CLASSINFO("Title", "the directory for the dust cache files (default: the output path)")
+    Q_CLASSINFO("Optional", "true")
+    Q_CLASSINFO("Silent", "true")
+    Q_CLASSINFO("RelevantIf", "cacheGrid")
+
+    Q_CLASSINFO("Property", "cacheLimit")
+    Q_CLASSINFO("Title", "the maximum number of dust cache files kept in the cache directory (0 means no limit)")
+    Q_CLASSINFO("MinValue", "0")
+    Q_CLASSINFO("MaxValue", "1000000")
+    Q_CLASSINFO("Default", "10")
+    Q_CLASSINFO("Silent", "true")
+    Q_CLASSINFO("RelevantIf", "cacheGrid")
+
+    Q_CLASSINFO("Property", "extinctionTable")
+    Q_CLASSINFO("Title", "the storage of the extinction coefficients for each cell and wavelength")
+    Q_CLASSINFO("Factorized", "factorized (cell densities times dust mix opacities; no extra memory)")
+    Q_CLASSINFO("SinglePrecision", "precomputed table in single precision (4 bytes per cell and wavelength)")
+    Q_CLASSINFO("DoublePrecision", "precomputed table in double precision (8 bytes per cell and wavelength)")
+    Q_CLASSINFO("Default", "Factorized")
+    Q_CLASSINFO("Silent", "true")
+
     Q_CLASSINFO("Property", "writeConvergence")
     Q_CLASSINFO("Title", "output a data file with convergence checks on the dust system")
     Q_CLASSINFO("Default", "yes")
@@ -88,7 +116,9 @@ protected:
     /** The default constructor; it is protected since this is an abstract class. */
     DustSystem();
 
-    /** This function verifies that all attribute values have been appropriately set. */
+    /** This function verifies that all attribute values have been appropriately set. If caching
+        is enabled, it also reads the cache file for the current configuration, if it exists (see
+        readcache()). */
     void setupSelfBefore();
 
     /** This function performs setup for the dust system, which includes several tasks. First, the
@@ -100,11 +130,34 @@ protected:
         positions are generated within the cell (see sampleCount()). The density in the cell is
         calculated as the mean of the density values (found using a call to the corresponding
         function of the dust distribution) in these points. The calculation of both volume and
-        density is parallellized. Finally, the function optionally invokes various writeXXX()
+        density is parallellized. If the densities have been read from a cache file, they are not
+        recalculated; otherwise, if caching is enabled, the densities are written to a new cache
+        file (see writecache()). Finally, the function optionally invokes various writeXXX()
         functions depending on the state of the corresponding write flags. */
     void setupSelfAfter();
 
 private:
+    /** This function calculates a hash of the configuration of the dust distribution, the dust
+        grid, the random generator and the number of density samples (i.e. everything that
+        determines the structure of the dust grid and the densities in the dust cells; see
+        ConfigurationHash), and derives the name of the cache file from this hash. The cache file
+        is placed in the cache directory (by default the output path), without the output prefix,
+        so that it can be shared by simulations with a different prefix. If a cache file with this name exists and contains the
+        same hash, the function reads the cell densities from the file, and it offers the grid
+        structure to the dust grid if the dust grid implements the DustGridStructureCacheInterface.
+        Because this function is called before the dust grid is being setup, such a dust grid can
+        then skip its construction procedure. */
+    void readcache();
+
+    /** This function writes the grid structure (if the dust grid implements the
+        DustGridStructureCacheInterface) and the cell densities to the cache file determined by
+        readcache(). The file is written to a temporary file first, and replaces an existing cache
+        file only when it is complete. Because each configuration produces a new cache file, the
+        function then removes the oldest cache files in the cache directory so that at most the
+        number of files specified by the cacheLimit property remain (see
+        DustCacheFile::removeOldest()). */
+    void writecache();
+
     /** This function serves as the parallelization body for calculating the volume of each cell.
         */
     void setVolumeBody(size_t m);
@@ -117,6 +170,12 @@ private:
         by taking random density sample. */
     void setSampleDensityBody(size_t m);
 
+    /** This function serves as the parallelization body for calculating the extinction
+        coefficients \f$(\kappa\rho)_{\ell,m} = \sum_h \kappa_{\ell,h}^\text{ext}\,\rho_{m,h}\f$
+        of all cells at the wavelength with index \f$\ell\f$, if a precomputed table has been
+        requested (see setExtinctionTable()). */
+    void setExtinctionTableBody(size_t ell);
+
     /** This function is used to assemble the container that stores the densities of all dust cells
         for each dust component. If multiprocessing is enabled, the calculation of these densities
         can be performed in parallel by the different processes, depending on the type of
@@ -209,6 +268,64 @@ public:
         dust grid. */
     Q_INVOKABLE int sampleCount() const;
 
+    /** Sets the flag that indicates whether or not to cache the structure of the dust grid and
+        the densities in the dust cells in a binary file, so that later simulations with the same
+        dust distribution, dust grid, random seed and number of density samples can skip the
+        construction of the grid and the calculation of the densities. The cache file is read if it
+        exists and written otherwise. The default value is false. */
+    Q_INVOKABLE void setCacheGrid(bool value);
+
+    /** Returns the flag that indicates whether or not to cache the structure of the dust grid and
+        the densities in the dust cells. */
+    Q_INVOKABLE bool cacheGrid() const;
+
+    /** Sets the directory in which the dust cache files are placed. A relative path is interpreted
+        relative to the output path; the directory is created if it does not exist. If the value
+        is empty (the default), the cache files are placed in the output path. A separate cache
+        directory allows simulations with different output paths, such as the simulations
+        performed by a FitSKIRT run, to share their cache files. */
+    Q_INVOKABLE void setCacheDirectory(QString value);
+
+    /** Returns the directory in which the dust cache files are placed. */
+    Q_INVOKABLE QString cacheDirectory() const;
+
+    /** Sets the maximum number of dust cache files kept in the cache directory. Each simulation
+        with a configuration that has not been cached before adds a file, which holds the grid
+        structure and the densities for all cells and can easily take many megabytes. Series of
+        simulations with varying dust configurations would thus fill the cache directory without
+        bounds. After writing a new cache file, the oldest cache files (by modification time) are
+        removed until this number of files remains. The value zero disables the removal, so that
+        the cache grows with each new configuration. The default value is 10. */
+    Q_INVOKABLE void setCacheLimit(int value);
+
+    /** Returns the maximum number of dust cache files kept in the cache directory. */
+    Q_INVOKABLE int cacheLimit() const;
+
+    /** The enumeration type indicating how the extinction coefficient \f$(\kappa\rho)_{\ell,m} =
+        \sum_h \kappa_{\ell,h}^\text{ext}\,\rho_{m,h}\f$ for each cell \f$m\f$ and wavelength
+        index \f$\ell\f$ is obtained when calculating the optical depth along the path of a photon
+        package. With the Factorized option (the default), the sum over the dust components is
+        evaluated for each path segment from the cell densities \f$\rho_{m,h}\f$ and the
+        extinction spectra \f$\kappa_{\ell,h}^\text{ext}\f$ of the dust mixes, which requires no
+        additional memory. With the SinglePrecision and DoublePrecision options, the complete table
+        with \f$N_\text{cells}\times N_\lambda\f$ values is calculated during setup and stored in
+        single or double precision, so that the optical depth of a path segment requires a single
+        memory load. This is faster for multiple dust components, at the cost of 4 or 8 bytes per
+        cell and per wavelength; a warning is issued if the table exceeds 4000 MB. The single
+        precision table introduces relative differences of the order of \f$10^{-7}\f$ in the
+        optical depths. A compressed table, which would approximate the extinction spectra of all
+        cells by fewer basis spectra than there are dust components, is not implemented. */
+    Q_ENUMS(ExtinctionTable)
+    enum ExtinctionTable { Factorized, SinglePrecision, DoublePrecision };
+
+    /** Sets the enumeration value indicating how the extinction coefficients for each cell and
+        wavelength are obtained. The default value is Factorized. */
+    Q_INVOKABLE void setExtinctionTable(ExtinctionTable value);
+
+    /** Returns the enumeration value indicating how the extinction coefficients for each cell and
+        wavelength are obtained. */
+    Q_INVOKABLE ExtinctionTable extinctionTable() const;
+
     /** Sets the flag that indicates whether or not to output a data file with convergence checks
         on the dust system. The default value is true. */
     Q_INVOKABLE void setWriteConvergence(bool value);
@@ -297,6 +414,18 @@ public:
         component. */
     DustMix* mix(int h) const;
 
+    /** This function returns a pointer to a contiguous array with the scattering coefficients
+        \f$\kappa_\ell^{\text{sca}}(h)\f$ at wavelength index \f$\ell\f$ of the dust mixes for all
+        dust components \f$h=0,\dots,N_{\text{comp}}-1\f$. The values are copied from the dust
+        mixes during setup, so that the photon life cycle can obtain them without further function
+        calls or memory allocation. */
+    const double* kappascav(int ell) const;
+
+    /** This function returns a pointer to a contiguous array with the extinction coefficients
+        \f$\kappa_\ell^{\text{ext}}(h)\f$ at wavelength index \f$\ell\f$ of the dust mixes for all
+        dust components \f$h=0,\dots,N_{\text{comp}}-1\f$. See kappascav(). */
+    const double* kappaextv(int ell) const;
+
     /** This function returns a pointer to a dust mixture that is selected randomly among the dust
         mixes of the dust components in the dust system. If we have just a single dust component,
         this is simple. If there are multiple dust components, the relative probability of
@@ -348,7 +477,9 @@ public:
         depth covered within the \f$m\f$'th dust cell, \f[ (\Delta\tau_\ell)_m = (\Delta s)_m
         \sum_h \kappa_{\ell,h}^{\text{ext}}\, \rho_m, \f] and the total optical depth
         \f$\tau_{\ell,m}\f$ covered between the starting point \f${\boldsymbol{r}}\f$ and the
-        boundary of the cell. */
+        boundary of the cell. If a precomputed table with the extinction coefficients has been
+        requested (see setExtinctionTable()), the factor \f$\sum_h \kappa_{\ell,h}^{\text{ext}}\,
+        \rho_{m,h}\f$ is obtained from that table. */
     void fillOpticalDepth(PhotonPackage* pp);
 
     /** This function returns the optical depth
@@ -362,7 +493,15 @@ public:
         distance. The calculation proceeds as described for the fillOpticalDepth() function; the
         differences being that the path length is limited to the specified distance, and that this
         function does not store the optical depth information back into the PhotonPackage object.
-        */
+        If the photon package already holds the path segments for its current position and
+        direction (see DustGridPath::hasValidSegments()), for example because the previous peel-off
+        photon package was sent to an instrument at the same observer direction, the path is not
+        determined again. Furthermore, the optical depth is obtained from the column density of
+        each dust component along the path (see DustGridPath::columnDensities()) as
+        \f$\tau_\ell = \sum_h \kappa_{\ell,h}^\text{ext}\,\Sigma_h\f$. The column densities do not
+        depend on wavelength and are cached in the photon package, so that a path that is reused
+        for another instrument or another wavelength costs only \f$N_\text{comp}\f$
+        multiplications. */
     double opticaldepth(PhotonPackage* pp, double distance);
 
     /** If the writeCellsCrossed attribute is true, this function writes out a data file (named
@@ -376,6 +515,11 @@ public:
         this base class. */
     virtual void write() const;
 
+    /** This function clears the statistics on the number of cells crossed per path gathered during
+        a previous run (see write()), so that a dust system that has been setup and run can be
+        retained for another run of the simulation (see MonteCarloSimulation::prepareRerun()). */
+    void clearstatistics();
+
     /** This pure virtual function must be implemented in each subclass to indicate whether dust
         emission is turned on for this dust system. The function returns true if dust emission is
         turned on, and false otherwise. It is provided in this base class because it is invoked
@@ -417,6 +561,10 @@ protected:
     DustGrid* _grid;
     DustGridDensityInterface* _gdi;
     int _Nrandom;
+    bool _cacheGrid;
+    QString _cacheDirectory;
+    int _cacheLimit;
+    ExtinctionTable _extinctionTable;
     bool _writeConvergence;
     bool _writeDensity;
     bool _writeDepthMap;
@@ -427,11 +575,21 @@ protected:
     // the process assigner; determines which dust cells are assigned to this process
     ProcessAssigner* _assigner;
 
+    // data members related to caching, initialized during setup
+    QByteArray _cachekey;   // the hash of the configuration
+    QString _cachepath;     // the path of the cache file
+    bool _cached;           // true if the densities have been read from the cache file
+
     // data members initialized during setup
     int _Ncomp;
     int _Ncells;
     Array _volumev;     // volume for each cell (indexed on m)
-    Table<2> _rhovv;    // density for each cell and each dust component (indexed on m,h)
+    Table<2> _rhovv;    // density for each cell and each dust component (indexed on m+1,h; zero for m=-1)
+    Table<2> _kappascavv;   // scattering coefficient for each wavelength and each dust component (indexed on ell,h)
+    Table<2> _kappaextvv;   // extinction coefficient for each wavelength and each dust component (indexed on ell,h)
+    std::vector<float> _kapparhofv;     // if requested, kappa*rho for each wavelength and each cell (index ell*(Ncells+1)+m+1)
+    std::vector<double> _kapparhodv;    // if requested, kappa*rho for each wavelength and each cell (index ell*(Ncells+1)+m+1)
+    Random* _random;    // the random generator, cached for use in the photon life cycle
     std::vector<qint64> _crossed;
     std::mutex _crossedMutex;
 };
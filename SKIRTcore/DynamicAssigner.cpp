@@ -0,0 +1,83 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#include "DynamicAssigner.hpp"
+#include "FatalError.hpp"
+#include "MonteCarloSimulation.hpp"
+#include "PeerToPeerCommunicator.hpp"
+
+////////////////////////////////////////////////////////////////////
+
+DynamicAssigner::DynamicAssigner()
+{
+}
+
+////////////////////////////////////////////////////////////////////
+
+DynamicAssigner::DynamicAssigner(SimulationItem *parent)
+{
+    setParent(parent);
+    setup();
+}
+
+////////////////////////////////////////////////////////////////////
+
+void DynamicAssigner::setupSelfBefore()
+{
+    ProcessAssigner::setupSelfBefore();
+
+    if (!_comm) throw FATALERROR("Could not find an object of type PeerToPeerCommunicator in the simulation hierarchy");
+    if (!dynamic_cast<MonteCarloSimulation*>(parent()))
+        throw FATALERROR("A dynamic assigner can only be used as the process assigner of a Monte Carlo simulation");
+
+    // the threads of each process pull chunks from the shared counter, so MPI must allow serialized calls from threads
+    if (_comm->isMultiProc() && !_comm->threads_serialized())
+        throw FATALERROR("A dynamic assigner requires an MPI library supporting at least MPI_THREAD_SERIALIZED");
+}
+
+////////////////////////////////////////////////////////////////////
+
+void DynamicAssigner::assign(size_t size, size_t blocks)
+{
+    _nvalues = size * blocks;
+}
+
+////////////////////////////////////////////////////////////////////
+
+size_t DynamicAssigner::absoluteIndex(size_t relativeIndex)
+{
+    return relativeIndex;
+}
+
+////////////////////////////////////////////////////////////////////
+
+size_t DynamicAssigner::relativeIndex(size_t absoluteIndex)
+{
+    return absoluteIndex;
+}
+
+////////////////////////////////////////////////////////////////////
+
+int DynamicAssigner::rankForIndex(size_t index) const
+{
+    Q_UNUSED(index)
+    throw FATALERROR("A dynamic assigner does not know which process performs a given part of the work");
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool DynamicAssigner::parallel() const
+{
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool DynamicAssigner::dynamic() const
+{
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
@@ -0,0 +1,91 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#ifndef DYNAMICASSIGNER_HPP
+#define DYNAMICASSIGNER_HPP
+
+#include "ProcessAssigner.hpp"
+
+//////////////////////////////////////////////////////////////////////
+
+/** The DynamicAssigner class is a subclass of the ProcessAssigner class, representing objects that
+    assign work to different processes. In contrast to the other subclasses, the DynamicAssigner
+    does not decide in advance which parts of the work are performed by which process. Instead, the
+    parts of work are pulled from a common pool by each process as soon as it is ready to start on
+    new work, using a counter that is shared by all processes through one-sided communication (see
+    the PeerToPeerCommunicator::fetch_add_counter() function). As a result, a process that happens
+    to run on faster hardware, or that happens to receive cheaper parts of the work, simply performs
+    more parts, and all processes finish at nearly the same time.
+
+    Because the actual assignment is determined while the work is being performed, the client
+    using a DynamicAssigner must explicitly support it (see the dynamic() function). Currently, the
+    DynamicAssigner can only be used as the process assigner for the photon shooting phases of a
+    Monte Carlo simulation (see the MonteCarloSimulation::runchunks() function). The results of the
+    photon shooting phases are summed across all processes, so that the eventual assignment of
+    chunks to processes has no influence on the results, apart from the random number sequences
+    used by each chunk. */
+class DynamicAssigner : public ProcessAssigner
+{
+    Q_OBJECT
+    Q_CLASSINFO("Title", "an assigner that lets processes dynamically pull parts of the work as they become available")
+
+    //============= Construction - Setup - Destruction =============
+
+public:
+    /** Default constructor. */
+    Q_INVOKABLE DynamicAssigner();
+
+    /** This constructor can be invoked by SKIRT classes that wish to hard-code the creation of a new
+        ProcessAssigner object of this type (as opposed to creation through the ski file). Before the
+        constructor returns, the newly created object is hooked up as a child to the specified parent
+        in the simulation hierarchy (so it will automatically be deleted) and the setup of the
+        ProcessAssigner base class is invoked, which sets the _comm attribute that points to the object
+        of type PeerToPeerCommunicator that is found in the simulation hierarchy. */
+    explicit DynamicAssigner(SimulationItem* parent);
+
+    /** This function verifies that the pointer to the PeerToPeerCommunicator was set by the base
+        class, that the assigner is used for a Monte Carlo simulation, and, with multiple processes,
+        that the MPI library allows the threads to access the shared counter. If this is not the
+        case, a FatalError is thrown. */
+    void setupSelfBefore();
+
+    //======================== Other Functions =======================
+
+public:
+    /** This function invokes the assignment procedure. As a first argument, it takes the number of
+        parts of work that need to be performed. As a second optional argument, it takes the number of
+        blocks; the total number of parts of work is \c size \f$\times\f$ \c blocks. Since the parts
+        of work are handed out dynamically, all of them are reported as being assigned to this
+        process, i.e. the number of values is set to the total number of parts of work. */
+    void assign(size_t size, size_t blocks = 1);
+
+    /** This function takes the relative index of a certain part of the work as an argument and
+        returns the absolute index of that part. Since all parts of work are reported as being
+        assigned to this process, the absolute index is identical to the relative index. */
+    size_t absoluteIndex(size_t relativeIndex);
+
+    /** This function takes the absolute index of a certain part of the work as an argument and
+        returns the relative index of that part. Since all parts of work are reported as being
+        assigned to this process, the relative index is identical to the absolute index. */
+    size_t relativeIndex(size_t absoluteIndex);
+
+    /** This function should return the rank of the process that is assigned to a certain part of
+        the work. Since this is determined only while the work is being performed, this information
+        is not available to the DynamicAssigner, and the function throws a FatalError. */
+    int rankForIndex(size_t index) const;
+
+    /** This function returns true if the different parts of work are distributed amongst the
+        different processes and returns false if each process is assigned to the same work. In this
+        class, the processes are assigned to different work so this function returns true. */
+    bool parallel() const;
+
+    /** This function returns true, indicating that the parts of work are pulled dynamically from a
+        common pool by the processes. */
+    bool dynamic() const;
+};
+
+////////////////////////////////////////////////////////////////////
+
+#endif // DYNAMICASSIGNER_HPP
@@ -3,9 +3,10 @@
 ////       © Astronomical Observatory, Ghent University         ////
 ///////////////////////////////////////////////////////////////// */
 
+#include "DistantInstrument.hpp"
 #include "FatalError.hpp"
-#include "Instrument.hpp"
 #include "InstrumentSystem.hpp"
+#include "Log.hpp"
 
 using namespace std;
 
@@ -17,6 +18,52 @@ InstrumentSystem::InstrumentSystem()
 
 //////////////////////////////////////////////////////////////////////
 
+namespace
+{
+    // returns true if the specified directions are identical
+    bool equal(Direction a, Direction b)
+    {
+        return a.x() == b.x() && a.y() == b.y() && a.z() == b.z();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void InstrumentSystem::setupSelfAfter()
+{
+    SimulationItem::setupSelfAfter();
+
+    // group the distant instruments by observer direction, keeping the groups in order of first appearance;
+    // the other instruments form a group by themselves
+    vector< vector<Instrument*> > groups;
+    vector<DistantInstrument*> distants;    // the first distant instrument in each group, or null
+    foreach (Instrument* instr, _instruments)
+    {
+        DistantInstrument* distant = dynamic_cast<DistantInstrument*>(instr);
+        size_t g = groups.size();
+        if (distant)
+        {
+            for (g=0; g<groups.size(); g++)
+                if (distants[g] && equal(distants[g]->bfkobs(Position()), distant->bfkobs(Position()))) break;
+        }
+        if (g == groups.size())
+        {
+            groups.push_back(vector<Instrument*>());
+            distants.push_back(distant);
+        }
+        groups[g].push_back(instr);
+    }
+
+    _peeloffv.clear();
+    for (const vector<Instrument*>& group : groups) _peeloffv.insert(_peeloffv.end(), group.begin(), group.end());
+
+    if (groups.size() < _peeloffv.size())
+        find<Log>()->info("Peel-off paths are shared between instruments: " + QString::number(_peeloffv.size())
+                          + " instruments in " + QString::number(groups.size()) + " distinct observer directions");
+}
+
+//////////////////////////////////////////////////////////////////////
+
 void InstrumentSystem::insertInstrument(int index, Instrument* value)
 {
     if (!value) throw FATALERROR("Instrument pointer shouldn't be null");
@@ -40,6 +87,13 @@ QList<Instrument*> InstrumentSystem::instruments() const
 
 //////////////////////////////////////////////////////////////////////
 
+const vector<Instrument*>& InstrumentSystem::peelOffInstruments() const
+{
+    return _peeloffv;
+}
+
+//////////////////////////////////////////////////////////////////////
+
 void InstrumentSystem::write()
 {
     foreach (Instrument* instrument, _instruments) instrument->write();
@@ -7,7 +7,6 @@
 #define INSTRUMENTSYSTEM_HPP
 
 #include <vector>
-#include <QPair>
 #include "SimulationItem.hpp"
 class Instrument;
 class ParallelFactory;
@@ -16,7 +15,15 @@ class ParallelFactory;
 
 /** An InstrumentSystem instance keeps a list of zero or more instruments. The instruments can be
     of various nature (e.g. photometric, spectroscopic,...) and do not need to be located at the
-    same observing position. */
+    same observing position.
+
+    A simulation often includes several distant instruments at the same observer direction, for
+    example an SEDInstrument, a FrameInstrument and a FullInstrument with the same inclination and
+    azimuth. The peel-off photon packages sent to these instruments follow the same path through
+    the dust grid. The instrument system therefore offers the instruments in an order in which
+    distant instruments with the same observer direction are adjacent (see peelOffInstruments()),
+    so that the path determined for the first of these instruments can be reused for the others
+    (see DustSystem::opticaldepth()). */
 class InstrumentSystem : public SimulationItem
 {
     Q_OBJECT
@@ -33,6 +40,13 @@ public:
     /** The default constructor; creates an empty instrument system. */
     Q_INVOKABLE InstrumentSystem();
 
+protected:
+    /** This function determines the order in which the instruments are offered by the
+        peelOffInstruments() function. It lists the instruments in their original order, except
+        that each distant instrument is moved up to follow the last preceding distant instrument
+        with the same observer direction, if any. */
+    void setupSelfAfter();
+
     //======== Setters & Getters for Discoverable Attributes =======
 
 public:
@@ -48,6 +62,13 @@ public:
     //======================== Other Functions =======================
 
 public:
+    /** This function returns the instruments in the order in which peel-off photon packages
+        should be sent to them, i.e. with distant instruments at the same observer direction
+        listed consecutively. Sending the peel-off photon packages in this order allows the path
+        of the peel-off photon package through the dust grid to be determined only once for each
+        distinct observer direction. */
+    const std::vector<Instrument*>& peelOffInstruments() const;
+
     /** This function writes down the results of the instrument system. It calls the write()
         function for each of the instruments. */
     void write();
@@ -57,6 +78,9 @@ public:
 private:
     // discoverable attributes
     QList<Instrument*> _instruments;
+
+    // other data members
+    std::vector<Instrument*> _peeloffv;    // the instruments grouped by observer direction
 };
 
 ////////////////////////////////////////////////////////////////////
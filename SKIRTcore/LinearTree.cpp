@@ -0,0 +1,157 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#include <unordered_map>
+#include "DustCacheFile.hpp"
+#include "FatalError.hpp"
+#include "LinearTree.hpp"
+#include "TreeNode.hpp"
+
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////
+
+LinearTree::LinearTree()
+{
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void LinearTree::initialize(const vector<TreeNode*>& tree, bool neighbors)
+{
+    size_t Nnodes = tree.size();
+    if (Nnodes == 0) throw FATALERROR("Cannot create a linear tree without nodes");
+
+    // determine the linear node order: the nodes are visited in depth-first order, and the children of each
+    // node are placed in a consecutive block at the end of the list when the node is visited;
+    // the leaves are numbered in the order in which they are visited
+    vector<const TreeNode*> nodev;          // the nodes in linear order
+    vector<int> fatherv;                    // the linear index of the father of each node
+    vector<int> childv;                     // the linear index of the first child of each node
+    nodev.reserve(Nnodes);
+    fatherv.reserve(Nnodes);
+    childv.reserve(Nnodes);
+    nodev.push_back(tree[0]);
+    fatherv.push_back(0);
+    childv.push_back(0);
+    vector<int> leafv;                      // the linear indices of the leaves in depth-first order
+    vector<int> stack(1, 0);                // linear indices of the nodes still to be visited
+    while (!stack.empty())
+    {
+        int l = stack.back();
+        stack.pop_back();
+        const vector<TreeNode*>& children = nodev[l]->children();
+        int Nchildren = children.size();
+        if (Nchildren)
+        {
+            int first = nodev.size();
+            childv[l] = first;
+            for (int c=0; c<Nchildren; c++)
+            {
+                nodev.push_back(children[c]);
+                fatherv.push_back(l);
+                childv.push_back(0);
+            }
+            // push the children in reverse order so that the first child is visited first
+            for (int c=Nchildren-1; c>=0; c--) stack.push_back(first+c);
+        }
+        else leafv.push_back(l);
+    }
+    if (nodev.size() != Nnodes) throw FATALERROR("The tree node list does not match the tree structure");
+
+    // copy the node properties into the linear arrays
+    _xminv.resize(Nnodes); _yminv.resize(Nnodes); _zminv.resize(Nnodes);
+    _xmaxv.resize(Nnodes); _ymaxv.resize(Nnodes); _zmaxv.resize(Nnodes);
+    _fatherv.swap(fatherv);
+    _childv.swap(childv);
+    _cellv.assign(Nnodes, -1);
+    _levelv.resize(Nnodes);
+    _splitv.assign(Nnodes, 0);
+    for (size_t l=0; l<Nnodes; l++)
+    {
+        const TreeNode* node = nodev[l];
+        _xminv[l] = node->xmin(); _yminv[l] = node->ymin(); _zminv[l] = node->zmin();
+        _xmaxv[l] = node->xmax(); _ymaxv[l] = node->ymax(); _zmaxv[l] = node->zmax();
+        _levelv[l] = node->level();
+
+        // a node is split in a given direction if its first child does not extend up to the node's border
+        if (_childv[l])
+        {
+            const TreeNode* first = node->child(0);
+            int mask = 0;
+            if (first->xmax() < node->xmax()) mask |= 1;
+            if (first->ymax() < node->ymax()) mask |= 2;
+            if (first->zmax() < node->zmax()) mask |= 4;
+            int Nsplit = (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1);
+            if (static_cast<int>(node->children().size()) != (1 << Nsplit))
+                throw FATALERROR("Tree node has a number of children that does not match its subdivision");
+            _splitv[l] = mask;
+        }
+    }
+
+    // number the leaves
+    _nodev.swap(leafv);
+    int Ncells = _nodev.size();
+    for (int m=0; m<Ncells; m++) _cellv[_nodev[m]] = m;
+
+    // copy the neighbor lists of the leaves, translating the neighbors to linear indices
+    _nbrindexv.clear();
+    _nbrv.clear();
+    if (neighbors)
+    {
+        unordered_map<const TreeNode*,int> indexmap;
+        indexmap.reserve(Nnodes);
+        for (size_t l=0; l<Nnodes; l++) indexmap[nodev[l]] = l;
+
+        _nbrindexv.resize(6*Nnodes+1);
+        for (size_t l=0; l<Nnodes; l++)
+        {
+            for (int wall=0; wall<6; wall++)
+            {
+                _nbrindexv[6*l+wall] = _nbrv.size();
+                if (!_childv[l])
+                    for (const TreeNode* neighbor : nodev[l]->neighbors(static_cast<TreeNode::Wall>(wall)))
+                        _nbrv.push_back(indexmap.at(neighbor));
+            }
+        }
+        _nbrindexv[6*Nnodes] = _nbrv.size();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void LinearTree::write(DustCacheFile& file) const
+{
+    file.write(_xminv); file.write(_yminv); file.write(_zminv);
+    file.write(_xmaxv); file.write(_ymaxv); file.write(_zmaxv);
+    file.write(_fatherv);
+    file.write(_childv);
+    file.write(_cellv);
+    file.write(_levelv);
+    file.write(_splitv);
+    file.write(_nodev);
+    file.write(_nbrindexv);
+    file.write(_nbrv);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void LinearTree::read(DustCacheFile& file)
+{
+    file.read(_xminv); file.read(_yminv); file.read(_zminv);
+    file.read(_xmaxv); file.read(_ymaxv); file.read(_zmaxv);
+    file.read(_fatherv);
+    file.read(_childv);
+    file.read(_cellv);
+    file.read(_levelv);
+    file.read(_splitv);
+    file.read(_nodev);
+    file.read(_nbrindexv);
+    file.read(_nbrv);
+    if (_fatherv.empty() || _childv.size() != _fatherv.size() || _xminv.size() != _fatherv.size())
+        throw FATALERROR("The cached tree is inconsistent");
+}
+
+//////////////////////////////////////////////////////////////////////
@@ -0,0 +1,206 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#ifndef LINEARTREE_HPP
+#define LINEARTREE_HPP
+
+#include <vector>
+#include "Box.hpp"
+class DustCacheFile;
+class TreeNode;
+
+//////////////////////////////////////////////////////////////////////
+
+/** A LinearTree instance holds an immutable, contiguous representation of a tree of cuboidal
+    nodes lined up with the coordinate axes, such as the tree constructed by a TreeDustGrid. The
+    representation is derived from a tree of TreeNode objects after construction of the tree has
+    been completed, after which the TreeNode objects can be discarded. Traversing a LinearTree is
+    substantially faster than traversing the original tree, because it involves no pointer chasing
+    through objects scattered in memory.
+
+    The nodes are identified by an index \f$l\f$ in the linear tree, with the root node at index
+    zero. The children of a node are stored consecutively, and the blocks of children are laid out
+    in depth-first order, so that the nodes in a subtree are stored close together. The leaf nodes
+    (the actual dust cells) are numbered in the order in which they are encountered by a
+    depth-first traversal of the tree. For an octree with geometric subdivision, this is the Morton
+    (or Z-order) curve; in general, cells that are close to each other in space tend to have cell
+    numbers that are close to each other, which improves the memory locality of data indexed on
+    cell number.
+
+    The properties of the nodes are stored in separate arrays indexed on node index (a structure
+    of arrays), including the node bounds in each spatial direction, the index of the father, the
+    index of the first child, and a mask indicating the directions in which the node is split.
+    Depending on this mask, a node has 2 (binary tree) or 8 (octree) children, and the index of
+    the child containing a given position can be derived directly by comparing the position to
+    the split point of the node. Optionally, the neighbors of each leaf node at each of its walls
+    are stored in a compressed list format. */
+class LinearTree
+{
+public:
+    /** The default constructor creates an empty tree. The tree must be initialized through the
+        initialize() function before it can be used. */
+    LinearTree();
+
+    /** This function initializes the linear tree from the specified list of TreeNode objects. The
+        first item in the list must be the root node, and the list must contain all nodes in the
+        tree. The identifiers of the TreeNode objects are not used. If the \em neighbors flag is
+        true, the function also copies the neighbor lists of the leaf nodes, which must have been
+        added to the TreeNode objects. The function throws a fatal error if a node has a number of
+        children that does not correspond to its split directions. */
+    void initialize(const std::vector<TreeNode*>& tree, bool neighbors);
+
+    /** This function writes the complete representation of the tree to the specified cache file,
+        so that it can be restored later through the read() function. */
+    void write(DustCacheFile& file) const;
+
+    /** This function replaces the current tree by the tree stored in the specified cache file,
+        which must have been written by the write() function. */
+    void read(DustCacheFile& file);
+
+    /** This function returns the number of nodes in the tree. */
+    int numNodes() const { return _fatherv.size(); }
+
+    /** This function returns the number of leaf nodes (i.e. cells) in the tree. */
+    int numCells() const { return _nodev.size(); }
+
+    /** This function returns the bounding box of the node with index \f$l\f$. */
+    Box extent(int l) const { return Box(_xminv[l], _yminv[l], _zminv[l], _xmaxv[l], _ymaxv[l], _zmaxv[l]); }
+
+    /** This function returns the minimum \f$x\f$ coordinate of the node with index \f$l\f$. */
+    double xmin(int l) const { return _xminv[l]; }
+
+    /** This function returns the minimum \f$y\f$ coordinate of the node with index \f$l\f$. */
+    double ymin(int l) const { return _yminv[l]; }
+
+    /** This function returns the minimum \f$z\f$ coordinate of the node with index \f$l\f$. */
+    double zmin(int l) const { return _zminv[l]; }
+
+    /** This function returns the maximum \f$x\f$ coordinate of the node with index \f$l\f$. */
+    double xmax(int l) const { return _xmaxv[l]; }
+
+    /** This function returns the maximum \f$y\f$ coordinate of the node with index \f$l\f$. */
+    double ymax(int l) const { return _ymaxv[l]; }
+
+    /** This function returns the maximum \f$z\f$ coordinate of the node with index \f$l\f$. */
+    double zmax(int l) const { return _zmaxv[l]; }
+
+    /** This function returns the level of the node with index \f$l\f$, i.e. zero for the root
+        node, one for its children, and so on. */
+    int level(int l) const { return _levelv[l]; }
+
+    /** This function returns true if the node with index \f$l\f$ is a leaf node. */
+    bool isleaf(int l) const { return _childv[l] == 0; }
+
+    /** This function returns the cell number of the node with index \f$l\f$ if it is a leaf node,
+        or -1 if it is not a leaf node. */
+    int cellnumber(int l) const { return _cellv[l]; }
+
+    /** This function returns the index of the leaf node corresponding to cell number \f$m\f$. */
+    int cellnode(int m) const { return _nodev[m]; }
+
+    /** This function returns the index of the child of the node with index \f$l\f$ that contains
+        the position \f$(x,y,z)\f$, assuming that the position is inside the node. The node must
+        have children. */
+    int child(int l, double x, double y, double z) const
+    {
+        int first = _childv[l];
+        int mask = _splitv[l];
+        int offset = 0;
+        int weight = 1;
+        if (mask & 1) { if (x >= _xmaxv[first]) offset += weight; weight <<= 1; }
+        if (mask & 2) { if (y >= _ymaxv[first]) offset += weight; weight <<= 1; }
+        if (mask & 4) { if (z >= _zmaxv[first]) offset += weight; }
+        return first + offset;
+    }
+
+    /** This function returns the index of the leaf node that contains the position
+        \f$(x,y,z)\f$, or -1 if the position is outside the tree. The search starts at the root
+        node and recursively selects the child containing the position. */
+    int whichnode(double x, double y, double z) const
+    {
+        if (_fatherv.empty() || x < _xminv[0] || x > _xmaxv[0] || y < _yminv[0] || y > _ymaxv[0]
+                             || z < _zminv[0] || z > _zmaxv[0]) return -1;
+        int l = 0;
+        while (_childv[l]) l = child(l, x, y, z);
+        return l;
+    }
+
+    /** This function returns the index of the leaf node that contains the position
+        \f$(x,y,z)\f$ just beyond the specified wall of the leaf node with index \f$l\f$, or -1 if
+        such a node can't be found by searching the neighbors of that wall. The wall is specified
+        as a TreeNode::Wall value. The neighbors must have been copied during initialization. */
+    int whichneighbor(int l, int wall, double x, double y, double z) const
+    {
+        if (_nbrindexv.empty()) return -1;
+        size_t begin = _nbrindexv[6*static_cast<size_t>(l)+wall];
+        size_t end = _nbrindexv[6*static_cast<size_t>(l)+wall+1];
+        for (size_t i=begin; i<end; i++)
+        {
+            int n = _nbrv[i];
+            if (x >= _xminv[n] && x <= _xmaxv[n] && y >= _yminv[n] && y <= _ymaxv[n]
+                               && z >= _zminv[n] && z <= _zmaxv[n])
+            {
+                while (_childv[n]) n = child(n, x, y, z);
+                return n;
+            }
+        }
+        return -1;
+    }
+
+    /** This function returns the index of the leaf node adjacent to the leaf node with index
+        \f$l\f$ across the wall perpendicular to the specified spatial direction (0 for \f$x\f$, 1
+        for \f$y\f$, 2 for \f$z\f$), at the side indicated by the \em positive flag, or -1 if that
+        wall is part of the boundary of the tree. The position \f$(x,y,z)\f$ must be on the wall
+        and determines which of the leaf nodes adjacent to the wall is returned. The neighbor is
+        derived solely from the structure of the tree: the function moves up the tree until it
+        finds an ancestor that is split in the specified direction and has a sibling at the
+        requested side, and then moves down from that sibling to the leaf node containing the
+        position. */
+    int crosswall(int l, int dir, bool positive, double x, double y, double z) const
+    {
+        int bit = 1 << dir;
+        while (l)
+        {
+            int father = _fatherv[l];
+            int mask = _splitv[father];
+            if (mask & bit)
+            {
+                // the offset between siblings differing in this direction depends on the number of lower split directions
+                int lower = mask & (bit-1);
+                int weight = 1 << ((lower & 1) + (lower >> 1));
+                bool high = ((l - _childv[father]) & weight) != 0;
+                if (high != positive)
+                {
+                    l += positive ? weight : -weight;
+                    while (_childv[l]) l = child(l, x, y, z);
+                    return l;
+                }
+            }
+            l = father;
+        }
+        return -1;
+    }
+
+private:
+    // node properties indexed on node index
+    std::vector<double> _xminv, _yminv, _zminv, _xmaxv, _ymaxv, _zmaxv;
+    std::vector<int> _fatherv;              // index of the father node (zero for the root)
+    std::vector<int> _childv;               // index of the first child node, or zero for leaf nodes
+    std::vector<int> _cellv;                // cell number for leaf nodes, -1 for other nodes
+    std::vector<unsigned char> _levelv;     // the level of the node
+    std::vector<unsigned char> _splitv;     // bit mask for the split directions (1 for x, 2 for y, 4 for z)
+
+    // node index indexed on cell number
+    std::vector<int> _nodev;
+
+    // neighbor lists for each leaf node and each wall in compressed format (empty if neighbors were not requested);
+    // the neighbors of node l at wall w are stored in _nbrv[i] with _nbrindexv[6*l+w] <= i < _nbrindexv[6*l+w+1]
+    std::vector<size_t> _nbrindexv;
+    std::vector<int> _nbrv;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+#endif // LINEARTREE_HPP
@@ -10,7 +10,9 @@
 #include "IdenticalAssigner.hpp"
 #include "Instrument.hpp"
 #include "InstrumentSystem.hpp"
+#include "LockFree.hpp"
 #include "Log.hpp"
+#include "MemoryStatistics.hpp"
 #include "MonteCarloSimulation.hpp"
 #include "NR.hpp"
 #include "Parallel.hpp"
@@ -18,11 +20,15 @@
 #include "PeerToPeerCommunicator.hpp"
 #include "PhotonPackage.hpp"
 #include "Random.hpp"
+#include "RootAssigner.hpp"
 #include "StellarSystem.hpp"
 #include "TextOutFile.hpp"
 #include "TimeLogger.hpp"
 #include "Units.hpp"
 #include "WavelengthGrid.hpp"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
 
 using namespace std;
 
@@ -31,12 +37,35 @@ using namespace std;
 MonteCarloSimulation::MonteCarloSimulation()
     : _is(0), _packages(0), _minWeightReduction(1e4),
       _minfs(0), _xi(0.5), _continuousScattering(false), _assigner(0),
-      _lambdagrid(0), _ss(0), _ds(0)
+      _lambdagrid(0), _ss(0), _ds(0), _Nphases(0)
 {
 }
 
 ////////////////////////////////////////////////////////////////////
 
+MonteCarloSimulation::~MonteCarloSimulation()
+{
+    for (PhotonPackage* packages : _threadpackagesv) delete[] packages;
+}
+
+////////////////////////////////////////////////////////////////////
+
+void MonteCarloSimulation::prepareRerun()
+{
+    for (PhotonPackage*& packages : _threadpackagesv)
+    {
+        delete[] packages;
+        packages = 0;
+    }
+    _Nphases = 0;
+    _costv.resize(0);
+    _random->reinitialize();
+    if (_ds) _ds->clearstatistics();
+    _state = Created;
+}
+
+////////////////////////////////////////////////////////////////////
+
 void MonteCarloSimulation::setupSelfBefore()
 {
     Simulation::setupSelfBefore();
@@ -64,6 +93,9 @@ void MonteCarloSimulation::setupSelfBefore()
 
     // If no assigner was set, use an IdenticalAssigner as default
     if (!_assigner) setAssigner(new IdenticalAssigner(this));
+
+    // Provide a slot for the photon packages of each parallel thread
+    _threadpackagesv.assign(_parfac->maxThreadCount(), 0);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -91,9 +123,11 @@ void MonteCarloSimulation::setChunkParams(double packages)
         else if (Nprocs == 1) _Nchunks = ceil( std::max({packages/1e7, 10.*Nthreads/_Nlambda}));
         else _Nchunks = ceil( std::max({10.*Nprocs, packages/1e7, 10.*Nthreads*Nprocs/_Nlambda}));
 
-        // Calculate the size of the chunks and the definitive number of photon packages per wavelength
-        _chunksize = ceil(packages/_Nchunks);
-        _Npp = _Nchunks * _chunksize;
+        // Calculate the definitive number of photon packages per wavelength and the (maximum) size of the chunks;
+        // the number of packages does not depend on the number of chunks, so that it is the same for any
+        // number of threads and processes
+        _Npp = ceil(packages);
+        _chunksize = (_Npp + _Nchunks - 1) / _Nchunks;
     }
 
     // Determine the log frequency; continuous scattering is much slower!
@@ -105,6 +139,15 @@ void MonteCarloSimulation::setChunkParams(double packages)
 
 ////////////////////////////////////////////////////////////////////
 
+void MonteCarloSimulation::chunkpackages(size_t index, quint64& first, quint64& count) const
+{
+    quint64 chunk = index / _Nlambda;
+    first = chunk * _Npp / _Nchunks;
+    count = (chunk+1) * _Npp / _Nchunks - first;
+}
+
+////////////////////////////////////////////////////////////////////
+
 void MonteCarloSimulation::setInstrumentSystem(InstrumentSystem* value)
 {
     if (_is) delete _is;
@@ -218,43 +261,370 @@ void MonteCarloSimulation::initprogress(QString phase)
 {
     _phase = phase;
     _Ndone = 0;
+    _Nallocs = 0;
 
     _log->info("(" + QString::number(_Npp) + " photon packages for "
                + (_Nlambda==1 ? QString("a single wavelength") : QString("each of %1 wavelengths").arg(_Nlambda))
                + ")");
 
-    if (_comm->isMultiProc()) _log->info("(" + QString::number(_assigner->nvalues()*_chunksize/_Nlambda)
-                                         + " photon packages per wavelength per process)");
+    if (dynamicchunks()) _log->info("(chunks of " + QString::number(_chunksize) + " photon packages"
+                                    + " are distributed dynamically over the processes)");
+    else if (_comm->isMultiProc()) _log->info("(" + QString::number(_assigner->nvalues()*_chunksize/_Nlambda)
+                                              + " photon packages per wavelength per process)");
 
     _timer.start();
 }
 
 ////////////////////////////////////////////////////////////////////
 
-void MonteCarloSimulation::logprogress(quint64 extraDone)
+void MonteCarloSimulation::logprogress(quint64 extraDone, size_t allocations)
 {
     // accumulate the work already done
     _Ndone.fetch_add(extraDone);
+    if (allocations) _Nallocs.fetch_add(allocations);
 
     // space the messages at least 3 seconds apart; in the interest of speed,
     // we do this without locking, so once in a while two consecutive messages may slip through
     if (_timer.elapsed() > 3000)
     {
         _timer.restart();
-        double completed = _Ndone * 100. / (_assigner->nvalues()*_chunksize);
+        // when the chunks are distributed dynamically, show the progress relative to the average share per process
+        double total = dynamicchunks() ? static_cast<double>(_Nlambda*_Npp)/_comm->size()
+                                       : static_cast<double>(_assigner->nvalues()*_chunksize);
+        double completed = min(100., _Ndone * 100. / total);
         _log->info("Launched " + _phase + " photon packages: " + QString::number(completed,'f',1) + "%");
     }
 }
 
 ////////////////////////////////////////////////////////////////////
 
+bool MonteCarloSimulation::dynamicchunks() const
+{
+    return _assigner->dynamic() && _comm->isMultiProc();
+}
+
+////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    // An instance of this class hands out the chunks of a photon shooting phase in a predetermined order,
+    // and measures the time spent in each chunk; if a communicator is specified, the chunks are pulled
+    // in batches from the pool shared by all processes through the communicator's shared counter;
+    // when there are multiple threads, each chunk is handed out in pieces that become smaller as the
+    // work remaining in this process decreases (guided self-scheduling), so that the threads finish at
+    // nearly the same time; no pieces are handed out while the pause predicate returns true, so that the
+    // phase can be paused and resumed by invoking the parallel loop again
+    class ChunkRunner : public ParallelTarget
+    {
+    private:
+        std::function<void(size_t,quint64,quint64)> _body;      // the loop body for a range of photon packages
+        std::function<void(size_t,quint64&,quint64&)> _range;   // obtains the range of photon packages in a chunk
+        const vector<size_t>& _indexv;      // the absolute chunk indices in the order in which they are handed out
+        PeerToPeerCommunicator* _comm;      // the communicator providing the shared counter, or null
+        int _Nlambda;
+        quint64 _chunksize;                 // the maximum number of photon packages in a chunk
+        quint64 _probe;                     // the number of packages at the start of each wavelength handled in advance
+        int _Nthreads;                      // the number of parallel threads
+        Array& _timev;                      // the accumulated time spent in chunks for each wavelength
+        Array& _countv;                     // the number of photon packages handled for each wavelength
+        std::function<bool()> _pause;       // returns true if no more pieces should be handed out for now
+        std::mutex _mutex;                  // guards the data members below
+        size_t _next;                       // the position in the list of the chunk currently being handed out
+        size_t _last;                       // the position beyond the last chunk available to this process
+        size_t _fetched;                    // the most recent value obtained from the shared counter
+        quint64 _offset;                    // the number of packages in the current chunk already handed out
+
+        // skips the packages handled in advance at the start of the current chunk, advancing to the next
+        // chunk as long as there are no packages left in the current one; the caller must hold the mutex
+        void skip()
+        {
+            for (; _next < _last; _next++)
+            {
+                size_t index = _indexv[_next];
+                quint64 first, count;
+                _range(index, first, count);
+                _offset = index < static_cast<size_t>(_Nlambda) ? min(_probe, count) : 0;
+                if (_offset < count) return;
+            }
+            _offset = 0;
+        }
+
+    public:
+        ChunkRunner(std::function<void(size_t,quint64,quint64)> body,
+                    std::function<void(size_t,quint64&,quint64&)> range, const vector<size_t>& indexv,
+                    PeerToPeerCommunicator* comm, int Nlambda, quint64 chunksize, quint64 probe, int Nthreads,
+                    Array& timev, Array& countv, std::function<bool()> pause)
+            : _body(body), _range(range), _indexv(indexv), _comm(comm), _Nlambda(Nlambda), _chunksize(chunksize),
+              _probe(probe), _Nthreads(Nthreads), _timev(timev), _countv(countv), _pause(pause),
+              _next(0), _last(comm ? 0 : indexv.size()), _fetched(0), _offset(0)
+        {
+            skip();
+        }
+
+        // returns true if all chunks available to this process have been handed out
+        bool exhausted()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _next == _last && !_comm;
+        }
+
+        // the index argument is ignored; each invocation keeps handing out pieces to the calling thread until
+        // all chunks available to this process have been handed out or the loop is paused
+        void body(size_t /*index*/)
+        {
+            size_t Nchunks = _indexv.size();
+            while (true)
+            {
+                size_t index = 0;
+                quint64 first = 0, count = 0;
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    if (_pause()) return;
+
+                    // if the current batch is exhausted, pull a new batch from the shared pool; the batch size is
+                    // derived from the number of chunks remaining in the pool according to the most recent value of
+                    // the counter obtained by this process (which accounts for the batches pulled by all processes)
+                    if (_next == _last && _comm)
+                    {
+                        size_t remaining = Nchunks - min(_fetched, Nchunks);
+                        size_t batch = max(static_cast<size_t>(1), remaining/(2*_comm->size()));
+                        size_t first = _comm->fetch_add_counter(batch);
+                        _fetched = first + batch;
+                        _next = min(first, Nchunks);
+                        _last = min(first+batch, Nchunks);
+                        if (_next == Nchunks) _comm = 0;    // the pool is empty, so don't ask again
+                        skip();
+                    }
+                    if (_next == _last) return;
+
+                    // determine the next piece of the current chunk; its size is half of the work remaining
+                    // in this process divided by the number of threads, with a minimum of 1/8 of a chunk
+                    index = _indexv[_next];
+                    quint64 chunkfirst, chunkcount;
+                    _range(index, chunkfirst, chunkcount);
+                    quint64 rest = chunkcount - _offset;
+                    count = rest;
+                    if (_Nthreads > 1)
+                    {
+                        quint64 remaining = rest + (_last-_next-1)*_chunksize;
+                        quint64 minimum = max(static_cast<quint64>(1), _chunksize/8);
+                        count = min(rest, max(minimum, remaining/(2*_Nthreads)));
+                    }
+                    first = chunkfirst + _offset;
+                    _offset += count;
+                    if (_offset == chunkcount)
+                    {
+                        _next++;
+                        skip();
+                    }
+                }
+
+                // handle the piece
+                auto start = std::chrono::steady_clock::now();
+                _body(index, first, count);
+                int ell = index % _Nlambda;
+                LockFree::add(_timev[ell],
+                              std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                LockFree::add(_countv[ell], static_cast<double>(count));
+            }
+        }
+    };
+
+    // An instance of this class handles the packages at the start of the first chunk for the wavelengths
+    // assigned to this process, i.e. the wavelengths with an index equal to the process rank modulo the
+    // number of processes, and measures the time spent for each wavelength
+    class ProbeRunner : public ParallelTarget
+    {
+    private:
+        std::function<void(size_t,quint64,quint64)> _body;
+        std::function<void(size_t,quint64&,quint64&)> _range;
+        quint64 _probe;
+        int _rank;
+        int _Nprocs;
+        Array& _timev;
+        Array& _countv;
+
+    public:
+        ProbeRunner(std::function<void(size_t,quint64,quint64)> body,
+                    std::function<void(size_t,quint64&,quint64&)> range, quint64 probe, int rank, int Nprocs,
+                    Array& timev, Array& countv)
+            : _body(body), _range(range), _probe(probe), _rank(rank), _Nprocs(Nprocs), _timev(timev), _countv(countv)
+        { }
+
+        void body(size_t index)
+        {
+            size_t ell = _rank + index*_Nprocs;
+            quint64 first, count;
+            _range(ell, first, count);
+            count = min(_probe, count);
+            auto start = std::chrono::steady_clock::now();
+            _body(ell, first, count);
+            _timev[ell] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            _countv[ell] = count;
+        }
+    };
+}
+
+////////////////////////////////////////////////////////////////////
+
+void MonteCarloSimulation::runchunks(std::function<void(size_t,quint64,quint64)> body, bool grouped)
+{
+    // Get the chunks assigned to this process (or all chunks, if they are distributed dynamically)
+    if (_costv.size() != _Nlambda) _costv.resize(_Nlambda);
+    bool dynamic = dynamicchunks();
+    size_t Nchunks = _assigner->nvalues();
+    vector<size_t> indexv(Nchunks);
+    for (size_t i=0; i<Nchunks; i++) indexv[i] = _assigner->absoluteIndex(i);
+    auto range = [this](size_t index, quint64& first, quint64& count){ chunkpackages(index, first, count); };
+    _Nphases++;
+    Parallel* parallel = _parfac->parallel();
+    int Nthreads = parallel->threadCount();
+    int Nprocs = _comm->size();
+
+    // In the first phase of the simulation, no cost estimates are available yet; measure the cost of the packages
+    // at the start of the first chunk for each wavelength, distributing the wavelengths over the processes, and
+    // combine the measurements of all processes; these packages are then skipped when handing out the chunks
+    quint64 probe = 0;
+    double Nprobed = 0.;
+    if (_Nphases == 1 && !grouped && _Nlambda > 1 && Nthreads*Nprocs > 1 && _chunksize > 1)
+    {
+        probe = max(static_cast<quint64>(1), _chunksize/16);
+        Array probetimev(_Nlambda);
+        Array probecountv(_Nlambda);
+        ProbeRunner prober(body, range, probe, _comm->rank(), Nprocs, probetimev, probecountv);
+        RootAssigner localassigner(0);
+        localassigner.assign((_Nlambda - _comm->rank() + Nprocs - 1) / Nprocs);
+        parallel->call(&prober, &localassigner);
+        Nprobed = probecountv.sum();
+        _comm->sum_all(probetimev);
+        _comm->sum_all(probecountv);
+        for (size_t ell=0; ell<_Nlambda; ell++)
+            if (probecountv[ell]) _costv[ell] = probetimev[ell] / probecountv[ell];
+    }
+
+    // Order the chunks by decreasing estimated cost; wavelengths without an estimate have zero cost
+    int Nlambda = _Nlambda;
+    const Array& costv = _costv;
+    if (grouped)
+        stable_sort(indexv.begin(), indexv.end(), [Nlambda,&costv](size_t a, size_t b)
+        {
+            int ella = a % Nlambda;
+            int ellb = b % Nlambda;
+            return costv[ella] > costv[ellb] || (costv[ella] == costv[ellb] && ella < ellb);
+        });
+    else
+        stable_sort(indexv.begin(), indexv.end(), [Nlambda,&costv](size_t a, size_t b)
+        {
+            return costv[a % Nlambda] > costv[b % Nlambda];
+        });
+
+    // Perform the loop, invoking the runner once for each thread; if a subclass pauses the loop, it is resumed
+    // after all processes have reached the end of the current round, as long as any process has chunks left
+    Array timev(_Nlambda);
+    Array countv(_Nlambda);
+    if (dynamic) _comm->create_counter();
+    ChunkRunner runner(body, range, indexv, dynamic ? _comm : 0, _Nlambda, _chunksize, probe, Nthreads,
+                       timev, countv, [this](){ return pausechunks(); });
+    RootAssigner threadassigner(0);
+    threadassigner.assign(Nthreads);
+    double elapsed = 0.;
+    vector<double> busyv(Nthreads);
+    int Npauses = 0;
+    while (true)
+    {
+        parallel->call(&runner, &threadassigner);
+        elapsed += parallel->elapsedTime();
+        for (int t=0; t<Nthreads; t++) busyv[t] += parallel->busyTime(t);
+        if (pausechunks()) Npauses++;
+        if (!resumechunks()) break;
+
+        // continue as long as any process has chunks left
+        Array leftv(1);
+        leftv[0] = runner.exhausted() ? 0. : 1.;
+        _comm->sum_all(leftv);
+        if (!leftv[0]) break;
+    }
+    if (dynamic) _comm->free_counter();
+    _random->resetStreams();
+    if (Npauses)
+        _log->info("This process paused the " + _phase + " phase " + QString::number(Npauses) + " times");
+
+    // Report the number of photon packages handled by this process, and combine the measurements of all processes
+    // so that each process arrives at the same cost estimates (and thus at the same order in the next phase)
+    if (dynamic)
+    {
+        _log->info("This process handled " + QString::number(countv.sum() + Nprobed) + " out of "
+                   + QString::number(static_cast<double>(_Npp)*_Nlambda) + " photon packages");
+        _comm->sum_all(timev);
+        _comm->sum_all(countv);
+    }
+
+    // Remember the cost per photon package for each wavelength handled by this process
+    for (size_t ell=0; ell<_Nlambda; ell++)
+        if (countv[ell]) _costv[ell] = timev[ell] / countv[ell];
+
+    // Report the fraction of time the threads were busy
+    if (Nthreads > 1 && elapsed > 0)
+    {
+        double minbusy = 1., maxbusy = 0., sumbusy = 0.;
+        QString busyList;
+        for (int t=0; t<Nthreads; t++)
+        {
+            double busy = busyv[t] / elapsed;
+            minbusy = min(minbusy, busy);
+            maxbusy = max(maxbusy, busy);
+            sumbusy += busy;
+            busyList += " " + QString::number(100*busy, 'f', 1) + "%";
+        }
+        _log->info("Threads were busy during " + QString::number(100*sumbusy/Nthreads, 'f', 1)
+                   + "% of the " + _phase + " phase on average (ranging from "
+                   + QString::number(100*minbusy, 'f', 1) + "% to " + QString::number(100*maxbusy, 'f', 1) + "%)");
+        _log->info("Busy fraction for each thread:" + busyList);
+    }
+
+#ifdef BUILDING_MEMORY
+    // Report the number of heap allocations in the photon life cycle
+    _log->info("Heap allocations in the " + _phase + " photon life cycle: " + QString::number(_Nallocs)
+               + " for " + QString::number(_Ndone) + " photon packages");
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool MonteCarloSimulation::pausechunks() const
+{
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool MonteCarloSimulation::resumechunks()
+{
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+
+PhotonPackage* MonteCarloSimulation::threadpackages()
+{
+    // get the photon packages for this thread, allocating them if this is the first invocation from this thread;
+    // each thread accesses only its own slot, so there is no need for locking
+    size_t thread = _parfac->currentThreadIndex();
+    if (thread >= _threadpackagesv.size()) throw FATALERROR("Thread index exceeds the number of photon package slots");
+    PhotonPackage*& packages = _threadpackagesv[thread];
+    if (!packages) packages = new PhotonPackage[2];
+    return packages;
+}
+
+////////////////////////////////////////////////////////////////////
+
 void MonteCarloSimulation::runstellaremission()
 {
     TimeLogger logger(_log, "the stellar emission phase");
     setChunkParams(_packages);
     initprogress("stellar emission");
-    Parallel* parallel = find<ParallelFactory>()->parallel();
-    parallel->call(this, &MonteCarloSimulation::dostellaremissionchunk, _assigner);
+    runchunks([this](size_t index, quint64 first, quint64 count){ dostellaremissionchunk(index, first, count); },
+              false);
 
     // Wait for the other processes to reach this point
     _comm->wait("the stellar emission phase");
@@ -262,21 +632,24 @@ void MonteCarloSimulation::runstellaremission()
 
 ////////////////////////////////////////////////////////////////////
 
-void MonteCarloSimulation::dostellaremissionchunk(size_t index)
+void MonteCarloSimulation::dostellaremissionchunk(size_t index, quint64 first, quint64 remaining)
 {
     int ell = index % _Nlambda;
     double L = _ss->luminosity(ell)/_Npp;
     if (L > 0)
     {
         double Lthreshold = L / minWeightReduction();
-        PhotonPackage pp,ppp;
+        PhotonPackage* packages = threadpackages();
+        PhotonPackage& pp = packages[0];
+        PhotonPackage& ppp = packages[1];
 
-        quint64 remaining = _chunksize;
         while (remaining > 0)
         {
             quint64 count = qMin(remaining, _logchunksize);
+            size_t allocations = MemoryStatistics::threadAllocations();
             for (quint64 i=0; i<count; i++)
             {
+                _random->setStream(_Nphases, ell, first++);
                 _ss->launch(&pp,ell,L);
                 if (pp.luminosity()>0)
                 {
@@ -293,11 +666,11 @@ void MonteCarloSimulation::dostellaremissionchunk(size_t index)
                     }
                 }
             }
-            logprogress(count);
+            logprogress(count, MemoryStatistics::threadAllocations() - allocations);
             remaining -= count;
         }
     }
-    else logprogress(_chunksize);
+    else logprogress(remaining);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -306,7 +679,7 @@ void MonteCarloSimulation::peeloffemission(PhotonPackage* pp, PhotonPackage* ppp
 {
     Position bfr = pp->position();
 
-    foreach (Instrument* instr, _is->instruments())
+    for (Instrument* instr : _is->peelOffInstruments())
     {
         Direction bfknew = instr->bfkobs(bfr);
         ppp->launchEmissionPeelOff(pp, bfknew);
@@ -322,24 +695,22 @@ void MonteCarloSimulation::peeloffscattering(PhotonPackage* pp, PhotonPackage* p
     int ell = pp->ell();
     Position bfr = pp->position();
 
-    // Determine the weighting factors of the phase functions corresponding to
+    // Determine the normalization of the weighting factors of the phase functions corresponding to
     // the different dust components: each component h is weighted by kappasca(h)*rho(m,h)
-    QVarLengthArray<double,4> wv(Ncomp);
-    if (Ncomp==1)
-        wv[0] = 1.0;
-    else
+    const double* kappascav = _ds->kappascav(ell);
+    int m = -1;
+    double sum = 1.0;
+    if (Ncomp>1)
     {
-        int m = _ds->whichcell(bfr);
+        m = _ds->whichcell(bfr);
         if (m==-1) return; // abort peel-off
-        for (int h=0; h<Ncomp; h++) wv[h] = _ds->mix(h)->kappasca(ell) * _ds->density(m,h);
-        double sum = 0;
-        for (int h=0; h<Ncomp; h++) sum += wv[h];
+        sum = 0;
+        for (int h=0; h<Ncomp; h++) sum += kappascav[h] * _ds->density(m,h);
         if (sum<=0) return; // abort peel-off
-        for (int h=0; h<Ncomp; h++) wv[h] /= sum;
     }
 
     // Now do the actual peel-off
-    foreach (Instrument* instr, _is->instruments())
+    for (Instrument* instr : _is->peelOffInstruments())
     {
         Direction bfkobs = instr->bfkobs(bfr);
         Direction bfkx = instr->bfkx();
@@ -348,7 +719,8 @@ void MonteCarloSimulation::peeloffscattering(PhotonPackage* pp, PhotonPackage* p
         for (int h=0; h<Ncomp; h++)
         {
             DustMix* mix = _ds->mix(h);
-            double w = wv[h] * mix->phaseFunctionValue(pp, bfkobs);
+            double wh = Ncomp==1 ? 1.0 : kappascav[h] * _ds->density(m,h) / sum;
+            double w = wh * mix->phaseFunctionValue(pp, bfkobs);
             StokesVector sv;
             mix->scatteringPeelOffPolarization(&sv, pp, bfkobs, bfkx, bfky);
             I += w * sv.stokesI();
@@ -371,14 +743,8 @@ void MonteCarloSimulation::continuouspeeloffscattering(PhotonPackage *pp, Photon
     Direction bfk = pp->direction();
 
     int Ncomp = _ds->Ncomp();
-    QVarLengthArray<double,4> kappascav(Ncomp);
-    QVarLengthArray<double,4> kappaextv(Ncomp);
-    for (int h=0; h<Ncomp; h++)
-    {
-        DustMix* mix = _ds->mix(h);
-        kappascav[h] = mix->kappasca(ell);
-        kappaextv[h] = mix->kappaext(ell);
-    }
+    const double* kappascav = _ds->kappascav(ell);
+    const double* kappaextv = _ds->kappaextv(ell);
 
     int Ncells = pp->size();
     for (int n=0; n<Ncells; n++)
@@ -386,19 +752,16 @@ void MonteCarloSimulation::continuouspeeloffscattering(PhotonPackage *pp, Photon
         int m = pp->m(n);
         if (m!=-1)
         {
-            QVarLengthArray<double,4> wv(Ncomp);
             double ksca = 0.0;
             double kext = 0.0;
             for (int h=0; h<Ncomp; h++)
             {
                 double rho = _ds->density(m,h);
-                wv[h] = rho*kappascav[h];
                 ksca += rho*kappascav[h];
                 kext += rho*kappaextv[h];
             }
             if (ksca>0.0)
             {
-                for (int h=0; h<Ncomp; h++) wv[h] /= ksca;
                 double albedo = ksca/kext;
                 double tau0 = (n==0) ? 0.0 : pp->tau(n-1);
                 double dtau = pp->dtau(n);
@@ -407,7 +770,7 @@ void MonteCarloSimulation::continuouspeeloffscattering(PhotonPackage *pp, Photon
                 double factorm = albedo * exp(-tau0) * (-expm1(-dtau));
                 double s = s0 + _random->uniform()*ds;
                 Position bfrnew(bfr+s*bfk);
-                foreach (Instrument* instr, _is->instruments())
+                for (Instrument* instr : _is->peelOffInstruments())
                 {
                     Direction bfkobs = instr->bfkobs(bfrnew);
                     Direction bfkx = instr->bfkx();
@@ -416,7 +779,7 @@ void MonteCarloSimulation::continuouspeeloffscattering(PhotonPackage *pp, Photon
                     for (int h=0; h<Ncomp; h++)
                     {
                         DustMix* mix = _ds->mix(h);
-                        double w = wv[h] * mix->phaseFunctionValue(pp, bfkobs);
+                        double w = _ds->density(m,h)*kappascav[h]/ksca * mix->phaseFunctionValue(pp, bfkobs);
                         StokesVector sv;
                         mix->scatteringPeelOffPolarization(&sv, pp, bfkobs, bfkx, bfky);
                         I += w * sv.stokesI();
@@ -473,14 +836,8 @@ void MonteCarloSimulation::simulateescapeandabsorption(PhotonPackage* pp, bool s
     // The absorption/scattering in each cell is weighted by the density contribution of the component.
     else
     {
-        Array kappascav(Ncomp);
-        Array kappaextv(Ncomp);
-        for (int h=0; h<Ncomp; h++)
-        {
-            DustMix* mix = _ds->mix(h);
-            kappascav[h] = mix->kappasca(ell);
-            kappaextv[h] = mix->kappaext(ell);
-        }
+        const double* kappascav = _ds->kappascav(ell);
+        const double* kappaextv = _ds->kappaextv(ell);
         int Ncells = pp->size();
         double Lsca = 0.0;
         for (int n=0; n<Ncells; n++)
@@ -6,9 +6,12 @@
 #ifndef MONTECARLOSIMULATION_HPP
 #define MONTECARLOSIMULATION_HPP
 
+#include "Array.hpp"
 #include "Simulation.hpp"
 #include <QTime>
 #include <atomic>
+#include <functional>
+#include <vector>
 class DustSystem;
 class InstrumentSystem;
 class PhotonPackage;
@@ -78,7 +81,8 @@ protected:
     MonteCarloSimulation();
 
     /** This function verifies that all attribute values have been appropriately set. The dust
-        system is optional and thus it may have a null value. */
+        system is optional and thus it may have a null value. It also prepares a slot for the
+        photon packages reserved for each parallel execution thread (see threadpackages()). */
     void setupSelfBefore();
 
     /** This function determines how the specified number of photon packages should be split over
@@ -86,9 +90,11 @@ protected:
         at the start of each photon shooting phase.
 
         A chunk is the unit of parallelization in the simulation, i.e. multiple chunks may be performed
-        simultaneously in different execution threads. The number of photons launched in a chunk,
-        called the chunk size, is the same for all chunks in the simulation. All photon packages in a
-        chunk have the same wavelength. If no photon packages must be launched for the simulation, the
+        simultaneously in different execution threads. The number of photon packages launched per
+        wavelength is the specified number rounded up to an integer, regardless of the number of
+        chunks; these packages are divided as evenly as possible over the chunks for the
+        wavelength, so that the chunk sizes differ by at most one (see chunkpackages()). All photon
+        packages in a chunk have the same wavelength. If no photon packages must be launched for the simulation, the
         number of chunks is trivially zero. If the number of photon packages is nonzero, we
         differentiate between 3 cases to calculate the number of chunks:
         -# if the current simulation is <b>not parallelized</b> at all, i.e. the number of processes as
@@ -118,6 +124,15 @@ protected:
         \frac{N_\text{pp}}{S_\text{max}}}\f] */
     void setChunkParams(double packages);
 
+    /** This function determines the photon packages to be launched by the chunk with the
+        specified absolute chunk index, as set up by the most recent call to setChunkParams(). It
+        stores the index (within the chunk's wavelength) of the first photon package in \em first,
+        and the number of photon packages in \em count. The photon packages of the consecutive
+        chunks for a given wavelength have consecutive indices, so that each photon package can be
+        identified by its wavelength index and its index within that wavelength, independent of
+        the way in which the packages are divided into chunks. */
+    void chunkpackages(size_t index, quint64& first, quint64& count) const;
+
     //======== Setters & Getters for Discoverable Attributes =======
 
 public:
@@ -185,7 +200,9 @@ public:
         in a staggered way, also minimizing load imbalance but most importantly reducing the
         communication overhead after the emission stages (but this more efficient communication has not
         been implemented yet). Using a SequentialAssigner for this purpose would not be recommended due
-        to very poor load balancing. */
+        to very poor load balancing. Finally, a DynamicAssigner lets each process pull chunks from a
+        common pool as it becomes available, so that all processes finish each photon shooting
+        phase at nearly the same time, even if they run on hardware with different performance. */
     Q_INVOKABLE void setAssigner(ProcessAssigner* value);
 
     /** Returns the process assigner for this Monte Carlo simulation. */
@@ -194,6 +211,9 @@ public:
     //======================== Other Functions =======================
 
 public:
+    /** The destructor deletes the photon packages reserved for each parallel thread. */
+    ~MonteCarloSimulation();
+
     /** This function returns the dimension of the simulation, which depends on the (lack of)
         symmetry in the stellar and dust geometries. A value of 1 means spherical symmetry, 2 means
         axial symmetry and 3 means none of these symmetries. The stellar or dust component with the
@@ -201,6 +221,24 @@ public:
         */
     int dimension() const;
 
+    /** This function prepares a simulation that has been setup (and usually run) for being setup
+        and run once more, after some of the simulation items held by the simulation have been
+        replaced by new items through the corresponding setters. The function resets the run-time
+        state of the simulation itself, so that a subsequent invocation of setupAndRun() performs
+        setup for the simulation and for the newly inserted items, while the items that have been
+        setup before retain the result of their setup. The photon shooting phases are counted
+        from zero again, so that the photon packages are launched with the same random streams as
+        in a newly constructed simulation with the same configuration. Furthermore, the default
+        random streams of all threads are reinitialized to their state after setup of the random
+        generator, the cost estimates used to order the chunks are discarded, and the statistics
+        on the number of cells crossed gathered by the dust system are cleared.
+
+        The caller must ensure that the retained items are not affected by the replacements, and
+        that they do not hold any results of the previous run. Specifically, the instrument system
+        accumulates the detected photon packages, so it must always be replaced, and the same is
+        true for a dust system that stores absorption rates. */
+    void prepareRerun();
+
 protected:
     /** This function initializes the progress counter used in logprogress() for the specified
         phase and logs the number of photon packages and wavelengths to be processed. */
@@ -208,9 +246,106 @@ protected:
 
     /** This function logs a progress message for the phase specified in the initprogress()
         function, assuming the previous message was issued at least 3 seconds ago. The function
-        must be called regularly while processing photon packages. The argument specifies the
-        number of photon packages processed since the most recent invocation in the same thread. */
-    void logprogress(quint64 extraDone);
+        must be called regularly while processing photon packages. The first argument specifies the
+        number of photon packages processed since the most recent invocation in the same thread.
+        The optional second argument specifies the number of heap allocations performed while
+        processing these photon packages, as obtained from MemoryStatistics::threadAllocations(). */
+    void logprogress(quint64 extraDone, size_t allocations = 0);
+
+    /** This function returns true if the chunks of the photon shooting phases are handed out
+        dynamically to the processes, i.e. if the simulation's process assigner is a
+        DynamicAssigner and there are multiple processes. In that case, the chunks handled by this
+        process are known only while the runchunks() function is executing. */
+    bool dynamicchunks() const;
+
+    /** This function performs the parallel loop over the chunks of the photon shooting phase
+        specified in the initprogress() function, invoking the specified loop body for the photon
+        packages in each of the chunks assigned to this process by the simulation's process
+        assigner. The arguments passed to the loop body are the absolute chunk index, from which
+        the wavelength index can be derived, the index of the first photon package to be launched
+        (within its wavelength), and the number of photon packages to be launched. The loop body
+        may be invoked several times for the same chunk, each time for a different range of photon
+        packages (see below). Because each photon package draws its random numbers from its own
+        stream, the results do not depend on the way the chunks are split.
+
+        Because the cost of processing a photon package varies by orders of magnitude between
+        wavelengths (e.g. because of the number of scattering events), the order in which the
+        chunks are handed out to the parallel threads matters: if an expensive chunk is started
+        last, the other threads become idle while waiting for it to complete. Therefore this
+        function measures the time spent in each chunk and remembers the resulting cost per photon
+        package for each wavelength. In subsequent phases, the chunks are handed out in order of
+        decreasing estimated cost, so that the last chunks to be started are the cheapest ones.
+        In the first phase of the simulation, no estimates are available from a previous phase.
+        If there are multiple wavelengths and multiple threads or processes, and the phase is not
+        grouped, the function therefore first launches a small number of photon packages (1/16 of
+        a chunk) at the start of the first chunk for each wavelength, with the wavelengths
+        distributed over the processes, and combines the measured times of all processes into
+        initial estimates. These photon packages are skipped when the chunks are handed out
+        afterwards. Wavelengths for which no estimate is available are handed out last. If the \em grouped
+        flag is true, all chunks for the same wavelength are handed out consecutively (which allows
+        sharing wavelength-dependent data between these chunks); otherwise the chunks for
+        wavelengths with the same estimated cost remain interleaved as in the original order.
+
+        If the chunks are handed out dynamically (see dynamicchunks()), the list of chunks in
+        order of decreasing cost is the same for all processes, because the measured costs are
+        summed over all processes at the end of each phase. The processes pull consecutive
+        batches of positions in this list from a counter shared by all processes. The batch size
+        decreases as the list is exhausted (guided self-scheduling): initially each batch holds
+        half of the remaining chunks divided by the number of processes, and near the end of the
+        phase each batch holds a single chunk. Within a process, the chunks in a batch are handed
+        out to the parallel threads in order. Thus the number of remote operations remains small
+        while all processes finish the phase at nearly the same time.
+
+        Within a process, the same guided scheme is applied to the threads if there is more than
+        one: each chunk is handed out in pieces with a size equal to half of the photon packages
+        remaining in this process (in the current batch, if the chunks are distributed
+        dynamically) divided by the number of threads, with a minimum of 1/8 of a chunk. Thus the
+        pieces become smaller towards the end of the loop, so that the threads finish at nearly
+        the same time even if the last chunks are expensive. The cost estimates are based on the
+        time measured for each piece.
+
+        A subclass may ask to pause the loop (see pausechunks()). No more pieces are then handed
+        out until the pieces in progress have completed and all processes have reached the end of
+        the loop, after which resumechunks() is invoked and the loop is resumed. This is repeated
+        until no process has any chunks left. If resumechunks() returns false, as it does in this
+        class, the loop is performed only once, and the processes do not communicate to find out
+        whether there are chunks left.
+
+        Each photon package draws its random numbers from its own stream, selected by calling
+        Random::setStream() with the phase counter incremented by this function, the wavelength
+        index and the index of the photon package within its wavelength (see chunkpackages()).
+        After the loop, the function switches all threads back to their default random stream.
+
+        Finally, the function logs the fraction of the elapsed time that the parallel threads were
+        busy, and, if heap allocations are being counted (i.e. if the code is compiled with the
+        BUILDING_MEMORY option), the number of heap allocations reported to logprogress() during
+        the phase. Once the reusable memory for each thread has reached its working size, the
+        photon life cycle should not perform any heap allocations at all. */
+    void runchunks(std::function<void(size_t,quint64,quint64)> body, bool grouped);
+
+    /** This function is invoked by runchunks() from the parallel threads before handing out each
+        piece of a chunk. If it returns true, no more pieces are handed out until the pieces in
+        progress have completed, after which runchunks() invokes resumechunks(). The implementation in this class
+        always returns false. */
+    virtual bool pausechunks() const;
+
+    /** This function is invoked by runchunks() on all processes at the same time each time the
+        parallel loop over the chunks has ended, whether because it was paused (see pausechunks())
+        or because this process has no chunks left. No photon packages are in flight, so the
+        function can perform collective operations involving all processes. If the function returns
+        true, runchunks() resumes the loop as long as any process has chunks left; otherwise the
+        loop is considered complete. The function must return the same value on all processes. The
+        implementation in this class returns false, so that a loop can't be paused. */
+    virtual bool resumechunks();
+
+    /** This function returns a pointer to an array of two photon packages reserved for the calling
+        thread. The first package serves to follow the life cycle of a photon package, and the
+        second one serves for the peel-off photon packages. The packages are allocated the first
+        time a thread requests them, and are then reused by that thread for all subsequent chunks.
+        As a result, the vectors holding the path information in the photon packages retain their
+        capacity, and the photon life cycle requires no heap allocations once these vectors have
+        grown to the required size. */
+    PhotonPackage* threadpackages();
 
     /** This function drives the stellar emission phase in a Monte Carlo simulation. It consists of
         a parallelized loop that iterates over \f$N_{\text{pp}}\times N_\lambda\f$ monochromatic
@@ -229,8 +364,10 @@ protected:
         part of its original luminosity (and hence becomes irrelevant). */
     void runstellaremission();
 
-    /** This function implements the loop body for runstellaremission(). */
-    void dostellaremissionchunk(size_t index);
+    /** This function implements the loop body for runstellaremission(), launching \em count
+        photon packages starting at the photon package with index \em first within the chunk with
+        the specified absolute index. */
+    void dostellaremissionchunk(size_t index, quint64 first, quint64 count);
 
     /** This function simulates the peel-off of a photon package after an emission event. This
         means that we create peel-off or shadow photon packages, one for every instrument in the
@@ -420,15 +557,25 @@ protected:
     // *** data members initialized by this class through the setChunkParams() function ***
     quint64 _Nlambda;       // the number of wavelengths in the simulation's wavelength grid
     quint64 _Nchunks;       // the number of chunks to be launched per wavelength
-    quint64 _chunksize;     // the number of photon packages in one chunk
+    quint64 _chunksize;     // the maximum number of photon packages in one chunk
     quint64 _Npp;           // the precise number of photon packages to be launched per wavelength
     quint64 _logchunksize;  // the number of photon packages to be processed between logprogress() invocations
 
+    // *** data member initialized by this class through the runchunks() function ***
+    int _Nphases;           // the number of photon shooting phases started so far; selects the random streams
+
 private:
     // *** data members used by the XXXprogress() functions in this class ***
     QString _phase;         // a string identifying the photon shooting phase for use in the log message
     std::atomic<quint64> _Ndone;  // the number of photon packages processed so far (for all wavelengths)
+    std::atomic<quint64> _Nallocs;  // the number of heap allocations in the photon life cycle so far
     QTime _timer;           // measures the time elapsed since the most recent log message
+
+    // *** data members used by the runchunks() function in this class ***
+    Array _costv;           // the most recently measured processing time per photon package for each wavelength
+
+    // photon packages reserved for each parallel thread (allocated by the thread on first use)
+    std::vector<PhotonPackage*> _threadpackagesv;
 };
 
 ////////////////////////////////////////////////////////////////////
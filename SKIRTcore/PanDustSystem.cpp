@@ -3,6 +3,7 @@
 ////       © Astronomical Observatory, Ghent University         ////
 ///////////////////////////////////////////////////////////////// */
 
+#include <algorithm>
 #include <cmath>
 #include "ArrayTable.hpp"
 #include "DustEmissivity.hpp"
@@ -22,6 +23,7 @@
 #include "ParallelFactory.hpp"
 #include "PeerToPeerCommunicator.hpp"
 #include "RootAssigner.hpp"
+#include "StaggeredAssigner.hpp"
 #include "TextOutFile.hpp"
 #include "TimeLogger.hpp"
 #include "Units.hpp"
@@ -31,10 +33,184 @@ using namespace std;
 
 //////////////////////////////////////////////////////////////////////
 
+namespace
+{
+    // the capacity (in records) of a buffer for absorptions in foreign cells
+    const size_t Nbuffer = 1 << 16;
+
+    // the maximum number of absorption records shipped to each process in a single exchange
+    const size_t Nexchange = 1 << 22;
+
+    // the number of slots in a private absorption cache, as a power of two
+    const int Nbits = 16;
+    const size_t Ncache = static_cast<size_t>(1) << Nbits;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+// An instance of this class buffers the luminosities absorbed in dust cells held by other processes.
+// Each record holds the index m*Nlambda+ell of the corresponding entry in the absorption table, and
+// the absorbed luminosity. When the buffer fills up, the records for the same table entry are combined.
+// If that does not free up at least half of the buffer, the buffer asks to be flushed: the chunks being
+// processed are completed, after which the records are shipped to the processes holding the cells.
+// Only while completing these chunks may the buffer exceed its capacity, and the excess capacity is
+// released when the buffer is emptied.
+class PDS_Buffer
+{
+private:
+    vector< pair<size_t,double> > _recordv;
+    size_t _limit;
+
+public:
+    PDS_Buffer()
+        : _limit(Nbuffer)
+    {
+        _recordv.reserve(Nbuffer);
+    }
+
+    // adds a record to the buffer, coalescing the buffer if needed;
+    // returns true if the buffer should be flushed as soon as possible
+    bool add(size_t index, double L)
+    {
+        _recordv.push_back(make_pair(index,L));
+        if (_recordv.size() < _limit) return false;
+        coalesce();
+        _limit = max(Nbuffer, _recordv.size() + Nbuffer/2);
+        return 2*_recordv.size() >= Nbuffer;
+    }
+
+    // appends the records of another buffer to this buffer (without coalescing)
+    void append(const PDS_Buffer& other)
+    {
+        _recordv.insert(_recordv.end(), other._recordv.begin(), other._recordv.end());
+    }
+
+    // sorts the records on table index and combines the records for the same table entry
+    void coalesce()
+    {
+        sort(_recordv.begin(), _recordv.end());
+        size_t j = 0;
+        for (size_t i=0; i<_recordv.size(); i++)
+        {
+            if (j>0 && _recordv[j-1].first == _recordv[i].first) _recordv[j-1].second += _recordv[i].second;
+            else _recordv[j++] = _recordv[i];
+        }
+        _recordv.resize(j);
+    }
+
+    // returns the total luminosity in the buffer
+    double sum() const
+    {
+        double sum = 0;
+        for (const auto& record : _recordv) sum += record.second;
+        return sum;
+    }
+
+    // removes all records from the buffer, and releases any memory exceeding the regular capacity
+    void clear()
+    {
+        _recordv.clear();
+        if (_recordv.capacity() > Nbuffer) vector< pair<size_t,double> >().swap(_recordv);
+        _recordv.reserve(Nbuffer);
+        _limit = Nbuffer;
+    }
+
+    // returns the records in the buffer
+    const vector< pair<size_t,double> >& records() const
+    {
+        return _recordv;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////
+
+// An instance of this class accumulates the luminosities absorbed by a single thread in a fixed number of
+// slots, each holding a pending contribution for a particular entry of an absorption table. A table entry is
+// always mapped to the same slot, so that repeated absorptions in the same entry (e.g. in the dust cells
+// near a bright source) are combined without touching the shared table. When a slot is needed for
+// another table entry, the pending contribution is added to the shared table in a thread-safe manner.
+class PDS_Cache
+{
+private:
+    struct Slot
+    {
+        double* target;
+        double value;
+    };
+    vector<Slot> _slotv;
+    double* _base;
+
+    // returns the slot index for the table entry with the specified offset; the offset m*Nlambda+ell is hashed
+    // with a multiplicative (Fibonacci) hash, keeping the high-order bits, so that the entries for the same
+    // wavelength in consecutive cells do not map to only a few slots when Nlambda is a power of two
+    static size_t slotindex(ptrdiff_t offset)
+    {
+        const int shift = 64 - Nbits;
+        return static_cast<size_t>((static_cast<quint64>(offset) * Q_UINT64_C(0x9E3779B97F4A7C15)) >> shift);
+    }
+
+public:
+    PDS_Cache(double* base)
+        : _slotv(Ncache, Slot{0,0.}), _base(base)
+    {
+    }
+
+    // adds the luminosity to the slot for the specified table entry, evicting the current contents if needed
+    void add(double* target, double L)
+    {
+        Slot& slot = _slotv[slotindex(target-_base)];
+        if (slot.target == target) slot.value += L;
+        else
+        {
+            if (slot.target) LockFree::add(*slot.target, slot.value);
+            slot.target = target;
+            slot.value = L;
+        }
+    }
+
+    // adds all pending contributions to the shared table and empties the cache;
+    // this function may not be called concurrently with other threads accessing the table
+    void flush()
+    {
+        for (Slot& slot : _slotv)
+        {
+            if (slot.target) *slot.target += slot.value;
+            slot.target = 0;
+        }
+    }
+
+    // returns the total pending luminosity in the cache
+    double sum() const
+    {
+        double sum = 0;
+        for (const Slot& slot : _slotv) if (slot.target) sum += slot.value;
+        return sum;
+    }
+
+    // empties the cache without adding the pending contributions to the shared table
+    void clear()
+    {
+        for (Slot& slot : _slotv) slot.target = 0;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////
+
 PanDustSystem::PanDustSystem()
     : _dustemissivity(0), _dustlib(0), _emissionBias(0.5), _emissionBoost(1), _selfabsorption(false), _writeEmissivity(false),
-      _writeTemp(true), _writeISRF(false), _cycles(0), _Nlambda(0), _haveLabsstel(false), _haveLabsdust(false)
+      _writeTemp(true), _writeISRF(false), _cycles(0), _distributedAbsorption(false), _threadLocalAbsorption(false), _Nlambda(0),
+      _haveLabsstel(false), _haveLabsdust(false), _distributed(false), _comm(0), _cellassigner(0), _flushrequested(false), _parfac(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////
+
+PanDustSystem::~PanDustSystem()
 {
+    for (auto buffer : _bufferstelv) delete buffer;
+    for (auto buffer : _bufferdustv) delete buffer;
+    for (auto cache : _cachestelv) delete cache;
+    for (auto cache : _cachedustv) delete cache;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -119,13 +295,42 @@ void PanDustSystem::setupSelfAfter()
     _haveLabsdust = false;
     if (dustemission())
     {
-        _Labsstelvv.resize(_Ncells,_Nlambda);
+        // if so requested, each process holds the rows of the tables only for the cells assigned to it
+        int Nrows = _Ncells;
+        if (_distributedAbsorption)
+        {
+            _comm = find<PeerToPeerCommunicator>();
+            _distributed = _comm->isMultiProc();
+        }
+        if (_distributed)
+        {
+            _cellassigner = new StaggeredAssigner(this);
+            _cellassigner->assign(_Ncells);
+            Nrows = _cellassigner->nvalues();
+            _Labsbolstelv.resize(_Ncells);
+            _Labsboldustv.resize(_Ncells);
+            _parfac = find<ParallelFactory>();
+            _bufferstelv.resize(_parfac->maxThreadCount(), 0);
+            _bufferdustv.resize(_parfac->maxThreadCount(), 0);
+            find<Log>()->info("Distributing the absorption tables; this process holds " + QString::number(Nrows)
+                              + " out of " + QString::number(_Ncells) + " dust cells");
+        }
+
+        _Labsstelvv.resize(Nrows,_Nlambda);
         _haveLabsstel = true;
         if (selfAbsorption())
         {
-            _Labsdustvv.resize(_Ncells,_Nlambda);
+            _Labsdustvv.resize(Nrows,_Nlambda);
             _haveLabsdust = true;
         }
+
+        // if so requested, prepare a slot for the private absorption caches of each thread
+        if (_threadLocalAbsorption)
+        {
+            _parfac = find<ParallelFactory>();
+            _cachestelv.resize(_parfac->maxThreadCount(), 0);
+            _cachedustv.resize(_parfac->maxThreadCount(), 0);
+        }
     }
 
     // write emissivities if so requested
@@ -287,6 +492,34 @@ bool PanDustSystem::writeISRF() const
 
 ////////////////////////////////////////////////////////////////////
 
+void PanDustSystem::setDistributedAbsorption(bool value)
+{
+    _distributedAbsorption = value;
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool PanDustSystem::distributedAbsorption() const
+{
+    return _distributedAbsorption;
+}
+
+////////////////////////////////////////////////////////////////////
+
+void PanDustSystem::setThreadLocalAbsorption(bool value)
+{
+    _threadLocalAbsorption = value;
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool PanDustSystem::threadLocalAbsorption() const
+{
+    return _threadLocalAbsorption;
+}
+
+////////////////////////////////////////////////////////////////////
+
 bool PanDustSystem::dustemission() const
 {
     return _dustemissivity!=0;
@@ -306,19 +539,60 @@ void PanDustSystem::absorb(int m, int ell, double DeltaL, bool ynstellar)
     if (ynstellar)
     {
         if (!_haveLabsstel) throw FATALERROR("This dust system does not support absorption of stellar emission");
-        LockFree::add(_Labsstelvv(m,ell), DeltaL);
     }
     else
     {
         if (!_haveLabsdust) throw FATALERROR("This dust system does not support absorption of dust emission");
-        LockFree::add(_Labsdustvv(m,ell), DeltaL);
     }
+    Table<2>& Labsvv = ynstellar ? _Labsstelvv : _Labsdustvv;
+
+    // if the absorption tables are distributed, buffer the absorptions in cells held by other processes
+    if (_distributed)
+    {
+        if (!ownscell(m))
+        {
+            if (threadbuffer(ynstellar)->add(static_cast<size_t>(m)*_Nlambda+ell, DeltaL)) _flushrequested = true;
+            return;
+        }
+        m = _cellassigner->relativeIndex(m);
+    }
+
+    // add the absorption to the private cache of this thread, or directly to the shared table
+    if (_threadLocalAbsorption) threadcache(ynstellar)->add(&Labsvv(m,ell), DeltaL);
+    else LockFree::add(Labsvv(m,ell), DeltaL);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+bool PanDustSystem::distributedtables() const
+{
+    return _distributed;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+bool PanDustSystem::ownscell(int m) const
+{
+    return !_distributed || _cellassigner->rankForIndex(m) == _comm->rank();
+}
+
+//////////////////////////////////////////////////////////////////////
+
+int PanDustSystem::cellrank(int m) const
+{
+    return _distributed ? _cellassigner->rankForIndex(m) : -1;
 }
 
 //////////////////////////////////////////////////////////////////////
 
 double PanDustSystem::Labs(int m, int ell) const
 {
+    if (_distributed)
+    {
+        if (!ownscell(m)) throw FATALERROR("The absorbed luminosity is not available for a dust cell held by another process");
+        m = _cellassigner->relativeIndex(m);
+    }
+
     double sum = 0;
     if (_haveLabsstel) sum += _Labsstelvv(m,ell);
     if (_haveLabsdust) sum += _Labsdustvv(m,ell);
@@ -330,12 +604,20 @@ double PanDustSystem::Labs(int m, int ell) const
 void PanDustSystem::rebootLabsdust()
 {
     _Labsdustvv.clear();
+    for (auto cache : _cachedustv) if (cache) cache->clear();
+    if (_distributed)
+    {
+        for (auto buffer : _bufferdustv) if (buffer) buffer->clear();
+        _Labsboldustv = 0.;
+    }
 }
 
 //////////////////////////////////////////////////////////////////////
 
 double PanDustSystem::Labs(int m) const
 {
+    if (_distributed) return _Labsbolstelv[m] + _Labsboldustv[m];
+
     double sum = 0;
     if (_haveLabsstel)
         for (int ell=0; ell<_Nlambda; ell++)
@@ -350,6 +632,8 @@ double PanDustSystem::Labs(int m) const
 
 double PanDustSystem::Labsstellartot() const
 {
+    if (_distributed) return _Labsbolstelv.sum();
+
     double sum = 0;
     if (_haveLabsstel)
         for (int m=0; m<_Ncells; m++)
@@ -364,10 +648,18 @@ double PanDustSystem::Labsdusttot() const
 {
     double sum = 0;
     if (_haveLabsdust)
-        for (int m=0; m<_Ncells; m++)
+    {
+        int Nrows = _Labsdustvv.size(0);
+        for (int m=0; m<Nrows; m++)
             for (int ell=0; ell<_Nlambda; ell++)
                 sum += _Labsdustvv(m,ell);
 
+        // include the absorptions pending in the private caches of the threads and,
+        // if the absorption tables are distributed, the absorptions buffered for foreign cells
+        for (auto cache : _cachedustv) if (cache) sum += cache->sum();
+        for (auto buffer : _bufferdustv) if (buffer) sum += buffer->sum();
+    }
+
     PeerToPeerCommunicator * comm = find<PeerToPeerCommunicator>();
 
     Array arr(1);
@@ -399,8 +691,152 @@ void PanDustSystem::sumResults(bool ynstellar)
     Log* log = find<Log>();
     TimeLogger logger(log->verbose() && comm->isMultiProc() ? log : 0, "communication of the absorbed luminosities");
 
-    // Sum the array of luminosities across all processes
-    comm->sum_all(ynstellar ? _Labsstelvv.getArray() : _Labsdustvv.getArray());
+    // Add the absorptions pending in the private caches of the threads to the table
+    for (auto cache : ynstellar ? _cachestelv : _cachedustv) if (cache) cache->flush();
+
+    if (_distributed)
+    {
+        // Ship the absorptions in foreign cells to the processes holding these cells
+        exchangeabsorption(ynstellar);
+        _flushrequested = false;
+
+        // Assemble the bolometric absorbed luminosity of all cells on every process
+        Table<2>& Labsvv = ynstellar ? _Labsstelvv : _Labsdustvv;
+        Array& Labsbolv = ynstellar ? _Labsbolstelv : _Labsboldustv;
+        Labsbolv = 0.;
+        int Nrows = Labsvv.size(0);
+        for (int i=0; i<Nrows; i++)
+        {
+            double sum = 0;
+            for (int ell=0; ell<_Nlambda; ell++) sum += Labsvv(i,ell);
+            Labsbolv[_cellassigner->absoluteIndex(i)] = sum;
+        }
+        comm->sum_all(Labsbolv);
+    }
+    else
+    {
+        // Sum the array of luminosities across all processes
+        comm->sum_all(ynstellar ? _Labsstelvv.getArray() : _Labsdustvv.getArray());
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+void PanDustSystem::exchangeabsorption(bool ynstellar)
+{
+    Table<2>& Labsvv = ynstellar ? _Labsstelvv : _Labsdustvv;
+    vector<PDS_Buffer*>& bufferv = ynstellar ? _bufferstelv : _bufferdustv;
+    int Nprocs = _comm->size();
+
+    // combine the buffers of all threads, and sort the records by the process holding the corresponding cell
+    vector< vector< pair<size_t,double> > > recordvv(Nprocs);
+    {
+        PDS_Buffer buffer;
+        for (auto threadbuffer : bufferv)
+        {
+            if (threadbuffer)
+            {
+                buffer.append(*threadbuffer);
+                threadbuffer->clear();
+            }
+        }
+        buffer.coalesce();
+        for (const auto& record : buffer.records())
+            recordvv[_cellassigner->rankForIndex(record.first/_Nlambda)].push_back(record);
+    }
+
+    // determine the number of exchanges, which is the same for all processes
+    size_t Nmine = 0;
+    for (int p=0; p<Nprocs; p++) Nmine = max(Nmine, (recordvv[p].size()+Nexchange-1)/Nexchange);
+    Array Nexchangesv(Nprocs);
+    Nexchangesv[_comm->rank()] = Nmine;
+    _comm->sum_all(Nexchangesv);
+    size_t Nexchanges = Nexchangesv.max();
+
+    // perform the exchanges, each shipping a limited number of records to each process;
+    // the table indices and the luminosities are shipped in separate lists
+    vector< vector<qint64> > sendindexvv(Nprocs);
+    vector< vector<double> > sendLvv(Nprocs);
+    vector<qint64> recvindexv;
+    vector<double> recvLv;
+    for (size_t x=0; x<Nexchanges; x++)
+    {
+        size_t first = x*Nexchange;
+        for (int p=0; p<Nprocs; p++)
+        {
+            sendindexvv[p].clear();
+            sendLvv[p].clear();
+            size_t last = min(recordvv[p].size(), first+Nexchange);
+            for (size_t i=first; i<last; i++)
+            {
+                sendindexvv[p].push_back(recordvv[p][i].first);
+                sendLvv[p].push_back(recordvv[p][i].second);
+            }
+        }
+        _comm->exchange(sendindexvv, recvindexv);
+        _comm->exchange(sendLvv, recvLv);
+
+        // add the received absorptions to the rows of the local table
+        for (size_t i=0; i<recvindexv.size(); i++)
+        {
+            int m = recvindexv[i] / _Nlambda;
+            int ell = recvindexv[i] % _Nlambda;
+            Labsvv(_cellassigner->relativeIndex(m),ell) += recvLv[i];
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool PanDustSystem::absorptionflushrequested() const
+{
+    return _flushrequested;
+}
+
+////////////////////////////////////////////////////////////////////
+
+void PanDustSystem::flushabsorption()
+{
+    if (_distributed)
+    {
+        if (_haveLabsstel) exchangeabsorption(true);
+        if (_haveLabsdust) exchangeabsorption(false);
+    }
+    _flushrequested = false;
+}
+
+////////////////////////////////////////////////////////////////////
+
+PDS_Cache* PanDustSystem::threadcache(bool ynstellar)
+{
+    // get the cache for this thread, allocating it if this is the first invocation from this thread;
+    // each thread accesses only its own slot, so there is no need for locking
+    vector<PDS_Cache*>& cachev = ynstellar ? _cachestelv : _cachedustv;
+    size_t thread = _parfac->currentThreadIndex();
+    if (thread >= cachev.size()) throw FATALERROR("Thread index exceeds the number of absorption caches");
+    PDS_Cache*& cache = cachev[thread];
+    if (!cache)
+    {
+        // the table has no rows if this process holds none of the cells of a distributed table,
+        // in which case its first entry does not exist (and the cache is never used anyway)
+        Table<2>& Labsvv = ynstellar ? _Labsstelvv : _Labsdustvv;
+        cache = new PDS_Cache(Labsvv.size(0) ? &Labsvv(0,0) : 0);
+    }
+    return cache;
+}
+
+////////////////////////////////////////////////////////////////////
+
+PDS_Buffer* PanDustSystem::threadbuffer(bool ynstellar)
+{
+    // get the buffer for this thread, allocating it if this is the first invocation from this thread;
+    // each thread accesses only its own slot, so there is no need for locking
+    vector<PDS_Buffer*>& bufferv = ynstellar ? _bufferstelv : _bufferdustv;
+    size_t thread = _parfac->currentThreadIndex();
+    if (thread >= bufferv.size()) throw FATALERROR("Thread index exceeds the number of absorption buffers");
+    PDS_Buffer*& buffer = bufferv[thread];
+    if (!buffer) buffer = new PDS_Buffer();
+    return buffer;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -489,7 +925,7 @@ namespace
                 double y = yd ? (ybase + (zd ? i : j)*ypsize) : 0.;
                 Position bfr(x,y,z);
                 int m = _grid->whichcell(bfr);
-                if (m!=-1 && _ds->Labs(m)>0.0)
+                if (m!=-1 && _ds->Labs(m)>0.0 && _ds->ownscell(m))
                 {
                     const Array& Jv = _ds->meanintensityv(m);
                     int p = 0;
@@ -515,6 +951,9 @@ namespace
         // Write the results to a FITS file with an appropriate name
         void write()
         {
+            // if the absorption tables are distributed, each process calculated the values for its own cells
+            if (_ds->distributedtables()) _ds->find<PeerToPeerCommunicator>()->sum(tempv);
+
             QString filename = "ds_temp" + plane;
             Image image(_ds, Np, Np, Nmaps, xd?xpsize:ypsize, zd?zpsize:ypsize,
                         xd?xcenter:ycenter, zd?zcenter:ycenter, "temperature");
@@ -555,6 +994,9 @@ namespace
         // the parallized loop body; calculates the results for a single dust cell
         void body(size_t m)
         {
+            // if the absorption tables are distributed, only handle the cells held by this process
+            if (!_ds->ownscell(m)) return;
+
             // dust mass in cell
             _Mv[m] = _ds->density(m) * _ds->volume(m);
 
@@ -594,6 +1036,14 @@ namespace
         // Write the results to a text file with an appropriate name
         void write()
         {
+            // if the absorption tables are distributed, each process calculated the values for its own cells
+            if (_ds->distributedtables())
+            {
+                PeerToPeerCommunicator* comm = _ds->find<PeerToPeerCommunicator>();
+                comm->sum(_Mv);
+                comm->sum(_Tv);
+            }
+
             // Create a text file
             TextOutFile file(_ds, "ds_celltemps", "dust cell temperatures");
 
@@ -636,17 +1086,36 @@ void PanDustSystem::write() const
                            + QString::number(units->owavelength(lambdagrid->lambda(ell)))
                            + " " + units->uwavelength(), 'g');
 
-        // Write one line for each dust cell with nonzero absorption
-        for (int m=0; m<_Ncells; m++)
+        // Write one line for each dust cell with nonzero absorption; if the absorption tables are distributed,
+        // the mean intensities are gathered from the processes holding the cells, for a block of cells at a time
+        const int Nblock = 10000;
+        for (int m0=0; m0<_Ncells; m0+=Nblock)
         {
-            double Ltotm = Labs(m);
-            if (Ltotm>0.0)
+            int Nb = min(Nblock, _Ncells-m0);
+            ArrayTable<2> Jvv(Nb,_Nlambda);
+            vector<int> ranks(Nb,-1);
+            for (int i=0; i<Nb; i++)
+            {
+                int m = m0+i;
+                if (Labs(m)>0.0)
+                {
+                    ranks[i] = cellrank(m);
+                    if (ownscell(m)) Jvv[i] = meanintensityv(m);
+                }
+            }
+            if (_distributed) _comm->gather_all(Jvv, ranks);
+
+            for (int i=0; i<Nb; i++)
             {
-                QList<double> values;
-                Position bfr = _grid->centralPositionInCell(m);
-                values << m << units->olength(bfr.x()) << units->olength(bfr.y()) << units->olength(bfr.z());
-                for (auto J : meanintensityv(m)) values << J;
-                file.writeRow(values);
+                int m = m0+i;
+                if (Labs(m)>0.0)
+                {
+                    QList<double> values;
+                    Position bfr = _grid->centralPositionInCell(m);
+                    values << m << units->olength(bfr.x()) << units->olength(bfr.y()) << units->olength(bfr.z());
+                    for (auto J : Jvv[i]) values << J;
+                    file.writeRow(values);
+                }
             }
         }
     }
@@ -6,9 +6,15 @@
 #ifndef PANDUSTSYSTEM_HPP
 #define PANDUSTSYSTEM_HPP
 
+#include <atomic>
 #include "DustSystem.hpp"
 class DustEmissivity;
 class DustLib;
+class PDS_Buffer;
+class PDS_Cache;
+class PeerToPeerCommunicator;
+class ParallelFactory;
+class ProcessAssigner;
 
 //////////////////////////////////////////////////////////////////////
 
@@ -17,7 +23,29 @@ class DustLib;
     and additionaly supports dust emission. It maintains information on the absorbed energy for
     each cell at each wavelength in a (potentially very large) table. It also holds a
     DustEmissivity object and a DustLib object used to calculate the dust emission spectrum for
-    dust cells. */
+    dust cells.
+
+    In a multiprocessing environment, each process by default holds the absorbed luminosities
+    for all cells and wavelengths, and these tables are summed across the processes after each
+    emission phase. For very large dust grids, the tables can instead be distributed over the
+    processes by turning on the distributedAbsorption flag. Each process then holds the rows for
+    a subset of the dust cells, assigned by a StaggeredAssigner. Absorptions in the cells held by
+    other processes are collected in per-thread buffers, which are coalesced on the fly and shipped
+    to the processes holding the corresponding rows, in a limited number of large batches, at the
+    end of the emission phase. Subsequently, the bolometric absorbed luminosity of all cells is
+    made available on every process, while the mean intensity of the radiation field (and thus
+    any dust temperature or emission spectrum calculation) is available only for the cells held
+    by the process.
+
+    By default, absorbed luminosities are added directly to the shared tables using an atomic
+    operation, which may cause heavy contention between threads when many photon packages
+    traverse the same cells (e.g. close to a bright central source). If the threadLocalAbsorption
+    flag is turned on, each thread instead accumulates its absorptions in a private cache with a
+    fixed number of slots, combining repeated contributions to the same table entry. A pending
+    contribution is moved to the shared table only when its slot is needed for another entry, and
+    all caches are emptied into the tables at the end of each emission phase. The memory used by
+    the caches is bounded to about 1 MB per thread for each table, regardless of the size of the
+    tables. */
 class PanDustSystem : public DustSystem
 {
     Q_OBJECT
@@ -78,12 +106,27 @@ class PanDustSystem : public DustSystem
     Q_CLASSINFO("Default", "no")
     Q_CLASSINFO("RelevantIf", "dustEmissivity")
 
+    Q_CLASSINFO("Property", "distributedAbsorption")
+    Q_CLASSINFO("Title", "distribute the absorption rate tables over the parallel processes")
+    Q_CLASSINFO("Default", "no")
+    Q_CLASSINFO("Silent", "true")
+    Q_CLASSINFO("RelevantIf", "dustEmissivity")
+
+    Q_CLASSINFO("Property", "threadLocalAbsorption")
+    Q_CLASSINFO("Title", "accumulate absorbed luminosities in a private cache for each thread")
+    Q_CLASSINFO("Default", "no")
+    Q_CLASSINFO("Silent", "true")
+    Q_CLASSINFO("RelevantIf", "dustEmissivity")
+
     //============= Construction - Setup - Destruction =============
 
 public:
     /** The default constructor. */
     Q_INVOKABLE PanDustSystem();
 
+    /** The destructor releases the buffers for absorptions in cells held by other processes. */
+    ~PanDustSystem();
+
 protected:
     /** This function does some basic initialization. */
     void setupSelfBefore();
@@ -91,7 +134,8 @@ protected:
     /** If the relevant flag is turned on, this function outputs a data file tabulating the
         emissivity for each dust component's dust mix, assuming the dust would be embedded in the
         local (i.e. solar neighborhood) interstellar radiation field as defined by Mathis et al.
-        (1983, A&A, 128, 212). */
+        (1983, A&A, 128, 212). It also sizes the absorption rate tables, and if these tables are
+    to be distributed over the processes, it assigns the dust cells to the processes. */
     void setupSelfAfter();
 
     //======== Setters & Getters for Discoverable Attributes =======
@@ -173,6 +217,24 @@ public:
         radiation field. If dust emission is turned off, this function returns false. */
     Q_INVOKABLE bool writeISRF() const;
 
+    /** Sets the flag that indicates whether the tables holding the absorbed luminosities should be
+        distributed over the parallel processes (rather than being stored in full by each of them).
+        The default value is false. The flag has no effect when there is only a single process. */
+    Q_INVOKABLE void setDistributedAbsorption(bool value);
+
+    /** Returns the flag that indicates whether the tables holding the absorbed luminosities should
+        be distributed over the parallel processes. */
+    Q_INVOKABLE bool distributedAbsorption() const;
+
+    /** Sets the flag that indicates whether each thread should accumulate its absorbed luminosities
+        in a private cache (rather than adding them directly to the shared tables). The default value
+        is false. */
+    Q_INVOKABLE void setThreadLocalAbsorption(bool value);
+
+    /** Returns the flag that indicates whether each thread should accumulate its absorbed
+        luminosities in a private cache. */
+    Q_INVOKABLE bool threadLocalAbsorption() const;
+
     //======================== Other Functions =======================
 
 public:
@@ -189,13 +251,43 @@ public:
         cell with cell number \f$m\f$, i.e. it adds a fraction \f$\Delta L\f$ to the already
         absorbed luminosity at wavelength index \f$\ell\f$. The function adds the absorbed
         luminosity \f$\Delta L\f$ to the appropriate item in the absorption rate table for stellar
-        or dust emission as indicated by the flag. The addition is performed in a thread-safe
+        or dust emission as indicated by the flag, or to the private cache of the calling thread if
+        the threadLocalAbsorption flag is turned on. The addition is performed in a thread-safe
         manner so this function may be concurrently called from multiple threads. */
     void absorb(int m, int ell, double DeltaL, bool ynstellar);
 
+    /** This function returns true if the absorption tables are distributed, and the buffer for
+        absorptions in foreign cells of at least one thread is filled to the extent that it should
+        be flushed before more photon packages are launched. */
+    bool absorptionflushrequested() const;
+
+    /** If the absorption tables are distributed, this function ships the absorptions buffered for
+        foreign cells (for both stellar and dust emission) to the processes holding these cells, so
+        that the buffers are empty again. All processes must call this function at the same time,
+        and no photon packages may be in flight. The bolometric absorbed luminosities are assembled
+        only by sumResults() at the end of the emission phase. */
+    void flushabsorption();
+
+    /** This function returns true if the tables holding the absorbed luminosities are actually
+        distributed over multiple processes, and false otherwise. */
+    bool distributedtables() const;
+
+    /** This function returns true if this process holds the absorbed luminosities for the dust cell
+        with cell number \f$m\f$. If the absorption tables are not distributed, it always returns
+        true. The functions that return the absorbed luminosity at a particular wavelength, or the
+        mean intensity of the radiation field, may be called only for the cells held by this
+        process. */
+    bool ownscell(int m) const;
+
+    /** This function returns the rank of the process that holds the absorbed luminosities for the
+        dust cell with cell number \f$m\f$. If the absorption tables are not distributed, it
+        returns -1 to indicate that every process holds all cells. */
+    int cellrank(int m) const;
+
     /** This function returns the absorbed luminosity \f$L_{\ell,m}\f$ at wavelength index
         \f$\ell\f$ in the dust cell with cell number \f$m\f$. For a panchromatic dust system, it sums
-        the individual absorption rate counters corresponding to the stellar and dust emission. */
+        the individual absorption rate counters corresponding to the stellar and dust emission. If
+        the absorption tables are distributed, the cell must be held by this process. */
     double Labs(int m, int ell) const;
 
     /** This function resets the absorbed dust luminosity to zero in all cells of the dust system.
@@ -204,7 +296,8 @@ public:
 
     /** This function returns the total (bolometric) absorbed luminosity in the dust cell with cell
         number \f$m\f$. It is calculated by summing the absorbed luminosity at all the wavelength
-        indices. */
+        indices. If the absorption tables are distributed, the function returns the values assembled
+        by the most recent invocation of sumResults(), which are available for all cells. */
     double Labs(int m) const;
 
     /** This function returns the total (bolometric) absorbed dust luminosity in the entire dust
@@ -223,9 +316,13 @@ public:
     /** This function is used to sum the absorbed luminosities in the panchromatic dust system
         across the different processes in the multiprocessing environment. This function must be
         provided with a boolean argument, indicating whether the absorbed stellar luminosities (in
-        _Labsstelvv) or the absorbed thermal luminosities (in _Labsdustvv) must be summed. The
+        _Labsstelvv) or the absorbed thermal luminosities (in _Labsdustvv) must be summed. Any
+        absorptions pending in the private caches of the threads are first added to the table. The
         communication is performed by calling the sum_all() function of the PeerToPeerCommunicator
-        object, which is found with the discovery mechanism. */
+        object, which is found with the discovery mechanism. If the absorption tables are
+        distributed, the buffered absorptions in cells held by other processes are instead shipped
+        to these processes, after which the bolometric absorbed luminosities of all cells are
+        assembled on every process. */
     void sumResults(bool ynstellar);
 
     /** This function returns the luminosity \f$L_\ell\f$ at the wavelength index \f$\ell\f$ in the
@@ -267,6 +364,23 @@ public:
         (weighed by density in the dust cell). */
     void write() const;
 
+private:
+    /** This function ships the buffered absorptions (stellar or dust emission as indicated by the
+        flag) in cells held by other processes to those processes, and adds the absorptions received
+        from other processes to the corresponding rows of the local table. The records are sent in
+        batches of limited size, so that the communication buffers remain small compared to the
+        absorption table; the table indices are shipped as integers, separately from the absorbed
+        luminosities. */
+    void exchangeabsorption(bool ynstellar);
+
+    /** This function returns the private absorption cache (for stellar or dust emission as
+        indicated by the flag) for the calling thread, allocating it if needed. */
+    PDS_Cache* threadcache(bool ynstellar);
+
+    /** This function returns the buffer for absorptions in foreign cells (for stellar or dust
+        emission as indicated by the flag) for the calling thread, allocating it if needed. */
+    PDS_Buffer* threadbuffer(bool ynstellar);
+
     //======================== Data Members ========================
 
 private:
@@ -280,6 +394,8 @@ private:
     bool _writeTemp;
     bool _writeISRF;
     int _cycles;
+    bool _distributedAbsorption;
+    bool _threadLocalAbsorption;
 
     // data members initialized during setup
     int _Nlambda;
@@ -287,6 +403,22 @@ private:
     Table<2> _Labsdustvv;   // absorbed dust emission for each cell and each wavelength (indexed on m,ell)
     bool _haveLabsstel;     // true if absorbed stellar emission is relevant for this simulation
     bool _haveLabsdust;     // true if absorbed dust emission is relevant for this simulation
+
+    // data members initialized during setup if the absorption tables are distributed over the processes;
+    // in that case the tables above hold only the rows for the cells assigned to this process
+    bool _distributed;                  // true if the absorption tables are actually distributed
+    PeerToPeerCommunicator* _comm;
+    ProcessAssigner* _cellassigner;     // assigns the dust cells (rows of the absorption tables) to the processes
+    Array _Labsbolstelv;    // bolometric absorbed stellar emission for all cells (after each sumResults)
+    Array _Labsboldustv;    // bolometric absorbed dust emission for all cells (after each sumResults)
+    std::vector<PDS_Buffer*> _bufferstelv;  // absorbed stellar emission in foreign cells, one buffer per thread
+    std::vector<PDS_Buffer*> _bufferdustv;  // absorbed dust emission in foreign cells, one buffer per thread
+    std::atomic<bool> _flushrequested;      // true if a thread asks to flush the foreign cell buffers
+
+    // data members initialized during setup if the threads accumulate absorptions in private caches
+    ParallelFactory* _parfac;               // identifies the calling thread (also for the foreign cell buffers)
+    std::vector<PDS_Cache*> _cachestelv;    // pending absorbed stellar emission, one cache per thread
+    std::vector<PDS_Cache*> _cachedustv;    // pending absorbed dust emission, one cache per thread
 };
 
 //////////////////////////////////////////////////////////////////////
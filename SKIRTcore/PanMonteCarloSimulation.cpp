@@ -3,8 +3,12 @@
 ////       © Astronomical Observatory, Ghent University         ////
 ///////////////////////////////////////////////////////////////// */
 
+#include <algorithm>
+#include <mutex>
+#include "AliasTable.hpp"
+#include "FatalError.hpp"
 #include "Log.hpp"
-#include "NR.hpp"
+#include "MemoryStatistics.hpp"
 #include "PanDustSystem.hpp"
 #include "PanMonteCarloSimulation.hpp"
 #include "PanWavelengthGrid.hpp"
@@ -12,7 +16,9 @@
 #include "ParallelFactory.hpp"
 #include "PeerToPeerCommunicator.hpp"
 #include "PhotonPackage.hpp"
+#include "ProcessAssigner.hpp"
 #include "Random.hpp"
+#include "RootAssigner.hpp"
 #include "SED.hpp"
 #include "StellarSystem.hpp"
 #include "TimeLogger.hpp"
@@ -22,8 +28,113 @@ using namespace std;
 
 ////////////////////////////////////////////////////////////////////
 
+// An instance of this class holds the luminosity distribution over the dust cells at each wavelength
+// for the chunks of a dust emission phase handled by this process. The distributions for all wavelengths
+// that may be handled by this process are calculated up front by the constructor, in parallel over the
+// wavelengths, so that the chunks never wait for each other. The chunks are handed out grouped per wavelength
+// index, so that consecutive chunks share the same distribution. If the chunks are assigned to the processes
+// in advance, the distribution for a wavelength is released as soon as the last chunk for that wavelength has
+// been handled. If the chunks are distributed dynamically over the processes, the chunks handled by this
+// process are not known in advance; in that case the distributions for all wavelengths are calculated, and
+// they are kept until the end of the phase.
+class PMCS_SourceCache : public ParallelTarget
+{
+public:
+    struct Source
+    {
+        Array Lv;           // the luminosity emitted by each cell
+        AliasTable alias;   // the alias table for drawing cells from the distribution Lv (empty if Ltot is zero)
+        double Ltot;        // the total luminosity emitted at this wavelength
+    };
+
+private:
+    struct Entry
+    {
+        std::mutex mutex;   // guards the release of the source
+        bool built;         // true if the source has been calculated and not yet released
+        quint64 users;      // the number of photon packages for this wavelength that have not yet been launched
+        Source source;
+        Entry() : built(false), users(0) { }
+    };
+
+    PanDustSystem* _pds;
+    const Array& _Labsbolv;
+    int _Ncells;
+    bool _dynamic;              // true if the chunks are distributed dynamically over the processes
+    vector<Entry> _entryv;      // the cached source for each wavelength index
+
+public:
+    // constructor; unless the chunks are distributed dynamically, stores the number of photon packages
+    // for each wavelength assigned to this process (as specified by the caller); then calculates the source
+    // for each wavelength with photon packages in this process (or for all wavelengths), in parallel over
+    // the wavelengths
+    PMCS_SourceCache(PanDustSystem* pds, const Array& Labsbolv, const vector<quint64>& Npackagesv, bool dynamic,
+                     Parallel* parallel)
+        : _pds(pds), _Labsbolv(Labsbolv), _Ncells(Labsbolv.size()), _dynamic(dynamic), _entryv(Npackagesv.size())
+    {
+        int Nlambda = Npackagesv.size();
+        if (!_dynamic) for (int ell=0; ell<Nlambda; ell++) _entryv[ell].users = Npackagesv[ell];
+
+        // a private assigner without communicator assigns all wavelengths to this process
+        RootAssigner localassigner(0);
+        localassigner.assign(Nlambda);
+        parallel->call(this, &localassigner);
+    }
+
+    // calculates the source for the specified wavelength index, if it is needed by this process
+    void body(size_t ell)
+    {
+        Entry& entry = _entryv[ell];
+        if (!_dynamic && !entry.users) return;
+
+        Source& source = entry.source;
+        source.Lv.resize(_Ncells);
+        for (int m=0; m<_Ncells; m++)
+        {
+            double Labsbol = _Labsbolv[m];
+            if (Labsbol>0.0) source.Lv[m] = Labsbol * _pds->dustluminosity(m,ell);
+        }
+        source.Ltot = source.Lv.sum();
+        if (source.Ltot > 0) source.alias.initialize(source.Lv);
+        entry.built = true;
+    }
+
+    // returns the number of wavelengths for which a source has been calculated
+    int Nbuilt() const
+    {
+        int count = 0;
+        for (const Entry& entry : _entryv) if (entry.built) count++;
+        return count;
+    }
+
+    // returns the source for the specified wavelength index
+    const Source& acquire(int ell)
+    {
+        Entry& entry = _entryv[ell];
+        if (!entry.built) throw FATALERROR("No emission source for wavelength index " + QString::number(ell));
+        return entry.source;
+    }
+
+    // indicates that the calling chunk has launched the specified number of photon packages for the specified
+    // wavelength index; when the chunks are assigned in advance, the source is released after the last photon
+    // package for the wavelength has been launched
+    void release(int ell, quint64 Npackages)
+    {
+        if (_dynamic) return;
+        Entry& entry = _entryv[ell];
+        std::unique_lock<std::mutex> lock(entry.mutex);
+        entry.users -= Npackages;
+        if (entry.users) return;
+        entry.source.Lv.resize(0);
+        entry.source.alias = AliasTable();
+        entry.built = false;
+    }
+};
+
+////////////////////////////////////////////////////////////////////
+
 PanMonteCarloSimulation::PanMonteCarloSimulation()
-    : _pds(0)
+    : _pds(0), _sources(0)
 {
 }
 
@@ -103,6 +214,22 @@ void PanMonteCarloSimulation::runSelf()
 
 ////////////////////////////////////////////////////////////////////
 
+bool PanMonteCarloSimulation::pausechunks() const
+{
+    return _pds && _pds->absorptionflushrequested();
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool PanMonteCarloSimulation::resumechunks()
+{
+    if (!_pds || !_pds->distributedtables()) return false;
+    _pds->flushabsorption();
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+
 void PanMonteCarloSimulation::rundustselfabsorption()
 {
     TimeLogger logger(_log, "the dust self-absorption phase");
@@ -141,8 +268,7 @@ void PanMonteCarloSimulation::rundustselfabsorption()
             // Perform dust self-absorption, using the appropriate number of packages for the current stage
             setChunkParams(packages()*stage_factor[stage]);
             initprogress(QString(stage_name[stage]) + " dust self-absorption cycle " + QString::number(cycle));
-            Parallel* parallel = find<ParallelFactory>()->parallel();
-            parallel->call(this, &PanMonteCarloSimulation::dodustselfabsorptionchunk, assigner());
+            rundustchunks(&PanMonteCarloSimulation::dodustselfabsorptionchunk);
 
             // Wait for the other processes to reach this point
             _comm->wait("this self-absorption cycle");
@@ -184,38 +310,32 @@ void PanMonteCarloSimulation::rundustselfabsorption()
 
 ////////////////////////////////////////////////////////////////////
 
-void PanMonteCarloSimulation::dodustselfabsorptionchunk(size_t index)
+void PanMonteCarloSimulation::dodustselfabsorptionchunk(size_t index, quint64 first, quint64 remaining)
 {
-    // Determine the wavelength index for this chunk
+    // Determine the wavelength index, and remember the number of photon packages to be launched
     int ell = index % _Nlambda;
+    quint64 Npackages = remaining;
 
-    // Determine the luminosity to be emitted at this wavelength index
-    Array Lv(_Ncells);
-    for (int m=0; m<_Ncells; m++)
-    {
-        double Labsbol = _Labsbolv[m];
-        if (Labsbol>0.0) Lv[m] = Labsbol * _pds->dustluminosity(m,ell);
-    }
-    double Ltot = Lv.sum();
+    // Get the luminosity to be emitted at this wavelength index, shared with the other chunks for this wavelength
+    const PMCS_SourceCache::Source& source = _sources->acquire(ell);
+    const AliasTable& alias = source.alias;
+    double Ltot = source.Ltot;
 
     // Emit photon packages
     if (Ltot > 0)
     {
-        Array Xv;
-        NR::cdf(Xv, Lv);
-
-        PhotonPackage pp;
+        PhotonPackage& pp = threadpackages()[0];
         double L = Ltot / _Npp;
         double Lthreshold = L / minWeightReduction();
 
-        quint64 remaining = _chunksize;
         while (remaining > 0)
         {
             quint64 count = qMin(remaining, _logchunksize);
+            size_t allocations = MemoryStatistics::threadAllocations();
             for (quint64 i=0; i<count; i++)
             {
-                double X = _random->uniform();
-                int m = NR::locate_clip(Xv,X);
+                _random->setStream(_Nphases, ell, first++);
+                int m = alias.sample(_random->uniform());
                 Position bfr = _pds->randomPositionInCell(m);
                 Direction bfk = _random->direction();
                 pp.launch(L,ell,bfr,bfk);
@@ -230,11 +350,13 @@ void PanMonteCarloSimulation::dodustselfabsorptionchunk(size_t index)
                     simulatescattering(&pp);
                 }
             }
-            logprogress(count);
+            logprogress(count, MemoryStatistics::threadAllocations() - allocations);
             remaining -= count;
         }
     }
-    else logprogress(_chunksize);
+    else logprogress(remaining);
+
+    _sources->release(ell, Npackages);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -257,8 +379,7 @@ void PanMonteCarloSimulation::rundustemission()
     // Perform the actual dust emission, possibly using more photon packages to obtain decent resolution
     setChunkParams(packages()*_pds->emissionBoost());
     initprogress("dust emission");
-    Parallel* parallel = find<ParallelFactory>()->parallel();
-    parallel->call(this, &PanMonteCarloSimulation::dodustemissionchunk, assigner());
+    rundustchunks(&PanMonteCarloSimulation::dodustemissionchunk);
 
     // Wait for the other processes to reach this point
     _comm->wait("the dust emission phase");
@@ -266,19 +387,16 @@ void PanMonteCarloSimulation::rundustemission()
 
 ////////////////////////////////////////////////////////////////////
 
-void PanMonteCarloSimulation::dodustemissionchunk(size_t index)
+void PanMonteCarloSimulation::dodustemissionchunk(size_t index, quint64 first, quint64 remaining)
 {
-    // Determine the wavelength index for this chunk
+    // Determine the wavelength index, and remember the number of photon packages to be launched
     int ell = index % _Nlambda;
+    quint64 Npackages = remaining;
 
-    // Determine the luminosity to be emitted at this wavelength index
-    Array Lv(_Ncells);
-    for (int m=0; m<_Ncells; m++)
-    {
-        double Labsbol = _Labsbolv[m];
-        if (Labsbol>0.0) Lv[m] = Labsbol * _pds->dustluminosity(m,ell);
-    }
-    double Ltot = Lv.sum();  // the total luminosity to be emitted at this wavelength index
+    // Get the luminosity to be emitted at this wavelength index, shared with the other chunks for this wavelength
+    const PMCS_SourceCache::Source& source = _sources->acquire(ell);
+    const Array& Lv = source.Lv;
+    double Ltot = source.Ltot;  // the total luminosity to be emitted at this wavelength index
 
     // Emit photon packages
     if (Ltot > 0)
@@ -289,21 +407,23 @@ void PanMonteCarloSimulation::dodustemissionchunk(size_t index)
         // a uniform distribution in which each cell has a equal probability.
         double xi = _pds->emissionBias();    // the fraction to be selected from a uniform distribution
 
-        // the cumulative distribution of the natural pdf (Lv does not need to be normalized before)
-        Array cumLv;
-        NR::cdf(cumLv, Lv);
+        // the alias table for drawing from the natural pdf
+        const AliasTable& alias = source.alias;
 
-        PhotonPackage pp,ppp;
+        PhotonPackage* packages = threadpackages();
+        PhotonPackage& pp = packages[0];
+        PhotonPackage& ppp = packages[1];
         double Lmean = Ltot/_Ncells;
         double Lem = Ltot / _Npp;
         double Lthreshold = Lem / minWeightReduction();
 
-        quint64 remaining = _chunksize;
         while (remaining > 0)
         {
             quint64 count = qMin(remaining, _logchunksize);
+            size_t allocations = MemoryStatistics::threadAllocations();
             for (quint64 i=0; i<count; i++)
             {
+                _random->setStream(_Nphases, ell, first++);
                 int m;
                 double X = _random->uniform();
                 if (X<xi)
@@ -314,7 +434,7 @@ void PanMonteCarloSimulation::dodustemissionchunk(size_t index)
                 else
                 {
                     // rescale the deviate from [xi,1[ to [0,1[
-                    m = NR::locate_clip(cumLv,(X-xi)/(1-xi));
+                    m = alias.sample((X-xi)/(1-xi));
                 }
                 double weight = 1.0/(1-xi+xi*Lmean/Lv[m]);
                 Position bfr = _pds->randomPositionInCell(m);
@@ -334,11 +454,40 @@ void PanMonteCarloSimulation::dodustemissionchunk(size_t index)
                     simulatescattering(&pp);
                 }
             }
-            logprogress(count);
+            logprogress(count, MemoryStatistics::threadAllocations() - allocations);
             remaining -= count;
         }
     }
-    else logprogress(_chunksize);
+    else logprogress(remaining);
+
+    _sources->release(ell, Npackages);
+}
+
+////////////////////////////////////////////////////////////////////
+
+void PanMonteCarloSimulation::rundustchunks(void (PanMonteCarloSimulation::*chunk)(size_t,quint64,quint64))
+{
+    // Count the photon packages for each wavelength in the chunks assigned to this process
+    vector<quint64> Npackagesv(_Nlambda);
+    size_t Nchunks = assigner()->nvalues();
+    for (size_t i=0; i<Nchunks; i++)
+    {
+        size_t index = assigner()->absoluteIndex(i);
+        quint64 first, count;
+        chunkpackages(index, first, count);
+        Npackagesv[index % _Nlambda] += count;
+    }
+
+    // Prepare the emission sources, to be shared by the chunks for each wavelength
+    PMCS_SourceCache sources(_pds, _Labsbolv, Npackagesv, dynamicchunks(), _parfac->parallel());
+    _sources = &sources;
+    double megabytes = 20. * sources.Nbuilt() * _Ncells / 1e6;
+    _log->info("Calculated the emission sources for " + QString::number(sources.Nbuilt()) + " wavelengths"
+               + " (using about " + QString::number(megabytes,'f',1) + " MB)");
+
+    // Handle the chunks, grouped per wavelength
+    runchunks([this,chunk](size_t index, quint64 first, quint64 count){ (this->*chunk)(index, first, count); }, true);
+    _sources = 0;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -10,6 +10,7 @@
 #include "MonteCarloSimulation.hpp"
 class PanDustSystem;
 class PanWavelengthGrid;
+class PMCS_SourceCache;
 
 //////////////////////////////////////////////////////////////////////
 
@@ -73,6 +74,20 @@ protected:
         (plus writing the results). */
     void runSelf();
 
+    /** This function returns true if the dust system asks to ship the absorptions buffered for dust
+        cells held by other processes before more photon packages are launched (see
+        PanDustSystem::absorptionflushrequested()), so that runchunks() pauses the current photon
+        shooting phase. */
+    bool pausechunks() const;
+
+    /** If the absorption tables of the dust system are distributed over the processes, this
+        function ships the absorptions buffered for dust cells held by other processes to these
+        processes (see PanDustSystem::flushabsorption()) and returns true, so that runchunks()
+        resumes the photon shooting phase until no process has any chunks left. Otherwise the
+        function returns false, and runchunks() performs a single round without additional
+        communication. */
+    bool resumechunks();
+
 private:
     /** This function drives the dust self-absorption phase in a panchromatic Monte Carlo
         simulation. This function consists of a big loop, which represents the different cycles of
@@ -90,20 +105,22 @@ private:
         \f$m\f$'th dust cell, \f$L^{\text{abs}}_m\f$, and the normalized SED at wavelength index
         \f$\ell\f$ corresponding to that cell, as obtained from the dust emission library. Once we
         know the luminosity \f$L_{\ell,m}\f$ emitted by each dust cell, we calculate the total dust
-        luminosity, \f[ L_\ell = \sum_{m=0}^{N_{\text{cells}}-1} L_{\ell,m}, \f] and create a
-        vector \f$X_m\f$ that describes the normalized cumulative luminosity distribution as a
-        function of the cell number \f$m\f$, \f[ X_m = \frac{ \sum_{m'=0}^m L_{\ell,m'} }{ L_\ell
-        }. \f] This vector is used to generate random dust cells from which photon packages can be
+        luminosity, \f[ L_\ell = \sum_{m=0}^{N_{\text{cells}}-1} L_{\ell,m}, \f] and construct
+        an alias table (see the AliasTable class) for the normalized luminosity distribution
+        \f$L_{\ell,m}/L_\ell\f$ as a function of the cell number \f$m\f$. This table is used to
+        generate random dust cells, in constant time per draw, from which photon packages can be
         launched. Now the actual dust self-absorption can start, i.e. we launch \f$N_{\text{pp}}\f$
         different photon packages at wavelength index \f$\ell\f$, with the original position chosen
-        as a random position in the cell \f$m\f$ chosen randomly from the cumulative luminosity
-        distribution \f$X_m\f$. The remaining life cycle of a photon package in the dust emission
+        as a random position in the cell \f$m\f$ chosen randomly from the luminosity
+        distribution. The remaining life cycle of a photon package in the dust emission
         phase is very similar to the life cycle described in
         MonteCarloSimulation::runstellaremission(). */
     void rundustselfabsorption();
 
-    /** This function implements the loop body for rundustselfabsorption(). */
-    void dodustselfabsorptionchunk(size_t index);
+    /** This function implements the loop body for rundustselfabsorption(), launching \em count photon
+        packages starting at the photon package with index \em first within the chunk with the
+        specified absolute index. */
+    void dodustselfabsorptionchunk(size_t index, quint64 first, quint64 count);
 
     /** This function drives the dust emission phase in a panchromatic Monte Carlo simulation. The
         first task is to construct the dust emission library that describes the spectral properties
@@ -117,19 +134,35 @@ private:
         wavelength index \f$\ell\f$ corresponding to that cell, as obtained from the dust emission
         library. Once we know the luminosity \f$L_{\ell,m}\f$ emitted by each dust cell, we
         calculate the total dust luminosity, \f[ L_\ell = \sum_{m=0}^{N_{\text{cells}}-1}
-        L_{\ell,m}, \f] and create a vector \f$X_m\f$ that describes the normalized cumulative
-        luminosity distribution as a function of the cell number \f$m\f$, \f[ X_m = \frac{
-        \sum_{m'=0}^m L_{\ell,m'} }{ L_\ell }. \f] This vector is used to generate random dust
-        cells from which photon packages can be launched. Now the actual dust emission can start,
-        i.e. we launch \f$N_{\text{pp}}\f$ different photon packages at wavelength index
-        \f$\ell\f$, with the original position chosen as a random position in the cell \f$m\f$
-        chosen randomly from the cumulative luminosity distribution \f$X_m\f$. The remaining life
-        cycle of a photon package in the dust emission phase is very similar to the life cycle
-        described in MonteCarloSimulation::runstellaremission(). */
+        L_{\ell,m}, \f] and construct an alias table (see the AliasTable class) for the normalized
+        luminosity distribution \f$L_{\ell,m}/L_\ell\f$ as a function of the cell number \f$m\f$.
+        This table is used to generate random dust cells, in constant time per draw, from which
+        photon packages can be launched. Now the actual dust emission can start, i.e. we launch
+        \f$N_{\text{pp}}\f$ different photon packages at wavelength index \f$\ell\f$, with the
+        original position chosen as a random position in the cell \f$m\f$ chosen randomly from the
+        luminosity distribution. The remaining life cycle of a photon package in the dust emission
+        phase is very similar to the life cycle described in
+        MonteCarloSimulation::runstellaremission(). */
     void rundustemission();
 
-    /** This function implements the loop body for rundustemission(). */
-    void dodustemissionchunk(size_t index);
+    /** This function implements the loop body for rundustemission(), launching \em count photon
+        packages starting at the photon package with index \em first within the chunk with the
+        specified absolute index. */
+    void dodustemissionchunk(size_t index, quint64 first, quint64 count);
+
+    /** This function performs the parallel loop over the chunks of a dust emission phase (for
+        either dust self-absorption or the final dust emission), invoking the specified loop body
+        for each chunk. The chunks are handed out by MonteCarloSimulation::runchunks(), grouped per
+        wavelength index. The luminosity \f$L_{\ell,m}\f$ emitted by each cell at a given
+        wavelength index and the corresponding alias table are calculated only once, before the
+        loop starts and in parallel over the wavelength indices handled by this process, and they
+        are shared by all chunks for that wavelength index. This requires memory for all of these
+        wavelength indices at the same time (about 20 bytes per cell and per wavelength). If the
+        chunks are assigned to the processes in advance, the memory for a wavelength index is
+        released as soon as all of its photon packages have been launched. If the chunks are distributed
+        dynamically, the distributions are calculated for all wavelength indices and kept until the
+        end of the loop. */
+    void rundustchunks(void (PanMonteCarloSimulation::*chunk)(size_t,quint64,quint64));
 
     //======================== Data Members ========================
 
@@ -139,6 +172,7 @@ private:
     // data members used to communicate between rundustXXX() and the corresponding parallel loop
     int _Ncells;           // number of dust cells
     Array _Labsbolv;       // vector that contains the bolometric absorbed luminosity in each cell
+    PMCS_SourceCache* _sources;  // the emission sources shared by the chunks for each wavelength
 };
 
 ////////////////////////////////////////////////////////////////////
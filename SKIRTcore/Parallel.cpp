@@ -3,6 +3,7 @@
 ////       © Astronomical Observatory, Ghent University         ////
 ///////////////////////////////////////////////////////////////// */
 
+#include <chrono>
 #include "FatalError.hpp"
 #include "Parallel.hpp"
 #include "ParallelFactory.hpp"
@@ -31,6 +32,8 @@ Parallel::Parallel(int threadCount, ParallelFactory* factory)
         _exception = nullptr;
         _terminate = false;
         _next = 0;
+        _elapsed = 0;
+        _busy.assign(threadCount, 0.);
 
         // Create the extra parallel threads with one-based index (parent thread has index zero)
         for (int index = 1; index < threadCount; index++)
@@ -73,12 +76,29 @@ int Parallel::threadCount() const
 
 ////////////////////////////////////////////////////////////////////
 
+double Parallel::elapsedTime() const
+{
+    return _elapsed;
+}
+
+////////////////////////////////////////////////////////////////////
+
+double Parallel::busyTime(int threadIndex) const
+{
+    return _busy[threadIndex];
+}
+
+////////////////////////////////////////////////////////////////////
+
 void Parallel::call(ParallelTarget* target, ProcessAssigner* assigner)
 {
     // Verify that we're being called from our parent thread
     if (std::this_thread::get_id() != _parentThread)
         throw FATALERROR("Parallel call not invoked from thread that constructed this object");
 
+    // Start measuring the elapsed time
+    auto start = std::chrono::steady_clock::now();
+
     // Initialize shared data members and activate threads in a critical section
     {
         std::unique_lock<std::mutex> lock(_mutex);
@@ -94,18 +114,20 @@ void Parallel::call(ParallelTarget* target, ProcessAssigner* assigner)
         // Clear the exception pointer
         _exception = 0;
 
-        // Initialize the loop variable
+        // Initialize the loop variable and the thread statistics
         _next = 0;
+        _busy.assign(_threadCount, 0.);
 
         // Wake all parallel threads, if multithreading is allowed
         if (assigner->parallel()) _conditionExtra.notify_all();
     }
 
     // Do some work ourselves as well
-    doWork();
+    doWork(0);
 
     // Wait until all parallel threads are done
     if (assigner->parallel()) waitForThreads();
+    _elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
     // Check for and process the exception, if any
     if (_exception)
@@ -144,14 +166,15 @@ void Parallel::run(int threadIndex)
         }
 
         // Do work as long as some is available
-        doWork();
+        doWork(threadIndex);
     }
 }
 
 ////////////////////////////////////////////////////////////////////
 
-void Parallel::doWork()
+void Parallel::doWork(int threadIndex)
 {
+    auto start = std::chrono::steady_clock::now();
     try
     {
         // Do work as long as some is available
@@ -174,6 +197,7 @@ void Parallel::doWork()
         // Create a fresh exception
         reportException(new FATALERROR("Unhandled exception (not of type FatalError) in a parallel thread"));
     }
+    _busy[threadIndex] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
 ////////////////////////////////////////////////////////////////////
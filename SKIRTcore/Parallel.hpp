@@ -97,12 +97,23 @@ public:
         parallel threads in an unpredicable manner. */
     template<class T> void call(T* targetObject, void (T::*targetMember)(size_t index), ProcessAssigner* assigner);
 
+    /** Returns the wall-clock time, in seconds, taken by the most recent invocation of the call()
+        function. */
+    double elapsedTime() const;
+
+    /** Returns the time, in seconds, during which the thread with the specified index (with zero
+        indicating the parent thread) was executing loop bodies during the most recent invocation
+        of the call() function. For the remainder of the elapsed time (see elapsedTime()), the
+        thread was idle, e.g. waiting for the other threads to complete their last loop body. */
+    double busyTime(int threadIndex) const;
+
 private:
     /** The function that gets executed inside each of the parallel threads. */
     void run(int threadIndex);
 
-    /** The function to do the actual work; used by call() and run(). */
-    void doWork();
+    /** The function to do the actual work; used by call() and run(). The argument specifies the
+        index of the calling thread, so that its busy time can be recorded. */
+    void doWork(int threadIndex);
 
     /** A function to report an exception; used by doWork(). */
     void reportException(FatalError* exception);
@@ -165,6 +176,10 @@ private:
 
     // data member shared by all threads; incrementing is atomic (no need for protection)
     std::atomic<size_t> _next;   // the current index of the for loop being implemented
+
+    // statistics for the most recent call; each thread writes only its own busy time (no need for protection)
+    double _elapsed;            // the wall-clock time taken by the call, in seconds
+    std::vector<double> _busy;  // the time spent by each thread in executing loop bodies, in seconds
 };
 
 ////////////////////////////////////////////////////////////////////
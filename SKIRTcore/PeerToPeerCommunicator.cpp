@@ -3,7 +3,9 @@
 ////       © Astronomical Observatory, Ghent University         ////
 ///////////////////////////////////////////////////////////////// */
 
+#include <algorithm>
 #include "Array.hpp"
+#include "FatalError.hpp"
 #include "Log.hpp"
 #include "PeerToPeerCommunicator.hpp"
 #include "ProcessManager.hpp"
@@ -12,6 +14,108 @@
 
 #define ROOT 0
 
+using namespace std;
+
+////////////////////////////////////////////////////////////////////
+
+namespace
+{
+    // the maximum number of values exchanged between all processes in a single collective operation
+    const size_t MAXVALUES = 1 << 24;
+
+    // exchanges the rows indicated by rowv (each containing Ncols values) between all processes,
+    // where ranks specifies the process holding each row (or -1 for rows that should not be exchanged)
+    template<typename T> void gatherRows(const vector<T*>& rowv, size_t Ncols, const vector<int>& ranks,
+                                         int Nprocs, int myrank)
+    {
+        // determine the list of rows held by each process
+        vector< vector<size_t> > indicesv(Nprocs);
+        size_t Nrows = rowv.size();
+        for (size_t i=0; i<Nrows; i++) if (ranks[i] >= 0) indicesv[ranks[i]].push_back(i);
+
+        // determine the number of rows per process in each exchange and the resulting number of exchanges
+        size_t Nmax = max(static_cast<size_t>(1), MAXVALUES/(Ncols*Nprocs));
+        size_t Nexchanges = 0;
+        for (int p=0; p<Nprocs; p++) Nexchanges = max(Nexchanges, (indicesv[p].size()+Nmax-1)/Nmax);
+
+        vector<int> countv(Nprocs);
+        vector<int> displv(Nprocs);
+        vector<T> sendv;
+        vector<T> recvv;
+        for (size_t x=0; x<Nexchanges; x++)
+        {
+            // determine the number of values sent by each process, and their offsets in the receive buffer
+            size_t first = x*Nmax;
+            int total = 0;
+            for (int p=0; p<Nprocs; p++)
+            {
+                size_t Nsend = indicesv[p].size()>first ? min(Nmax, indicesv[p].size()-first) : 0;
+                countv[p] = Nsend*Ncols;
+                displv[p] = total;
+                total += countv[p];
+            }
+
+            // pack the rows held by this process
+            sendv.resize(countv[myrank]);
+            for (int k=0; k<countv[myrank]/static_cast<int>(Ncols); k++)
+            {
+                const T* row = rowv[indicesv[myrank][first+k]];
+                copy(row, row+Ncols, sendv.begin()+k*Ncols);
+            }
+
+            // exchange the rows between all processes
+            recvv.resize(total);
+            ProcessManager::gather_all(sendv.data(), countv[myrank], recvv.data(), &countv[0], &displv[0]);
+
+            // unpack the rows held by the other processes
+            for (int p=0; p<Nprocs; p++)
+            {
+                if (p == myrank) continue;
+                for (int k=0; k<countv[p]/static_cast<int>(Ncols); k++)
+                {
+                    typename vector<T>::const_iterator begin = recvv.begin() + displv[p] + k*Ncols;
+                    copy(begin, begin+Ncols, rowv[indicesv[p][first+k]]);
+                }
+            }
+        }
+    }
+
+    // sends the values in sendvv[p] to each process p, and concatenates the values received from all processes
+    // in order of increasing sender rank
+    template<typename T> void exchangeValues(const vector< vector<T> >& sendvv, vector<T>& recvv, int Nprocs)
+    {
+        // pack the values to be sent into a single buffer
+        vector<int> sendcountv(Nprocs);
+        vector<int> senddisplv(Nprocs);
+        int sendtotal = 0;
+        for (int p=0; p<Nprocs; p++)
+        {
+            sendcountv[p] = sendvv[p].size();
+            senddisplv[p] = sendtotal;
+            sendtotal += sendcountv[p];
+        }
+        vector<T> sendv;
+        sendv.reserve(sendtotal);
+        for (int p=0; p<Nprocs; p++) sendv.insert(sendv.end(), sendvv[p].begin(), sendvv[p].end());
+
+        // inform each process of the number of values it will receive
+        vector<int> recvcountv(Nprocs);
+        vector<int> recvdisplv(Nprocs);
+        ProcessManager::exchange(&sendcountv[0], &recvcountv[0]);
+        int recvtotal = 0;
+        for (int p=0; p<Nprocs; p++)
+        {
+            recvdisplv[p] = recvtotal;
+            recvtotal += recvcountv[p];
+        }
+
+        // exchange the values
+        recvv.resize(recvtotal);
+        ProcessManager::exchange(sendv.data(), &sendcountv[0], &senddisplv[0],
+                                 recvv.data(), &recvcountv[0], &recvdisplv[0]);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////
 
 void PeerToPeerCommunicator::sum(Array& arr)
@@ -53,6 +157,95 @@ void PeerToPeerCommunicator::broadcast(int& value, int sender)
 
 ////////////////////////////////////////////////////////////////////
 
+void PeerToPeerCommunicator::gather_all(ArrayTable<2>& table, const std::vector<int>& ranks)
+{
+    if (!isMultiProc()) return;
+
+    size_t Nrows = table.size(0);
+    size_t Ncols = table.rowsize();
+    if (!Nrows || !Ncols) return;
+
+    vector<double*> rowv(Nrows);
+    for (size_t i=0; i<Nrows; i++) rowv[i] = &table[i][0];
+    gatherRows(rowv, Ncols, ranks, size(), rank());
+}
+
+////////////////////////////////////////////////////////////////////
+
+void PeerToPeerCommunicator::gather_all(std::vector<int>& values, const std::vector<int>& ranks)
+{
+    if (!isMultiProc()) return;
+
+    size_t Nvalues = values.size();
+    vector<int*> rowv(Nvalues);
+    for (size_t i=0; i<Nvalues; i++) rowv[i] = &values[i];
+    gatherRows(rowv, 1, ranks, size(), rank());
+}
+
+////////////////////////////////////////////////////////////////////
+
+void PeerToPeerCommunicator::exchange(const std::vector< std::vector<double> >& sendvv, std::vector<double>& recvv)
+{
+    if (!isMultiProc())
+    {
+        recvv = sendvv[0];
+        return;
+    }
+
+    exchangeValues(sendvv, recvv, size());
+}
+
+////////////////////////////////////////////////////////////////////
+
+void PeerToPeerCommunicator::exchange(const std::vector< std::vector<qint64> >& sendvv, std::vector<qint64>& recvv)
+{
+    if (!isMultiProc())
+    {
+        recvv = sendvv[0];
+        return;
+    }
+
+    exchangeValues(sendvv, recvv, size());
+}
+
+////////////////////////////////////////////////////////////////////
+
+bool PeerToPeerCommunicator::threads_serialized()
+{
+    return ProcessManager::isThreadSerialized();
+}
+
+////////////////////////////////////////////////////////////////////
+
+void PeerToPeerCommunicator::create_counter()
+{
+    if (!isMultiProc()) return;
+    if (!threads_serialized())
+        throw FATALERROR("The MPI library does not allow the threads to access the shared counter");
+
+    ProcessManager::createCounter();
+}
+
+////////////////////////////////////////////////////////////////////
+
+qint64 PeerToPeerCommunicator::fetch_add_counter(qint64 increment)
+{
+    if (!isMultiProc()) throw FATALERROR("The shared counter is available only with multiple processes");
+
+    return ProcessManager::fetchAddCounter(increment);
+}
+
+////////////////////////////////////////////////////////////////////
+
+void PeerToPeerCommunicator::free_counter()
+{
+    if (!isMultiProc()) return;
+
+    ProcessManager::freeCounter();
+}
+
+////////////////////////////////////////////////////////////////////
+
 int PeerToPeerCommunicator::root()
 {
     return ROOT;
@@ -6,6 +6,7 @@
 #ifndef PEERTOPEERCOMMUNICATOR_HPP
 #define PEERTOPEERCOMMUNICATOR_HPP
 
+#include <vector>
 #include "ArrayTable.hpp"
 #include "ProcessCommunicator.hpp"
 class Array;
@@ -50,6 +51,58 @@ public:
         second argument. */
     void broadcast(int& value, int sender);
 
+    /** This function is used for assembling the rows of a table on all processes in this
+        communicator, when each row has been calculated by a single process. The second argument
+        specifies, for each row of the table, the rank of the process that holds the values of that
+        row, or -1 if the row should be left untouched. Rather than broadcasting each row
+        separately, the rows held by each process are packed into a buffer and exchanged between
+        all processes in a single collective operation. For very large tables, the exchange is split
+        into a number of such operations, each handling a limited amount of data, so that the number
+        of collective operations depends on the data volume rather than on the number of rows. */
+    void gather_all(ArrayTable<2>& table, const std::vector<int>& ranks);
+
+    /** This function is used for assembling a list of integer values on all processes in this
+        communicator, when each value has been determined by a single process. The second argument
+        specifies, for each value, the rank of the process that holds it, or -1 if the value should
+        be left untouched. The values are exchanged in the same way as the rows of a table by the
+        other version of this function. */
+    void gather_all(std::vector<int>& values, const std::vector<int>& ranks);
+
+    /** This function is used for sending a list of double values from each process to each other
+        process in this communicator. The first argument contains, for each process rank, the list
+        of values to be sent to that process. On return, the second argument contains the values
+        received from all processes, concatenated in order of increasing sender rank. The values in
+        the list destined for this process itself are simply copied. */
+    void exchange(const std::vector< std::vector<double> >& sendvv, std::vector<double>& recvv);
+
+    /** This function is used for sending a list of 64-bit integer values from each process to each
+        other process in this communicator, in the same way as the version of this function that
+        sends double values. */
+    void exchange(const std::vector< std::vector<qint64> >& sendvv, std::vector<qint64>& recvv);
+
+    /** This function returns true if the threads of a process in this communicator may perform
+        communication operations, as long as these operations are serialized (as is the case for
+        the shared counter), and false if the MPI library does not provide this level of thread
+        support. */
+    bool threads_serialized();
+
+    /** This function creates a counter shared by all processes in this communicator, with an
+        initial value of zero. The counter can be incremented by any process without the
+        participation of the other processes, which allows the processes to pull parts of the work
+        from a common pool as they become available (see the DynamicAssigner class). There can be
+        only one such counter at any time. All processes must call this function. If the MPI
+        library does not allow serialized communication from multiple threads, a FatalError is
+        thrown. */
+    void create_counter();
+
+    /** This function atomically adds the specified increment to the shared counter, and returns the
+        value of the counter before the addition. Calls from multiple threads in the same process
+        must be serialized by the caller. */
+    qint64 fetch_add_counter(qint64 increment);
+
+    /** This function releases the shared counter. All processes must call this function. */
+    void free_counter();
+
     /** This function returns the rank of the root process. */
     int root();
 
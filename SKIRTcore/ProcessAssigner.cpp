@@ -43,3 +43,10 @@ size_t ProcessAssigner::nvalues()
 }
 
 ////////////////////////////////////////////////////////////////////
+
+bool ProcessAssigner::dynamic() const
+{
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
@@ -89,6 +89,15 @@ public:
         Except for the IdenticalAssigner class, each subclass always returns true. */
     virtual bool parallel() const = 0;
 
+    /** This function returns \c true if the parts of work are not assigned to the processes in
+        advance, but rather are pulled from a common pool by each process as it becomes available
+        during the calculation. In that case, all parts of work are reported as being assigned to
+        the calling process, and the client must use the shared counter provided by the
+        PeerToPeerCommunicator to determine which parts are actually performed by the process. The
+        default implementation in this base class returns \c false. Only the DynamicAssigner class
+        returns \c true. */
+    virtual bool dynamic() const;
+
     //======================== Data Members ========================
 
 protected:
@@ -3,6 +3,7 @@
 ////       © Astronomical Observatory, Ghent University         ////
 ///////////////////////////////////////////////////////////////// */
 
+#include <atomic>
 #include <cmath>
 #include "Box.hpp"
 #include "FatalError.hpp"
@@ -15,10 +16,52 @@
 
 using namespace std;
 
+namespace
+{
+    // the multipliers and the key increments of the Philox4x32 bijection
+    const quint32 M0 = 0xD2511F53;
+    const quint32 M1 = 0xCD9E8D57;
+    const quint32 W0 = 0x9E3779B9;
+    const quint32 W1 = 0xBB67AE85;
+
+    // the source for unique generation numbers
+    std::atomic<quint64> generations(0);
+
+    // returns a new unique generation number, which is always nonzero
+    quint64 newGeneration()
+    {
+        return ++generations;
+    }
+
+    // increments a Philox counter; the first word counts the blocks within a stream, carrying into the last two words
+    inline void increment(quint32* counter)
+    {
+        if (!++counter[0] && !++counter[2]) ++counter[3];
+    }
+
+    // returns a uniform deviate in the open interval (0,1) constructed from two consecutive 32-bit values;
+    // the 52 most significant bits are shifted by half a step to exclude both 0 and 1
+    // (with 52 bits, the shifted value and the result are exactly representable)
+    inline double deviate(quint32 hi, quint32 lo)
+    {
+        quint64 bits = (static_cast<quint64>(hi) << 32) | lo;
+        return ((bits >> 12) + 0.5) * (1.0/4503599627370496.0);
+    }
+
+    // the number of consecutive counter values processed at the same time when generating a block of deviates
+    const int GROUP = 32;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+thread_local quint64 Random::_tgeneration = 0;
+thread_local int Random::_tthread = 0;
+thread_local Random::Stream* Random::_tstream = 0;
+
 //////////////////////////////////////////////////////////////////////
 
 Random::Random()
-    : _seed(4357), _parfac(0)
+    : _seed(4357), _generation(0), _parfac(0)
 {
 }
 
@@ -29,30 +72,28 @@ void Random::setupSelfBefore()
     SimulationItem::setupSelfBefore();
 
     _parfac = find<ParallelFactory>();
-    int Nthreads = _parfac->maxThreadCount();
-    _mtv.resize(Nthreads);
-    _mtiv.resize(Nthreads);
-
-    initialize(Nthreads);
+    initialize(_parfac->maxThreadCount(), 0);
 }
 
 //////////////////////////////////////////////////////////////////////
 
-void Random::initialize(int Nthreads)
+void Random::initialize(int Nthreads, int rank)
 {
-    unsigned long seed = _seed;
+    // the number of threads can be different during and after the setup of the simulation
+    _basev.resize(Nthreads);
+    _photonv.resize(Nthreads);
+
     for (int thread=0; thread<Nthreads; thread++)
     {
+        quint32 stream = Nthreads*rank + thread;
         find<Log>()->info("Initializing random number generator for thread number "
-                          + QString::number(thread) + " with seed " + QString::number(seed) + "... ");
-        vector<unsigned long>& mt = _mtv[thread];
-        int& mti = _mtiv[thread];
-        mt.resize(624);
-        mt[0] = seed & 0xffffffff;
-        for (mti=1; mti<624; mti++)
-            mt[mti] = (69069 * mt[mti-1]) & 0xffffffff;
-        ++seed;
+                          + QString::number(thread) + " with seed " + QString::number(_seed)
+                          + " and stream " + QString::number(stream) + "... ");
+        initStream(_basev[thread], _seed, 0, 0, stream, 0, 0);
     }
+
+    // invalidate the thread-local caches, which may point into the old vectors
+    _generation = newGeneration();
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -74,14 +115,93 @@ int Random::seed() const
 void Random::randomize()
 {
     PeerToPeerCommunicator* comm = find<PeerToPeerCommunicator>();
+    initialize(_parfac->maxThreadCount(), comm->rank());
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void Random::reinitialize()
+{
+    initialize(_parfac->maxThreadCount(), 0);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void Random::setStream(int phase, int ell, quint64 index)
+{
+    if (_tgeneration != _generation) threadStream();
+    Stream& stream = _photonv[_tthread];
+    initStream(stream, _seed, phase, 0, ell, index & 0xffffffff, index >> 32);
+    _tstream = &stream;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void Random::setConstructionStream(int level, quint64 index)
+{
+    if (_tgeneration != _generation) threadStream();
+    Stream& stream = _photonv[_tthread];
+    initStream(stream, _seed, 0xffffffff, 0, level, index & 0xffffffff, index >> 32);
+    _tstream = &stream;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void Random::resetStreams()
+{
+    _generation = newGeneration();
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void Random::initStream(Stream& stream, quint32 key0, quint32 key1,
+                        quint32 counter0, quint32 counter1, quint32 counter2, quint32 counter3)
+{
+    stream.key[0] = key0;
+    stream.key[1] = key1;
+    stream.counter[0] = counter0;
+    stream.counter[1] = counter1;
+    stream.counter[2] = counter2;
+    stream.counter[3] = counter3;
+    stream.next = 4;
+}
 
-    int Nthreads = _parfac->maxThreadCount();
-    _mtv.resize(Nthreads);      // Because the number of threads can be different during and after the setup
-    _mtiv.resize(Nthreads);     // of the simulation.
+//////////////////////////////////////////////////////////////////////
+
+void Random::generate(Stream& stream)
+{
+    quint32 c0 = stream.counter[0], c1 = stream.counter[1], c2 = stream.counter[2], c3 = stream.counter[3];
+    quint32 k0 = stream.key[0], k1 = stream.key[1];
+    for (int round=0; round<10; round++)
+    {
+        quint64 p0 = static_cast<quint64>(M0) * c0;
+        quint64 p1 = static_cast<quint64>(M1) * c2;
+        quint32 hi0 = p0 >> 32, lo0 = p0;
+        quint32 hi1 = p1 >> 32, lo1 = p1;
+        c0 = hi1 ^ c1 ^ k0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ k1;
+        c3 = lo0;
+        k0 += W0;
+        k1 += W1;
+    }
+    stream.buffer[0] = c0;
+    stream.buffer[1] = c1;
+    stream.buffer[2] = c2;
+    stream.buffer[3] = c3;
+    stream.next = 0;
+    increment(stream.counter);
+}
 
-    _seed = _seed + Nthreads * comm->rank();
+//////////////////////////////////////////////////////////////////////
 
-    initialize(Nthreads);
+Random::Stream* Random::threadStream()
+{
+    _tthread = _parfac->currentThreadIndex();
+    if (_tthread >= static_cast<int>(_basev.size())) throw FATALERROR("Thread index exceeds the number of random streams");
+    _tstream = &_basev[_tthread];
+    _tgeneration = _generation;
+    return _tstream;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -89,40 +209,73 @@ void Random::randomize()
 double
 Random::uniform()
 {
-    int thread = _parfac->currentThreadIndex();
-    vector<unsigned long>& mt = _mtv[thread];
-    int& mti = _mtiv[thread];
-    double ans = 0.0;
-    do
+    Stream* stream = _tgeneration == _generation ? _tstream : threadStream();
+    if (stream->next == 4) generate(*stream);
+    double x = deviate(stream->buffer[stream->next], stream->buffer[stream->next+1]);
+    stream->next += 2;
+    return x;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void
+Random::uniform(double* xv, size_t n)
+{
+    Stream* stream = _tgeneration == _generation ? _tstream : threadStream();
+    size_t i = 0;
+
+    // use the deviate remaining in the buffer, if any
+    while (i<n && stream->next < 4)
+    {
+        xv[i++] = deviate(stream->buffer[stream->next], stream->buffer[stream->next+1]);
+        stream->next += 2;
+    }
+
+    // apply the bijection to a group of consecutive counter values at the same time, with the loops over the group
+    // innermost so that they can be vectorized; the deviates are stored in the same order as for generate()
+    while (n-i >= 2*GROUP)
     {
-        unsigned long y;
-        static unsigned long mag01[2]={0x0,0x9908b0df};
-        if (mti >= 624)
+        quint32 c0[GROUP], c1[GROUP], c2[GROUP], c3[GROUP];
+        for (int g=0; g<GROUP; g++)
         {
-            int kk;
-            for (kk=0;kk<227;kk++)
-            {
-                y = (mt[kk]&0x80000000)|(mt[kk+1]&0x7fffffff);
-                mt[kk] = mt[kk+397] ^ (y >> 1) ^ mag01[y & 0x1];
-            }
-            for (;kk<624-1;kk++)
+            c0[g] = stream->counter[0];
+            c1[g] = stream->counter[1];
+            c2[g] = stream->counter[2];
+            c3[g] = stream->counter[3];
+            increment(stream->counter);
+        }
+        quint32 k0 = stream->key[0], k1 = stream->key[1];
+        for (int round=0; round<10; round++)
+        {
+            for (int g=0; g<GROUP; g++)
             {
-                y = (mt[kk]&0x80000000)|(mt[kk+1]&0x7fffffff);
-                mt[kk] = mt[kk-227] ^ (y >> 1) ^ mag01[y & 0x1];
+                quint64 p0 = static_cast<quint64>(M0) * c0[g];
+                quint64 p1 = static_cast<quint64>(M1) * c2[g];
+                quint32 hi0 = p0 >> 32, lo0 = p0;
+                quint32 hi1 = p1 >> 32, lo1 = p1;
+                c0[g] = hi1 ^ c1[g] ^ k0;
+                c1[g] = lo1;
+                c2[g] = hi0 ^ c3[g] ^ k1;
+                c3[g] = lo0;
             }
-            y = (mt[623]&0x80000000)|(mt[0]&0x7fffffff);
-            mt[623] = mt[396] ^ (y >> 1) ^ mag01[y & 0x1];
-            mti = 0;
+            k0 += W0;
+            k1 += W1;
         }
-        y = mt[mti++];
-        y ^= (y>>11);
-        y ^= (y<<7) & 0x9d2c5680;
-        y ^= (y<<15) & 0xefc60000;
-        y ^= (y>>18);
-        ans = static_cast<double>(y) / static_cast<unsigned long>(0xffffffff);
+        for (int g=0; g<GROUP; g++)
+        {
+            xv[i+2*g] = deviate(c0[g], c1[g]);
+            xv[i+2*g+1] = deviate(c2[g], c3[g]);
+        }
+        i += 2*GROUP;
+    }
+
+    // generate the remaining deviates one by one, leaving any unused value in the buffer
+    while (i<n)
+    {
+        if (stream->next == 4) generate(*stream);
+        xv[i++] = deviate(stream->buffer[stream->next], stream->buffer[stream->next+1]);
+        stream->next += 2;
     }
-    while (ans<=0.0 || ans>=1.0);
-    return ans;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -234,3 +387,13 @@ Position Random::position(const Box& box)
 }
 
 //////////////////////////////////////////////////////////////////////
+
+void Random::positions(const Box& box, vector<Position>& rv)
+{
+    size_t n = rv.size();
+    vector<double> xv(3*n);
+    if (n) uniform(&xv[0], 3*n);
+    for (size_t k=0; k<n; k++) rv[k] = Position(box.fracpos(xv[3*k], xv[3*k+1], xv[3*k+2]));
+}
+
+//////////////////////////////////////////////////////////////////////
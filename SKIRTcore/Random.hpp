@@ -18,9 +18,25 @@ class Position;
 
 /** This class contains a random number generator, and can be used to produce series of random
     numbers for different probability distributions. Typically, only a single instance of the class
-    should be constructed for each simulation. This random number class is adapted from a C library
-    known as genrand(), written by Takuji Nishimura. More information can be found at
-    http://www.math.keio.ac.jp/matumoto/emt.html. */
+    should be constructed for each simulation.
+
+    The class uses the counter-based generator Philox4x32-10 described by Salmon et al. (2011, "Parallel
+    random numbers: as easy as 1, 2, 3", Proceedings of SC11). The generator is a bijection that
+    scrambles a 128-bit counter under the control of a 64-bit key into four 32-bit random values.
+    Consecutive values of the counter thus yield a random sequence, and different keys or different
+    counter ranges yield independent sequences, called streams. Because a stream is fully
+    determined by its key and its starting counter, there is no need to store or advance a
+    generator state for each stream.
+
+    Each parallel execution thread draws its random numbers from its own stream, so that no data
+    locking is needed. By default, each thread uses a stream that is determined by the seed and by
+    the index of the thread (and, after calling randomize(), by the rank of the process). During
+    the photon shooting phases, the simulation instead calls setStream() at the start of the life
+    cycle of each photon package, so that the random numbers used by a photon package depend only
+    on the seed, the phase, the wavelength index and the index of the photon package within its
+    wavelength. As a result, the life cycle of each photon package does not depend on the number
+    of threads or processes, nor on the order in which the chunks are handed out to them. Similarly,
+    setConstructionStream() provides a stream for each item in a hierarchical construction. */
 class Random : public SimulationItem
 {
     Q_OBJECT
@@ -44,13 +60,13 @@ protected:
 
 private:
     /** This function serves as the body of two different functions: the setupSelfBefore() function and
-        the randomize() function. Based on the seed stored in the \c _seed attribute, this function
-        generates random sequences for each different thread in the simulation. This is done by
-        incrementing the seed with each increment of the thread number. During setup, the \c _seed
-        variable is equal on each process, providing them with the same random sequences. When this
-        function is called from randomize(), each process has given a different seed, yielding
-        different random sequences for every thread in the multiprocessing environment. */
-    void initialize(int Nthreads);
+        the randomize() function. It initializes the default stream for each thread in the
+        simulation, using the stream numbers \f$N_\text{threads}\times r + t\f$, where \f$t\f$ is
+        the thread index and \f$r\f$ is the specified process rank. During setup, the rank is zero
+        for each process, providing them with the same random sequences. When this function is
+        called from randomize(), each process uses its own rank, yielding different random
+        sequences for every thread in the multiprocessing environment. */
+    void initialize(int Nthreads, int rank);
 
     //======== Setters & Getters for Discoverable Attributes =======
 
@@ -65,19 +81,58 @@ public:
     //======================== Other Functions =======================
 
 public:
-    /** This function is used to give each thread in the multiprocessing environment a different random
-        seed and regenerating their random sequences. This function uses the find algorithm to obtain a
-        pointer to the PeerToPeerCommunicator object. Next, the \c _seed variable is shifted by exactly
-        the number of threads for each successive process. At least, the initialize() function is
-        called with the number of threads as an argument.
-        \image html randomize.png "The randomize function makes sure that each process ‘reserves’ a unique set of random seeds for its own threads." */
+    /** This function is used to give each thread in the multiprocessing environment a different
+        default stream. This function uses the find algorithm to obtain a pointer to the
+        PeerToPeerCommunicator object. Next, the initialize() function is called with the number of
+        threads and the rank of the process as arguments, so that the stream numbers are shifted
+        by exactly the number of threads for each successive process. The seed itself is not
+        changed, so that the streams selected by setStream() remain the same for all processes.
+        \image html randomize.png "The randomize function makes sure that each process ‘reserves’ a unique set of random streams for its own threads." */
     void randomize();
 
+    /** This function reinitializes the default stream for each thread to the state established
+        during setup, using the same stream numbers as setupSelfBefore(). It is intended for a
+        simulation that is run once more after its setup has been reused (see
+        MonteCarloSimulation::prepareRerun()), so that the random numbers drawn from the default
+        streams do not depend on the previous run. */
+    void reinitialize();
+
+    /** This function switches the calling thread to the stream reserved for the photon package
+        with index \em index (within its wavelength) and wavelength index \em ell in the photon
+        shooting phase with index \em phase, which must be positive. The stream is positioned at
+        its start, so that the subsequent random numbers drawn by this thread depend only on the
+        seed and on the specified arguments. The thread keeps using this stream until the next
+        call to setStream() or resetStreams(). */
+    void setStream(int phase, int ell, quint64 index);
+
+    /** This function switches the calling thread to the stream reserved for the item with index
+        \em index at level \em level of a hierarchical construction, such as the subdivision of the
+        nodes of a tree dust grid. These streams use a key that is never used for the streams of the
+        photon shooting phases, so that the construction does not depend on the number of threads
+        or processes, nor on the order in which the items are evaluated. As for setStream(), the
+        thread keeps using this stream until the next call to setStream(), setConstructionStream()
+        or resetStreams(). */
+    void setConstructionStream(int level, quint64 index);
+
+    /** This function switches all threads back to their default stream, continuing the sequence
+        where it was left off. It must be called from the parent thread while no other threads are
+        drawing random numbers, e.g. at the end of a photon shooting phase. */
+    void resetStreams();
+
     /** This function generates a random uniform deviate, i.e. a random double precision number in
-        the interval [0,1]. For details how this is exactly done, see the information at
-        http://www.math.keio.ac.jp/matumoto/emt.html. */
+        the open interval (0,1). The deviate is constructed from the 52 most significant bits of
+        two consecutive 32-bit values in the stream of the calling thread. The stream is located
+        through a thread-local cache, so that the thread index needs to be looked up in the
+        ParallelFactory only for the first deviate drawn by a thread after a change of streams. */
     double uniform();
 
+    /** This function fills the array \em xv with \em n random uniform deviates, producing the same
+        values as \em n consecutive calls of uniform(). Apart from the deviate that may remain in
+        the buffer of the stream, the Philox bijection is applied to a group of consecutive
+        counter values at the same time, in loops that the compiler can vectorize. This is faster
+        than separate calls of uniform() when a large number of deviates is needed at once. */
+    void uniform(double* xv, size_t n);
+
     /** This function generates a random number drawn from an arbitrary probability distribution
         \f$p(x)\,{\text{d}}x\f$ with corresponding cumulative distribution function \f$P(x)\f$.
         The routine reads in a discretized version \f$P_i\f$ of the cdf sampled at a set of
@@ -127,19 +182,60 @@ public:
         cuboid lined up with the coordinate axes). */
     Position position(const Box& box);
 
+    /** This function replaces each element of the vector \em rv by a uniformly distributed random
+        position in the given box, producing the same positions as consecutive calls of
+        position() with the same box. The uniform deviates are generated as a block (see the
+        uniform() function with array argument). */
+    void positions(const Box& box, std::vector<Position>& rv);
+
+private:
+    /** A Stream holds the key and the next counter value of a Philox stream, and a buffer with the
+        four 32-bit values produced for the previous counter value, of which the values with index
+        \em next and higher have not yet been used. */
+    struct Stream
+    {
+        quint32 key[2];
+        quint32 counter[4];
+        quint32 buffer[4];
+        int next;
+    };
+
+    /** This function initializes the specified stream with the specified key and counter, and
+        marks its buffer as exhausted. */
+    static void initStream(Stream& stream, quint32 key0, quint32 key1,
+                           quint32 counter0, quint32 counter1, quint32 counter2, quint32 counter3);
+
+    /** This function fills the buffer of the specified stream by applying the Philox4x32-10
+        bijection to the stream's counter, and increments the counter. */
+    static void generate(Stream& stream);
+
+    /** This function locates the thread index of the calling thread, stores it in the
+        thread-local cache together with a pointer to its default stream, and returns that
+        pointer. */
+    Stream* threadStream();
+
     //======================== Data Members ========================
 
 private:
-    // the state of the random generators; one for each concurrent thread in the simulation
-    // (maintaining a separate generator per thread avoids time-consuming data locking)
-    std::vector< std::vector<unsigned long> > _mtv;
-    std::vector<int> _mtiv;
+    // the streams for each concurrent thread in the simulation; the default streams and the photon package streams
+    // (maintaining separate streams per thread avoids time-consuming data locking)
+    std::vector<Stream> _basev;
+    std::vector<Stream> _photonv;
 
-    // the seed used to initialize the random generators (the value is incremented between generators)
+    // the seed used as the first word of the key for all streams
     int _seed;
 
+    // a number that is unique among all Random instances and all invocations of initialize() and resetStreams();
+    // the thread-local cache is valid only if it was filled for the same value
+    quint64 _generation;
+
     // a cached pointer to the ParallelFactory instance associated with this simulation hierarchy
     ParallelFactory* _parfac;
+
+    // the thread-local cache: the generation for which it was filled, the thread index and the current stream
+    static thread_local quint64 _tgeneration;
+    static thread_local int _tthread;
+    static thread_local Stream* _tstream;
 };
 
 //////////////////////////////////////////////////////////////////////
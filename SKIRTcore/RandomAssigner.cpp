@@ -54,12 +54,13 @@ void RandomAssigner::assign(size_t size, size_t blocks)
     }
 
     // Communication of the randomly determined ranks
+    std::vector<int> senders(size);
+    for (size_t j = 0; j < size; j++) senders[j] = helpassigner->rankForIndex(j);
+    _comm->gather_all(_assignment, senders);
+
+    // If the process assigned to a value is this process, add the value to the list
     for (size_t j = 0; j < size; j++)
     {
-        int sender = helpassigner->rankForIndex(j);
-        _comm->broadcast(_assignment[j], sender);
-
-        // If the process assigned to this value is this process, add the value to the list
         if (_assignment[j] == _comm->rank())
         {
             _values.push_back(j);
@@ -41,6 +41,7 @@ HEADERS += \
     AdaptiveMesh.hpp \
     AdaptiveMeshAmrvacFile.hpp \
     AdaptiveMeshAsciiFile.hpp \
+    AdaptiveMeshBinaryFile.hpp \
     AdaptiveMeshDustDistribution.hpp \
     AdaptiveMeshDustGrid.hpp \
     AdaptiveMeshFile.hpp \
@@ -65,9 +66,11 @@ HEADERS += \
     BruzualCharlotSED.hpp \
     BruzualCharlotSEDFamily.hpp \
     ClumpyGeometryDecorator.hpp \
+    ColumnBinaryFile.hpp \
     CombineGeometryDecorator.hpp \
     CompDustDistribution.hpp \
     ConfigurableDustMix.hpp \
+    ConfigurationHash.hpp \
     ConicalShellGeometry.hpp \
     Console.hpp \
     CropGeometryDecorator.hpp \
@@ -85,6 +88,7 @@ HEADERS += \
     DraineLiDustMix.hpp \
     DraineNeutralPAHGrainComposition.hpp \
     DraineSilicateGrainComposition.hpp \
+    DustCacheFile.hpp \
     DustComp.hpp \
     DustCompNormalization.hpp \
     DustDistribution.hpp \
@@ -94,6 +98,7 @@ HEADERS += \
     DustGridDensityInterface.hpp \
     DustGridPath.hpp \
     DustGridPlotFile.hpp \
+    DustGridStructureCacheInterface.hpp \
     DustLib.hpp \
     DustMassDustCompNormalization.hpp \
     DustMassInBoxInterface.hpp \
@@ -103,6 +108,7 @@ HEADERS += \
     DustSystem.hpp \
     DustSystemDensityCalculator.hpp \
     DustSystemDepthCalculator.hpp \
+    DynamicAssigner.hpp \
     EdgeOnDustCompNormalization.hpp \
     EinastoGeometry.hpp \
     ElectronDustMix.hpp \
@@ -150,6 +156,7 @@ HEADERS += \
     KuruczSED.hpp \
     LaserGeometry.hpp \
     LinMesh.hpp \
+    LinearTree.hpp \
     Log.hpp \
     LogNormalGrainSizeDistribution.hpp \
     LogWavelengthGrid.hpp \
@@ -217,7 +224,7 @@ HEADERS += \
     SIUnits.hpp \
     SPHDustDistribution.hpp \
     SPHGasParticle.hpp \
-    SPHGasParticleGrid.hpp \
+    SPHGasParticleTree.hpp \
     SPHGeometry.hpp \
     SPHStellarComp.hpp \
     SepAxGeometry.hpp \
@@ -288,6 +295,7 @@ HEADERS += \
     VoronoiGeometry.hpp \
     VoronoiMesh.hpp \
     VoronoiMeshAsciiFile.hpp \
+    VoronoiMeshBinaryFile.hpp \
     VoronoiMeshFile.hpp \
     VoronoiMeshInterface.hpp \
     VoronoiStellarComp.hpp \
@@ -315,6 +323,7 @@ SOURCES += \
     AdaptiveMesh.cpp \
     AdaptiveMeshAmrvacFile.cpp \
     AdaptiveMeshAsciiFile.cpp \
+    AdaptiveMeshBinaryFile.cpp \
     AdaptiveMeshDustDistribution.cpp \
     AdaptiveMeshDustGrid.cpp \
     AdaptiveMeshFile.cpp \
@@ -337,9 +346,11 @@ SOURCES += \
     BruzualCharlotSEDFamily.cpp \
     CartesianDustGrid.cpp \
     ClumpyGeometryDecorator.cpp \
+    ColumnBinaryFile.cpp \
     CombineGeometryDecorator.cpp \
     CompDustDistribution.cpp \
     ConfigurableDustMix.cpp \
+    ConfigurationHash.cpp \
     ConicalShellGeometry.cpp \
     Console.cpp \
     CropGeometryDecorator.cpp \
@@ -357,6 +368,7 @@ SOURCES += \
     DraineLiDustMix.cpp \
     DraineNeutralPAHGrainComposition.cpp \
     DraineSilicateGrainComposition.cpp \
+    DustCacheFile.cpp \
     DustComp.cpp \
     DustCompNormalization.cpp \
     DustDistribution.cpp \
@@ -372,6 +384,7 @@ SOURCES += \
     DustSystem.cpp \
     DustSystemDensityCalculator.cpp \
     DustSystemDepthCalculator.cpp \
+    DynamicAssigner.cpp \
     EdgeOnDustCompNormalization.cpp \
     EinastoGeometry.cpp \
     ElectronDustMix.cpp \
@@ -417,6 +430,7 @@ SOURCES += \
     KuruczSED.cpp \
     LaserGeometry.cpp \
     LinMesh.cpp \
+    LinearTree.cpp \
     Log.cpp \
     LogNormalGrainSizeDistribution.cpp \
     LogWavelengthGrid.cpp \
@@ -484,7 +498,7 @@ SOURCES += \
     SIUnits.cpp \
     SPHDustDistribution.cpp \
     SPHGasParticle.cpp \
-    SPHGasParticleGrid.cpp \
+    SPHGasParticleTree.cpp \
     SPHGeometry.cpp \
     SPHStellarComp.cpp \
     SepAxGeometry.cpp \
@@ -554,6 +568,7 @@ SOURCES += \
     VoronoiGeometry.cpp \
     VoronoiMesh.cpp \
     VoronoiMeshAsciiFile.cpp \
+    VoronoiMeshBinaryFile.cpp \
     VoronoiMeshFile.cpp \
     VoronoiStellarComp.cpp \
     WavelengthGrid.cpp \
@@ -575,3 +590,19 @@ SOURCES += \
     TrustPolarizedMeanDustMix.cpp \
     ThemisDustMix.cpp \
     SimpleOligoDustMix.cpp
+
+#--------------------------------------------------
+# source files with specific compiler flags
+#--------------------------------------------------
+
+# compile the SPH kernel evaluation with extra floating point flags, so that the batched kernel loops,
+# which contain a square root and conditional expressions, can be vectorized; the flags apply only to
+# this source file, which never inspects errno after calling math functions or enables floating point traps
+SOURCES -= SPHDustDistribution.cpp
+SPHKERNEL_SOURCES = SPHDustDistribution.cpp
+sphkernel.input = SPHKERNEL_SOURCES
+sphkernel.output = ${QMAKE_FILE_BASE}$${first(QMAKE_EXT_OBJ)}
+sphkernel.commands = $(CXX) -c $(CXXFLAGS) -fno-math-errno -fno-trapping-math $(INCPATH) ${QMAKE_FILE_IN} -o ${QMAKE_FILE_OUT}
+sphkernel.dependency_type = TYPE_C
+sphkernel.variable_out = OBJECTS
+QMAKE_EXTRA_COMPILERS += sphkernel
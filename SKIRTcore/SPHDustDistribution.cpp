@@ -4,14 +4,16 @@
 ///////////////////////////////////////////////////////////////// */
 
 #include <cmath>
+#include "ColumnBinaryFile.hpp"
 #include "DustMix.hpp"
 #include "FatalError.hpp"
 #include "FilePaths.hpp"
 #include "Log.hpp"
 #include "NR.hpp"
+#include "ParallelFactory.hpp"
 #include "Random.hpp"
 #include "SPHDustDistribution.hpp"
-#include "SPHGasParticleGrid.hpp"
+#include "SPHGasParticleTree.hpp"
 #include "TextInFile.hpp"
 #include "Units.hpp"
 
@@ -19,9 +21,30 @@ using namespace std;
 
 //////////////////////////////////////////////////////////////////////
 
+namespace
+{
+    // returns the metal density of a particle with central metal density rho0 at a position with squared
+    // normalized distance u2 from the particle center, using the same spline kernel and the same sequence of
+    // operations as SPHGasParticle::metalDensity(); the expression has no branches so that loops can be vectorized
+    inline double kernel(double u2, double rho0)
+    {
+        double u = sqrt(u2);
+        double u1m = 1.0-u;
+        double inner = rho0*(1.0-6.0*u2*u1m);
+        double outer = 2.0*rho0*u1m*u1m*u1m;
+        return u2 < 1.0 ? (u < 0.5 ? inner : outer) : 0.0;
+    }
+
+    // the maximum number of particles per position in the leaves overlapping the bounding box of a batch of
+    // positions for which the batch evaluation is used; for larger numbers, the positions are handled one by one
+    const int MAXBATCHPARTICLES = 16;
+}
+
+//////////////////////////////////////////////////////////////////////
+
 
 SPHDustDistribution::SPHDustDistribution()
-    : _fdust(0), _Tmax(0), _mix(0), _grid(0), _negativeMasses(false)
+    : _fdust(0), _Tmax(0), _mix(0), _tree(0), _negativeMasses(false)
 {
 }
 
@@ -29,7 +52,7 @@ SPHDustDistribution::SPHDustDistribution()
 
 SPHDustDistribution::~SPHDustDistribution()
 {
-    delete _grid;
+    delete _tree;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -50,8 +73,7 @@ void SPHDustDistribution::setupSelfBefore()
     int Nignored = 0;
     double Mtot = 0;
     double Mmetal = 0;
-    double x, y, z, h, M, Z, T;
-    while (infile.readRow(1, x, y, z, h, M, Z, T))
+    auto addParticle = [&] (double x, double y, double z, double h, double M, double Z, double T)
     {
         // ignore particle if the temperature is higher than the maximum (assuming both T and Tmax are valid)
         if (T > 0 && _Tmax > 0 && T > _Tmax)
@@ -61,28 +83,64 @@ void SPHDustDistribution::setupSelfBefore()
         else
         {
             // add a particle
-            _pv.push_back(SPHGasParticle(Vec(x, y,z)*pc, h*pc, M*Msun, Z));
+            _pv.push_back(SPHGasParticle(Vec(x,y,z)*pc, h*pc, M*Msun, Z));
             Mtot += M;
             Mmetal += M * Z;
 
             // remember whether there are any negative masses
             if (M<0) _negativeMasses = true;
         }
+    };
+
+    // for a column binary file, take the values directly from the columns in the memory mapping
+    const ColumnBinaryFile* binary = infile.binaryFile();
+    if (binary)
+    {
+        if (binary->numColumns() < 6) throw FATALERROR("One or more required column(s) in binary file are missing");
+        const double* xv = binary->column(0);
+        const double* yv = binary->column(1);
+        const double* zv = binary->column(2);
+        const double* hv = binary->column(3);
+        const double* Mv = binary->column(4);
+        const double* Zv = binary->column(5);
+        const double* Tv = binary->numColumns() > 6 ? binary->column(6) : 0;
+        size_t Nrows = binary->numRows();
+        _pv.reserve(Nrows);
+        for (size_t i=0; i<Nrows; i++) addParticle(xv[i], yv[i], zv[i], hv[i], Mv[i], Zv[i], Tv ? Tv[i] : 0.);
+    }
+
+    // for a column text file, parse the values row by row
+    else
+    {
+        double x, y, z, h, M, Z, T;
+        while (infile.readRow(1, x, y, z, h, M, Z, T)) addParticle(x, y, z, h, M, Z, T);
     }
     find<Log>()->info("  Number of high-temperature particles ignored: " + QString::number(Nignored));
     find<Log>()->info("  Number of SPH gas particles containing dust: " + QString::number(_pv.size()));
     find<Log>()->info("  Total gas mass: " + QString::number(Mtot) + " Msun");
     find<Log>()->info("  Total metal mass: " + QString::number(Mmetal) + " Msun");
 
-    // construct a 3D-grid over the particle space, and create a list of particles that overlap each grid cell
-    const int GRIDSIZE = 20;
-    QString size = QString::number(GRIDSIZE);
-    find<Log>()->info("Constructing intermediate " + size + "x" + size + "x" + size + " grid for particles...");
-    _grid = new SPHGasParticleGrid(_pv, GRIDSIZE);
-    find<Log>()->info("  Smallest number of particles per cell: " + QString::number(_grid->minParticlesPerCell()));
-    find<Log>()->info("  Largest  number of particles per cell: " + QString::number(_grid->maxParticlesPerCell()));
-    find<Log>()->info("  Average  number of particles per cell: "
-                      + QString::number(_grid->totalParticles() / double(GRIDSIZE*GRIDSIZE*GRIDSIZE),'f',1));
+    // construct a bounding volume hierarchy over the particles, adapted to their spatial distribution
+    find<Log>()->info("Constructing search tree for particles...");
+    _tree = new SPHGasParticleTree(_pv, find<ParallelFactory>());
+    find<Log>()->info("  Number of nodes: " + QString::number(_tree->numNodes()));
+    find<Log>()->info("  Number of leaves: " + QString::number(_tree->numLeaves()));
+    find<Log>()->info("  Number of levels: " + QString::number(_tree->numLevels()));
+
+    // copy the properties used for calculating the density into separate vectors in the leaf order of the tree
+    int Np = _pv.size();
+    _xv.resize(Np); _yv.resize(Np); _zv.resize(Np);
+    _normv.resize(Np);
+    _rho0v.resize(Np);
+    for (int i=0; i<Np; i++)
+    {
+        const SPHGasParticle& particle = _pv[_tree->particleIndex(i)];
+        Vec rc = particle.center();
+        double h = particle.radius();
+        _xv[i] = rc.x(); _yv[i] = rc.y(); _zv[i] = rc.z();
+        _normv[i] = 1/(h*h);
+        _rho0v[i] = particle.centralMetalDensity();
+    }
 
     // construct a vector with the normalized cumulative particle densities
     NR::cdf(_cumrhov, _pv.size(), [this](int i){return _pv[i].metalMass();} );
@@ -180,18 +238,87 @@ double SPHDustDistribution::density(int h, Position bfr) const
 
 double SPHDustDistribution::density(Position bfr) const
 {
-    const vector<const SPHGasParticle*>& particles = _grid->particlesFor(bfr);
-
+    double x = bfr.x(), y = bfr.y(), z = bfr.z();
     double sum = 0.0;
-    int n = particles.size();
-    for (int i=0; i<n; i++)
-        sum += particles[i]->metalDensity(bfr);  // sum contains the total density in metals
+    _tree->forEachLeaf(Box(bfr,bfr), [this,x,y,z,&sum](int first, int count)
+    {
+        int last = first + count;
+        for (int i=first; i<last; i++)
+        {
+            double dx = x-_xv[i], dy = y-_yv[i], dz = z-_zv[i];
+            sum += kernel(_normv[i]*(dx*dx+dy*dy+dz*dz), _rho0v[i]);  // sum contains the total density in metals
+        }
+    });
     sum *= _fdust;    // sum now contains the total density in metals locked up in dust grains
     return max(sum,0.);  // guard against negative dust masses
 }
 
 //////////////////////////////////////////////////////////////////////
 
+void SPHDustDistribution::densities(int h, const vector<Position>& bfrv, Array& rhov) const
+{
+    if (h!=0) throw FATALERROR("Wrong value for h (" + QString::number(h) + ")");
+    densities(bfrv, rhov);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void SPHDustDistribution::densities(const vector<Position>& bfrv, Array& rhov) const
+{
+    int n = bfrv.size();
+    rhov.resize(n);
+    if (!n) return;
+
+    // copy the coordinates of the positions into separate vectors, and determine their bounding box
+    vector<double> xv(n), yv(n), zv(n);
+    double xmin = bfrv[0].x(), ymin = bfrv[0].y(), zmin = bfrv[0].z();
+    double xmax = xmin, ymax = ymin, zmax = zmin;
+    for (int j=0; j<n; j++)
+    {
+        xv[j] = bfrv[j].x(); yv[j] = bfrv[j].y(); zv[j] = bfrv[j].z();
+        xmin = min(xmin, xv[j]); ymin = min(ymin, yv[j]); zmin = min(zmin, zv[j]);
+        xmax = max(xmax, xv[j]); ymax = max(ymax, yv[j]); zmax = max(zmax, zv[j]);
+    }
+
+    // the batch evaluates the kernel of each particle in the leaves overlapping the bounding box for all positions,
+    // which pays off only if these leaves hold few particles compared to the number of positions; otherwise
+    // (e.g. for the samples in a dust cell that is large compared to the smoothing lengths), handle each position
+    // separately, so that only the leaves overlapping that position are visited
+    Box box(xmin,ymin,zmin,xmax,ymax,zmax);
+    if (_tree->countLeafParticles(box, MAXBATCHPARTICLES*n) > MAXBATCHPARTICLES*n)
+    {
+        for (int j=0; j<n; j++) rhov[j] = density(bfrv[j]);
+        return;
+    }
+
+    // accumulate the contributions of the particles in the leaves overlapping the bounding box, in the same
+    // order as density(); particles that don't overlap a position contribute exactly zero to its density
+    double* rho = begin(rhov);
+    const double* x = &xv[0];
+    const double* y = &yv[0];
+    const double* z = &zv[0];
+    _tree->forEachLeaf(box, [this,n,rho,x,y,z](int first, int count)
+    {
+        int last = first + count;
+        for (int i=first; i<last; i++)
+        {
+            double xc = _xv[i], yc = _yv[i], zc = _zv[i];
+            double norm = _normv[i];
+            double rho0 = _rho0v[i];
+            for (int j=0; j<n; j++)
+            {
+                double dx = x[j]-xc, dy = y[j]-yc, dz = z[j]-zc;
+                rho[j] += kernel(norm*(dx*dx+dy*dy+dz*dz), rho0);
+            }
+        }
+    });
+
+    // convert to the density in metals locked up in dust grains, guarding against negative dust masses
+    for (int j=0; j<n; j++) rho[j] = max(rho[j]*_fdust, 0.);
+}
+
+//////////////////////////////////////////////////////////////////////
+
 Position SPHDustDistribution::generatePosition() const
 {
     Random* random = find<Random>();
@@ -214,12 +341,11 @@ double SPHDustDistribution::massInBox(int h, const Box& box) const
 
 double SPHDustDistribution::massInBox(const Box& box) const
 {
-    const vector<const SPHGasParticle*>& particles = _grid->particlesFor(box);
-
     double sum = 0.0;
-    int n = particles.size();
-    for (int i=0; i<n; i++)
-        sum += particles[i]->metalMassInBox(box);  // total mass in metals
+    _tree->forEachParticle(box, [&sum,&box](const SPHGasParticle& particle)
+    {
+        sum += particle.metalMassInBox(box);  // total mass in metals
+    });
     sum *= _fdust;    // total mass in metals locked up in dust grains
     return max(sum,0.);  // guard against negative dust masses
 }
@@ -250,8 +376,8 @@ double SPHDustDistribution::SigmaX() const
 {
     const int NSAMPLES = 10000;
     double sum = 0;
-    double xmin = _grid->xmin();
-    double xmax = _grid->xmax();
+    double xmin = _tree->xmin();
+    double xmax = _tree->xmax();
     for (int k = 0; k < NSAMPLES; k++)
     {
         sum += density(Position(xmin + k*(xmax-xmin)/NSAMPLES, 0, 0));
@@ -265,8 +391,8 @@ double SPHDustDistribution::SigmaY() const
 {
     const int NSAMPLES = 10000;
     double sum = 0;
-    double ymin = _grid->ymin();
-    double ymax = _grid->ymax();
+    double ymin = _tree->ymin();
+    double ymax = _tree->ymax();
     for (int k = 0; k < NSAMPLES; k++)
     {
         sum += density(Position(0, ymin + k*(ymax-ymin)/NSAMPLES, 0));
@@ -280,8 +406,8 @@ double SPHDustDistribution::SigmaZ() const
 {
     const int NSAMPLES = 10000;
     double sum = 0;
-    double zmin = _grid->zmin();
-    double zmax = _grid->zmax();
+    double zmin = _tree->zmin();
+    double zmax = _tree->zmax();
     for (int k = 0; k < NSAMPLES; k++)
     {
         sum += density(Position(0, 0, zmin + k*(zmax-zmin)/NSAMPLES));
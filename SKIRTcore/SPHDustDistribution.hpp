@@ -12,7 +12,7 @@
 #include "DustMassInBoxInterface.hpp"
 #include "DustParticleInterface.hpp"
 #include "SPHGasParticle.hpp"
-class SPHGasParticleGrid;
+class SPHGasParticleTree;
 
 ////////////////////////////////////////////////////////////////////
 
@@ -70,7 +70,10 @@ public:
         particle (in \f$M_\odot\f$), and the sixth column is the metallicity \f$Z\f$ of the gas
         (dimensionless fraction). The optional seventh column is the temperature of the gas (in K).
         If this value is provided and it is higher than the maximum temperature the particle is
-        ignored. If the temperature value is missing, the particle is never ignored. */
+        ignored. If the temperature value is missing, the particle is never ignored.
+
+        Alternatively, the file may hold the same columns in the column binary format described
+        for the ColumnBinaryFile class, which is detected automatically and loads much faster. */
     Q_INVOKABLE void setFilename(QString value);
 
     /** Returns the name of the file containing the information on the SPH gas particles. */
@@ -129,6 +132,23 @@ public:
         with \f$u=r/h\f$. */
     double density(Position bfr) const;
 
+    /** This function calculates the mass density of the \f$h\f$'th component of the dust
+        distribution at each of the positions in the specified list. If \f$h\f$ is not equal to
+        zero, a FatalError error is thrown. In the other case, the call is passed to the total
+        density version of this function. */
+    void densities(int h, const std::vector<Position>& bfrv, Array& rhov) const;
+
+    /** This function calculates the total mass density of the dust distribution at each of the
+        positions in the specified list, with the same result as calling density(Position) for
+        each position. If the leaves of the search tree overlapping the bounding box of all
+        positions hold no more than 16 particles per position, as is the case for the random
+        sample positions in a small dust cell, the tree is traversed only once for the bounding
+        box. For each particle in these leaves, the smoothing kernel is then evaluated for all
+        positions in a single loop without branches, which the compiler can vectorize. Otherwise,
+        for example for the sample positions in a cell that is large compared to the smoothing
+        lengths, the densities are calculated for each position separately. */
+    void densities(const std::vector<Position>& bfrv, Array& rhov) const;
+
     /** This function generates a random position from the dust distribution. It randomly chooses a
         particle using the normalized cumulative density distribution constructed during the setup
         phase. Then a position is determined randomly from the smoothed distribution around the
@@ -224,7 +244,12 @@ private:
 
     // the SPH particles
     std::vector<SPHGasParticle> _pv;  // the particles in the order read from the file
-    const SPHGasParticleGrid* _grid;  // a list of particles overlapping each grid cell
+    const SPHGasParticleTree* _tree;  // a search tree over the particles
+
+    // the particle properties used for calculating the density, in the leaf order of the search tree
+    std::vector<double> _xv, _yv, _zv;  // the coordinates of the particle center
+    std::vector<double> _normv;         // the squared distance normalization factor 1/h^2
+    std::vector<double> _rho0v;         // the central metal density
     Array _cumrhov;         // cumulative density distribution for particles in pv
     bool _negativeMasses;   // true if at least one of the imported particles has a negative mass
 };
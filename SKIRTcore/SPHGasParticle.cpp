@@ -91,6 +91,13 @@ double SPHGasParticle::metalMass() const
 
 ////////////////////////////////////////////////////////////////////
 
+double SPHGasParticle::centralMetalDensity() const
+{
+    return _rho0;
+}
+
+////////////////////////////////////////////////////////////////////
+
 double SPHGasParticle::metalMassInBox(const Box& box) const
 {
     // ensure that the sampled version of the erf function is properly initialized
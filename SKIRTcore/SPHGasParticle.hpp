@@ -35,6 +35,10 @@ public:
     /** This function returns the total metal mass of the particle. */
     double metalMass() const;
 
+    /** This function returns the metal density at the center of the particle, i.e. the front
+        factor of the smoothing kernel used by the metalDensity() function. */
+    double centralMetalDensity() const;
+
     /** This function returns the metal mass of the particle inside a given box (i.e. a cuboid
         lined up with the coordinate axes). */
     double metalMassInBox(const Box& box) const;
@@ -0,0 +1,183 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#include <algorithm>
+#include <limits>
+#include "Parallel.hpp"
+#include "ParallelFactory.hpp"
+#include "RootAssigner.hpp"
+#include "SPHGasParticleTree.hpp"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////
+
+SPHGasParticleTree::SPHGasParticleTree(const vector<SPHGasParticle>& pv, ParallelFactory* factory)
+    : _pv(&pv), _Nleaves(0), _Nlevels(0), _levelbegin(0)
+{
+    int n = pv.size();
+    if (n == 0) return;
+
+    // copy the particle spheres in the original order, and initialize the leaf order to the original order
+    _spherev.resize(n);
+    _indexv.resize(n);
+    for (int i=0; i<n; i++)
+    {
+        Vec rc = pv[i].center();
+        Sphere& s = _spherev[i];
+        s.x = rc.x(); s.y = rc.y(); s.z = rc.z(); s.h = pv[i].radius();
+        _indexv[i] = i;
+    }
+
+    // create the root node containing all particles
+    Node root = { 0, 0, 0, 0, 0, 0, 0, 0, n };
+    _nodev.push_back(root);
+
+    // construct the tree level by level; the nodes on each level are processed in parallel, and each of them
+    // only accesses its own range of particles, so the result does not depend on the number of threads
+    Parallel* parallel = factory->parallel();
+    RootAssigner assigner(0);
+    size_t begin = 0;
+    size_t end = 1;
+    while (begin < end)
+    {
+        _Nlevels++;
+        _levelbegin = begin;
+        assigner.assign(end-begin);
+        parallel->call(this, &SPHGasParticleTree::splitnode, &assigner);
+
+        // create the children for the nodes marked for subdivision, in order of node index
+        for (size_t l=begin; l<end; l++)
+        {
+            if (_nodev[l].child < 0)
+            {
+                int first = _nodev[l].first;
+                int count = _nodev[l].count;
+                int half = count/2;
+                _nodev[l].child = _nodev.size();
+                _nodev[l].count = 0;
+                Node left = { 0, 0, 0, 0, 0, 0, 0, first, half };
+                Node right = { 0, 0, 0, 0, 0, 0, 0, first+half, count-half };
+                _nodev.push_back(left);
+                _nodev.push_back(right);
+            }
+            else _Nleaves++;
+        }
+        begin = end;
+        end = _nodev.size();
+    }
+
+    // put the particle spheres in leaf order
+    vector<Sphere> spherev(n);
+    for (int i=0; i<n; i++) spherev[i] = _spherev[_indexv[i]];
+    _spherev.swap(spherev);
+
+    // the bounding box of the root node encloses all particles
+    const Node& node = _nodev[0];
+    _xmin = node.xmin; _ymin = node.ymin; _zmin = node.zmin;
+    _xmax = node.xmax; _ymax = node.ymax; _zmax = node.zmax;
+}
+
+////////////////////////////////////////////////////////////////////
+
+void SPHGasParticleTree::splitnode(size_t i)
+{
+    Node& node = _nodev[_levelbegin+i];
+    int first = node.first;
+    int last = node.first + node.count;
+
+    // determine the bounding box of the particles and the range of the particle centers
+    const double inf = numeric_limits<double>::infinity();
+    node.xmin = node.ymin = node.zmin = inf;
+    node.xmax = node.ymax = node.zmax = -inf;
+    double cxmin = inf, cymin = inf, czmin = inf;
+    double cxmax = -inf, cymax = -inf, czmax = -inf;
+    for (int k=first; k<last; k++)
+    {
+        const Sphere& s = _spherev[_indexv[k]];
+        node.xmin = min(node.xmin, s.x-s.h); node.xmax = max(node.xmax, s.x+s.h);
+        node.ymin = min(node.ymin, s.y-s.h); node.ymax = max(node.ymax, s.y+s.h);
+        node.zmin = min(node.zmin, s.z-s.h); node.zmax = max(node.zmax, s.z+s.h);
+        cxmin = min(cxmin, s.x); cxmax = max(cxmax, s.x);
+        cymin = min(cymin, s.y); cymax = max(cymax, s.y);
+        czmin = min(czmin, s.z); czmax = max(czmax, s.z);
+    }
+
+    // if the node contains too many particles, partition them at the median along the direction
+    // with the largest spread of the centers (unless all centers coincide), and mark the node for subdivision
+    if (node.count > MAXLEAFSIZE && _Nlevels < MAXLEVELS)
+    {
+        double wx = cxmax-cxmin;
+        double wy = cymax-cymin;
+        double wz = czmax-czmin;
+        if (wx > 0 || wy > 0 || wz > 0)
+        {
+            int axis = (wx >= wy && wx >= wz) ? 0 : (wy >= wz ? 1 : 2);
+            const vector<Sphere>& spherev = _spherev;
+            auto coord = [&spherev,axis] (int p)
+            {
+                const Sphere& s = spherev[p];
+                return axis==0 ? s.x : (axis==1 ? s.y : s.z);
+            };
+            vector<int>::iterator begin = _indexv.begin();
+            nth_element(begin+first, begin+first+node.count/2, begin+last,
+                        [&coord] (int p1, int p2) { return coord(p1) < coord(p2); });
+            node.child = -1;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+int SPHGasParticleTree::numNodes() const
+{
+    return _nodev.size();
+}
+
+////////////////////////////////////////////////////////////////////
+
+int SPHGasParticleTree::numLeaves() const
+{
+    return _Nleaves;
+}
+
+////////////////////////////////////////////////////////////////////
+
+int SPHGasParticleTree::numLevels() const
+{
+    return _Nlevels;
+}
+
+////////////////////////////////////////////////////////////////////
+
+int SPHGasParticleTree::countLeafParticles(const Box& box, int limit) const
+{
+    if (_nodev.empty()) return 0;
+
+    int count = 0;
+    int stack[MAXLEVELS+1];
+    int top = 0;
+    stack[top++] = 0;
+    while (top)
+    {
+        const Node& node = _nodev[stack[--top]];
+        if (box.xmax() < node.xmin || box.xmin() > node.xmax || box.ymax() < node.ymin
+                || box.ymin() > node.ymax || box.zmax() < node.zmin || box.zmin() > node.zmax)
+            continue;
+        if (node.count)
+        {
+            count += node.count;
+            if (count > limit) break;
+        }
+        else
+        {
+            stack[top++] = node.child+1;
+            stack[top++] = node.child;
+        }
+    }
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////
@@ -0,0 +1,222 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#ifndef SPHGASPARTICLETREE_HPP
+#define SPHGASPARTICLETREE_HPP
+
+#include <vector>
+#include "Box.hpp"
+#include "SPHGasParticle.hpp"
+#include "Vec.hpp"
+class ParallelFactory;
+
+////////////////////////////////////////////////////////////////////
+
+/** SPHGasParticleTree is a technical class for organizing SPHGasParticle instances in a bounding
+    volume hierarchy, so that it is easy to retrieve all particles overlapping a particular point
+    in space or a particular box. A particle is considered to be a sphere with a radius equal to
+    its smoothing length. The Box object on which this class is based specifies a cuboid
+    guaranteed to enclose all particles in the tree.
+
+    The hierarchy is a binary tree. Each node holds the bounding box of all particles in its
+    subtree. A node is split by partitioning its particles at the median of their center
+    coordinates along the direction in which the centers are spread out the most, until a node
+    contains no more than a small number of particles. Because each particle is assigned to a
+    single leaf, regardless of its smoothing length, the number of nodes and the depth of the tree
+    adapt to the particle distribution. In particular, strongly clustered particles (as in the
+    central regions of a zoom-in galaxy snapshot) simply lead to smaller nodes in the clustered
+    region. A query only visits the nodes whose bounding box contains the query point or overlaps
+    the query box, and it reports only the particles that actually overlap the query.
+
+    The nodes are stored in a single vector in breadth-first order, with the two children of a
+    node stored consecutively. The centers and smoothing lengths of the particles are copied into
+    a separate vector in the order of the leaves, so that the particles in a leaf can be tested
+    without accessing the original particle objects. The tree is constructed level by level, and
+    the nodes on each level are split in parallel. */
+class SPHGasParticleTree : public Box
+{
+public:
+    /** The constructor builds the tree for the specified list of particles, using the parallel
+        threads offered by the specified parallel factory. The tree keeps a pointer to the
+        provided list \em pv, so that list must not be modified or deallocated as long as this
+        tree instance exists. */
+    SPHGasParticleTree(const std::vector<SPHGasParticle>& pv, ParallelFactory* factory);
+
+    /** This function returns the number of nodes in the tree. */
+    int numNodes() const;
+
+    /** This function returns the number of leaf nodes in the tree. */
+    int numLeaves() const;
+
+    /** This function returns the number of levels in the tree. */
+    int numLevels() const;
+
+    /** This function calls the specified function object with signature void f(const
+        SPHGasParticle&) for each particle that overlaps the specified position, i.e. for which
+        the distance between the position and the particle center is smaller than the smoothing
+        length. The order in which the particles are reported is fixed for a given tree. */
+    template<typename Functor> void forEachParticle(Vec r, Functor f) const
+    {
+        if (_nodev.empty()) return;
+        double x = r.x(), y = r.y(), z = r.z();
+
+        int stack[MAXLEVELS+1];
+        int top = 0;
+        stack[top++] = 0;
+        while (top)
+        {
+            const Node& node = _nodev[stack[--top]];
+            if (x < node.xmin || x > node.xmax || y < node.ymin || y > node.ymax || z < node.zmin || z > node.zmax)
+                continue;
+            if (node.count)
+            {
+                int last = node.first + node.count;
+                for (int i=node.first; i<last; i++)
+                {
+                    const Sphere& s = _spherev[i];
+                    double dx = x - s.x, dy = y - s.y, dz = z - s.z;
+                    if (dx*dx + dy*dy + dz*dz < s.h*s.h) f((*_pv)[_indexv[i]]);
+                }
+            }
+            else
+            {
+                stack[top++] = node.child+1;
+                stack[top++] = node.child;
+            }
+        }
+    }
+
+    /** This function calls the specified function object with signature void f(const
+        SPHGasParticle&) for each particle that overlaps the specified box (i.e. a cuboid lined
+        up with the coordinate axes), i.e. for which the sphere with a radius equal to the
+        smoothing length intersects the box. Each overlapping particle is reported exactly once.
+    */
+    template<typename Functor> void forEachParticle(const Box& box, Functor f) const
+    {
+        if (_nodev.empty()) return;
+
+        int stack[MAXLEVELS+1];
+        int top = 0;
+        stack[top++] = 0;
+        while (top)
+        {
+            const Node& node = _nodev[stack[--top]];
+            if (box.xmax() < node.xmin || box.xmin() > node.xmax || box.ymax() < node.ymin
+                    || box.ymin() > node.ymax || box.zmax() < node.zmin || box.zmin() > node.zmax)
+                continue;
+            if (node.count)
+            {
+                int last = node.first + node.count;
+                for (int i=node.first; i<last; i++)
+                {
+                    if (intersects(box, _spherev[i])) f((*_pv)[_indexv[i]]);
+                }
+            }
+            else
+            {
+                stack[top++] = node.child+1;
+                stack[top++] = node.child;
+            }
+        }
+    }
+
+    /** This function calls the specified function object with signature void f(int first, int
+        count) for each leaf node whose bounding box overlaps the specified box, including a box
+        with zero volume representing a single position. The arguments specify the range of
+        particles in the leaf, as indices in the leaf order of the particles; the corresponding
+        indices in the original particle list are obtained with the particleIndex() function. The
+        leaves are reported in the same fixed order as used by the forEachParticle() functions. The
+        particles in the reported leaves do not necessarily overlap the box, so that the caller
+        must handle particles that do not overlap the box. */
+    template<typename Functor> void forEachLeaf(const Box& box, Functor f) const
+    {
+        if (_nodev.empty()) return;
+
+        int stack[MAXLEVELS+1];
+        int top = 0;
+        stack[top++] = 0;
+        while (top)
+        {
+            const Node& node = _nodev[stack[--top]];
+            if (box.xmax() < node.xmin || box.xmin() > node.xmax || box.ymax() < node.ymin
+                    || box.ymin() > node.ymax || box.zmax() < node.zmin || box.zmin() > node.zmax)
+                continue;
+            if (node.count) f(node.first, node.count);
+            else
+            {
+                stack[top++] = node.child+1;
+                stack[top++] = node.child;
+            }
+        }
+    }
+
+    /** This function returns the total number of particles in the leaf nodes whose bounding box
+        overlaps the specified box, i.e. the number of particles reported by the forEachLeaf()
+        function for the same box. To limit the cost for large boxes, the traversal stops as soon
+        as the number exceeds the specified limit, in which case some number larger than the limit
+        is returned. */
+    int countLeafParticles(const Box& box, int limit) const;
+
+    /** This function returns the index in the original particle list of the particle with index
+        \em i in the leaf order of the particles. */
+    int particleIndex(int i) const { return _indexv[i]; }
+
+private:
+    /** The maximum number of levels in the tree. The median split guarantees that this limit is
+        never reached for any realistic number of particles. */
+    enum { MAXLEVELS = 64 };
+
+    /** The maximum number of particles in a leaf node. */
+    enum { MAXLEAFSIZE = 8 };
+
+    /** A Node holds the bounding box of the particles in its subtree. For a leaf node, \em first
+        and \em count specify the range of particles in the leaf order; for other nodes, \em count
+        is zero and \em child is the index of the first of two consecutive children. */
+    struct Node
+    {
+        double xmin, ymin, zmin, xmax, ymax, zmax;
+        int child, first, count;
+    };
+
+    /** A Sphere holds the center and smoothing length of a particle. */
+    struct Sphere
+    {
+        double x, y, z, h;
+    };
+
+    /** This private function serves as the parallelization body for constructing the tree. It
+        calculates the bounding box of the node with index \f$l_\text{level}+i\f$, where
+        \f$l_\text{level}\f$ is the index of the first node on the level being processed. If the
+        node contains too many particles, the function partitions these particles at the median
+        along the direction with the largest spread of particle centers, and marks the node for
+        subdivision by setting its child index to -1. The children are created by the caller. */
+    void splitnode(size_t i);
+
+    /** This function returns true if the specified box and sphere intersect. It uses the
+        algorithm due to Jim Arvo in "Graphics Gems" (1990). */
+    static bool intersects(const Box& box, const Sphere& s)
+    {
+        double squaredist = s.h*s.h;
+        if (s.x < box.xmin())      squaredist -= (s.x - box.xmin())*(s.x - box.xmin());
+        else if (s.x > box.xmax()) squaredist -= (s.x - box.xmax())*(s.x - box.xmax());
+        if (s.y < box.ymin())      squaredist -= (s.y - box.ymin())*(s.y - box.ymin());
+        else if (s.y > box.ymax()) squaredist -= (s.y - box.ymax())*(s.y - box.ymax());
+        if (s.z < box.zmin())      squaredist -= (s.z - box.zmin())*(s.z - box.zmin());
+        else if (s.z > box.zmax()) squaredist -= (s.z - box.zmax())*(s.z - box.zmax());
+        return squaredist > 0.;
+    }
+
+    const std::vector<SPHGasParticle>* _pv;     // the particles provided to the constructor
+    std::vector<Node> _nodev;                   // the nodes in breadth-first order; the root has index zero
+    std::vector<int> _indexv;                   // the index in _pv of each particle in leaf order
+    std::vector<Sphere> _spherev;               // the center and smoothing length of each particle in leaf order
+    int _Nleaves;
+    int _Nlevels;
+    size_t _levelbegin;                         // index of the first node on the level being constructed
+};
+
+////////////////////////////////////////////////////////////////////
+
+#endif // SPHGASPARTICLETREE_HPP
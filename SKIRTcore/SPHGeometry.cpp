@@ -4,13 +4,15 @@
 ///////////////////////////////////////////////////////////////// */
 
 #include <cmath>
+#include "ColumnBinaryFile.hpp"
 #include "FatalError.hpp"
 #include "FilePaths.hpp"
 #include "Log.hpp"
 #include "NR.hpp"
+#include "ParallelFactory.hpp"
 #include "Random.hpp"
 #include "SPHGeometry.hpp"
-#include "SPHGasParticleGrid.hpp"
+#include "SPHGasParticleTree.hpp"
 #include "TextInFile.hpp"
 #include "Units.hpp"
 
@@ -19,7 +21,7 @@ using namespace std;
 //////////////////////////////////////////////////////////////////////
 
 SPHGeometry::SPHGeometry()
-    : _Tmax(0), _grid(0)
+    : _Tmax(0), _tree(0)
 {
 }
 
@@ -27,7 +29,7 @@ SPHGeometry::SPHGeometry()
 
 SPHGeometry::~SPHGeometry()
 {
-    delete _grid;
+    delete _tree;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -45,8 +47,7 @@ void SPHGeometry::setupSelfBefore()
     int Nignored = 0;
     double Mtot = 0;
     double Mmetal = 0;
-    double x, y, z, h, M, Z, T;
-    while (infile.readRow(1, x, y, z, h, M, Z, T))
+    auto addParticle = [&] (double x, double y, double z, double h, double M, double Z, double T)
     {
         // ignore particle if the temperature is higher than the maximum (assuming both T and Tmax are valid)
         if (T > 0 && _Tmax > 0 && T > _Tmax)
@@ -60,21 +61,42 @@ void SPHGeometry::setupSelfBefore()
             Mtot += M;
             Mmetal += M * Z;
         }
+    };
+
+    // for a column binary file, take the values directly from the columns in the memory mapping
+    const ColumnBinaryFile* binary = infile.binaryFile();
+    if (binary)
+    {
+        if (binary->numColumns() < 6) throw FATALERROR("One or more required column(s) in binary file are missing");
+        const double* xv = binary->column(0);
+        const double* yv = binary->column(1);
+        const double* zv = binary->column(2);
+        const double* hv = binary->column(3);
+        const double* Mv = binary->column(4);
+        const double* Zv = binary->column(5);
+        const double* Tv = binary->numColumns() > 6 ? binary->column(6) : 0;
+        size_t Nrows = binary->numRows();
+        _pv.reserve(Nrows);
+        for (size_t i=0; i<Nrows; i++) addParticle(xv[i], yv[i], zv[i], hv[i], Mv[i], Zv[i], Tv ? Tv[i] : 0.);
+    }
+
+    // for a column text file, parse the values row by row
+    else
+    {
+        double x, y, z, h, M, Z, T;
+        while (infile.readRow(1, x, y, z, h, M, Z, T)) addParticle(x, y, z, h, M, Z, T);
     }
     find<Log>()->info("  Number of high-temperature particles ignored: " + QString::number(Nignored));
     find<Log>()->info("  Number of SPH gas particles containing dust: " + QString::number(_pv.size()));
     find<Log>()->info("  Total gas mass: " + QString::number(Mtot) + " Msun");
     find<Log>()->info("  Total metal mass: " + QString::number(Mmetal) + " Msun");
 
-    // construct a 3D-grid over the particle space, and create a list of particles that overlap each grid cell
-    const int GRIDSIZE = 20;
-    QString size = QString::number(GRIDSIZE);
-    find<Log>()->info("Constructing intermediate " + size + "x" + size + "x" + size + " grid for particles...");
-    _grid = new SPHGasParticleGrid(_pv, GRIDSIZE);
-    find<Log>()->info("  Smallest number of particles per cell: " + QString::number(_grid->minParticlesPerCell()));
-    find<Log>()->info("  Largest  number of particles per cell: " + QString::number(_grid->maxParticlesPerCell()));
-    find<Log>()->info("  Average  number of particles per cell: "
-                      + QString::number(_grid->totalParticles() / double(GRIDSIZE*GRIDSIZE*GRIDSIZE),'f',1));
+    // construct a bounding volume hierarchy over the particles, adapted to their spatial distribution
+    find<Log>()->info("Constructing search tree for particles...");
+    _tree = new SPHGasParticleTree(_pv, find<ParallelFactory>());
+    find<Log>()->info("  Number of nodes: " + QString::number(_tree->numNodes()));
+    find<Log>()->info("  Number of leaves: " + QString::number(_tree->numLeaves()));
+    find<Log>()->info("  Number of levels: " + QString::number(_tree->numLevels()));
 
     // construct a vector with the normalized cumulative particle densities
     NR::cdf(_cumrhov, _pv.size(), [this](int i){return _pv[i].metalMass();} );
@@ -115,12 +137,11 @@ double SPHGeometry::maximumTemperature() const
 
 double SPHGeometry::density(Position bfr) const
 {
-    const vector<const SPHGasParticle*>& particles = _grid->particlesFor(bfr);
-
     double sum = 0.0;
-    int n = particles.size();
-    for (int i=0; i<n; i++)
-        sum += particles[i]->metalDensity(bfr);  // sum contains the density in metals
+    _tree->forEachParticle(bfr, [&sum,bfr](const SPHGasParticle& particle)
+    {
+        sum += particle.metalDensity(bfr);
+    });  // sum contains the density in metals
     sum *= _norm;    // sum now contains the normalized density
     return sum;
 }
@@ -142,8 +163,8 @@ double SPHGeometry::SigmaX() const
 {
     const int NSAMPLES = 10000;
     double sum = 0;
-    double xmin = _grid->xmin();
-    double xmax = _grid->xmax();
+    double xmin = _tree->xmin();
+    double xmax = _tree->xmax();
     for (int k = 0; k < NSAMPLES; k++)
     {
         sum += density(Position(xmin + k*(xmax-xmin)/NSAMPLES, 0, 0));
@@ -157,8 +178,8 @@ double SPHGeometry::SigmaY() const
 {
     const int NSAMPLES = 10000;
     double sum = 0;
-    double ymin = _grid->ymin();
-    double ymax = _grid->ymax();
+    double ymin = _tree->ymin();
+    double ymax = _tree->ymax();
     for (int k = 0; k < NSAMPLES; k++)
     {
         sum += density(Position(0, ymin + k*(ymax-ymin)/NSAMPLES, 0));
@@ -172,8 +193,8 @@ double SPHGeometry::SigmaZ() const
 {
     const int NSAMPLES = 10000;
     double sum = 0;
-    double zmin = _grid->zmin();
-    double zmax = _grid->zmax();
+    double zmin = _tree->zmin();
+    double zmax = _tree->zmax();
     for (int k = 0; k < NSAMPLES; k++)
     {
         sum += density(Position(0, 0, zmin + k*(zmax-zmin)/NSAMPLES));
@@ -10,7 +10,7 @@
 #include "DustParticleInterface.hpp"
 #include "GenGeometry.hpp"
 #include "SPHGasParticle.hpp"
-class SPHGasParticleGrid;
+class SPHGasParticleTree;
 
 ////////////////////////////////////////////////////////////////////
 
@@ -61,7 +61,8 @@ public:
         the sixth column is the metallicity \f$Z\f$ of the gas (dimensionless fraction). The
         optional seventh column is the temperature of the gas (in K). If this value is provided and
         it is higher than the maximum temperature the particle is ignored. If the temperature value
-        is missing, the particle is never ignored. */
+        is missing, the particle is never ignored. The file may also be provided in the column
+        binary format (see ColumnBinaryFile). */
     Q_INVOKABLE void setFilename(QString value);
 
     /** Returns the name of the file containing the information on the SPH gas particles. */
@@ -122,7 +123,7 @@ private:
 
     // the SPH particles
     std::vector<SPHGasParticle> _pv;  // the particles in the order read from the file
-    const SPHGasParticleGrid* _grid;  // a list of particles overlapping each grid cell
+    const SPHGasParticleTree* _tree;  // a search tree over the particles
     Array _cumrhov;   // cumulative density distribution for particles in pv
     double _norm;     // normalization factor ( 1 / M_tot )
 };
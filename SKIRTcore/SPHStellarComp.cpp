@@ -140,55 +140,40 @@ void SPHStellarComp::setupSelfAfter()
     const double pc = Units::pc();
 
     // load the SPH source particles, including the parameters for our SED family
-    // and including the velocity, if requested
+    // and including the velocity, if requested; the properties of each particle are processed as it is read,
+    // so that the rows of the input file are not stored
     int Nbase = _velocity ? 7 : 4;
     int Nsed = _sedFamily->nparams();
     QString description = "SPH " + _sedFamily->sourceDescription() + " particles";
-    const vector<Array>& particles = TextInFile(this, _filename, description).readAllRows(Nbase+Nsed);
+    TextInFile infile(this, _filename, description);
 
-    find<Log>()->info("Processing the particle properties... ");
-
-    // store the particle positions and sizes, and calculate the total mass in Msun
-    int Np = particles.size();
-    _rv.resize(Np);
-    _hv.resize(Np);
+    // store the particle positions and sizes, calculate the total mass in Msun, and calculate the luminosity
+    // of each particle at each wavelength; also construct anisotropy information for each particle, if requested
+    int Nlambda = find<WavelengthGrid>()->Nlambda();
+    _Ltotv.resize(Nlambda);
+    vector<double> Lv;  // [i*Nlambda+ell]
     double Mtot = 0;
-    for (int i=0; i!=Np; ++i)
+    Array particle;
+    while (infile.readRow(particle, Nbase+Nsed))
     {
-        const Array& particle = particles[i];
-        _rv[i] = Vec(particle[0],particle[1],particle[2])*pc;
-        _hv[i] = particle[3]*pc;
+        _rv.push_back(Vec(particle[0],particle[1],particle[2])*pc);
+        _hv.push_back(particle[3]*pc);
         Mtot += _sedFamily->mass_generic(particle, Nbase);
-    }
 
-    // construct a temporary matrix with the luminosity of each particle at each wavelength
-    ArrayTable<2> Lvv(Np,0);  // [i,ell]
-    for (int i=0; i!=Np; ++i)
-    {
-        Lvv[i] = _sedFamily->luminosities_generic(particles[i], Nbase);
-    }
+        const Array& Lv_i = _sedFamily->luminosities_generic(particle, Nbase);
+        _Ltotv += Lv_i;
+        for (int ell=0; ell<Nlambda; ell++) Lv.push_back(Lv_i[ell]);
 
-    // calculate the total luminosity for every wavelength bin, and the grand total luminosity
-    int Nlambda = find<WavelengthGrid>()->Nlambda();
-    _Ltotv.resize(Nlambda);
-    for (int i=0; i!=Np; ++i) _Ltotv += Lvv[i];
+        if (_velocity) _av.push_back(new SPHStellarComp_Private::VelocityAnisotropy(particle, _sedFamily, _random));
+    }
+    int Np = _rv.size();
     double Ltot = _Ltotv.sum();
 
     // construct the normalized cumulative luminosity distribution over particles, for each wavelength bin
     _Xvv.resize(Nlambda,0);  // [ell,i]
     for (int ell=0; ell<Nlambda; ell++)
     {
-        NR::cdf(_Xvv[ell], Np, [&Lvv, ell](int i) { return Lvv(i,ell); });
-    }
-
-    // construct anisotropy information for each particle, if requested
-    if (_velocity)
-    {
-        _av.resize(Np);
-        for (int i=0; i!=Np; ++i)
-        {
-            _av[i] = new SPHStellarComp_Private::VelocityAnisotropy(particles[i], _sedFamily, _random);
-        }
+        NR::cdf(_Xvv[ell], Np, [&Lv, Nlambda, ell](int i) { return Lv[static_cast<size_t>(i)*Nlambda+ell]; });
     }
 
     // log key statistics
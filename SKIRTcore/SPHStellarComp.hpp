@@ -88,7 +88,10 @@ public:
         assumed to be constant over the past 10 Myr (in \f$M_\odot\,{\text{yr}}^{-1}\f$),
         metallicity \f$Z\f$ (as a dimensionless fraction), the logarithm of the compactness \f$\log
         C\f$ (as a dimensionless fraction), the ISM pressure \f$p\f$ (in Pa), and the dimensionless
-        PDR covering factor \f$f_{\text{PDR}}\f$. */
+        PDR covering factor \f$f_{\text{PDR}}\f$.
+
+        Instead of a text file, a file in the column binary format (see ColumnBinaryFile) with the
+        same columns can be provided; the format is recognized from the file contents. */
     Q_INVOKABLE void setFilename(QString value);
 
     /** Returns the name of the file containing the information on the SPH source particles. */
@@ -4,6 +4,7 @@
 ///////////////////////////////////////////////////////////////// */
 
 #include <sstream>
+#include "ColumnBinaryFile.hpp"
 #include "FatalError.hpp"
 #include "FilePaths.hpp"
 #include "Log.hpp"
@@ -14,9 +15,19 @@ using namespace std;
 ////////////////////////////////////////////////////////////////////
 
 TextInFile::TextInFile(const SimulationItem* item, QString filename, QString description)
+    : _binary(0), _row(0)
 {
-    // open the file and log a message
     QString filepath = item->find<FilePaths>()->input(filename);
+
+    // if the file is in the column binary format, map it into memory and log a message
+    if (ColumnBinaryFile::isColumnBinaryFile(filepath))
+    {
+        _binary = new ColumnBinaryFile(filepath);
+        item->find<Log>()->info("Reading " + description + " from binary file " + filepath + "...");
+        return;
+    }
+
+    // otherwise open the text file and log a message
     _in.open(filepath.toLocal8Bit().constData());
     if (!_in.is_open()) throw FATALERROR("Could not open the " + description + " data file " + filepath);
     item->find<Log>()->info("Reading " + description + " from file " + filepath + "...");
@@ -24,8 +35,27 @@ TextInFile::TextInFile(const SimulationItem* item, QString filename, QString des
 
 ////////////////////////////////////////////////////////////////////
 
+TextInFile::~TextInFile()
+{
+    delete _binary;
+}
+
+////////////////////////////////////////////////////////////////////
+
 bool TextInFile::readRow(Array& values, size_t ncols, size_t noptcols)
 {
+    // for a column binary file, copy the values from the next row, if any
+    if (_binary)
+    {
+        if (_row >= _binary->numRows()) return false;
+        size_t navailable = _binary->numColumns();
+        if (navailable < ncols-noptcols) throw FATALERROR("One or more required column(s) in binary file are missing");
+        values.resize(ncols);
+        for (size_t i=0; i<ncols; ++i) values[i] = i<navailable ? _binary->value(_row,i) : 0.;
+        _row++;
+        return true;
+    }
+
     // read new line until it is non-empty and non-comment
     string line;
     while (_in.good())
@@ -64,6 +94,7 @@ bool TextInFile::readRow(Array& values, size_t ncols, size_t noptcols)
 vector<Array> TextInFile::readAllRows(size_t ncols, size_t noptcols)
 {
     vector<Array> rows;
+    if (_binary) rows.reserve(_binary->numRows() - _row);
     while (true)
     {
         rows.emplace_back();                        // add a default-constructed array to the vector
@@ -77,3 +108,10 @@ vector<Array> TextInFile::readAllRows(size_t ncols, size_t noptcols)
 }
 
 ////////////////////////////////////////////////////////////////////
+
+const ColumnBinaryFile* TextInFile::binaryFile() const
+{
+    return _binary;
+}
+
+////////////////////////////////////////////////////////////////////
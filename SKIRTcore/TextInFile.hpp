@@ -10,6 +10,7 @@
 #include <vector>
 #include <QString>
 #include "Array.hpp"
+class ColumnBinaryFile;
 class SimulationItem;
 
 ////////////////////////////////////////////////////////////////////
@@ -18,7 +19,13 @@ class SimulationItem;
     specified in the constructor. The values may be provided as a single sequence in free form,
     disregarding line breaks, or they may be organized in columns, forming a table. An
     informational message is logged when the file is opened, and the file is automatically closed
-    when the object is destructed. */
+    when the object is destructed.
+
+    As an alternative to a column text file, the input file may be in the column binary format
+    described for the ColumnBinaryFile class. The format is detected automatically from the
+    contents of the file, so that it can be selected separately for each input file. For a column
+    binary file, the row reading functions return the values stored in the binary file without
+    any parsing, which is much faster for large files. */
 class TextInFile
 {
     //=============== Construction - Destruction  ==================
@@ -33,6 +40,9 @@ public:
         issued after the file is successfully opened; */
     TextInFile(const SimulationItem* item, QString filename, QString description);
 
+    /** The destructor closes the file. */
+    ~TextInFile();
+
     //====================== Other functions =======================
 
     /** This function reads the next row from a column text file and stores the resulting values in
@@ -47,7 +57,8 @@ public:
         false and the contents of the \em values array is undefined. If the line contains
         improperly formatted floating point numbers, or if there are less than \em ncols - \em
         noptcols values, the function throws a FatalError (and the contents of the \em values array
-        is undefined). */
+        is undefined). For a column binary file, the row is taken from the binary table, which
+        must have at least \em ncols - \em noptcols columns. */
     bool readRow(Array& values, size_t ncols, size_t noptcols = 0);
 
     /** This variadic template function reads the next row from a column text file and stores the
@@ -70,6 +81,12 @@ public:
         this function behaves just like readRow(Array&). */
     std::vector<Array> readAllRows(size_t ncols, size_t noptcols = 0);
 
+    /** This function returns the column binary file being read if the input file is in the column
+        binary format, or null if the input file is a column text file. This allows the caller to
+        access the values in each column of a binary file directly in the memory mapping (see
+        ColumnBinaryFile::column()), rather than obtaining them row by row. */
+    const ColumnBinaryFile* binaryFile() const;
+
 private:
     // recursively assign values from Array to double& arguments; used in variadic readRow()
     template <typename... Values>
@@ -79,7 +96,9 @@ private:
     //======================== Data Members ========================
 
 private:
-    std::ifstream _in;  // the input stream
+    std::ifstream _in;              // the input stream for a column text file
+    ColumnBinaryFile* _binary;      // the column binary file, or null for a column text file
+    size_t _row;                    // the index of the next row to be read from the column binary file
 };
 
 ////////////////////////////////////////////////////////////////////
@@ -3,11 +3,14 @@
 ////       © Astronomical Observatory, Ghent University         ////
 ///////////////////////////////////////////////////////////////// */
 
+#include <algorithm>
 #include <limits>
 #include "DustDistribution.hpp"
+#include "FatalError.hpp"
 #include "MultiGrainDustMix.hpp"
 #include "Log.hpp"
 #include "NR.hpp"
+#include "ParallelFactory.hpp"
 #include "TransientDustEmissivity.hpp"
 #include "Table.hpp"
 #include "Units.hpp"
@@ -20,41 +23,25 @@ using namespace std;
 // container classes that are highly specialized to optimize the operations in this class
 namespace
 {
-    // square matrix
-    template<typename T> class Square
-    {
-    private:
-        size_t _n;
-        T* _v;
+    // the number of radiation fields handled together in a batch
+    const int Nbatch = 8;
 
-    public:
-        // constructor sets maximum size and logical size
-        Square(size_t n) : _n(n), _v(new T[n*n]) { }
-        ~Square() { delete[] _v; }
-
-        // sets logical size, which must not be larger than maximum size set in constructor (is not checked)
-        // does not clear values; does not resize underlying memory
-        void resize(size_t n) { _n = n; }
-
-        // access to values  (const version currently not needed)
-        T& operator()(size_t i, size_t j) { return _v[i*_n+j]; }
-    };
-
-    // square matrix with only items below the diagonal (i>j)
+    // square matrix with only items below the diagonal (i>j), stored column by column
     template<typename T> class Triangle
     {
     private:
+        size_t _n;
         T* _v;
-        static size_t offset(size_t i) { return ((i-1)*i)>>1; }
+        size_t offset(size_t i, size_t j) const { return j*(_n-1) - (((j-1)*j)>>1) + i-j-1; }
 
     public:
         // constructor sets size (can't be changed)
-        Triangle(size_t n) : _v(new T[offset(n)]) { }
+        Triangle(size_t n) : _n(n), _v(new T[((n-1)*n)>>1]) { }
         ~Triangle() { delete[] _v; }
 
-        // access to values; must have i>j (is not checked)
-        const T& operator()(size_t i, size_t j) const { return _v[offset(i)+j]; }
-        T& operator()(size_t i, size_t j) { return _v[offset(i)+j]; }
+        // access to values; must have i>j (is not checked); the values in a column are adjacent in memory
+        const T& operator()(size_t i, size_t j) const { return _v[offset(i,j)]; }
+        T& operator()(size_t i, size_t j) { return _v[offset(i,j)]; }
     };
 }
 
@@ -110,6 +97,71 @@ public:
 
 ////////////////////////////////////////////////////////////////////
 
+// helper class to hold the scratch memory used by a single execution thread for the calculations in this class;
+// it is sized once to accommodate a batch of fields on the largest temperature grid and then reused for all calls
+// (it grows only if a call handles more fields than any previous call from the same thread)
+class TDE_Workspace
+{
+public:
+    // the state of the calculation in calcbatch(), for the fields in a batch
+    vector<double> _Jv;     // radiation fields for a batch, transposed (indexed on ell,k)
+    vector<double> _Mv;     // temperature range mask for a batch (indexed on i,k)
+    vector<double> _Sv;     // partial sums in the recursion relation for a batch (indexed on i,k)
+    vector<double> _Pv;     // probabilities for a batch (indexed on i,k)
+
+    // the state of the calculation in emissivities() and calcprobs(), for each of the fields (indexed on k)
+    size_t _NTmax;          // the largest number of temperature grid points, i.e. the stride in _Pkv
+    size_t _Ngc;            // the largest number of grain compositions in a dust mix, i.e. the stride in _eqMassv
+    vector<double> _Teqv;   // the equilibrium temperature for the current population
+    vector<double> _Tminv;  // the temperature range for the current population
+    vector<double> _Tmaxv;
+    vector<int> _ioffv;     // the index offset in the temperature grid for the current probabilities
+    vector<int> _endv;      // the index just beyond the temperature range for the current probabilities
+    vector<double> _Pkv;    // the probabilities for the current population (indexed on k,i)
+    vector<double> _eqMassv;  // the mass above which grains of a given composition are in equilibrium (indexed on k,g)
+    vector<int> _kAv;       // the indices of the fields handled by the coarse, medium and fine calculators
+    vector<int> _kBv;
+    vector<int> _kCv;
+    vector<int> _sortedkv;  // the indices of the fields handled by a calculator, sorted on temperature range
+
+    // a table holding a single radiation field, for use by emissivity()
+    ArrayTable<2> _Jvv;
+
+    // constructor
+    TDE_Workspace(size_t NTmax, size_t Ngc, size_t Nlambda)
+        : _NTmax(NTmax), _Ngc(Ngc), _Jvv(1,Nlambda)
+    {
+        _Jv.reserve(Nlambda*Nbatch);
+        _Mv.reserve(NTmax*Nbatch);
+        _Sv.reserve(NTmax*Nbatch);
+        _Pv.reserve(NTmax*Nbatch);
+        resize(Nbatch);
+    }
+
+    // ensure that the per-field state can hold the specified number of fields
+    void resize(size_t Nfields)
+    {
+        if (_Teqv.size() >= Nfields) return;
+        _Teqv.resize(Nfields);
+        _Tminv.resize(Nfields);
+        _Tmaxv.resize(Nfields);
+        _ioffv.resize(Nfields);
+        _endv.resize(Nfields);
+        _Pkv.resize(Nfields*_NTmax);
+        _eqMassv.resize(Nfields*_Ngc);
+        _kAv.reserve(Nfields);
+        _kBv.reserve(Nfields);
+        _kCv.reserve(Nfields);
+        _sortedkv.reserve(Nfields);
+    }
+
+    // the probabilities for field k
+    double* probs(int k) { return &_Pkv[k*_NTmax]; }
+    const double* probs(int k) const { return &_Pkv[k*_NTmax]; }
+};
+
+////////////////////////////////////////////////////////////////////
+
 // helper class to calculate the temperature probability distribution for a dust population in a given radiation field
 // on a particular fixed grid, with support for pre-calculating enthalpy-related data on that grid
 class TDE_Calculator
@@ -176,67 +228,59 @@ public:
         }
     }
 
-    // calculate the probabilities
-    // Pv: the calculated probabilities (out)
-    // ioff: the index offset in the temperature grid used for this calculation (out)
-    // Am: scratch memory for the calculation (internal only)
-    // Tmin/Tmax: temperature range in which to perform the calculation (in), and
-    //            temperature range where the calculated probabilities are above a certain fraction of maximum (out)
-    // Jv: the radiation field (in)
-    void calcprobs(Array& Pv, int& ioff, Square<double>& Am, double& Tmin, double& Tmax, const Array& Jv) const
+    // calculate the probabilities for a number of radiation fields, processing the fields in batches
+    // kv: the indices of the fields to be handled by this calculator (in)
+    // Jvv: the radiation fields, indexed on k (in)
+    // ws: the state of the calculation for each field, indexed on k, and scratch memory for the calculation:
+    //   - probs(k): the calculated probabilities (out)
+    //   - _ioffv: the index offset in the temperature grid used for the calculation (out)
+    //   - _Tminv/_Tmaxv: temperature range in which to perform the calculation (in), and
+    //     temperature range where the calculated probabilities are above a certain fraction of maximum (out)
+    void calcprobs(const vector<int>& kv, const ArrayTable<2>& Jvv, TDE_Workspace* ws) const
     {
-        ioff = NR::locate_clip(_grid->_Tv, Tmin);
-        int NT = NR::locate_clip(_grid->_Tv, Tmax) - ioff + 2;
+        vector<int>& ioffv = ws->_ioffv;
+        vector<int>& endv = ws->_endv;
 
-        // copy/calculate the transition matrix coefficients
-        Am.resize(NT);
-        for (int f=1; f<NT; f++)
-        {
-            const short* ELLv = &_ELLm(f+ioff,ioff);
-            const double* HRv = &_HRm(f+ioff,ioff);
-            for (int i=0; i<f; i++)
-            {
-                int ell = ELLv[i];
-                Am(f,i) = ell>=0 ? HRv[i] * Jv[ell] : 0.;
-            }
-        }
-        for (int i=1; i<NT; i++)
+        // determine the temperature index range for each field
+        for (int k : kv)
         {
-            Am(i-1,i) = _CRv[i+ioff];
+            ioffv[k] = NR::locate_clip(_grid->_Tv, ws->_Tminv[k]);
+            endv[k] = NR::locate_clip(_grid->_Tv, ws->_Tmaxv[k]) + 2;
         }
 
-        // calculate the cumulative matrix coefficients, in place
-        for (int f=NT-2; f>0; f--)
+        // sort the fields on the lower end of their range, so that fields with a similar range end up in the same batch
+        vector<int>& sortedkv = ws->_sortedkv;
+        sortedkv.assign(kv.begin(), kv.end());
+        stable_sort(sortedkv.begin(), sortedkv.end(), [&ioffv](int k1, int k2) { return ioffv[k1] < ioffv[k2]; });
+
+        // process the fields in batches; a field is added to a batch only if the union of the temperature ranges
+        // remains close to the largest individual range, so that little work is wasted on the fields in the batch
+        size_t Nfields = sortedkv.size();
+        size_t first = 0;
+        while (first < Nfields)
         {
-            for (int i=0; i<f; i++)
+            int imin = ioffv[sortedkv[first]];
+            int imax = endv[sortedkv[first]];
+            int NTlargest = imax - imin;
+            size_t last = first+1;
+            while (last < Nfields && last-first < static_cast<size_t>(Nbatch))
             {
-                Am(f,i) += Am(f+1,i);
+                int k = sortedkv[last];
+                int imaxnew = max(imax, endv[k]);
+                int NTlargestnew = max(NTlargest, endv[k]-ioffv[k]);
+                if (4*(imaxnew-imin) > 5*NTlargestnew) break;
+                imax = imaxnew;
+                NTlargest = NTlargestnew;
+                last++;
             }
-        }
 
-        // calculate the probabilities
-        Pv.resize(NT);
-        Pv[0] = 1.;
-        for (int i=1; i<NT; i++)
-        {
-            double sum = 0.;
-            for (int j=0; j<i; j++) sum += Am(i,j) * Pv[j];
-            Pv[i] = sum / Am(i-1,i);
-
-            // rescale if needed to keep infinities from happening
-            if (Pv[i] > 1e10) for (int j=0; j<=i; j++) Pv[j]/=Pv[i];
+            // use the narrowest batch layout that can hold the fields, to avoid wasting work on empty lanes
+            int K = last-first;
+            if (K > Nbatch/2) calcbatch<Nbatch>(&sortedkv[first], K, imin, imax, Jvv, ws);
+            else if (K > 1) calcbatch<Nbatch/2>(&sortedkv[first], K, imin, imax, Jvv, ws);
+            else calcbatch<1>(&sortedkv[first], K, imin, imax, Jvv, ws);
+            first = last;
         }
-
-        // normalize probabilities to unity
-        Pv /= Pv.sum();
-
-        // determine the temperature range where the probabability is above a given fraction of its maximum
-        double frac = 1e-20 * Pv.max();
-        int k;
-        for (k=0; k!=NT-2; k++) if (Pv[k]>frac) break;
-        Tmin = _grid->_Tv[k+ioff];
-        for (k=NT-2; k!=1; k--) if (Pv[k]>frac) break;
-        Tmax = _grid->_Tv[k+1+ioff];
     }
 
     // add the transient emissivity of the population
@@ -244,7 +288,7 @@ public:
     // Tmin/Tmax: temperature range in which to add radiation (in)
     // Pv: the probabilities calculated previously by this calculator (in)
     // ioff: the index offset in the temperature grid used for that previous calculation (in)
-    void addtransient(Array& ev, double Tmin, double Tmax, const Array& Pv, int ioff) const
+    void addtransient(Array& ev, double Tmin, double Tmax, const double* Pv, int ioff) const
     {
         int imin = NR::locate_clip(_grid->_Tv, Tmin);
         int imax = NR::locate_clip(_grid->_Tv, Tmax);
@@ -263,6 +307,134 @@ public:
             ev[ell] += _sigmaabsv[ell] * _grid->B(Teq, ell);
         }
     }
+
+private:
+    // calculate the probabilities for a batch of radiation fields, in the union of the temperature ranges of the
+    // fields; the coefficients outside of the range for a particular field are forced to zero, so that the
+    // calculation yields the same probabilities as a separate calculation for each field
+    // - the transition matrix is processed column by column, so that the cumulative coefficients can be calculated
+    //   on the fly and never need to be stored; once the probability for bin j is known, the contributions of the
+    //   cumulative coefficients in column j to the numerators of the recursion relation for the higher bins are
+    //   added to the partial sums for these bins (the order of the additions is the same as in the usual formulation)
+    // - the heating rate tables are stored column by column, and they are streamed only once for the batch
+    // - the loops over the fields are innermost and have a fixed length L, so that they can be vectorized;
+    //   if there are fewer than L fields, the remaining lanes are left empty
+    // kv: the indices of the K fields in this batch (in)
+    // imin/imax: the union of the temperature index ranges of the fields in this batch (in)
+    // other arguments: see calcprobs(); in addition, ws->_endv holds the index just beyond the temperature
+    //   index range for each field (in)
+    template<int L> void calcbatch(const int* kv, int K, int imin, int imax, const ArrayTable<2>& Jvv,
+                                   TDE_Workspace* ws) const
+    {
+        const vector<int>& ioffv = ws->_ioffv;
+        const vector<int>& endv = ws->_endv;
+        int NT = imax - imin;
+        int Nlambda = _grid->_Nlambda;
+
+        // copy the radiation fields, transposed so that the values for all fields at a given wavelength are adjacent
+        vector<double>& Jv = ws->_Jv;
+        Jv.assign(Nlambda*L, 0.);
+        for (int k=0; k<K; k++)
+        {
+            const Array& Jkv = Jvv[kv[k]];
+            for (int ell=0; ell<Nlambda; ell++) Jv[ell*L+k] = Jkv[ell];
+        }
+
+        // mark the temperature range for each field
+        vector<double>& Mv = ws->_Mv;
+        Mv.assign(NT*L, 0.);
+        for (int k=0; k<K; k++)
+        {
+            for (int i=ioffv[kv[k]]; i<endv[kv[k]]; i++) Mv[(i-imin)*L+k] = 1.;
+        }
+
+        // initialize the partial sums and the probabilities
+        vector<double>& Sv = ws->_Sv;
+        vector<double>& Pv = ws->_Pv;
+        Sv.assign(NT*L, 0.);
+        Pv.assign(NT*L, 0.);
+
+        // calculate the probabilities, starting from unity at the lower end of the range for each field
+        for (int j=0; j<NT; j++)
+        {
+            // determine the probability for bin j from the completed partial sum (the cooling rate is A_{j-1,j})
+            double* Pjv = &Pv[j*L];
+            if (j>0)
+            {
+                const double* Sjv = &Sv[j*L];
+                double CR = _CRv[j+imin];
+                for (int k=0; k<L; k++) Pjv[k] = Sjv[k] / CR;
+            }
+            for (int k=0; k<K; k++)
+            {
+                int ioff = ioffv[kv[k]];
+                if (j+imin == ioff) Pjv[k] = 1.;
+
+                // rescale if needed to keep infinities from happening (including the partial sums for higher bins)
+                else if (Pjv[k] > 1e10)
+                {
+                    double P = Pjv[k];
+                    for (int i=ioff-imin; i<j; i++) Pv[i*L+k] /= P;
+                    for (int i=j+1; i<NT; i++) Sv[i*L+k] /= P;
+                    Pjv[k] = 1.;
+                }
+            }
+
+            // calculate the cumulative coefficients in column j, starting from the last row,
+            // and add their contributions to the partial sums for the higher bins
+            if (j<NT-1)
+            {
+                const short* ELLv = &_ELLm(j+1+imin,j+imin);
+                const double* HRv = &_HRm(j+1+imin,j+imin);
+                const double* Mjv = &Mv[j*L];
+                double Bv[L];
+                for (int k=0; k<L; k++) Bv[k] = 0.;
+                for (int f=NT-1; f>j; f--)
+                {
+                    int ell = ELLv[f-j-1];
+                    if (ell>=0)
+                    {
+                        double HR = HRv[f-j-1];
+                        const double* Jellv = &Jv[ell*L];
+                        const double* Mfv = &Mv[f*L];
+                        for (int k=0; k<L; k++) Bv[k] += HR * Jellv[k] * Mfv[k] * Mjv[k];
+                    }
+                    double* Sfv = &Sv[f*L];
+                    for (int k=0; k<L; k++) Sfv[k] += Bv[k] * Pjv[k];
+                }
+            }
+        }
+
+        // copy the probabilities for each field into its own array and determine its temperature range
+        for (int k=0; k<K; k++)
+        {
+            int ioff = ioffv[kv[k]];
+            int NTk = endv[kv[k]] - ioff;
+            double* Pkv = ws->probs(kv[k]);
+            for (int i=0; i<NTk; i++) Pkv[i] = Pv[(i+ioff-imin)*L+k];
+            finishprobs(Pkv, NTk, ioff, ws->_Tminv[kv[k]], ws->_Tmaxv[kv[k]]);
+        }
+    }
+
+    // normalize the probabilities calculated for a single field and determine the temperature range
+    // where the probabability is above a given fraction of its maximum
+    void finishprobs(double* Pv, int NT, int ioff, double& Tmin, double& Tmax) const
+    {
+        // normalize probabilities to unity
+        double sum = 0.;
+        for (int i=0; i<NT; i++) sum += Pv[i];
+        for (int i=0; i<NT; i++) Pv[i] /= sum;
+
+        // determine the temperature range where the probabability is above a given fraction of its maximum
+        double max = Pv[0];
+        for (int i=1; i<NT; i++) if (Pv[i] > max) max = Pv[i];
+        double frac = 1e-20 * max;
+        int k;
+        for (k=0; k!=NT-2; k++) if (Pv[k]>frac) break;
+        Tmin = _grid->_Tv[k+ioff];
+        for (k=NT-2; k!=1; k--) if (Pv[k]>frac) break;
+        Tmax = _grid->_Tv[k+1+ioff];
+    }
 };
 
 ////////////////////////////////////////////////////////////////////
@@ -293,7 +465,7 @@ namespace
 ////////////////////////////////////////////////////////////////////
 
 TransientDustEmissivity::TransientDustEmissivity()
-    : _Nlambda(0)
+    : _Nlambda(0), _Ngc(0), _NTmax(0), _parfac(0)
 {
 }
 
@@ -305,6 +477,7 @@ TransientDustEmissivity::~TransientDustEmissivity()
     foreach (const TDE_Calculator* calculator, _calculatorsB.values()) delete calculator;
     foreach (const TDE_Calculator* calculator, _calculatorsC.values()) delete calculator;
     foreach (const TDE_Grid* grid, _grids) delete grid;
+    for (TDE_Workspace* workspace : _workspaces) delete workspace;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -331,85 +504,160 @@ void TransientDustEmissivity::setupSelfBefore()
         const TDE_Grid* gridC = new TDE_Grid(lambdagrid, 2.,Tupper,Tupper/widthC,ratioC);
         _grids << gridA << gridB << gridC;
 
-        // create calculators
+        // create calculators, and number the grain compositions in the mix
+        QHash<QString,int> gcindices;
         int Npop = mix->Npop();
         for (int c=0; c<Npop; c++)
         {
             _calculatorsA.insert(QPair<const DustMix*,int>(mix,c), new TDE_Calculator(gridA,mix,c));
             _calculatorsB.insert(QPair<const DustMix*,int>(mix,c), new TDE_Calculator(gridB,mix,c));
             _calculatorsC.insert(QPair<const DustMix*,int>(mix,c), new TDE_Calculator(gridC,mix,c));
+            QString gcname = mix->gcname(c);
+            if (!gcindices.contains(gcname)) gcindices.insert(gcname, gcindices.size());
+            _gcindices.insert(QPair<const DustMix*,int>(mix,c), gcindices.value(gcname));
         }
+        _Ngc = max(_Ngc, gcindices.size());
     }
+
+    // determine the largest temperature grid, which sets the size of the scratch memory for each thread
+    _NTmax = 0;
+    foreach (const TDE_Grid* grid, _grids) _NTmax = max(_NTmax, grid->_NT);
+
+    // provide an (empty) workspace slot for each thread; the memory is allocated on first use by that thread
+    _parfac = find<ParallelFactory>();
+    _workspaces.assign(_parfac->maxThreadCount(), 0);
+    size_t bytes = sizeof(double) * (Nbatch * (_Nlambda + 4*_NTmax + _Ngc + 3) + _Nlambda) + sizeof(int) * Nbatch * 6;
+    find<Log>()->info("Scratch memory for transient dust emissivity computations: "
+                      + QString::number(bytes/1024., 'f', 1) + " kB per thread");
 }
 
 ////////////////////////////////////////////////////////////////////
 
 Array TransientDustEmissivity::emissivity(const DustMix* mix, const Array& Jv) const
+{
+    ArrayTable<2>& Jvv = threadWorkspace()->_Jvv;
+    Jvv[0] = Jv;
+    ArrayTable<2> evv;
+    emissivities(mix, Jvv, evv);
+    return evv[0];
+}
+
+////////////////////////////////////////////////////////////////////
+
+void TransientDustEmissivity::emissivities(const DustMix* mix, const ArrayTable<2>& Jvv, ArrayTable<2>& evv) const
 {
     const MultiGrainDustMix* mgmix = mix->find<MultiGrainDustMix>();
 
-    // This dictionary is updated as the loop over all dust populations in the mix proceeds.
+    // get the room for the state of the calculation for each of the radiation fields (indexed on k)
+    // from the scratch memory for this thread (see TDE_Workspace)
+    int Nfields = Jvv.size(0);
+    evv.resize(Nfields,_Nlambda);   // the accumulated emissivities
+    TDE_Workspace* ws = threadWorkspace();
+    ws->resize(Nfields);
+    vector<double>& Teqv = ws->_Teqv;
+    vector<double>& Tminv = ws->_Tminv;
+    vector<double>& Tmaxv = ws->_Tmaxv;
+    vector<int>& ioffv = ws->_ioffv;
+
+    // For each field, this table is updated as the loop over all dust populations in the mix proceeds.
     // For each type of grain composition, it keeps track of the grain mass above which
     // the dust population is most certainly in equilibrium.
-    QHash<QString,double> eqMass;
+    vector<double>& eqMassv = ws->_eqMassv;
+    fill(eqMassv.begin(), eqMassv.begin()+Nfields*_Ngc, numeric_limits<double>::infinity());
 
-    // provide room for the probabilities calculated over each of the temperature grids
-    Array Pv;
-    Square<double> Am(ceil(Tuppermax)+1);
+    // the indices of the fields that are handled by the coarse, medium and fine calculators
+    vector<int>& kAv = ws->_kAv;
+    vector<int>& kBv = ws->_kBv;
+    vector<int>& kCv = ws->_kCv;
 
     // accumulate the emissivities for all populations in the dust mix
-    Array ev(_Nlambda);
     int Npop = mix->Npop();
     for (int c=0; c<Npop; c++)
     {
-        // get the coarse calculator for this population
+        // get the calculators for this population
         const TDE_Calculator* calculatorA = _calculatorsA.value(qMakePair(mix,c));
+        const TDE_Calculator* calculatorB = _calculatorsB.value(qMakePair(mix,c));
+        const TDE_Calculator* calculatorC = _calculatorsC.value(qMakePair(mix,c));
+        int g = _gcindices.value(qMakePair(mix,c));
+        double meanmass = mgmix->meanmass(c);
 
-        // determine the equilibrium temperature for this population
-        double Teq = mix->equilibrium(Jv,c);
+        // determine the equilibrium temperature for this population, and consider transient calculation
+        // only if the mean mass for this population is below the cutoff mass
+        kAv.clear();
+        for (int k=0; k<Nfields; k++)
+        {
+            Teqv[k] = mix->equilibrium(Jvv[k],c);
+            if (meanmass < eqMassv[k*_Ngc+g])
+            {
+                Tminv[k] = 0;
+                Tmaxv[k] = Tuppermax;
+                kAv.push_back(k);
+            }
+            else calculatorA->addequilibrium(evv[k], Teqv[k]);
+        }
 
-        // consider transient calculation only if the mean mass for this population is below the cutoff mass
-        QString gcname = mgmix->gcname(c);
-        double meanmass = mgmix->meanmass(c);
-        if (meanmass < eqMass.value(gcname,numeric_limits<double>::infinity()))
+        // calculate the probabilities over the coarse temperature grid
+        calculatorA->calcprobs(kAv, Jvv, ws);
+
+        // if the population might be transient, select the medium or fine temperature grid
+        // depending on the temperature range; otherwise, add the equilibrium emissivity
+        kBv.clear();
+        kCv.clear();
+        for (int k : kAv)
         {
-            // calculate the probabilities over the coarse temperature grid
-            double Tmin = 0;
-            double Tmax = Tuppermax;
-            int ioff = 0;
-            calculatorA->calcprobs(Pv, ioff, Am, Tmin, Tmax, Jv);
-
-            // if the population might be transient...
-            if (Tmax-Tmin > deltaTeq && Teq < Tmax)
+            if (Tmaxv[k]-Tminv[k] > deltaTeq && Teqv[k] < Tmaxv[k])
+            {
+                if (Tmaxv[k]-Tminv[k] > deltaTmedium) kBv.push_back(k);
+                else kCv.push_back(k);
+            }
+            else
             {
-                // select the medium or fine temperature grid depending on the temperature range
-                const TDE_Calculator* calculator = (Tmax-Tmin > deltaTmedium)
-                                                   ? _calculatorsB.value(qMakePair(mix,c))
-                                                   : _calculatorsC.value(qMakePair(mix,c));
+                // remember that all grains above this mass will be in equilibrium
+                eqMassv[k*_Ngc+g] = meanmass;
+                calculatorA->addequilibrium(evv[k], Teqv[k]);
+            }
+        }
 
-                // calculate the probabilities over the chosen grid, in the range determined by the coarse calculation
-                calculator->calcprobs(Pv, ioff, Am, Tmin, Tmax, Jv);
+        // calculate the probabilities over the chosen grid, in the range determined by the coarse calculation
+        calculatorB->calcprobs(kBv, Jvv, ws);
+        calculatorC->calcprobs(kCv, Jvv, ws);
 
-                // if the population indeed is transient...
-                if (Tmax-Tmin > deltaTeq && Teq < Tmax)
+        // if the population indeed is transient, add the transient emissivity of this population to the
+        // running total; otherwise, add the equilibrium emissivity
+        for (int i=0; i<2; i++)
+        {
+            const TDE_Calculator* calculator = i ? calculatorC : calculatorB;
+            for (int k : i ? kCv : kBv)
+            {
+                if (Tmaxv[k]-Tminv[k] > deltaTeq && Teqv[k] < Tmaxv[k])
+                {
+                    calculator->addtransient(evv[k], Tminv[k], Tmaxv[k], ws->probs(k), ioffv[k]);
+                }
+                else
                 {
-                    // add the transient emissivity of this population to the running total
-                    calculator->addtransient(ev, Tmin, Tmax, Pv, ioff);
-                    continue;
+                    // remember that all grains above this mass will be in equilibrium
+                    eqMassv[k*_Ngc+g] = meanmass;
+                    calculatorA->addequilibrium(evv[k], Teqv[k]);
                 }
             }
-
-            // remember that all grains above this mass will be in equilibrium
-            eqMass[gcname] = meanmass;
         }
-
-        // otherwise, add the equilibrium emissivity of this population to the running total
-        calculatorA->addequilibrium(ev, Teq);
     }
 
     // convert emissivity from "per hydrogen atom" to "per unit mass"
-    ev /= mix->mu();
-    return ev;
+    for (int k=0; k<Nfields; k++) evv[k] /= mix->mu();
+}
+
+////////////////////////////////////////////////////////////////////
+
+TDE_Workspace* TransientDustEmissivity::threadWorkspace() const
+{
+    // get the scratch memory for this thread, allocating it if this is the first invocation from this thread;
+    // each thread accesses only its own slot, so there is no need for locking
+    size_t thread = _parfac->currentThreadIndex();
+    if (thread >= _workspaces.size()) throw FATALERROR("Thread index exceeds the number of transient emissivity workspaces");
+    TDE_Workspace*& workspace = _workspaces[thread];
+    if (!workspace) workspace = new TDE_Workspace(_NTmax, _Ngc, _Nlambda);
+    return workspace;
 }
 
 ////////////////////////////////////////////////////////////////////
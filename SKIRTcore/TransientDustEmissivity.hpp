@@ -6,10 +6,13 @@
 #ifndef TRANSIENTDUSTEMISSIVITY_HPP
 #define TRANSIENTDUSTEMISSIVITY_HPP
 
+#include <vector>
 #include <QHash>
 #include "DustEmissivity.hpp"
+class ParallelFactory;
 class TDE_Calculator;
 class TDE_Grid;
+class TDE_Workspace;
 
 //////////////////////////////////////////////////////////////////////
 
@@ -62,6 +65,19 @@ class TDE_Grid;
     B_{f+1,i}+A_{f,i} & f=N-2,\ldots,1;\,i=0,\ldots,f-1 \\ X_0 &= 1 \\ X_i &=
     \frac{\sum_{j=0}^{i-1}B_{i,j}X_j}{A_{i-1,i}} & i=1,\ldots,N-1 \\ P_i &=
     \frac{X_i}{\sum_{j=0}^{N-1}X_j} & i=0,\ldots,N-1 \f}
+
+    The implementation evaluates these relations column by column. Once \f$X_j\f$ is known, the
+    adjusted matrix elements \f$B_{f,j}\f$ in column \f$j\f$ are calculated on the fly (from
+    the last row upwards), and their contributions \f$B_{f,j}X_j\f$ are added to the partial
+    sums in the numerators for all \f$f>j\f$. The terms are added in the same order as in the
+    formulation given above, but the adjusted matrix never needs to be stored, and the heating
+    rate data (stored by column) are traversed only once. Furthermore, when the emissivity is
+    requested for a number of radiation fields at the same time (see the emissivities()
+    function), the recursion is performed for a batch of fields together, with the innermost
+    loops running over the fields so that they can be vectorized by the compiler. Each batch
+    covers the union of the temperature ranges of its fields; the matrix elements outside of the
+    range of a particular field are set to zero so that the result for each field is the same as
+    the result of a separate calculation.
 */
 class TransientDustEmissivity : public DustEmissivity
 {
@@ -79,7 +95,12 @@ public:
     ~TransientDustEmissivity();
 
     /** This function verifies that all dust components in the dust system have a dust mix based on
-        the MultiGrainDustMix class. */
+        the MultiGrainDustMix class. It also constructs the temperature grids and calculators for
+        each of the dust populations, and it prepares a scratch workspace slot for each parallel
+        execution thread. The workspace for a thread is allocated the first time that thread
+        requests an emissivity. It holds the complete state of the calculation for a batch of
+        radiation fields, sized to the largest temperature grid actually in use, so that it can be
+        reused for every subsequent calculation without further memory allocation. */
     void setupSelfBefore();
 
     //======================== Other Functions =======================
@@ -88,8 +109,15 @@ public:
     /** This function returns the dust emissivity \f$\varepsilon_\ell\f$ at all wavelength indices
         \f$\ell\f$ for a dust mix of the specified type residing in the specified mean radiation
         field \f$J_\ell\f$, assuming the simulation's wavelength grid. */
-
     Array emissivity(const DustMix* mix, const Array& Jv) const;
+
+    /** This function calculates the dust emissivity for a dust mix of the specified type residing
+        in each of the specified mean radiation fields \f$J_{k,\ell}\f$, and stores the results
+        in the output table \f$\varepsilon_{k,\ell}\f$. The fields are processed in batches as
+        described in the class header, which is substantially faster than invoking emissivity()
+        for each field separately. */
+    void emissivities(const DustMix* mix, const ArrayTable<2>& Jvv, ArrayTable<2>& evv) const;
+
     /** The return value of this function indicates a meaningful frequency for console-logging when
         repeatly invoking emissivity(). A value of zero means that the calculation is fast and thus
         there should be no logging. A value of one means that the calculation is slow and thus
@@ -97,6 +125,10 @@ public:
         function returns one, which means every invocation should be logged. */
     virtual int logfrequency() const;
 
+private:
+    /** This function returns the scratch workspace for the calling thread, allocating it if needed. */
+    TDE_Workspace* threadWorkspace() const;
+
     //========================= Data members =======================
 
 private:
@@ -109,6 +141,16 @@ private:
     QHash< QPair<const DustMix*,int>, const TDE_Calculator* > _calculatorsA;     // coarse grid
     QHash< QPair<const DustMix*,int>, const TDE_Calculator* > _calculatorsB;     // medium grid
     QHash< QPair<const DustMix*,int>, const TDE_Calculator* > _calculatorsC;     // fine grid
+
+    // setupSelfBefore numbers the grain compositions in each dust mix, and determines the largest number
+    // of grain compositions in a mix and the largest number of temperature grid points over all grids
+    QHash< QPair<const DustMix*,int>, int > _gcindices;
+    int _Ngc;
+    int _NTmax;
+
+    // scratch memory for the calculation, one for each parallel thread (allocated by the thread on first use)
+    ParallelFactory* _parfac;
+    mutable std::vector<TDE_Workspace*> _workspaces;
 };
 
 ////////////////////////////////////////////////////////////////////
@@ -5,6 +5,8 @@
 
 #include <cfloat>
 #include <cmath>
+#include <QTime>
+#include "DustCacheFile.hpp"
 #include "DustDistribution.hpp"
 #include "DustGridPath.hpp"
 #include "DustGridPlotFile.hpp"
@@ -16,6 +18,7 @@
 #include "ParallelFactory.hpp"
 #include "PeerToPeerCommunicator.hpp"
 #include "Random.hpp"
+#include "RootAssigner.hpp"
 #include "TreeDustGrid.hpp"
 #include "TreeNode.hpp"
 #include "TreeNodeBoxDensityCalculator.hpp"
@@ -26,13 +29,43 @@ using namespace std;
 
 //////////////////////////////////////////////////////////////////////
 
+namespace
+{
+    // Returns a checksum of the sequence of cell numbers in the specified path
+    quint64 pathchecksum(const DustGridPath& path)
+    {
+        quint64 checksum = path.size();
+        for (int k=0; k<path.size(); k++) checksum = checksum*1000003 + path.m(k);
+        return checksum;
+    }
+
+    // A density calculator that provides a barycenter calculated earlier, for use when creating the children
+    // of a tree node; the other properties are no longer needed at that point and thus are not supported
+    class StoredBarycenterCalculator : public TreeNodeDensityCalculator
+    {
+    public:
+        StoredBarycenterCalculator(const Box& extent, Vec barycenter) : _extent(extent), _barycenter(barycenter) { }
+        double volume() const { return _extent.volume(); }
+        double mass() const { throw FATALERROR("Calculation is not supported"); }
+        Vec barycenter() const { return _barycenter; }
+        double opticalDepth() const { throw FATALERROR("Calculation is not supported"); }
+        double densityDispersion() const { throw FATALERROR("Calculation is not supported"); }
+
+    private:
+        Box _extent;
+        Vec _barycenter;
+    };
+}
+
+//////////////////////////////////////////////////////////////////////
+
 TreeDustGrid::TreeDustGrid()
     : _minlevel(0), _maxlevel(0),
       _search(TopDown), _Nrandom(100),
       _maxOpticalDepth(0), _maxMassFraction(0), _maxDensDispFraction(0),
-      _assigner(0), _random(0), _parallel(0), _dd(0), _dmib(0),
+      _assigner(0), _Nbenchmark(0), _random(0), _parallel(0), _dd(0), _dmib(0),
       _totalmass(0), _eps(0),
-      _Nnodes(0), _highestWriteLevel(0),
+      _highestWriteLevel(0),
       _useDmibForSubdivide(false)
 {
 }
@@ -41,8 +74,7 @@ TreeDustGrid::TreeDustGrid()
 
 TreeDustGrid::~TreeDustGrid()
 {
-    for (int l=0; l<_Nnodes; l++)
-        delete _tree[l];
+    for (TreeNode* node : _tree) delete node;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -58,6 +90,7 @@ void TreeDustGrid::setupSelfBefore()
     if (_maxlevel < 2) throw FATALERROR("The maximum tree level should be at least 2");
     if (_maxlevel <= _minlevel) throw FATALERROR("Maximum tree level should be larger than minimum tree level");
     if (_Nrandom < 1) throw FATALERROR("Number of random samples must be at least 1");
+    if (_Nbenchmark < 0) throw FATALERROR("The number of benchmark paths should be positive");
     if (_maxOpticalDepth < 0.0) throw FATALERROR("The maximum mean optical depth should be positive");
     if (_maxMassFraction < 0.0) throw FATALERROR("The maximum mass fraction should be positive");
     if (_maxDensDispFraction < 0.0) throw FATALERROR("The maximum density dispersion fraction should be positive");
@@ -66,72 +99,30 @@ void TreeDustGrid::setupSelfBefore()
     if (!_assigner) setAssigner(new IdenticalAssigner(this));
 
     // Cache some often used values
-    // A Parallel instance is created with a limited amount of threads (4) for performance reasons
     _random = find<Random>();
-    _parallel = find<ParallelFactory>()->parallel(4);
+    _parallel = find<ParallelFactory>()->parallel();
     _dd = find<DustDistribution>();
     _dmib = _dd->interface<DustMassInBoxInterface>();
     _useDmibForSubdivide = _dmib && !_maxDensDispFraction;
     _totalmass = _dd->mass();
     _eps = 1e-12 * extent().widths().norm();
 
-    // Create the root node
-
-    _tree.push_back(createRoot(extent()));
-
-    // Recursively subdivide the root node until all nodes satisfy the
-    // necessary criteria. When finished, set the number _Nnodes.
+    // Construct the tree, unless the tree structure has been read from a cache file
 
-    int currentlevel = -1;
-    unsigned int l = 0;
-    while (true)
-    {
-        TreeNode* node = _tree[l];
-        int level = node->level();
-        if (level>currentlevel)
-        {
-            log->info("Starting subdivision of level " + QString::number(level) + "...");
-            currentlevel = level;
-        }
-        if (l%50000 == 0)
-            log->info("Subdividing node number " + QString::number(l) + "...");
-        if (node->ynchildless())
-            subdivide(node);
-        l++;
-        if (l>=_tree.size()) break;
-    }
-    _Nnodes = _tree.size();
-
-    // Construction of a vector _idv that contains the node IDs of all
-    // leaves. This is the actual dust cell vector (only the leaves will
-    // eventually become valid dust cells). We also create a vector
-    // _cellnumberv with the cell numbers of all the nodes (i.e. the
-    // rank m of the node in the vector _idv if the node is a leaf, and
-    // -1 if the node is not a leaf).
-
-    int m = 0;
-    _cellnumberv.resize(_Nnodes,-1);
-    for (int l=0; l<_Nnodes; l++)
-    {
-        if (_tree[l]->ynchildless())
-        {
-            _idv.push_back(l);
-            _cellnumberv[l] = m;
-            m++;
-        }
-    }
-    int Ncells = _idv.size();
+    if (_ltree.numNodes() == 0) buildtree();
+    else log->info("Using the tree structure read from the cache file.");
+    int Nnodes = _ltree.numNodes();
+    int Ncells = _ltree.numCells();
 
     // Log the number of cells
 
     log->info("Construction of the tree finished.");
-    log->info("  Total number of nodes: " + QString::number(_Nnodes));
+    log->info("  Total number of nodes: " + QString::number(Nnodes));
     log->info("  Total number of leaves: " + QString::number(Ncells));
     vector<int> countv(_maxlevel+1);
     for (int m=0; m<Ncells; m++)
     {
-        TreeNode* node = _tree[_idv[m]];
-        int level = node->level();
+        int level = _ltree.level(_ltree.cellnode(m));
         countv[level]++;
     }
     log->info("  Number of leaf cells of each level:");
@@ -152,27 +143,310 @@ void TreeDustGrid::setupSelfBefore()
             log->info("Will be outputting 3D grid data up to level " + QString::number(_highestWriteLevel) +
                       ", i.e. " + QString::number(cumulativeCells) + " cells.");
     }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void TreeDustGrid::buildtree()
+{
+    // Create the root node
+
+    Log* log = find<Log>();
+    _tree.push_back(createRoot(extent()));
+
+    // Subdivide the tree level by level until all nodes satisfy the necessary criteria. For each level,
+    // the subdivision criteria are evaluated concurrently for all nodes of the level, and the nodes are
+    // distributed over the processes by the assigner. If the assigner does not distribute the work, each
+    // process evaluates all nodes, using a private assigner so that the work can be distributed over threads.
+    // The results are then shared between the processes, so that all processes construct the same tree.
+    // Finally, the children are created in the order of the nodes in the level, which results in
+    // a deterministic node numbering regardless of the order in which the nodes were evaluated.
+
+    PeerToPeerCommunicator* comm = find<PeerToPeerCommunicator>();
+    RootAssigner localassigner(0);
+    ProcessAssigner* assigner = _assigner->parallel() ? _assigner : &localassigner;
+    size_t begin = 0;
+    while (begin < _tree.size())
+    {
+        // get the nodes of the current level
+        size_t end = _tree.size();
+        int Nnodes = end - begin;
+        int level = _tree[begin]->level();
+        log->info("Subdividing level " + QString::number(level) + " with " + QString::number(Nnodes) + " nodes...");
+        _levelnodev.assign(_tree.begin()+begin, _tree.begin()+end);
+
+        // evaluate the subdivision criteria for each of these nodes
+        _resultv.resize(0);
+        _resultv.resize(4*Nnodes);
+        assigner->assign(Nnodes);
+        _parallel->call(this, &TreeDustGrid::evaluatenode, assigner);
+        _random->resetStreams();
+
+        // share the results between the processes
+        if (comm->isMultiProc())
+        {
+            if (assigner == &localassigner) comm->broadcast(_resultv, comm->root());
+            else comm->sum_all(_resultv);
+        }
+
+        // create the children for the nodes that need subdivision
+        for (int i=0; i<Nnodes; i++)
+        {
+            if (_resultv[4*i])
+            {
+                TreeNode* node = _levelnodev[i];
+                if (node->level() <= _minlevel) node->createchildren(_tree.size());
+                else if (_useDmibForSubdivide)
+                {
+                    TreeNodeBoxDensityCalculator calc(_dmib, node);
+                    node->createchildren(_tree.size(), &calc);
+                }
+                else
+                {
+                    StoredBarycenterCalculator calc(node->extent(), Vec(_resultv[4*i+1], _resultv[4*i+2], _resultv[4*i+3]));
+                    node->createchildren(_tree.size(), &calc);
+                }
+                _tree.insert(_tree.end(), node->children().begin(), node->children().end());
+            }
+        }
+        begin = end;
+    }
+    _levelnodev.clear();
+    _resultv.resize(0);
 
     // Add neighbors to the tree structure (but only if required for the search method)
 
     if (_search == Neighbor)
     {
         log->info("Adding neighbors to the tree nodes...");
-        for (int l=0; l<_Nnodes; l++) _tree[l]->addneighbors();
-        for (int l=0; l<_Nnodes; l++) _tree[l]->sortneighbors();
+        for (TreeNode* node : _tree) node->addneighbors();
+        for (TreeNode* node : _tree) node->sortneighbors();
     }
+
+    // Convert the tree to its linear representation, which also assigns the cell numbers
+    // (only the leaves will eventually become valid dust cells), and discard the original nodes
+
+    _ltree.initialize(_tree, _search == Neighbor);
+    if (_Nbenchmark) benchmarktraversal();
+    for (TreeNode* node : _tree) delete node;
+    _tree.clear();
 }
 
 //////////////////////////////////////////////////////////////////////
 
-void TreeDustGrid::subdivide(TreeNode* node)
+void TreeDustGrid::benchmarktraversal()
 {
-    // If level is below or at minlevel, there is always subdivision, and the subdivision is "regular"
+    Log* log = find<Log>();
+    for (TreeNode* node : _tree)
+    {
+        if (!node->ynchildless() && node->children().size() != 8)
+        {
+            log->warning("The traversal benchmark supports only octrees -- skipping");
+            return;
+        }
+    }
+    log->info("Comparing traversal methods for " + QString::number(_Nbenchmark) + " random paths...");
+
+    // map the identifier of each leaf node to its cell number in the linear tree
+    vector<int> cellnumberv(_tree.size(), -1);
+    for (TreeNode* node : _tree)
+    {
+        if (node->ynchildless())
+        {
+            Vec center = node->extent().center();
+            cellnumberv[node->id()] = _ltree.cellnumber(_ltree.whichnode(center.x(), center.y(), center.z()));
+        }
+    }
+
+    // generate the random rays from a stream that is not used for anything else
+    _random->setConstructionStream(_maxlevel+1, 0);
+    vector<Position> bfrv(_Nbenchmark);
+    vector<Direction> bfkv(_Nbenchmark);
+    for (int i=0; i<_Nbenchmark; i++)
+    {
+        bfrv[i] = _random->position(extent());
+        bfkv[i] = _random->direction();
+    }
+    _random->resetStreams();
+
+    // time the pointer-based traversal, keeping a checksum of the cell sequence for each path
+    DustGridPath path;
+    vector<quint64> checksumv(_Nbenchmark);
+    QTime timer;
+    timer.start();
+    for (int i=0; i<_Nbenchmark; i++)
+    {
+        path.setPosition(bfrv[i]);
+        path.setDirection(bfkv[i]);
+        pointerpath(&path, cellnumberv);
+        checksumv[i] = pathchecksum(path);
+    }
+    int pointertime = timer.elapsed();
+
+    // time the traversal of the linear tree with the same search method, and compare the checksums
+    SearchMethod search = _search;
+    _search = Bookkeeping;
+    int Ndiff = 0;
+    timer.start();
+    for (int i=0; i<_Nbenchmark; i++)
+    {
+        path.setPosition(bfrv[i]);
+        path.setDirection(bfkv[i]);
+        TreeDustGrid::path(&path);
+        if (pathchecksum(path) != checksumv[i]) Ndiff++;
+    }
+    int lineartime = timer.elapsed();
+    _search = search;
+
+    log->info("  Pointer-based traversal: " + QString::number(pointertime*0.001,'f',3) + " s");
+    log->info("  Linear traversal: " + QString::number(lineartime*0.001,'f',3) + " s");
+    if (Ndiff) log->warning("  Number of paths with a different cell sequence: " + QString::number(Ndiff));
+    else log->info("  All paths have the same cell sequence");
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void TreeDustGrid::pointerpath(DustGridPath* path, const vector<int>& cellnumberv) const
+{
+    // Initialize the path
+    path->clear();
+
+    // If the photon package starts outside the dust grid, move it into the first grid cell that it will pass
+    Position bfr = path->moveInside(extent(), _eps);
+
+    // Get the node containing the current location;
+    // if the position is not inside the grid, return an empty path
+    const TreeNode* node = _tree[0]->whichnode(bfr);
+    if (!node) return path->clear();
+
+    double x,y,z;
+    bfr.cartesian(x,y,z);
+    double kx,ky,kz;
+    path->direction().cartesian(kx,ky,kz);
+
+    // Move from cell to cell, deriving the next node from the octree node numbering
+    int l = node->id();
+    while (true)
+    {
+        double xnext = (kx<0.0) ? _tree[l]->xmin() : _tree[l]->xmax();
+        double ynext = (ky<0.0) ? _tree[l]->ymin() : _tree[l]->ymax();
+        double znext = (kz<0.0) ? _tree[l]->zmin() : _tree[l]->zmax();
+        double dsx = (fabs(kx)>1e-15) ? (xnext-x)/kx : DBL_MAX;
+        double dsy = (fabs(ky)>1e-15) ? (ynext-y)/ky : DBL_MAX;
+        double dsz = (fabs(kz)>1e-15) ? (znext-z)/kz : DBL_MAX;
+
+        // the x-wall is hit first: move up until the node is on the appropriate side of its father,
+        // then move to the sibling at the other side and down to the leaf containing the position
+        if (dsx<=dsy && dsx<=dsz)
+        {
+            path->addSegment(cellnumberv[l], dsx);
+            x  = xnext;
+            y += ky*dsx;
+            z += kz*dsx;
+            while (true)
+            {
+                int oct = ((l - 1) % 8) + 1;
+                bool place = (kx<0.0) ? (oct % 2 == 1) : (oct % 2 == 0);
+                if (!place) break;
+                l = _tree[l]->father()->id();
+                if (l == 0) return;
+            }
+            l += (kx<0.0) ? -1 : 1;
+            while (cellnumberv[l] == -1)
+            {
+                double yM = _tree[l]->child(0)->ymax();
+                double zM = _tree[l]->child(0)->zmax();
+                if (kx<0.0)
+                {
+                    if (y<=yM) l = (z<=zM) ? _tree[l]->child(1)->id() : _tree[l]->child(5)->id();
+                    else       l = (z<=zM) ? _tree[l]->child(3)->id() : _tree[l]->child(7)->id();
+                }
+                else
+                {
+                    if (y<=yM) l = (z<=zM) ? _tree[l]->child(0)->id() : _tree[l]->child(4)->id();
+                    else       l = (z<=zM) ? _tree[l]->child(2)->id() : _tree[l]->child(6)->id();
+                }
+            }
+        }
+
+        // the y-wall is hit first
+        else if (dsy<dsx && dsy<=dsz)
+        {
+            path->addSegment(cellnumberv[l], dsy);
+            x += kx*dsy;
+            y  = ynext;
+            z += kz*dsy;
+            while (true)
+            {
+                bool place = (ky<0.0) ? ((l-1) % 4 < 2) : ((l-1) % 4 > 1);
+                if (!place) break;
+                l = _tree[l]->father()->id();
+                if (l == 0) return;
+            }
+            l += (ky<0.0) ? -2 : 2;
+            while (cellnumberv[l] == -1)
+            {
+                double xM = _tree[l]->child(0)->xmax();
+                double zM = _tree[l]->child(0)->zmax();
+                if (ky<0.0)
+                {
+                    if (x<=xM) l = (z<=zM) ? _tree[l]->child(2)->id() : _tree[l]->child(6)->id();
+                    else       l = (z<=zM) ? _tree[l]->child(3)->id() : _tree[l]->child(7)->id();
+                }
+                else
+                {
+                    if (x<=xM) l = (z<=zM) ? _tree[l]->child(0)->id() : _tree[l]->child(4)->id();
+                    else       l = (z<=zM) ? _tree[l]->child(1)->id() : _tree[l]->child(5)->id();
+                }
+            }
+        }
+
+        // the z-wall is hit first
+        else
+        {
+            path->addSegment(cellnumberv[l], dsz);
+            x += kx*dsz;
+            y += ky*dsz;
+            z  = znext;
+            while (true)
+            {
+                int oct = ((l-1) % 8) + 1;
+                bool place = (kz<0.0) ? (oct < 5) : (oct > 4);
+                if (!place) break;
+                l = _tree[l]->father()->id();
+                if (l == 0) return;
+            }
+            l += (kz<0.0) ? -4 : 4;
+            while (cellnumberv[l] == -1)
+            {
+                double xM = _tree[l]->child(0)->xmax();
+                double yM = _tree[l]->child(0)->ymax();
+                if (kz<0.0)
+                {
+                    if (x<=xM) l = (y<=yM) ? _tree[l]->child(4)->id() : _tree[l]->child(6)->id();
+                    else       l = (y<=yM) ? _tree[l]->child(5)->id() : _tree[l]->child(7)->id();
+                }
+                else
+                {
+                    if (x<=xM) l = (y<=yM) ? _tree[l]->child(0)->id() : _tree[l]->child(2)->id();
+                    else       l = (y<=yM) ? _tree[l]->child(1)->id() : _tree[l]->child(3)->id();
+                }
+            }
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void TreeDustGrid::evaluatenode(size_t i)
+{
+    TreeNode* node = _levelnodev[i];
     int level = node->level();
+
+    // If level is below or at minlevel, there is always subdivision, and the subdivision is "regular"
     if (level <= _minlevel)
     {
-        node->createchildren(_tree.size());
-        _tree.insert(_tree.end(), node->children().begin(), node->children().end());
+        _resultv[4*i] = 1.;
     }
 
     // if level is below maxlevel, there may be subdivision depending on various stopping criteria
@@ -187,11 +461,12 @@ void TreeDustGrid::subdivide(TreeNode* node)
         }
         else
         {
-            // sample the density in the cell
+            // sample the density in the cell, using the random stream reserved for this node, so that
+            // the samples do not depend on the thread or process evaluating the node
+            _random->setConstructionStream(level, i);
             TreeNodeSampleDensityCalculator* sampleCalc =
                     new TreeNodeSampleDensityCalculator(_random, _Nrandom, _dd, node);
-            _assigner->assign(_Nrandom);
-            _parallel->call(sampleCalc, _assigner);
+            sampleCalc->sample();
             calc = sampleCalc;
         }
 
@@ -221,11 +496,17 @@ void TreeDustGrid::subdivide(TreeNode* node)
             if (densdispfraction >= _maxDensDispFraction) needDivision = true;
         }
 
+        // there is subdivision, possibly using the barycenter (which is available only when sampling)
         if (needDivision)
         {
-            // there is subdivision, possibly using calculated properties such as barycenter
-            node->createchildren(_tree.size(), calc);
-            _tree.insert(_tree.end(), node->children().begin(), node->children().end());
+            _resultv[4*i] = 1.;
+            if (!_useDmibForSubdivide)
+            {
+                Vec bfr = calc->barycenter();
+                _resultv[4*i+1] = bfr.x();
+                _resultv[4*i+2] = bfr.y();
+                _resultv[4*i+3] = bfr.z();
+            }
         }
 
         delete calc;
@@ -348,41 +629,54 @@ ProcessAssigner* TreeDustGrid::assigner() const
 
 //////////////////////////////////////////////////////////////////////
 
+void TreeDustGrid::setBenchmarkPathCount(int value)
+{
+    _Nbenchmark = value;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+int TreeDustGrid::benchmarkPathCount() const
+{
+    return _Nbenchmark;
+}
+
+//////////////////////////////////////////////////////////////////////
+
 double TreeDustGrid::volume(int m) const
 {
-    if (m<0 || m>numCells())
+    if (m<0 || m>=numCells())
         throw FATALERROR("Invalid cell number: " + QString::number(m));
-    TreeNode* node = getnode(m);
-    return node->xwidth() * node->ywidth() * node->zwidth();
+    return _ltree.extent(_ltree.cellnode(m)).volume();
 }
 
 //////////////////////////////////////////////////////////////////////
 
 int TreeDustGrid::numCells() const
 {
-    return _idv.size();
+    return _ltree.numCells();
 }
 
 //////////////////////////////////////////////////////////////////////
 
 int TreeDustGrid::whichcell(Position bfr) const
 {
-    const TreeNode* node = root()->whichnode(bfr);
-    return node ? cellnumber(node) : -1;
+    int l = _ltree.whichnode(bfr.x(), bfr.y(), bfr.z());
+    return l>=0 ? _ltree.cellnumber(l) : -1;
 }
 
 //////////////////////////////////////////////////////////////////////
 
 Position TreeDustGrid::centralPositionInCell(int m) const
 {
-    return Position(getnode(m)->extent().center());
+    return Position(_ltree.extent(_ltree.cellnode(m)).center());
 }
 
 //////////////////////////////////////////////////////////////////////
 
 Position TreeDustGrid::randomPositionInCell(int m) const
 {
-    return _random->position(getnode(m)->extent());
+    return _random->position(_ltree.extent(_ltree.cellnode(m)));
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -397,73 +691,25 @@ void TreeDustGrid::path(DustGridPath* path) const
 
     // Get the node containing the current location;
     // if the position is not inside the grid, return an empty path
-    const TreeNode* node = root()->whichnode(bfr);
-    if (!node) return path->clear();
+    double x,y,z;
+    bfr.cartesian(x,y,z);
+    int l = _ltree.whichnode(x,y,z);
+    if (l<0) return path->clear();
 
     // Start the loop over nodes/path segments until we leave the grid.
     // Use a different code segment depending on the search method.
-    double x,y,z;
-    bfr.cartesian(x,y,z);
     double kx,ky,kz;
     path->direction().cartesian(kx,ky,kz);
 
-    // ----------- Top-down -----------
-
-    if (_search == TopDown)
-    {
-        while (node)
-        {
-            double xnext = (kx<0.0) ? node->xmin() : node->xmax();
-            double ynext = (ky<0.0) ? node->ymin() : node->ymax();
-            double znext = (kz<0.0) ? node->zmin() : node->zmax();
-            double dsx = (fabs(kx)>1e-15) ? (xnext-x)/kx : DBL_MAX;
-            double dsy = (fabs(ky)>1e-15) ? (ynext-y)/ky : DBL_MAX;
-            double dsz = (fabs(kz)>1e-15) ? (znext-z)/kz : DBL_MAX;
-
-            double ds;
-            if (dsx<=dsy && dsx<=dsz) ds = dsx;
-            else if (dsy<=dsx && dsy<=dsz) ds = dsy;
-            else ds = dsz;
-            path->addSegment(cellnumber(node), ds);
-            x += (ds+_eps)*kx;
-            y += (ds+_eps)*ky;
-            z += (ds+_eps)*kz;
-
-            // always search from the root node down
-            const TreeNode* oldnode = node;
-            node = root()->whichnode(Vec(x,y,z));
-
-            // if we're stuck in the same node...
-            if (node==oldnode)
-            {
-                // try to escape by advancing the position to the next representable coordinates
-                find<Log>()->warning("Photon package seems stuck in dust cell "
-                                     + QString::number(node->id()) + " -- escaping");
-                x = nextafter(x, (kx<0.0) ? -DBL_MAX : DBL_MAX);
-                y = nextafter(y, (ky<0.0) ? -DBL_MAX : DBL_MAX);
-                z = nextafter(z, (kz<0.0) ? -DBL_MAX : DBL_MAX);
-                node = root()->whichnode(Vec(x,y,z));
-
-                // if that didn't work, terminate the path
-                if (node==oldnode)
-                {
-                    find<Log>()->warning("Photon package is stuck in dust cell "
-                                         + QString::number(node->id()) + " -- terminating this path");
-                    break;
-                }
-            }
-        }
-    }
-
-    // ----------- Neighbor -----------
+    // ----------- Top-down and Neighbor -----------
 
-    else if (_search == Neighbor)
+    if (_search == TopDown || _search == Neighbor)
     {
-        while (node)
+        while (l>=0)
         {
-            double xnext = (kx<0.0) ? node->xmin() : node->xmax();
-            double ynext = (ky<0.0) ? node->ymin() : node->ymax();
-            double znext = (kz<0.0) ? node->zmin() : node->zmax();
+            double xnext = (kx<0.0) ? _ltree.xmin(l) : _ltree.xmax(l);
+            double ynext = (ky<0.0) ? _ltree.ymin(l) : _ltree.ymax(l);
+            double znext = (kz<0.0) ? _ltree.zmin(l) : _ltree.zmax(l);
             double dsx = (fabs(kx)>1e-15) ? (xnext-x)/kx : DBL_MAX;
             double dsy = (fabs(ky)>1e-15) ? (ynext-y)/ky : DBL_MAX;
             double dsz = (fabs(kz)>1e-15) ? (znext-z)/kz : DBL_MAX;
@@ -485,35 +731,37 @@ void TreeDustGrid::path(DustGridPath* path) const
                 ds = dsz;
                 wall = (kz<0.0) ? TreeNode::BOTTOM : TreeNode::TOP;
             }
-            path->addSegment(cellnumber(node), ds);
+            path->addSegment(_ltree.cellnumber(l), ds);
             x += (ds+_eps)*kx;
             y += (ds+_eps)*ky;
             z += (ds+_eps)*kz;
 
-            // attempt to find the new node among the neighbors of the current node;
+            // for the top-down method, always search from the root node down;
+            // for the neighbor method, attempt to find the new node among the neighbors of the current node;
             // this should not fail unless the new location is outside the grid,
             // however on rare occasions it fails due to rounding errors (e.g. in a corner),
             // thus we use top-down search as a fall-back
-            const TreeNode* oldnode = node;
-            node = node->whichnode(wall, Vec(x,y,z));
-            if (!node) node = root()->whichnode(Vec(x,y,z));
+            int oldl = l;
+            l = -1;
+            if (_search == Neighbor) l = _ltree.whichneighbor(oldl, wall, x,y,z);
+            if (l<0) l = _ltree.whichnode(x,y,z);
 
             // if we're stuck in the same node...
-            if (node==oldnode)
+            if (l==oldl)
             {
                 // try to escape by advancing the position to the next representable coordinates
                 find<Log>()->warning("Photon package seems stuck in dust cell "
-                                     + QString::number(node->id()) + " -- escaping");
+                                     + QString::number(_ltree.cellnumber(l)) + " -- escaping");
                 x = nextafter(x, (kx<0.0) ? -DBL_MAX : DBL_MAX);
                 y = nextafter(y, (ky<0.0) ? -DBL_MAX : DBL_MAX);
                 z = nextafter(z, (kz<0.0) ? -DBL_MAX : DBL_MAX);
-                node = root()->whichnode(Vec(x,y,z));
+                l = _ltree.whichnode(x,y,z);
 
                 // if that didn't work, terminate the path
-                if (node==oldnode)
+                if (l==oldl)
                 {
                     find<Log>()->warning("Photon package is stuck in dust cell "
-                                         + QString::number(node->id()) + " -- terminating this path");
+                                         + QString::number(_ltree.cellnumber(l)) + " -- terminating this path");
                     break;
                 }
             }
@@ -522,143 +770,54 @@ void TreeDustGrid::path(DustGridPath* path) const
 
     // ----------- Bookkeeping -----------
 
-    // !! This code section relies on the fact that an octtree node is used !!
+    // The wall of the current cell that is hit first determines the direction in which we move to the next cell.
+    // After moving the position exactly onto that wall, the linear tree derives the next cell from the node
+    // indices: it moves up the tree until it finds an ancestor with a sibling on the other side of the wall,
+    // and then moves down from that sibling to the leaf containing the position. If we have to move up until
+    // we hit the root node, this means our path has ended.
 
     else if (_search == Bookkeeping)
     {
-        int l = node->id();  // node index in the tree
-        while (true)
+        while (l>=0)
         {
-            double xnext = (kx<0.0) ? _tree[l]->xmin() : _tree[l]->xmax();
-            double ynext = (ky<0.0) ? _tree[l]->ymin() : _tree[l]->ymax();
-            double znext = (kz<0.0) ? _tree[l]->zmin() : _tree[l]->zmax();
+            double xnext = (kx<0.0) ? _ltree.xmin(l) : _ltree.xmax(l);
+            double ynext = (ky<0.0) ? _ltree.ymin(l) : _ltree.ymax(l);
+            double znext = (kz<0.0) ? _ltree.zmin(l) : _ltree.zmax(l);
             double dsx = (fabs(kx)>1e-15) ? (xnext-x)/kx : DBL_MAX;
             double dsy = (fabs(ky)>1e-15) ? (ynext-y)/ky : DBL_MAX;
             double dsz = (fabs(kz)>1e-15) ? (znext-z)/kz : DBL_MAX;
 
-            // First option: the x-wall is hit first. After moving
-            // towards the boundary, we have to find the next cell. First we
-            // check whether the node is on the right or left side of his
-            // father node. If the movement is towards positive x (i.e. if
-            // kx>0) we move up in the tree until we find a node on the left
-            // side. The next cell will then be the corresponding right node
-            // (if it is a leaf) or one of its children. If we have to move
-            // up until we hit the root node, this means our path has ended.
-
+            // the x-wall is hit first
             if (dsx<=dsy && dsx<=dsz)
             {
-                path->addSegment(_cellnumberv[l], dsx);
-                x = xnext;
+                path->addSegment(_ltree.cellnumber(l), dsx);
+                x  = xnext;
                 y += ky*dsx;
                 z += kz*dsx;
-                while (true)
-                {
-                    int oct = ((l - 1) % 8) + 1;
-                    bool place = (kx<0.0) ? (oct % 2 == 1) : (oct % 2 == 0);
-                    if (!place) break;
-                    l = _tree[l]->father()->id();
-                    if (l == 0) return;
-                }
-                l += (kx<0.0) ? -1 : 1;
-                while (_cellnumberv[l] == -1)
-                {
-                    double yM = _tree[l]->child(0)->ymax();
-                    double zM = _tree[l]->child(0)->zmax();
-                    if (kx<0.0)
-                    {
-                        if (y<=yM)
-                            l = (z<=zM) ? _tree[l]->child(1)->id() : _tree[l]->child(5)->id();
-                        else
-                            l = (z<=zM) ? _tree[l]->child(3)->id() : _tree[l]->child(7)->id();
-                    }
-                    else
-                    {
-                        if (y<=yM)
-                            l = (z<=zM) ? _tree[l]->child(0)->id() : _tree[l]->child(4)->id();
-                        else
-                            l = (z<=zM) ? _tree[l]->child(2)->id() : _tree[l]->child(6)->id();
-                    }
-                }
+                l = _ltree.crosswall(l, 0, kx>=0.0, x,y,z);
             }
 
-            // Repeat the same exercise, but now the y-wall is hit first...
-
+            // the y-wall is hit first
             else if (dsy<dsx && dsy<=dsz)
             {
-                path->addSegment(_cellnumberv[l], dsy);
+                path->addSegment(_ltree.cellnumber(l), dsy);
                 x += kx*dsy;
                 y  = ynext;
                 z += kz*dsy;
-                while (true)
-                {
-                    bool place = (ky<0.0) ? ((l-1) % 4 < 2) : ((l-1) % 4 > 1);
-                    if (!place) break;
-                    l = _tree[l]->father()->id();
-                    if (l == 0) return;
-                }
-                l += (ky<0.0) ? -2 : 2;
-                while (_cellnumberv[l] == -1)
-                {
-                    double xM = _tree[l]->child(0)->xmax();
-                    double zM = _tree[l]->child(0)->zmax();
-                    if (ky<0.0)
-                    {
-                        if (x<=xM)
-                            l = (z<=zM) ? _tree[l]->child(2)->id() : _tree[l]->child(6)->id();
-                        else
-                            l = (z<=zM) ? _tree[l]->child(3)->id() : _tree[l]->child(7)->id();
-                    }
-                    else
-                    {
-                        if (x<=xM)
-                            l = (z<=zM) ? _tree[l]->child(0)->id() : _tree[l]->child(4)->id();
-                        else
-                            l = (z<=zM) ? _tree[l]->child(1)->id() : _tree[l]->child(5)->id();
-                    }
-                }
+                l = _ltree.crosswall(l, 1, ky>=0.0, x,y,z);
             }
 
-            // Finally, repeat the same exercise, but now the z-wall is hit first...
-
-            else if (dsz< dsx && dsz< dsy)
+            // the z-wall is hit first
+            else
             {
-                path->addSegment(_cellnumberv[l], dsz);
+                path->addSegment(_ltree.cellnumber(l), dsz);
                 x += kx*dsz;
                 y += ky*dsz;
                 z  = znext;
-                while (true)
-                {
-                    int oct = ((l-1) % 8) + 1;
-                    bool place = (kz<0.0) ? (oct < 5) : (oct > 4);
-                    if (!place) break;
-                    l = _tree[l]->father()->id();
-                    if (l == 0) return;
-                }
-                l += (kz<0.0) ? -4 : 4;
-                while (_cellnumberv[l] == -1)
-                {
-                    double xM = _tree[l]->child(0)->xmax();
-                    double yM = _tree[l]->child(0)->ymax();
-                    if (kz<0.0)
-                    {
-                        if (x<=xM)
-                            l = (y<=yM) ? _tree[l]->child(4)->id() : _tree[l]->child(6)->id();
-                        else
-                            l = (y<=yM) ? _tree[l]->child(5)->id() : _tree[l]->child(7)->id();
-                    }
-                    else
-                    {
-                        if (x<=xM)
-                            l = (y<=yM) ? _tree[l]->child(0)->id() : _tree[l]->child(2)->id();
-                        else
-                            l = (y<=yM) ? _tree[l]->child(1)->id() : _tree[l]->child(3)->id();
-                    }
-                }
+                l = _ltree.crosswall(l, 2, kz>=0.0, x,y,z);
             }
         }
     }
-
-    // ------------------------------
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -674,8 +833,22 @@ QList<SimulationItem*> TreeDustGrid::interfaceCandidates(const type_info &interf
 
 double TreeDustGrid::density(int h, int m) const
 {
-    TreeNode* node = getnode(m);
-    return _dmib->massInBox(h, node->extent()) / node->volume();
+    Box box = _ltree.extent(_ltree.cellnode(m));
+    return _dmib->massInBox(h, box) / box.volume();
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void TreeDustGrid::writeStructure(DustCacheFile& file) const
+{
+    _ltree.write(file);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void TreeDustGrid::readStructure(DustCacheFile& file)
+{
+    _ltree.read(file);
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -687,10 +860,10 @@ void TreeDustGrid::write_xy(DustGridPlotFile* outfile) const
     int Ncells = numCells();
     for (int m=0; m<Ncells; m++)
     {
-        TreeNode* node = getnode(m);
-        if (fabs(node->zmin()) < 1e-8*extent().zwidth())
+        Box box = _ltree.extent(_ltree.cellnode(m));
+        if (fabs(box.zmin()) < 1e-8*extent().zwidth())
         {
-            outfile->writeRectangle(node->xmin(), node->ymin(), node->xmax(), node->ymax());
+            outfile->writeRectangle(box.xmin(), box.ymin(), box.xmax(), box.ymax());
         }
     }
 }
@@ -704,10 +877,10 @@ void TreeDustGrid::write_xz(DustGridPlotFile* outfile) const
     int Ncells = numCells();
     for (int m=0; m<Ncells; m++)
     {
-        TreeNode* node = getnode(m);
-        if (fabs(node->ymin()) < 1e-8*extent().ywidth())
+        Box box = _ltree.extent(_ltree.cellnode(m));
+        if (fabs(box.ymin()) < 1e-8*extent().ywidth())
         {
-            outfile->writeRectangle(node->xmin(), node->zmin(), node->xmax(), node->zmax());
+            outfile->writeRectangle(box.xmin(), box.zmin(), box.xmax(), box.zmax());
         }
     }
 }
@@ -721,10 +894,10 @@ void TreeDustGrid::write_yz(DustGridPlotFile* outfile) const
     int Ncells = numCells();
     for (int m=0; m<Ncells; m++)
     {
-        TreeNode* node = getnode(m);
-        if (fabs(node->xmin()) < 1e-8*extent().xwidth())
+        Box box = _ltree.extent(_ltree.cellnode(m));
+        if (fabs(box.xmin()) < 1e-8*extent().xwidth())
         {
-            outfile->writeRectangle(node->ymin(), node->zmin(), node->ymax(), node->zmax());
+            outfile->writeRectangle(box.ymin(), box.zmin(), box.ymax(), box.zmax());
         }
     }
 }
@@ -737,31 +910,11 @@ void TreeDustGrid::write_xyz(DustGridPlotFile* outfile) const
     int Ncells = numCells();
     for (int m=0; m<Ncells; m++)
     {
-        TreeNode* node = getnode(m);
-        if (node->level() <= _highestWriteLevel)
-            outfile->writeCube(node->xmin(), node->ymin(), node->zmin(), node->xmax(), node->ymax(), node->zmax());
+        int l = _ltree.cellnode(m);
+        if (_ltree.level(l) <= _highestWriteLevel)
+            outfile->writeCube(_ltree.xmin(l), _ltree.ymin(l), _ltree.zmin(l),
+                               _ltree.xmax(l), _ltree.ymax(l), _ltree.zmax(l));
     }
 }
 
 //////////////////////////////////////////////////////////////////////
-
-TreeNode* TreeDustGrid::root() const
-{
-    return _tree[0];
-}
-
-//////////////////////////////////////////////////////////////////////
-
-TreeNode* TreeDustGrid::getnode(int m) const
-{
-    return _tree[_idv[m]];
-}
-
-//////////////////////////////////////////////////////////////////////
-
-int TreeDustGrid::cellnumber(const TreeNode* node) const
-{
-    return _cellnumberv[node->id()];
-}
-
-//////////////////////////////////////////////////////////////////////
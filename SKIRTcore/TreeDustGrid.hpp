@@ -6,9 +6,12 @@
 #ifndef TREEDUSTGRID_HPP
 #define TREEDUSTGRID_HPP
 
+#include "Array.hpp"
 #include "BoxDustGrid.hpp"
 #include "DustGridDensityInterface.hpp"
+#include "DustGridStructureCacheInterface.hpp"
 #include "DustMassInBoxInterface.hpp"
+#include "LinearTree.hpp"
 #include "Random.hpp"
 class DustDistribution;
 class TreeNode;
@@ -24,8 +27,17 @@ class ProcessAssigner;
     subdivided) are the actual dust cells. The type of TreeNode used by the TreeDustGrid
     is decided in each subclass through a factory method. Depending on the type of TreeNode, the
     tree can become an octtree (8 children per node) or a kd-tree (2 children per node). Other node
-    types could be implemented, as long as they are cuboids lined up with the axes. */
-class TreeDustGrid : public BoxDustGrid, public DustGridDensityInterface
+    types could be implemented, as long as they are cuboids lined up with the axes.
+
+    The TreeNode objects are used only while the tree is being constructed. Once construction has
+    been completed, the tree is converted to a LinearTree, i.e. an immutable representation in
+    which the properties of all nodes are stored in contiguous arrays, and the TreeNode objects are
+    discarded. All search methods operate on this linear representation. The dust cells are
+    numbered in depth-first order, so that cells that are close to each other in space tend to have
+    cell numbers that are close to each other. The linear representation can be stored in a cache
+    file and restored from it in a later simulation, skipping the construction of the tree (see
+    the DustGridStructureCacheInterface). */
+class TreeDustGrid : public BoxDustGrid, public DustGridDensityInterface, public DustGridStructureCacheInterface
 {
     Q_OBJECT
     Q_CLASSINFO("Title", "a tree dust grid")
@@ -79,6 +91,13 @@ class TreeDustGrid : public BoxDustGrid, public DustGridDensityInterface
     Q_CLASSINFO("Optional", "true")
     Q_CLASSINFO("Silent", "true")
 
+    Q_CLASSINFO("Property", "benchmarkPathCount")
+    Q_CLASSINFO("Title", "the number of random paths for timing the traversal of the tree")
+    Q_CLASSINFO("MinValue", "0")
+    Q_CLASSINFO("MaxValue", "100000000")
+    Q_CLASSINFO("Default", "0")
+    Q_CLASSINFO("Silent", "true")
+
     //============= Construction - Setup - Destruction =============
 
 protected:
@@ -86,37 +105,72 @@ protected:
     TreeDustGrid();
 
 public:
-    /** The destructor deletes all nodes from the tree vector created during setup. */
+    /** The destructor deletes any nodes remaining in the tree vector used during setup. */
     ~TreeDustGrid();
 
 protected:
-    /** This function verifies that all attribute values have been appropriately set and actually
-        constructs the tree. The first step is to create the root node (through the factory method
-        createRoot() to be implemented in each subclass), and store it in the tree vector, which is
-        just a list of pointers to nodes). The second phase is to recursively subdivide the root
-        node and add the children at the end of the tree vector, until all nodes satisfy the
-        criteria for no further subdivision. When this task is accomplished, the function creates a
-        vector that contains the node IDs of all leaves. This is the actual dust cell vector (only
-        the leaf nodes are the actual dust cells). The function also creates a vector with the cell
-        numbers of all the nodes, i.e. the rank \f$m\f$ of the node in the ID vector if the node is
-        a leaf, and the number -1 if the node is not a leaf (and hence not a dust cell). Finally,
-        the function logs some details on the number of nodes and the number of cells, and if
-        writeFlag() returns true, it writes the distribution of the grid cells to a file. */
+    /** This function verifies that all attribute values have been appropriately set and
+        constructs the tree by calling buildtree(), unless the tree structure has already been read
+        from a cache file through the readStructure() function. Finally, the function logs some
+        details on the number of nodes and the number of cells. */
     void setupSelfBefore();
 
 private:
-    /** This function, only to be called during the construction phase, investigates whether a node
-        should be further subdivided and also takes care of the actual subdivision. There are
-        several criteria for subdivision. The simplest criterion is the level of subdivision of the
-        node: if it is less then a minimum level, the node is always subdivided, if it higher then
-        a maximum level, there is no subdivision (these levels are input parameters). In the
-        general case, whether or not we subdivide depends on the following criterion: if the ratio
-        of the dust mass in the cell and the total dust mass, corresponding to the dust density
-        distribution \f$\rho({\bf{r}})\f$, is larger than a preset threshold (an input parameter as
-        well), the node is subdivided. The dust mass in the cell is calculated by generating
-        \f$N_{\text{random}}\f$ random positions \f${\bf{r}}_n\f$ in the node, so that the total
-        mass using the density in these points is given by \f[ M \approx \frac{\Delta x\, \Delta
-        y\, \Delta z}{N_{\text{random}}} \sum_{n=0}^{N_{\text{random}}} \rho({\bf{r}}_n), \f] If
+    /** This function actually constructs the tree. The first step is to create the root node
+        (through the factory method createRoot() to be implemented in each subclass), and store it
+        in the tree vector, which is just a list of pointers to nodes. The second phase is to
+        subdivide the tree level by level, adding the children at the end of the tree vector,
+        until all nodes satisfy the criteria for no further subdivision. For each level, the
+        subdivision criteria are evaluated concurrently for all nodes in the level (see
+        evaluatenode()); the nodes are distributed over the processes by the assigner if it
+        supports parallel execution, and over the threads of each process in any case. The results
+        are shared between the processes, and the children are then created serially in the order
+        of the nodes in the level, so that all processes construct the same tree with the same
+        deterministic node numbering. When this task is accomplished, the function adds the
+        neighbors to the nodes if required for the search method, and it converts the tree to its
+        linear representation (see the LinearTree class), which also assigns a cell number to each
+        of the leaf nodes (only the leaf nodes are the actual dust cells). The TreeNode objects are
+        then deleted, after calling benchmarktraversal() if requested. */
+    void buildtree();
+
+    /** This function, only to be called during the construction phase while the TreeNode objects
+        still exist, compares the traversal of the linear tree with the pointer-based traversal of
+        the original tree. It calculates the paths for the configured number of random rays (see
+        setBenchmarkPathCount()) with the Bookkeeping method, once through the linear tree and once
+        through the TreeNode objects (see pointerpath()), and logs the time taken by each. It also
+        verifies that both methods produce the same cell sequences (by comparing a checksum for
+        each path), and logs the number of paths that differ. The random rays are drawn from a dedicated construction stream, so that the
+        benchmark does not affect the random numbers used by the rest of the simulation. The
+        pointer-based method supports only octrees; for other trees, the function logs a warning
+        and returns. */
+    void benchmarktraversal();
+
+    /** This function calculates a path through the grid using the Bookkeeping method on the
+        original tree of TreeNode objects, as implemented before the tree was converted to a
+        LinearTree. It relies on the octree node numbering established by buildtree(), where the
+        eight children of a node have consecutive identifiers ordered by octant. The vector \em
+        cellnumberv provides the cell number for each node identifier, or -1 for nodes that have
+        children. The function serves only as a reference for benchmarktraversal(). */
+    void pointerpath(DustGridPath* path, const std::vector<int>& cellnumberv) const;
+
+    /** This function, only to be called during the construction phase, investigates whether the
+        node with index \f$i\f$ in the current level should be further subdivided, and stores the
+        result together with the division point in the list of results for the level. The function
+        is designed as the body of a parallel loop over the nodes in a level; the density samples
+        for a node are drawn from the random stream reserved for the node's level and index (see
+        Random::setConstructionStream()), so that the tree is identical regardless of the number of
+        threads and processes. The actual subdivision is performed after all nodes in the level
+        have been evaluated. There are several criteria for subdivision. The simplest criterion is
+        the level of subdivision of the node: if it is less then a minimum level, the node is always
+        subdivided, if it higher then a maximum level, there is no subdivision (these levels are
+        input parameters). In the general case, whether or not we subdivide depends on the
+        following criterion: if the ratio of the dust mass in the cell and the total dust mass,
+        corresponding to the dust density distribution \f$\rho({\bf{r}})\f$, is larger than a
+        preset threshold (an input parameter as well), the node is subdivided. The dust mass in the
+        cell is calculated by generating \f$N_{\text{random}}\f$ random positions \f${\bf{r}}_n\f$
+        in the node, so that the total mass using the density in these points is given by \f[ M
+        \approx \frac{\Delta x\, \Delta y\, \Delta z}{N_{\text{random}}}
+        \sum_{n=0}^{N_{\text{random}}} \rho({\bf{r}}_n), \f] If
         the mass criterion is not satisfied, the node is not subdivided. If the conditions for
         subdivision are met, the first task is to calculate the division point. There are two
         options: geocentric division and barycentric division (an input flag again). In the former
@@ -125,9 +179,9 @@ private:
         \frac{y_{\text{min}}+y_{\text{max}}}{2}, \frac{z_{\text{min}}+z_{\text{max}}}{2} \right).
         \f] In the latter case the division point is the centre of mass, which we estimate using
         the \f$N_{\text{random}}\f$ points generated before, \f[ {\bf{r}}_c = \frac{ \sum_n
-        \rho({\bf{r}}_n)\, {\bf{r}}_n}{ \sum_n \rho({\bf{r}}_n) }. \f] The last task is to actually
-        create the eight child nodes of the node and add them to the tree. */
-    void subdivide(TreeNode* node);
+        \rho({\bf{r}}_n)\, {\bf{r}}_n}{ \sum_n \rho({\bf{r}}_n) }. \f] The barycenter is stored with
+        the result, so that it is available when the child nodes are actually created. */
+    void evaluatenode(size_t i);
 
     //======== Setters & Getters for Discoverable Attributes =======
 
@@ -149,7 +203,7 @@ public:
         root node and recursively finds the child node containing the new position. The Neighbor
         method constructs a neighbor list for each node (at each of the six walls) during setup,
         and then uses this list to locate the neighboring node containing the new position. The
-        Bookkeeping method relies on the order in which the occtree nodes are created and stored to
+        Bookkeeping method relies on the order in which the nodes are stored in the linear tree to
         derive the appropriate neighbor solely through the respective node indices. */
     Q_ENUMS(SearchMethod)
     enum SearchMethod { TopDown, Neighbor, Bookkeeping };
@@ -197,18 +251,26 @@ public:
         the object that assigns different parts of the calculation to different processes, to
         parallelize the algorithm. The ProcessAssigner class is the abstract class that represents
         different types of assigners; different subclasses implement the assignment in different
-        ways. At the moment, the assigner is only used for the part of the setup that is
-        multithreaded: sampling the density of the grid cells. This procedure has not yet been
-        adapted for multiprocessing, so currently only the IdenticalAssigner is supported, which
-        assigns each process to all of the calculations. In later versions of the code, different
-        assigners will be supported that effectively parallelize this procedure among the different
-        processes. The construction of the tree itsself might eventually even be parallelized, so
-        that different processes construct different parts of the tree. */
+        ways. The assigner distributes the evaluation of the subdivision criteria for the nodes in
+        each level of the tree among the processes, after which the results are shared so that each
+        process constructs the complete tree. With the IdenticalAssigner (the default), each
+        process evaluates all nodes, and the results of the root process are broadcast to the
+        other processes to guarantee that all processes construct the same tree. */
     Q_INVOKABLE void setAssigner(ProcessAssigner* value);
 
     /** Returns the process assigner for this tree dust grid. */
     Q_INVOKABLE ProcessAssigner* assigner() const;
 
+    /** Sets the number of random paths used to compare the time needed for traversing the linear
+        tree with the time needed for traversing the original pointer-based tree (see
+        benchmarktraversal()). The default value of zero disables the comparison. The comparison
+        is performed only when the tree is constructed, i.e. not when the tree structure is read
+        from a cache file. */
+    Q_INVOKABLE void setBenchmarkPathCount(int value);
+
+    /** Returns the number of random paths used to compare the traversal methods. */
+    Q_INVOKABLE int benchmarkPathCount() const;
+
     //======================== Other Functions =======================
 
 public:
@@ -222,9 +284,10 @@ public:
     int numCells() const;
 
     /** This function returns the number of the dust cell that contains the position
-        \f${\bf{r}}\f$. For a tree dust grid, the search algorithm starts at the root node and
-        selects the child node that contains the position. This procedure is repeated until the
-        node is childless, i.e. until it is a leaf node that corresponds to an actual dust cell. */
+        \f${\bf{r}}\f$. For a tree dust grid, the search algorithm starts at the root node of the
+        linear tree and selects the child node that contains the position. This procedure is
+        repeated until the node is childless, i.e. until it is a leaf node that corresponds to an
+        actual dust cell. */
     int whichcell(Position bfr) const;
 
     /** This function returns the central location of the dust cell with cell number \f$m\f$. For a
@@ -273,6 +336,15 @@ public:
         on the DustMassInBoxInterface interface in the dust distribution for this simulation. */
     double density(int h, int m) const;
 
+    /** This function implements the DustGridStructureCacheInterface interface. It writes the
+        linear representation of the tree to the specified cache file. */
+    void writeStructure(DustCacheFile& file) const;
+
+    /** This function implements the DustGridStructureCacheInterface interface. It reads the
+        linear representation of the tree from the specified cache file, so that the construction
+        of the tree can be skipped during setup. */
+    void readStructure(DustCacheFile& file);
+
 protected:
     /** This function writes the intersection of the dust grid with the xy plane to the specified
         DustGridPlotFile object. */
@@ -292,20 +364,6 @@ protected:
         */
     void write_xyz(DustGridPlotFile* outfile) const;
 
-private:
-    /** This function returns a pointer to the root node of the tree. */
-    TreeNode* root() const;
-
-    /** This function returns a pointer to the node corresponding to cell number \f$m\f$. It just
-        reads the node ID number of the \f$m\f$'th leave cell and returns the corresponding pointer
-        of the tree vector. */
-    TreeNode* getnode(int m) const;
-
-    /** This function returns the cell number \f$m\f$ of a node in the tree. It just reads the ID
-        of the node and determines the corresponding cell number from the internal cell number
-        vector. */
-    int cellnumber(const TreeNode* node) const;
-
 protected:
     /** This pure virtual function, to be implemented in each subclass, creates a root node of the
         appropriate type, using a node identifier of zero and the specified spatial extent, and
@@ -325,6 +383,7 @@ private:
     double _maxMassFraction;
     double _maxDensDispFraction;
     ProcessAssigner* _assigner;
+    int _Nbenchmark;
 
     // data members initialized during setup
     Random* _random;
@@ -333,10 +392,10 @@ private:
     DustMassInBoxInterface* _dmib;
     double _totalmass;
     double _eps;
-    int _Nnodes;
-    std::vector<TreeNode*> _tree;
-    std::vector<int> _cellnumberv;
-    std::vector<int> _idv;
+    std::vector<TreeNode*> _tree;   // the nodes of the tree during construction; empty after setup
+    std::vector<TreeNode*> _levelnodev; // the nodes in the level being evaluated during construction
+    Array _resultv;                 // for each node in the level: subdivision flag and barycenter x, y, z
+    LinearTree _ltree;              // the linear representation of the tree after construction
     int _highestWriteLevel;
 
 protected:
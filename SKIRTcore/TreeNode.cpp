@@ -94,6 +94,14 @@ const TreeNode* TreeNode::whichnode(TreeNode::Wall wall, Vec r) const
 
 //////////////////////////////////////////////////////////////////////
 
+const std::vector<TreeNode*>& TreeNode::neighbors(TreeNode::Wall wall) const
+{
+    static const vector<TreeNode*> none;
+    return _neighbors.empty() ? none : _neighbors[wall];
+}
+
+//////////////////////////////////////////////////////////////////////
+
 void TreeNode::ensureneighborlists()
 {
     _neighbors.resize(6);
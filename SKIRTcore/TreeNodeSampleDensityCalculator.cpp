@@ -31,6 +31,14 @@ void TreeNodeSampleDensityCalculator::body(size_t n)
 
 //////////////////////////////////////////////////////////////////////
 
+void TreeNodeSampleDensityCalculator::sample()
+{
+    _random->positions(_extent, _rv);
+    _dd->densities(_rv, _rhov);
+}
+
+//////////////////////////////////////////////////////////////////////
+
 double TreeNodeSampleDensityCalculator::volume() const
 {
     return _extent.volume();
@@ -41,6 +41,13 @@ public:
         the other functions in this class. */
     void body(size_t n);
 
+    /** This function calculates and stores the density in all random points. It generates the
+        random points in the same order as consecutive calls to the body() function, and then
+        obtains the densities for all points from the dust distribution in a single batch. The
+        function can be called instead of invoking body() for all indices in the sample range, in
+        case the density sampling for a single node does not need to be parallelized. */
+    void sample();
+
     /** This function calculates and returns the volume of the cell. */
     double volume() const;
 
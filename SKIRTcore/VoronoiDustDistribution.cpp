@@ -7,6 +7,7 @@
 #include "Log.hpp"
 #include "MeshDustComponent.hpp"
 #include "NR.hpp"
+#include "ParallelFactory.hpp"
 #include "Random.hpp"
 #include "VoronoiDustDistribution.hpp"
 #include "VoronoiMesh.hpp"
@@ -53,7 +54,7 @@ void VoronoiDustDistribution::setupSelfAfter()
     }
 
     // import the Voronoi mesh
-    _mesh = new VoronoiMesh(_meshfile, fieldIndices, extent());
+    _mesh = new VoronoiMesh(_meshfile, fieldIndices, extent(), find<ParallelFactory>());
     find<Log>()->info("Voronoi mesh data was successfully imported: " + QString::number(_mesh->Ncells()) + " cells.");
 
     // add a density field for each of our components, so that the mesh holds the total density
@@ -3,11 +3,13 @@
 ////       © Astronomical Observatory, Ghent University         ////
 ///////////////////////////////////////////////////////////////// */
 
+#include "DustCacheFile.hpp"
 #include "DustDistribution.hpp"
 #include "DustGridPlotFile.hpp"
 #include "DustParticleInterface.hpp"
 #include "FatalError.hpp"
 #include "Log.hpp"
+#include "ParallelFactory.hpp"
 #include "Random.hpp"
 #include "Units.hpp"
 #include "VoronoiDustGrid.hpp"
@@ -21,7 +23,8 @@ using namespace std;
 //////////////////////////////////////////////////////////////////////
 
 VoronoiDustGrid::VoronoiDustGrid()
-    : _numParticles(0), _distribution(DustDensity), _meshfile(0), _random(0), _mesh(0), _meshOwned(true)
+    : _numParticles(0), _distribution(DustDensity), _meshfile(0), _precomputeFaces(false), _precomputeTetrahedra(false),
+      _verifyTesselation(false), _random(0), _mesh(0), _meshOwned(true)
 {
 }
 
@@ -43,8 +46,11 @@ void VoronoiDustGrid::setupSelfBefore()
 
     Log* log = find<Log>();
 
-    // Determine an appropriate set of particles and construct the Voronoi mesh
-    switch (_distribution)
+    // Determine an appropriate set of particles and construct the Voronoi mesh,
+    // unless the mesh has been read from a cache file
+    if (_mesh) log->info("Using the Voronoi tesselation read from the cache file with "
+                         + QString::number(_mesh->Ncells()) + " cells...");
+    else switch (_distribution)
     {
     case Uniform:
         {
@@ -56,7 +62,7 @@ void VoronoiDustGrid::setupSelfBefore()
             }
             log->info("Computing Voronoi tesselation for " + QString::number(_numParticles)
                       + " uniformly distributed random particles...");
-            _mesh = new VoronoiMesh(rv, extent());
+            _mesh = new VoronoiMesh(rv, extent(), find<ParallelFactory>());
             break;
         }
     case CentralPeak:
@@ -81,7 +87,7 @@ void VoronoiDustGrid::setupSelfBefore()
             }
             log->info("Computing Voronoi tesselation for " + QString::number(_numParticles)
                       + " random particles distributed in a central peak...");
-            _mesh = new VoronoiMesh(rv, extent());
+            _mesh = new VoronoiMesh(rv, extent(), find<ParallelFactory>());
             break;
         }
     case DustDensity:
@@ -103,7 +109,7 @@ void VoronoiDustGrid::setupSelfBefore()
             }
             log->info("Computing Voronoi tesselation for " + QString::number(_numParticles)
                       + " random particles distributed according to dust density...");
-            _mesh = new VoronoiMesh(rv, extent());
+            _mesh = new VoronoiMesh(rv, extent(), find<ParallelFactory>());
             break;
         }
     case DustTesselation:
@@ -122,14 +128,14 @@ void VoronoiDustGrid::setupSelfBefore()
             if (!dpi) throw FATALERROR("Can't retrieve particle locations from this dust distribution");
             log->info("Computing Voronoi tesselation for " + QString::number(dpi->numParticles())
                       + " dust distribution particles...");
-            _mesh = new VoronoiMesh(dpi, extent());
+            _mesh = new VoronoiMesh(dpi, extent(), find<ParallelFactory>());
             break;
         }
     case File:
         {
             if (!_meshfile) throw FATALERROR("File containing particle locations is not defined");
             log->info("Computing Voronoi tesselation for particles loaded from file " + _meshfile->filename() + "...");
-            _mesh = new VoronoiMesh(_meshfile, QList<int>(), extent());
+            _mesh = new VoronoiMesh(_meshfile, QList<int>(), extent(), find<ParallelFactory>());
             break;
         }
     default:
@@ -138,6 +144,23 @@ void VoronoiDustGrid::setupSelfBefore()
 
     int Ncells = _mesh->Ncells();
 
+    // If requested, verify that the tesselation is identical to a serial construction
+    if (_verifyTesselation)
+    {
+        log->info("Verifying the Voronoi tesselation against a serial construction...");
+        int Ndiff = _mesh->serialDifferences();
+        if (Ndiff) throw FATALERROR("The Voronoi tesselation differs from a serial construction for "
+                                    + QString::number(Ndiff) + " of " + QString::number(Ncells) + " cells");
+        log->info("  All cells are identical to the serial construction");
+    }
+
+    // If requested, decompose the cells into tetrahedra for use by the random position generation
+    if (_precomputeTetrahedra)
+    {
+        log->info("Decomposing the Voronoi cells into tetrahedra...");
+        _mesh->precomputeTetrahedra(find<ParallelFactory>());
+    }
+
     // Log statistics on the cell neighbors
     double avgNeighbors;
     int minNeighbors, maxNeighbors;
@@ -147,6 +170,14 @@ void VoronoiDustGrid::setupSelfBefore()
     log->info("  Minimum number of neighbors per cell: " + QString::number(minNeighbors));
     log->info("  Maximum number of neighbors per cell: " + QString::number(maxNeighbors));
 
+    // If requested, precompute the cell faces for use by the path calculation
+    if (_precomputeFaces)
+    {
+        double megabytes = avgNeighbors * Ncells * 4 * sizeof(double) / 1e6;
+        log->info("Precomputing the Voronoi cell faces (using " + QString::number(megabytes,'f',1) + " MB)...");
+        _mesh->precomputeFaces();
+    }
+
     // Log statistics on the block lists
     int nblocks = _mesh->Nblocks();
     double avgRefsPerBlock;
@@ -264,6 +295,48 @@ VoronoiMeshFile* VoronoiDustGrid::voronoiMeshFile() const
 
 //////////////////////////////////////////////////////////////////////
 
+void VoronoiDustGrid::setPrecomputeFaces(bool value)
+{
+    _precomputeFaces = value;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+bool VoronoiDustGrid::precomputeFaces() const
+{
+    return _precomputeFaces;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void VoronoiDustGrid::setPrecomputeTetrahedra(bool value)
+{
+    _precomputeTetrahedra = value;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+bool VoronoiDustGrid::precomputeTetrahedra() const
+{
+    return _precomputeTetrahedra;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void VoronoiDustGrid::setVerifyTesselation(bool value)
+{
+    _verifyTesselation = value;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+bool VoronoiDustGrid::verifyTesselation() const
+{
+    return _verifyTesselation;
+}
+
+//////////////////////////////////////////////////////////////////////
+
 double VoronoiDustGrid::volume(int m) const
 {
     return _mesh->volume(m);
@@ -305,3 +378,22 @@ void VoronoiDustGrid::path(DustGridPath* path) const
 }
 
 //////////////////////////////////////////////////////////////////////
+
+void VoronoiDustGrid::writeStructure(DustCacheFile& file) const
+{
+    if (_distribution != DustTesselation) _mesh->write(file);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void VoronoiDustGrid::readStructure(DustCacheFile& file)
+{
+    if (_distribution != DustTesselation)
+    {
+        if (_meshOwned) delete _mesh;
+        _mesh = new VoronoiMesh(file, extent(), find<ParallelFactory>());
+        _meshOwned = true;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
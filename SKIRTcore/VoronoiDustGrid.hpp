@@ -7,6 +7,7 @@
 #define VORONOIDUSTGRID_HPP
 
 #include "BoxDustGrid.hpp"
+#include "DustGridStructureCacheInterface.hpp"
 #include "Random.hpp"
 class DustDistribution;
 class VoronoiMesh;
@@ -22,8 +23,10 @@ class VoronoiMeshFile;
     over the domain, either uniformly or with the same overall density distribution as the dust.
     Alternatively, the locations can be copied from the particles in an SPH dust distribution. This
     class uses the Voro++ code written by Chris H. Rycroft (LBL / UC Berkeley) to generate output
-    files for plotting the Voronoi grid. */
-class VoronoiDustGrid : public BoxDustGrid
+    files for plotting the Voronoi grid. Unless the tesselation is obtained from the dust
+    distribution, it can be stored in a cache file and restored from it in a later simulation,
+    skipping the construction of the Voronoi cells (see the DustGridStructureCacheInterface). */
+class VoronoiDustGrid : public BoxDustGrid, public DustGridStructureCacheInterface
 {
     Q_OBJECT
     Q_CLASSINFO("Title", "a Voronoi dust grid")
@@ -50,6 +53,21 @@ class VoronoiDustGrid : public BoxDustGrid
     Q_CLASSINFO("Default", "VoronoiMeshAsciiFile")
     Q_CLASSINFO("RelevantIf", "distribution")
 
+    Q_CLASSINFO("Property", "precomputeFaces")
+    Q_CLASSINFO("Title", "precompute the cell faces to accelerate the path calculation")
+    Q_CLASSINFO("Default", "no")
+    Q_CLASSINFO("Silent", "true")
+
+    Q_CLASSINFO("Property", "precomputeTetrahedra")
+    Q_CLASSINFO("Title", "decompose the cells into tetrahedra to sample random positions without rejection")
+    Q_CLASSINFO("Default", "no")
+    Q_CLASSINFO("Silent", "true")
+
+    Q_CLASSINFO("Property", "verifyTesselation")
+    Q_CLASSINFO("Title", "verify that the tesselation is identical to a serial construction")
+    Q_CLASSINFO("Default", "no")
+    Q_CLASSINFO("Silent", "true")
+
     //============= Construction - Setup - Destruction =============
 
 public:
@@ -68,7 +86,8 @@ protected:
         domain using a three-dimensional cuboidal cell structure, called the foam. The distribution
         of the foam cells is determined automatically from the dust density distribution. The foam
         allows to efficiently generate random points drawn from this probability distribution. Once
-        the particles have been generated, the foam is discarded. */
+        the particles have been generated, the foam is discarded. If the tesselation has already
+        been read from a cache file through the readStructure() function, it is used as is. */
     void setupSelfBefore();
 
     //======== Setters & Getters for Discoverable Attributes =======
@@ -101,6 +120,39 @@ public:
         value \em File. */
     Q_INVOKABLE VoronoiMeshFile* voronoiMeshFile() const;
 
+    /** Sets the flag that indicates whether or not to precompute the plane of each Voronoi cell
+        face, which accelerates the path calculation at the cost of additional memory (typically
+        around 500 bytes per cell). See VoronoiMesh::precomputeFaces(). The default value is false;
+        if the flag is enabled, the memory used by the planes is logged during setup. */
+    Q_INVOKABLE void setPrecomputeFaces(bool value);
+
+    /** Returns the flag that indicates whether or not to precompute the plane of each Voronoi cell
+        face. */
+    Q_INVOKABLE bool precomputeFaces() const;
+
+    /** Sets the flag that indicates whether or not to decompose the Voronoi cells into tetrahedra,
+        so that random positions in a cell can be drawn without rejection. This avoids the many
+        attempts that may be needed for elongated cells, at the cost of additional memory
+        (typically around 1.6 kB per cell). See VoronoiMesh::precomputeTetrahedra(). The default
+        value is false. */
+    Q_INVOKABLE void setPrecomputeTetrahedra(bool value);
+
+    /** Returns the flag that indicates whether or not to decompose the Voronoi cells into
+        tetrahedra. */
+    Q_INVOKABLE bool precomputeTetrahedra() const;
+
+    /** Sets the flag that indicates whether or not to verify the Voronoi tesselation against a
+        serial construction after it has been built or read from a cache file. The cells are then
+        recomputed serially, and a fatal error is thrown if the volume, centroid, bounding box or
+        neighbor list of any cell is not bitwise identical to that in the tesselation. See
+        VoronoiMesh::serialDifferences(). This regression check substantially increases the setup
+        time; the default value is false. */
+    Q_INVOKABLE void setVerifyTesselation(bool value);
+
+    /** Returns the flag that indicates whether or not to verify the Voronoi tesselation against a
+        serial construction. */
+    Q_INVOKABLE bool verifyTesselation() const;
+
     //======================== Other Functions =======================
 
 public:
@@ -127,6 +179,16 @@ public:
         VoronoiMesh class for more information. */
     void path(DustGridPath* path) const;
 
+    /** This function implements the DustGridStructureCacheInterface interface. Unless the
+        tesselation is obtained from the dust distribution, it writes the Voronoi tesselation to the
+        specified cache file (see VoronoiMesh::write()). */
+    void writeStructure(DustCacheFile& file) const;
+
+    /** This function implements the DustGridStructureCacheInterface interface. Unless the
+        tesselation is obtained from the dust distribution, it restores the Voronoi tesselation from
+        the specified cache file, so that the Voronoi cells need not be computed during setup. */
+    void readStructure(DustCacheFile& file);
+
     //======================== Data Members ========================
 
 private:
@@ -134,6 +196,9 @@ private:
     int _numParticles;
     Distribution _distribution;
     VoronoiMeshFile* _meshfile;
+    bool _precomputeFaces;
+    bool _precomputeTetrahedra;
+    bool _verifyTesselation;
 
     // data members initialized during setup
     Random* _random;
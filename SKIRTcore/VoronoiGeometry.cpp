@@ -6,6 +6,7 @@
 #include "FatalError.hpp"
 #include "Log.hpp"
 #include "NR.hpp"
+#include "ParallelFactory.hpp"
 #include "Random.hpp"
 #include "VoronoiMesh.hpp"
 #include "VoronoiMeshFile.hpp"
@@ -37,7 +38,8 @@ void VoronoiGeometry::setupSelfBefore()
     if (_densityIndex < 0) throw FATALERROR("Column index for density must be specified");
 
     // import the Voronoi mesh
-    _mesh = new VoronoiMesh(_meshfile, QList<int>() << _densityIndex << _multiplierIndex, extent());
+    _mesh = new VoronoiMesh(_meshfile, QList<int>() << _densityIndex << _multiplierIndex, extent(),
+                            find<ParallelFactory>());
     _mesh->addDensityDistribution(_densityIndex, _multiplierIndex);
     find<Log>()->info("Voronoi mesh data was successfully imported: " + QString::number(_mesh->Ncells()) + " cells.");
 
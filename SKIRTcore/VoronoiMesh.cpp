@@ -3,14 +3,19 @@
 ////       © Astronomical Observatory, Ghent University         ////
 ///////////////////////////////////////////////////////////////// */
 
+#include <algorithm>
 #include <cfloat>
 #include <cmath>
+#include "DustCacheFile.hpp"
 #include "DustGridPath.hpp"
 #include "DustParticleInterface.hpp"
 #include "VoronoiMesh.hpp"
 #include "VoronoiMeshFile.hpp"
 #include "FatalError.hpp"
+#include "Parallel.hpp"
+#include "ParallelFactory.hpp"
 #include "Random.hpp"
+#include "RootAssigner.hpp"
 #include "container.hh"
 
 using namespace std;
@@ -19,60 +24,6 @@ using namespace std;
 
 namespace VoronoiMesh_Private
 {
-    // class to hold the information about a Voronoi cell that is relevant for calculating paths and densities
-    class VoronoiCell : public Box  // enclosing box
-    {
-    private:
-        Vec _r;                     // particle position
-        Vec _c;                     // centroid position
-        double _volume;             // volume
-        vector<int> _neighbors;     // list of neighbor indices in cells vector
-
-    public:
-        // constructor stores the specified particle position; the other data members are set to zero
-        VoronoiCell(Vec r) : _r(r), _volume(0) { }
-
-        // initializes the receiver with information taken from the specified fully computed Voronoi cell
-        void init(voro::voronoicell_neighbor& cell)
-        {
-            // copy basic geometric info
-            double cx, cy, cz;
-            cell.centroid(cx,cy,cz);
-            _c = Vec(cx,cy,cz) + _r;
-            _volume = cell.volume();
-
-            // get the minimal and maximal coordinates of the box enclosing the cell
-            vector<double> coords;
-            cell.vertices(_r.x(),_r.y(),_r.z(), coords);
-            _xmin = DBL_MAX;  _ymin = DBL_MAX;  _zmin = DBL_MAX;
-            _xmax = -DBL_MAX; _ymax = -DBL_MAX; _zmax = -DBL_MAX;
-            int n = coords.size();
-            for (int i=0; i<n; i+=3)
-            {
-                _xmin = min(_xmin,coords[i]); _ymin = min(_ymin,coords[i+1]); _zmin = min(_zmin,coords[i+2]);
-                _xmax = max(_xmax,coords[i]); _ymax = max(_ymax,coords[i+1]); _zmax = max(_zmax,coords[i+2]);
-            }
-
-            // copy a list of neighboring cell/particle ids
-            cell.neighbors(_neighbors);
-        }
-
-        // returns the cell's particle position
-        Vec particle() const { return _r; }
-
-        // returns the squared distance from the cell's particle to the specified point
-        double squaredDistanceTo(Vec r) const { return (r-_r).norm2(); }
-
-        // returns the central position in the cell
-        Vec centroid() const { return _c; }
-
-        // returns the volume of the cell; overriding volume() function of Box bas class
-        double volume() const { return _volume; }
-
-        // returns a list of neighboring cell/particle ids
-        const vector<int>& neighbors() { return _neighbors; }
-    };
-
     // function to compare two points according to the specified axis (0,1,2)
     bool lessthan(Vec p1, Vec p2, int axis)
     {
@@ -108,14 +59,14 @@ namespace VoronoiMesh_Private
     class LessThan
     {
     private:
-        const vector<VoronoiCell*>& _cells;
+        const vector<Vec>& _rv;
         int _axis;
     public:
-        LessThan(const vector<VoronoiCell*>& cells, int depth) : _cells(cells), _axis(depth%3) { }
+        LessThan(const vector<Vec>& rv, int depth) : _rv(rv), _axis(depth%3) { }
         bool operator() (int m1, int m2)
         {
             if (m1==m2) return false;
-            return lessthan(_cells[m1]->particle(), _cells[m2]->particle(), _axis);
+            return lessthan(_rv[m1], _rv[m2], _axis);
         }
     };
 
@@ -123,7 +74,7 @@ namespace VoronoiMesh_Private
     class Node
     {
     private:
-        int _m;         // index in _cells to the particle defining the split at this node
+        int _m;         // cell index of the particle defining the split at this node
         int _axis;      // split axis for this node (0,1,2)
         Node* _up;      // ptr to the parent node
         Node* _left;    // ptr to the left child node
@@ -153,44 +104,44 @@ namespace VoronoiMesh_Private
         Node* right() const { return _right; }
 
         // returns the apropriate child for the specified query point
-        Node* child(Vec bfr, const vector<VoronoiCell*>& cells) const
-            { return lessthan(bfr, cells[_m]->particle(), _axis) ? _left : _right; }
+        Node* child(Vec bfr, const vector<Vec>& rv) const
+            { return lessthan(bfr, rv[_m], _axis) ? _left : _right; }
 
         // returns the other child than the one that would be apropriate for the specified query point
-        Node* otherChild(Vec bfr, const vector<VoronoiCell*>& cells) const
-            { return lessthan(bfr, cells[_m]->particle(), _axis) ? _right : _left; }
+        Node* otherChild(Vec bfr, const vector<Vec>& rv) const
+            { return lessthan(bfr, rv[_m], _axis) ? _right : _left; }
 
         // returns the squared distance from the query point to the split plane
-        double squaredDistanceToSplitPlane(Vec bfr, const vector<VoronoiCell*>& cells) const
+        double squaredDistanceToSplitPlane(Vec bfr, const vector<Vec>& rv) const
         {
             switch (_axis)
             {
             case 0:  // split on x
-                return sqr(cells[_m]->particle().x() - bfr.x());
+                return sqr(rv[_m].x() - bfr.x());
             case 1:  // split on y
-                return sqr(cells[_m]->particle().y() - bfr.y());
+                return sqr(rv[_m].y() - bfr.y());
             case 2:  // split on z
-                return sqr(cells[_m]->particle().z() - bfr.z());
+                return sqr(rv[_m].z() - bfr.z());
             default: // this should never happen
                 return 0;
             }
         }
 
         // returns the node in this subtree that represents the particle nearest to the query point
-        Node* nearest(Vec bfr, const vector<VoronoiCell*>& cells)
+        Node* nearest(Vec bfr, const vector<Vec>& rv)
         {
             // recursively descend the tree until a leaf node is reached, going left or right depending on
             // whether the specified point is less than or greater than the current node in the split dimension
             Node* current = this;
-            while (Node* child = current->child(bfr, cells)) current = child;
+            while (Node* child = current->child(bfr, rv)) current = child;
 
             // unwind the recursion, looking for the nearest node while climbing up
             Node* best = current;
-            double bestSD = cells[best->m()]->squaredDistanceTo(bfr);
+            double bestSD = (bfr-rv[best->m()]).norm2();
             while (true)
             {
                 // if the current node is closer than the current best, then it becomes the current best
-                double currentSD = cells[current->m()]->squaredDistanceTo(bfr);
+                double currentSD = (bfr-rv[current->m()]).norm2();
                 if (currentSD < bestSD)
                 {
                     best = current;
@@ -199,16 +150,16 @@ namespace VoronoiMesh_Private
 
                 // if there could be points on the other side of the splitting plane for the current node
                 // that are closer to the search point than the current best, then ...
-                double splitSD = current->squaredDistanceToSplitPlane(bfr, cells);
+                double splitSD = current->squaredDistanceToSplitPlane(bfr, rv);
                 if (splitSD < bestSD)
                 {
                     // move down the other branch of the tree from the current node looking for closer points,
                     // following the same recursive process as the entire search
-                    Node* other = current->otherChild(bfr, cells);
+                    Node* other = current->otherChild(bfr, rv);
                     if (other)
                     {
-                        Node* otherBest = other->nearest(bfr, cells);
-                        double otherBestSD = cells[otherBest->m()]->squaredDistanceTo(bfr);
+                        Node* otherBest = other->nearest(bfr, rv);
+                        double otherBestSD = (bfr-rv[otherBest->m()]).norm2();
                         if (otherBestSD < bestSD)
                         {
                             best = otherBest;
@@ -224,13 +175,186 @@ namespace VoronoiMesh_Private
             return best;
         }
     };
+
+    // returns the number of blocks in each direction for a Voro++ container holding the specified number of
+    // particles, aiming for about 5 particles per block as recommended for Voro++
+    int containerBlockCount(int Ncells)
+    {
+        return max(3, min(1000, static_cast<int>(pow(Ncells/5.,1./3.)) ));
+    }
+
+    // copies the relevant information from the specified fully computed Voronoi cell with index m
+    // into the output vectors
+    void storecell(int m, voro::voronoicell_neighbor& cell, const vector<Vec>& rv, vector<double>& volumev,
+                   vector<Vec>& centroidv, vector<Box>& boxv, vector< vector<int> >& neighborsv)
+    {
+        Vec r = rv[m];
+
+        // copy basic geometric info
+        double cx, cy, cz;
+        cell.centroid(cx,cy,cz);
+        centroidv[m] = Vec(cx,cy,cz) + r;
+        volumev[m] = cell.volume();
+
+        // get the minimal and maximal coordinates of the box enclosing the cell
+        vector<double> coords;
+        cell.vertices(r.x(),r.y(),r.z(), coords);
+        double xmin = DBL_MAX;  double ymin = DBL_MAX;  double zmin = DBL_MAX;
+        double xmax = -DBL_MAX; double ymax = -DBL_MAX; double zmax = -DBL_MAX;
+        int n = coords.size();
+        for (int i=0; i<n; i+=3)
+        {
+            xmin = min(xmin,coords[i]); ymin = min(ymin,coords[i+1]); zmin = min(zmin,coords[i+2]);
+            xmax = max(xmax,coords[i]); ymax = max(ymax,coords[i+1]); zmax = max(zmax,coords[i+2]);
+        }
+        boxv[m] = Box(xmin,ymin,zmin, xmax,ymax,zmax);
+
+        // copy a list of neighboring cell/particle ids
+        cell.neighbors(neighborsv[m]);
+    }
+
+    // helper class to compute the Voronoi cells in parallel; the body computes the cells for the particles
+    // in a row of blocks in the Voro++ container, and stores the relevant information in the output vectors
+    class CellComputer : public ParallelTarget
+    {
+    private:
+        voro::container& _con;
+        const vector<Vec>& _rv;
+        vector<double>& _volumev;
+        vector<Vec>& _centroidv;
+        vector<Box>& _boxv;
+        vector< vector<int> >& _neighborsv;
+        ParallelFactory* _factory;
+        vector<voro::voro_compute<voro::container>*> _computev;  // compute object for each thread, created when needed
+
+    public:
+        CellComputer(voro::container& con, const vector<Vec>& rv, vector<double>& volumev, vector<Vec>& centroidv,
+                     vector<Box>& boxv, vector< vector<int> >& neighborsv, ParallelFactory* factory)
+            : _con(con), _rv(rv), _volumev(volumev), _centroidv(centroidv), _boxv(boxv), _neighborsv(neighborsv),
+              _factory(factory), _computev(factory->maxThreadCount(), 0) { }
+
+        ~CellComputer() { for (auto compute : _computev) delete compute; }
+
+        // the Voro++ compute object holds scratch memory and thus can't be shared between threads;
+        // each thread creates its own object, which only accesses the shared container for reading
+        void body(size_t index)
+        {
+            voro::voro_compute<voro::container>*& compute = _computev[_factory->currentThreadIndex()];
+            if (!compute) compute = new voro::voro_compute<voro::container>(_con, _con.nx, _con.ny, _con.nz);
+
+            int j = index % _con.ny;
+            int k = index / _con.ny;
+            for (int i=0; i<_con.nx; i++)
+            {
+                int ijk = i + _con.nx*j + _con.nxy*k;
+                for (int q=0; q<_con.co[ijk]; q++)
+                {
+                    int m = _con.id[ijk][q];
+                    voro::voronoicell_neighbor fullcell;
+                    bool ok = compute->compute_cell(fullcell, ijk, q, i, j, k);
+                    if (!ok) throw FATALERROR("Can't compute Voronoi cell " + QString::number(m));
+                    storecell(m, fullcell, _rv, _volumev, _centroidv, _boxv, _neighborsv);
+                }
+            }
+        }
+    };
+
+    // helper class to decompose the Voronoi cells into tetrahedra in parallel; the body reconstructs the cell
+    // with the specified index by cutting the domain with the bisecting planes of its neighbors, and stores
+    // the cell's vertices and a tetrahedron for each triangle in the fan triangulation of each face,
+    // with the particle position as the fourth vertex
+    class TetrahedraComputer : public ParallelTarget
+    {
+    private:
+        const Box& _extent;
+        const vector<Vec>& _rv;
+        const vector<Box>& _boxv;
+        const vector<size_t>& _nbrindexv;
+        const vector<int>& _nbrv;
+        vector< vector<Vec> >& _verticesv;
+        vector< vector<int> >& _tetsv;
+        vector< vector<double> >& _cumvolumesv;
+
+    public:
+        TetrahedraComputer(const Box& extent, const vector<Vec>& rv, const vector<Box>& boxv,
+                           const vector<size_t>& nbrindexv, const vector<int>& nbrv, vector< vector<Vec> >& verticesv,
+                           vector< vector<int> >& tetsv, vector< vector<double> >& cumvolumesv)
+            : _extent(extent), _rv(rv), _boxv(boxv), _nbrindexv(nbrindexv), _nbrv(nbrv),
+              _verticesv(verticesv), _tetsv(tetsv), _cumvolumesv(cumvolumesv) { }
+
+        void body(size_t m)
+        {
+            // the Voro++ tolerances are absolute, so perform the calculation in coordinates relative to the
+            // particle position and scaled to the size of the cell, which preserves precision for tiny cells
+            Vec pr = _rv[m];
+            Vec w = _boxv[m].widths();
+            double scale = max(w.x(), max(w.y(), w.z()));
+            if (scale <= 0) throw FATALERROR("Voronoi cell " + QString::number(m) + " has zero size");
+            Vec rmin = (_extent.rmin() - pr) / scale;
+            Vec rmax = (_extent.rmax() - pr) / scale;
+
+            // construct the cell
+            voro::voronoicell cell;
+            cell.init(rmin.x(), rmax.x(), rmin.y(), rmax.y(), rmin.z(), rmax.z());
+            size_t end = _nbrindexv[m+1];
+            for (size_t i=_nbrindexv[m]; i<end; i++)
+            {
+                int mi = _nbrv[i];
+                if (mi >= 0)
+                {
+                    Vec n = (_rv[mi] - pr) / scale;
+                    if (!cell.plane(n.x(), n.y(), n.z(), n.norm2()))
+                        throw FATALERROR("Can't reconstruct Voronoi cell " + QString::number(m));
+                }
+            }
+
+            // copy the vertices, relative to the particle position
+            vector<double> coords;
+            cell.vertices(coords);
+            vector<Vec>& vertices = _verticesv[m];
+            int Nvertices = coords.size()/3;
+            vertices.resize(Nvertices);
+            for (int v=0; v<Nvertices; v++) vertices[v] = Vec(coords[3*v], coords[3*v+1], coords[3*v+2]) * scale;
+
+            // decompose each face in triangles sharing the face's first vertex, and store the tetrahedra
+            // formed by these triangles and the particle position, with their cumulative volume
+            vector<int> faces;
+            cell.face_vertices(faces);
+            vector<int>& tets = _tetsv[m];
+            vector<double>& cumvolumes = _cumvolumesv[m];
+            double volume = 0.;
+            size_t Nfaces = faces.size();
+            for (size_t f=0; f<Nfaces; f+=faces[f]+1)
+            {
+                int n = faces[f];
+                const int* face = &faces[f+1];
+                for (int j=1; j<n-1; j++)
+                {
+                    Vec a = vertices[face[0]];
+                    Vec b = vertices[face[j]];
+                    Vec c = vertices[face[j+1]];
+                    volume += fabs(Vec::dot(a, Vec::cross(b,c))) / 6.;
+                    tets.push_back(face[0]);
+                    tets.push_back(face[j]);
+                    tets.push_back(face[j+1]);
+                    cumvolumes.push_back(volume);
+                }
+            }
+            if (cumvolumes.empty() || volume <= 0)
+                throw FATALERROR("Can't decompose Voronoi cell " + QString::number(m) + " into tetrahedra");
+
+            // normalize the cumulative volumes
+            for (double& cumvolume : cumvolumes) cumvolume /= volume;
+        }
+    };
 }
 
 using namespace VoronoiMesh_Private;
 
 ////////////////////////////////////////////////////////////////////
 
-VoronoiMesh::VoronoiMesh(VoronoiMeshFile* meshfile, QList<int> fieldIndices, const Box& extent)
+VoronoiMesh::VoronoiMesh(VoronoiMeshFile* meshfile, QList<int> fieldIndices, const Box& extent,
+                         ParallelFactory* factory)
     : _extent(extent), _eps(1e-12 * extent.widths().norm()),
       _Ndistribs(0), _integratedDensity(0)
 {
@@ -273,22 +397,22 @@ VoronoiMesh::VoronoiMesh(VoronoiMeshFile* meshfile, QList<int> fieldIndices, con
     meshfile->close();
 
     // construct the Voronoi tesselation
-    buildMesh(particles);
+    buildMesh(particles, factory);
 }
 
 ////////////////////////////////////////////////////////////////////
 
-VoronoiMesh::VoronoiMesh(const std::vector<Vec> &particles, const Box &extent)
+VoronoiMesh::VoronoiMesh(const std::vector<Vec> &particles, const Box &extent, ParallelFactory* factory)
     : _extent(extent), _eps(1e-12 * extent.widths().norm()),
       _Ndistribs(0), _integratedDensity(0)
 {
     // construct the Voronoi tesselation
-    buildMesh(particles);
+    buildMesh(particles, factory);
 }
 
 ////////////////////////////////////////////////////////////////////
 
-VoronoiMesh::VoronoiMesh(DustParticleInterface *dpi, const Box &extent)
+VoronoiMesh::VoronoiMesh(DustParticleInterface *dpi, const Box &extent, ParallelFactory* factory)
     : _extent(extent), _eps(1e-12 * extent.widths().norm()),
       _Ndistribs(0), _integratedDensity(0)
 {
@@ -302,76 +426,174 @@ VoronoiMesh::VoronoiMesh(DustParticleInterface *dpi, const Box &extent)
     }
 
     // construct the Voronoi tesselation
-    buildMesh(particles);
+    buildMesh(particles, factory);
 }
 
 ////////////////////////////////////////////////////////////////////
 
-void VoronoiMesh::buildMesh(const std::vector<Vec>& particles)
+VoronoiMesh::VoronoiMesh(DustCacheFile& file, const Box& extent, ParallelFactory* factory)
+    : _extent(extent), _eps(1e-12 * extent.widths().norm()),
+      _Ndistribs(0), _integratedDensity(0)
+{
+    // read the flattened cell properties
+    vector<double> rv, centroidv, boxv;
+    file.read(rv);
+    file.read(_volumev);
+    file.read(centroidv);
+    file.read(boxv);
+    file.read(_nbrindexv);
+    file.read(_nbrv);
+    _Ncells = _volumev.size();
+    if (rv.size() != 3*static_cast<size_t>(_Ncells) || centroidv.size() != 3*static_cast<size_t>(_Ncells)
+            || boxv.size() != 6*static_cast<size_t>(_Ncells) || _nbrindexv.size() != static_cast<size_t>(_Ncells)+1
+            || _nbrv.size() != _nbrindexv.back())
+        throw FATALERROR("Cache file " + file.filepath() + " holds an inconsistent Voronoi tesselation");
+
+    // copy them into the cell vectors
+    _rv.resize(_Ncells);
+    _centroidv.resize(_Ncells);
+    _boxv.resize(_Ncells);
+    for (int m=0; m<_Ncells; m++)
+    {
+        _rv[m] = Vec(rv[3*m], rv[3*m+1], rv[3*m+2]);
+        _centroidv[m] = Vec(centroidv[3*m], centroidv[3*m+1], centroidv[3*m+2]);
+        _boxv[m] = Box(boxv[6*m], boxv[6*m+1], boxv[6*m+2], boxv[6*m+3], boxv[6*m+4], boxv[6*m+5]);
+    }
+
+    // build the data structures accelerating the cellIndex() function
+    setBlockCount();
+    buildBlocks(factory);
+}
+
+////////////////////////////////////////////////////////////////////
+
+void VoronoiMesh::write(DustCacheFile& file) const
+{
+    // flatten the cell properties of vector type
+    vector<double> rv(3*_Ncells), centroidv(3*_Ncells), boxv(6*_Ncells);
+    for (int m=0; m<_Ncells; m++)
+    {
+        rv[3*m] = _rv[m].x();
+        rv[3*m+1] = _rv[m].y();
+        rv[3*m+2] = _rv[m].z();
+        centroidv[3*m] = _centroidv[m].x();
+        centroidv[3*m+1] = _centroidv[m].y();
+        centroidv[3*m+2] = _centroidv[m].z();
+        const Box& box = _boxv[m];
+        boxv[6*m] = box.xmin();
+        boxv[6*m+1] = box.ymin();
+        boxv[6*m+2] = box.zmin();
+        boxv[6*m+3] = box.xmax();
+        boxv[6*m+4] = box.ymax();
+        boxv[6*m+5] = box.zmax();
+    }
+
+    file.write(rv);
+    file.write(_volumev);
+    file.write(centroidv);
+    file.write(boxv);
+    file.write(_nbrindexv);
+    file.write(_nbrv);
+}
+
+////////////////////////////////////////////////////////////////////
+
+void VoronoiMesh::setBlockCount()
 {
-    // Cache some often used values
-    _Ncells = particles.size();
     _nb = max(3, min(1000, static_cast<int>(3.*pow(_Ncells,1./3.)) ));
     _nb2 = _nb*_nb;
     _nb3 = _nb*_nb*_nb;
+}
 
-    // Initialize the vector that will hold pointers to the cell objects that will stay around,
-    // using the serial number of the cell as index in the vector
-    _cells.resize(_Ncells);
+////////////////////////////////////////////////////////////////////
 
-    // Add the specified particles to our cell vector AND to a temporary Voronoi container,
-    // using the serial number of the cell as particle ID
+void VoronoiMesh::buildMesh(const std::vector<Vec>& particles, ParallelFactory* factory)
+{
+    // Cache some often used values
+    _Ncells = particles.size();
+    setBlockCount();
+
+    // Copy the specified particles to our position vector AND add them to a temporary Voronoi container,
+    // using the serial number of the cell as particle ID; the container uses a coarser block grid than
+    // the search blocks, with about 5 particles per block as recommended for Voro++, which limits
+    // the size of the scratch memory needed by each thread (proportional to the number of blocks)
+    _rv = particles;
+    int nv = containerBlockCount(_Ncells);
     voro::container con(_extent.xmin(), _extent.xmax(), _extent.ymin(), _extent.ymax(), _extent.zmin(), _extent.zmax(),
-                        _nb, _nb, _nb, false,false,false, 8);
+                        nv, nv, nv, false,false,false, 8);
     for (int m=0; m<_Ncells; m++)
     {
-        Vec r = particles[m];
-        _cells[m] = new VoronoiCell(r);  // these objects will be deleted by the destructor
+        Vec r = _rv[m];
         con.put(m, r.x(),r.y(),r.z());
     }
 
-    // Initialize a vector of nb x nb x nb lists, each containing the cells overlapping a certain block in the domain
-    _blocklists.resize(_nb3);
-
-    // For each particle:
-    //   - compute the corresponding cell in the Voronoi tesselation
-    //   - extract and copy the relevant information to one of our own cell objects
-    //   - store the cell object in the vector indexed on cell number
-    //   - add the cell object to the lists for all blocks it overlaps
-    voro::c_loop_all loop(con);
-    if (loop.start()) do
+    // Compute the Voronoi cells in parallel, distributing the rows of container blocks over the threads,
+    // and copy the relevant information to the cell vectors that will stay around; the result for each
+    // cell does not depend on the thread computing it, so the mesh is identical to a serial construction
+    Parallel* parallel = factory->parallel();
+    RootAssigner assigner(0);
     {
-        // Compute the cell
-        voro::voronoicell_neighbor fullcell;
-        bool ok = con.compute_cell(fullcell, loop);
-        if (!ok) throw FATALERROR("Can't compute Voronoi cell " + QString::number(loop.pid()));
+        _volumev.resize(_Ncells);
+        _centroidv.resize(_Ncells);
+        _boxv.resize(_Ncells);
+        vector< vector<int> > neighborsv(_Ncells);
+        CellComputer computer(con, _rv, _volumev, _centroidv, _boxv, neighborsv, factory);
+        assigner.assign(nv*nv);
+        parallel->call(&computer, &assigner);
+
+        // concatenate the neighbor lists in order of cell index, releasing the temporary lists as we go
+        size_t Nneighbors = 0;
+        for (int m=0; m<_Ncells; m++) Nneighbors += neighborsv[m].size();
+        _nbrv.reserve(Nneighbors);
+        _nbrindexv.resize(_Ncells+1);
+        for (int m=0; m<_Ncells; m++)
+        {
+            _nbrindexv[m] = _nbrv.size();
+            _nbrv.insert(_nbrv.end(), neighborsv[m].begin(), neighborsv[m].end());
+            vector<int>().swap(neighborsv[m]);
+        }
+        _nbrindexv[_Ncells] = _nbrv.size();
+    }
 
-        // Copy all relevant information to the cell object that will stay around
-        VoronoiCell* cell = _cells[loop.pid()];
-        cell->init(fullcell);
+    // Build the data structures accelerating the cellIndex() function
+    buildBlocks(factory);
+}
+
+////////////////////////////////////////////////////////////////////
 
-        // Add the cell object to the lists for all blocks it may overlap
-        // --> a precise intersection test is really slow and doesn't substantially accelerate whichcell()
+void VoronoiMesh::buildBlocks(ParallelFactory* factory)
+{
+    // Add each cell to the lists for all blocks it may overlap, in order of cell index
+    // --> a precise intersection test is really slow and doesn't substantially accelerate whichcell()
+    _blocklists.resize(_nb3);
+    for (int m=0; m<_Ncells; m++)
+    {
+        const Box& box = _boxv[m];
         int i1,j1,k1, i2,j2,k2;
-        _extent.cellindices(i1,j1,k1, cell->rmin()-Vec(_eps,_eps,_eps), _nb,_nb,_nb);
-        _extent.cellindices(i2,j2,k2, cell->rmax()+Vec(_eps,_eps,_eps), _nb,_nb,_nb);
+        _extent.cellindices(i1,j1,k1, box.rmin()-Vec(_eps,_eps,_eps), _nb,_nb,_nb);
+        _extent.cellindices(i2,j2,k2, box.rmax()+Vec(_eps,_eps,_eps), _nb,_nb,_nb);
         for (int i=i1; i<=i2; i++)
             for (int j=j1; j<=j2; j++)
                 for (int k=k1; k<=k2; k++)
-                    _blocklists[i*_nb2+j*_nb+k].push_back(loop.pid());
+                    _blocklists[i*_nb2+j*_nb+k].push_back(m);
     }
-    while (loop.inc());
 
     // for each block that contains more than a predefined number of cells,
-    // construct a search tree on the particle locations of the cells
+    // construct a search tree on the particle locations of the cells (in parallel over the blocks)
     _blocktrees.resize(_nb3);
-    for (int b = 0; b<_nb3; b++)
+    RootAssigner assigner(0);
+    assigner.assign(_nb3);
+    factory->parallel()->call(this, &VoronoiMesh::buildBlockTree, &assigner);
+}
+
+////////////////////////////////////////////////////////////////////
+
+void VoronoiMesh::buildBlockTree(size_t b)
+{
+    vector<int>& ids = _blocklists[b];
+    if (ids.size() > 5)
     {
-        vector<int>& ids = _blocklists[b];
-        if (ids.size() > 5)
-        {
-            _blocktrees[b] = buildTree(ids.begin(), ids.end(), 0);
-        }
+        _blocktrees[b] = buildTree(ids.begin(), ids.end(), 0);
     }
 }
 
@@ -382,7 +604,7 @@ Node* VoronoiMesh::buildTree(vector<int>::iterator first, vector<int>::iterator
     size_t length = last-first;
     if (length>0)
     {
-        LessThan compare(_cells, depth);
+        LessThan compare(_rv, depth);
         size_t median = length >> 1;
         nth_element(first, first+median, last, compare);
         return new Node(*(first+median), depth,
@@ -394,6 +616,97 @@ Node* VoronoiMesh::buildTree(vector<int>::iterator first, vector<int>::iterator
 
 ////////////////////////////////////////////////////////////////////
 
+void VoronoiMesh::precomputeFaces()
+{
+    if (!_planev.empty()) return;
+
+    _planev.resize(4*_nbrv.size());
+    for (int m=0; m<_Ncells; m++)
+    {
+        Vec pr = _rv[m];
+        size_t end = _nbrindexv[m+1];
+        for (size_t i=_nbrindexv[m]; i<end; i++)
+        {
+            int mi = _nbrv[i];
+            Vec n;
+            double d;
+
+            // --- bisecting plane with neighboring cell
+            if (mi>=0)
+            {
+                Vec pi = _rv[mi];
+                n = pi - pr;
+                d = Vec::dot(n, 0.5*(pi+pr));
+            }
+
+            // --- domain wall, with outward normal
+            else
+            {
+                switch (mi)
+                {
+                case -1: n = Vec(-1,0,0); d = -_extent.xmin(); break;
+                case -2: n = Vec( 1,0,0); d =  _extent.xmax(); break;
+                case -3: n = Vec(0,-1,0); d = -_extent.ymin(); break;
+                case -4: n = Vec(0, 1,0); d =  _extent.ymax(); break;
+                case -5: n = Vec(0,0,-1); d = -_extent.zmin(); break;
+                case -6: n = Vec(0,0, 1); d =  _extent.zmax(); break;
+                default: throw FATALERROR("Invalid neighbor ID");
+                }
+            }
+
+            _planev[4*i] = n.x();
+            _planev[4*i+1] = n.y();
+            _planev[4*i+2] = n.z();
+            _planev[4*i+3] = d;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+
+void VoronoiMesh::precomputeTetrahedra(ParallelFactory* factory)
+{
+    if (!_tetindexv.empty()) return;
+
+    // decompose the cells in parallel into temporary per-cell lists
+    vector< vector<Vec> > verticesv(_Ncells);
+    vector< vector<int> > tetsv(_Ncells);
+    vector< vector<double> > cumvolumesv(_Ncells);
+    TetrahedraComputer computer(_extent, _rv, _boxv, _nbrindexv, _nbrv, verticesv, tetsv, cumvolumesv);
+    RootAssigner assigner(0);
+    assigner.assign(_Ncells);
+    factory->parallel()->call(&computer, &assigner);
+
+    // concatenate the lists in order of cell index, releasing the temporary lists as we go
+    size_t Nvertices = 0;
+    size_t Ntets = 0;
+    for (int m=0; m<_Ncells; m++)
+    {
+        Nvertices += verticesv[m].size();
+        Ntets += cumvolumesv[m].size();
+    }
+    _vertexv.reserve(Nvertices);
+    _tetv.reserve(3*Ntets);
+    _tetcumv.reserve(Ntets);
+    _vertexindexv.resize(_Ncells+1);
+    _tetindexv.resize(_Ncells+1);
+    for (int m=0; m<_Ncells; m++)
+    {
+        _vertexindexv[m] = _vertexv.size();
+        _tetindexv[m] = _tetcumv.size();
+        _vertexv.insert(_vertexv.end(), verticesv[m].begin(), verticesv[m].end());
+        _tetv.insert(_tetv.end(), tetsv[m].begin(), tetsv[m].end());
+        _tetcumv.insert(_tetcumv.end(), cumvolumesv[m].begin(), cumvolumesv[m].end());
+        vector<Vec>().swap(verticesv[m]);
+        vector<int>().swap(tetsv[m]);
+        vector<double>().swap(cumvolumesv[m]);
+    }
+    _vertexindexv[_Ncells] = _vertexv.size();
+    _tetindexv[_Ncells] = _tetcumv.size();
+}
+
+////////////////////////////////////////////////////////////////////
+
 void VoronoiMesh::addDensityDistribution(int densityField, int densityMultiplierField, double densityFraction)
 {
     // verify indices
@@ -418,7 +731,7 @@ void VoronoiMesh::addDensityDistribution(int densityField, int densityMultiplier
     {
         double density = _fieldvalues[densityField][m] * densityFraction;
         if (densityMultiplierField >= 0) density *= _fieldvalues[densityMultiplierField][m];
-        if (density > 0) integratedDensity += density*_cells[m]->volume();
+        if (density > 0) integratedDensity += density*_volumev[m];
     }
     _integratedDensityv.push_back(integratedDensity);
     _integratedDensity += integratedDensity;
@@ -428,7 +741,6 @@ void VoronoiMesh::addDensityDistribution(int densityField, int densityMultiplier
 
 VoronoiMesh::~VoronoiMesh()
 {
-    for (int m=0; m<_Ncells; m++) delete _cells[m];
     for (int b=0; b<_nb3; b++) delete _blocktrees[b];
 }
 
@@ -448,7 +760,7 @@ void VoronoiMesh::neighborStatistics(double &average, int &minimum, int &maximum
     qint64 totalNeighbors = 0;
     for (int m=0; m<_Ncells; m++)
     {
-        int ns = _cells[m]->neighbors().size();
+        int ns = _nbrindexv[m+1] - _nbrindexv[m];
         totalNeighbors += ns;
         minNeighbors = min(minNeighbors, ns);
         maxNeighbors = max(maxNeighbors, ns);
@@ -507,6 +819,54 @@ void VoronoiMesh::treeStatistics(int& Ntrees, double& average, int& minimum, int
     maximum = maxRefsPerTree;
 }
 
+//////////////////////////////////////////////////////////////////////
+
+int VoronoiMesh::serialDifferences() const
+{
+    // add the particles to a container configured as in buildMesh()
+    int nv = containerBlockCount(_Ncells);
+    voro::container con(_extent.xmin(), _extent.xmax(), _extent.ymin(), _extent.ymax(), _extent.zmin(), _extent.zmax(),
+                        nv, nv, nv, false,false,false, 8);
+    for (int m=0; m<_Ncells; m++)
+    {
+        Vec r = _rv[m];
+        con.put(m, r.x(),r.y(),r.z());
+    }
+
+    // compute the cells serially
+    vector<double> volumev(_Ncells);
+    vector<Vec> centroidv(_Ncells);
+    vector<Box> boxv(_Ncells);
+    vector< vector<int> > neighborsv(_Ncells);
+    voro::c_loop_all loop(con);
+    if (loop.start()) do
+    {
+        int m = loop.pid();
+        voro::voronoicell_neighbor fullcell;
+        bool ok = con.compute_cell(fullcell, loop);
+        if (!ok) throw FATALERROR("Can't compute Voronoi cell " + QString::number(m));
+        storecell(m, fullcell, _rv, volumev, centroidv, boxv, neighborsv);
+    }
+    while (loop.inc());
+
+    // compare with the stored tesselation
+    int Ndiff = 0;
+    for (int m=0; m<_Ncells; m++)
+    {
+        const Box& box = boxv[m];
+        const Box& mybox = _boxv[m];
+        bool same = volumev[m] == _volumev[m]
+                && centroidv[m].x() == _centroidv[m].x() && centroidv[m].y() == _centroidv[m].y()
+                && centroidv[m].z() == _centroidv[m].z()
+                && box.xmin() == mybox.xmin() && box.ymin() == mybox.ymin() && box.zmin() == mybox.zmin()
+                && box.xmax() == mybox.xmax() && box.ymax() == mybox.ymax() && box.zmax() == mybox.zmax()
+                && neighborsv[m].size() == _nbrindexv[m+1] - _nbrindexv[m]
+                && equal(neighborsv[m].begin(), neighborsv[m].end(), _nbrv.begin() + _nbrindexv[m]);
+        if (!same) Ndiff++;
+    }
+    return Ndiff;
+}
+
 ////////////////////////////////////////////////////////////////////
 
 int VoronoiMesh::cellIndex(Position bfr) const
@@ -521,7 +881,7 @@ int VoronoiMesh::cellIndex(Position bfr) const
 
     // look for the closest particle in this block, using the search tree if there is one
     Node* tree = _blocktrees[b];
-    if (tree) return tree->nearest(bfr,_cells)->m();
+    if (tree) return tree->nearest(bfr,_rv)->m();
 
     // if there is no search tree, simply loop over the index list
     const vector<int>& ids = _blocklists[b];
@@ -530,7 +890,7 @@ int VoronoiMesh::cellIndex(Position bfr) const
     int n = ids.size();
     for (int i=0; i<n; i++)
     {
-        double idist = _cells[ids[i]]->squaredDistanceTo(bfr);
+        double idist = (bfr-_rv[ids[i]]).norm2();
         if (idist < mdist)
         {
             m = ids[i];
@@ -552,7 +912,7 @@ double VoronoiMesh::volume() const
 double VoronoiMesh::volume(int m) const
 {
     if (m < 0 || m >= _Ncells) throw FATALERROR("Cell index out of range: " + QString::number(m));
-    return _cells[m]->volume();
+    return _volumev[m];
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -567,7 +927,7 @@ Box VoronoiMesh::extent() const
 Box VoronoiMesh::extent(int m) const
 {
     if (m < 0 || m >= _Ncells) throw FATALERROR("Cell index out of range: " + QString::number(m));
-    return _cells[m]->extent();
+    return _boxv[m];
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -575,7 +935,7 @@ Box VoronoiMesh::extent(int m) const
 Position VoronoiMesh::particlePosition(int m) const
 {
     if (m < 0 || m >= _Ncells) throw FATALERROR("Cell index out of range: " + QString::number(m));
-    return Position(_cells[m]->particle());
+    return Position(_rv[m]);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -583,7 +943,7 @@ Position VoronoiMesh::particlePosition(int m) const
 Position VoronoiMesh::centralPosition(int m) const
 {
     if (m < 0 || m >= _Ncells) throw FATALERROR("Cell index out of range: " + QString::number(m));
-    return Position(_cells[m]->centroid());
+    return Position(_centroidv[m]);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -592,27 +952,51 @@ Position VoronoiMesh::randomPosition(Random* random, int m) const
 {
     if (m < 0 || m >= _Ncells) throw FATALERROR("Cell index out of range: " + QString::number(m));
 
+    // if the cells have been decomposed into tetrahedra, sample one of these without rejection
+    if (!_tetindexv.empty())
+    {
+        // select a tetrahedron with a probability proportional to its volume
+        const double* first = &_tetcumv[_tetindexv[m]];
+        const double* last = &_tetcumv[_tetindexv[m+1]];
+        size_t t = min(upper_bound(first, last, random->uniform()), last-1) - &_tetcumv[0];
+
+        // draw barycentric coordinates uniformly over the tetrahedron by folding the unit cube
+        // (Rocchini & Cignoni 2000, Journal of Graphics Tools, 5, 9)
+        double s = random->uniform();
+        double u = random->uniform();
+        double v = random->uniform();
+        if (s+u > 1.) { s = 1.-s; u = 1.-u; }
+        if (u+v > 1.) { double tmp = v; v = 1.-s-u; u = 1.-tmp; }
+        else if (s+u+v > 1.) { double tmp = v; v = s+u+v-1.; s = 1.-u-tmp; }
+
+        // the fourth vertex is the particle position, which carries the remaining weight
+        const Vec* vertices = &_vertexv[_vertexindexv[m]];
+        const int* tet = &_tetv[3*t];
+        return Position(_rv[m] + s*vertices[tet[0]] + u*vertices[tet[1]] + v*vertices[tet[2]]);
+    }
+
     // get loop-invariant information about the cell
-    const Box& box = _cells[m]->extent();
-    const vector<int>& neighbors = _cells[m]->neighbors();
+    const Box& box = _boxv[m];
 
     // generate random points in the enclosing box until one happens to be inside the cell
     for (int i=0; i<10000; i++)
     {
         Vec r = random->position(box);
-        if (isPointClosestTo(r, m, neighbors)) return Position(r);
+        if (isPointClosestTo(r, m)) return Position(r);
     }
     throw FATALERROR("Can't find random position in cell");
 }
 
 //////////////////////////////////////////////////////////////////////
 
-bool VoronoiMesh::isPointClosestTo(Vec r, int m, const vector<int>& ids) const
+bool VoronoiMesh::isPointClosestTo(Vec r, int m) const
 {
-    double target = _cells[m]->squaredDistanceTo(r);
-    foreach (int id, ids)
+    double target = (r-_rv[m]).norm2();
+    size_t end = _nbrindexv[m+1];
+    for (size_t i=_nbrindexv[m]; i<end; i++)
     {
-        if (id>=0 && _cells[id]->squaredDistanceTo(r) < target) return false;
+        int id = _nbrv[i];
+        if (id>=0 && (r-_rv[id]).norm2() < target) return false;
     }
     return true;
 }
@@ -763,67 +1147,95 @@ void VoronoiMesh::path(DustGridPath* path) const
     // Start the loop over cells/path segments until we leave the grid
     while (mr>=0)
     {
-        // get the particle position for this cell
-        Vec pr = _cells[mr]->particle();
-
         // initialize the smallest nonnegative intersection distance and corresponding index
         double sq = DBL_MAX;          // very large, but not infinity (so that infinite si values are discarded)
         const int NO_INDEX = -99;     // meaningless cell index
         int mq = NO_INDEX;
 
-        // loop over the list of neighbor indices
-        const vector<int>& mv = _cells[mr]->neighbors();
-        int n = mv.size();
-        for (int i=0; i<n; i++)
-        {
-            int mi = mv[i];
+        // get the range of this cell's neighbors in the compressed neighbor list
+        size_t begin = _nbrindexv[mr];
+        size_t end = _nbrindexv[mr+1];
 
-            // declare the intersection distance for this neighbor (init to a value that will be rejected)
-            double si = 0;
-
-            // --- intersection with neighboring cell
-            if (mi>=0)
+        // --- use the precomputed planes for all neighbors and walls, which are stored contiguously
+        if (!_planev.empty())
+        {
+            const double* plane = &_planev[4*begin];
+            for (size_t i=begin; i<end; i++, plane+=4)
             {
-                // get the particle position for this neighbor
-                Vec pi = _cells[mi]->particle();
-
-                // calculate the (unnormalized) normal on the bisecting plane
-                Vec n = pi - pr;
-
                 // calculate the denominator of the intersection quotient
-                double ndotk = Vec::dot(n,bfk);
+                double ndotk = plane[0]*bfk.x() + plane[1]*bfk.y() + plane[2]*bfk.z();
 
-                // if the denominator is negative the intersection distance is negative, so don't calculate it
+                // if the denominator is not positive the intersection distance is negative, so don't calculate it
                 if (ndotk > 0)
                 {
-                    // calculate a point on the bisecting plane
-                    Vec p = 0.5 * (pi + pr);
-
-                    // calculate the intersection distance
-                    si = Vec::dot(n,p-r) / ndotk;
+                    double si = (plane[3] - (plane[0]*r.x() + plane[1]*r.y() + plane[2]*r.z())) / ndotk;
+                    if (si > 0 && si < sq)
+                    {
+                        sq = si;
+                        mq = _nbrv[i];
+                    }
                 }
             }
+        }
 
-            // --- intersection with domain wall
-            else
+        // --- calculate the planes on the fly from the particle positions
+        else
+        {
+            // get the particle position for this cell
+            Vec pr = _rv[mr];
+
+            // loop over the list of neighbor indices
+            for (size_t i=begin; i<end; i++)
             {
-                switch (mi)
+                int mi = _nbrv[i];
+
+                // declare the intersection distance for this neighbor (init to a value that will be rejected)
+                double si = 0;
+
+                // --- intersection with neighboring cell
+                if (mi>=0)
                 {
-                case -1: si = (extent().xmin()-r.x())/bfk.x(); break;
-                case -2: si = (extent().xmax()-r.x())/bfk.x(); break;
-                case -3: si = (extent().ymin()-r.y())/bfk.y(); break;
-                case -4: si = (extent().ymax()-r.y())/bfk.y(); break;
-                case -5: si = (extent().zmin()-r.z())/bfk.z(); break;
-                case -6: si = (extent().zmax()-r.z())/bfk.z(); break;
-                default: throw FATALERROR("Invalid neighbor ID");
+                    // get the particle position for this neighbor
+                    Vec pi = _rv[mi];
+
+                    // calculate the (unnormalized) normal on the bisecting plane
+                    Vec n = pi - pr;
+
+                    // calculate the denominator of the intersection quotient
+                    double ndotk = Vec::dot(n,bfk);
+
+                    // if the denominator is negative the intersection distance is negative, so don't calculate it
+                    if (ndotk > 0)
+                    {
+                        // calculate a point on the bisecting plane
+                        Vec p = 0.5 * (pi + pr);
+
+                        // calculate the intersection distance
+                        si = Vec::dot(n,p-r) / ndotk;
+                    }
                 }
-            }
 
-            // remember the smallest nonnegative intersection point
-            if (si > 0 && si < sq)
-            {
-                sq = si;
-                mq = mi;
+                // --- intersection with domain wall
+                else
+                {
+                    switch (mi)
+                    {
+                    case -1: si = (extent().xmin()-r.x())/bfk.x(); break;
+                    case -2: si = (extent().xmax()-r.x())/bfk.x(); break;
+                    case -3: si = (extent().ymin()-r.y())/bfk.y(); break;
+                    case -4: si = (extent().ymax()-r.y())/bfk.y(); break;
+                    case -5: si = (extent().zmin()-r.z())/bfk.z(); break;
+                    case -6: si = (extent().zmax()-r.z())/bfk.z(); break;
+                    default: throw FATALERROR("Invalid neighbor ID");
+                    }
+                }
+
+                // remember the smallest nonnegative intersection point
+                if (si > 0 && si < sq)
+                {
+                    sq = si;
+                    mq = mi;
+                }
             }
         }
 
@@ -11,18 +11,20 @@
 #include <QHash>
 #include "Box.hpp"
 #include "Position.hpp"
+class DustCacheFile;
 class DustGridPath;
 class DustParticleInterface;
+class ParallelFactory;
 class Random;
 class VoronoiMeshFile;
-namespace VoronoiMesh_Private { class VoronoiCell; class Node; }
+namespace VoronoiMesh_Private { class Node; }
 
 ////////////////////////////////////////////////////////////////////
 
 /** The VoronoiMesh class is used to manage a cartesian three-dimensional Voronoi mesh. It offers
     methods to interrogate the data structure in various (sometimes quite advanced) ways. Once an
-    VoronoiMesh instance has been constructed, its data is never modified. Consequently all methods
-    are re-entrant.
+    VoronoiMesh instance has been constructed (and, optionally, its cell faces or tetrahedra have
+    been precomputed), its data is never modified. Consequently all other methods are re-entrant.
 
     For the purposes of this class, a Voronoi mesh represents any number (including zero) of scalar
     fields over a given cuboidal spatial domain. The Voronoi mesh partitions the domain in
@@ -60,20 +62,36 @@ public:
         variables in the file are ignored. The indices may be specified in any order, and the same
         index may be specified more than once. Negative values are ignored. The last argument \em
         extent specifies the extent of the domain as a box lined up with the coordinate axes.
-        Any particles located outside of the domain are discarded. */
-    VoronoiMesh(VoronoiMeshFile* meshfile, QList<int> fieldIndices, const Box& extent);
+        Any particles located outside of the domain are discarded. The Voronoi tesselation is
+        constructed using the parallel threads offered by the specified parallel factory. */
+    VoronoiMesh(VoronoiMeshFile* meshfile, QList<int> fieldIndices, const Box& extent, ParallelFactory* factory);
 
     /** This constructor obtains the particle coordinates from a DustParticleInterface instance.
         There are no field values associated with the particles. The last argument \em extent
         specifies the extent of the domain as a box lined up with the coordinate axes.
-        Any particles located outside of the domain are discarded. */
-    VoronoiMesh(DustParticleInterface* dpi, const Box& extent);
+        Any particles located outside of the domain are discarded. The Voronoi tesselation is
+        constructed using the parallel threads offered by the specified parallel factory. */
+    VoronoiMesh(DustParticleInterface* dpi, const Box& extent, ParallelFactory* factory);
 
     /** This constructor uses the particle coordinates specified as a vector. There are no field
         values associated with the particles. The last argument \em extent specifies the extent of
         the domain as a box lined up with the coordinate axes. The specified particle locations
-        are assumed to be inside the domain; no check is performed. */
-    VoronoiMesh(const std::vector<Vec>& particles, const Box& extent);
+        are assumed to be inside the domain; no check is performed. The Voronoi tesselation is
+        constructed using the parallel threads offered by the specified parallel factory. */
+    VoronoiMesh(const std::vector<Vec>& particles, const Box& extent, ParallelFactory* factory);
+
+    /** This constructor restores a Voronoi tesselation from the specified cache file, which must
+        have been written by the write() function for a mesh with the same extent. There are no
+        field values associated with the particles. The Voronoi cells are not recomputed; only the
+        block lists and search trees accelerating the cellIndex() function are rebuilt, using the
+        parallel threads offered by the specified parallel factory. */
+    VoronoiMesh(DustCacheFile& file, const Box& extent, ParallelFactory* factory);
+
+    /** This function writes the Voronoi tesselation to the specified cache file, so that it can be
+        restored later through the corresponding constructor. It writes the particle positions, the
+        volume, centroid and bounding box of each cell, and the neighbor lists in CSR format. Any
+        field values, precomputed faces or tetrahedra are not written. */
+    void write(DustCacheFile& file) const;
 
 private:
     /** This private function is called from each constructor. Given a list of generating
@@ -83,11 +101,19 @@ private:
         discarded.
 
         The function performs the following steps:
-         - add the particles to a Voro++ container, and compute the Voronoi cells one by one;
+         - add the particles to a Voro++ container, and compute the Voronoi cells in parallel,
+           distributing the rows of blocks in the container over the threads offered by the
+           specified parallel factory; each thread uses its own Voro++ compute object, and the
+           result for each cell does not depend on the thread computing it or on the order in
+           which the cells are computed, so that the tesselation is identical to the one obtained
+           by a serial construction;
          - copy the relevant cell information (such as the list of neighboring cells) from the
-           Voro++ data structures into our own;
+           Voro++ data structures into our own; the cell properties are stored in separate
+           contiguous vectors indexed on cell index, and the neighbor lists of all cells are
+           concatenated into a single vector in compressed sparse row (CSR) format, with a
+           separate vector holding the offset of each cell's list;
          - build a data structure that allows fast retrieval of a list of the Voronoi cells
-           possibly overlapping a given point in the domain (see below).
+           possibly overlapping a given point in the domain (see below and buildBlocks()).
 
         To accelerate operation of the cellIndex() function, which is called quite frequently, the
         domain is partitioned yet again, this time using a linear cubodial grid. The cells in this
@@ -102,13 +128,53 @@ private:
         To further reduce the search time within blocks that overlaps with a large number of cells,
         this function builds a binary search tree on the cell particle locations for those blocks
         (see for example <a href="http://en.wikipedia.org/wiki/Kd-tree">en.wikipedia.org/wiki/Kd-tree</a>).
+        These search trees are constructed in parallel for the various blocks.
     */
-    void buildMesh(const std::vector<Vec>& particles);
+    void buildMesh(const std::vector<Vec>& particles, ParallelFactory* factory);
+
+    /** This private function determines the number of blocks in each dimension used by the
+        cellIndex() function from the number of cells. */
+    void setBlockCount();
+
+    /** This private function builds the block lists and the search trees accelerating the
+        cellIndex() function (see buildMesh()), using the parallel threads offered by the specified
+        parallel factory. The cells are added to the block lists in order of cell index. The
+        function is called by buildMesh() and by the constructor that restores the tesselation
+        from a cache file. */
+    void buildBlocks(ParallelFactory* factory);
+
+    /** This private function serves as the parallelization body for building the search tree
+        for the block with index \em b, if the block overlaps with more than a predefined number
+        of cells. */
+    void buildBlockTree(size_t b);
 
     /** This private function builds the binary search tree. TO DO: complete documentation. */
     VoronoiMesh_Private::Node* buildTree(std::vector<int>::iterator first, std::vector<int>::iterator last, int depth);
 
 public:
+    /** This function precomputes and stores the plane separating each Voronoi cell from each of
+        its neighbors, or the plane of the corresponding domain wall, so that the path() function
+        does not need to calculate these planes on the fly. Each plane is stored as a normal
+        \f$\mathbf{n}\f$ pointing away from the cell and an offset \f$d\f$ so that the plane
+        equation is \f$\mathbf{n}\cdot\mathbf{x}=d\f$. This substantially accelerates the path
+        calculation at the cost of four additional double values per neighbor (typically around
+        500 bytes per cell). Calling this function more than once has no effect. Because it
+        modifies the mesh, it must be called during setup, before the mesh is used concurrently. */
+    void precomputeFaces();
+
+    /** This function decomposes each Voronoi cell into tetrahedra and stores the result, so that
+        the randomPosition() function can draw a uniform random position in a cell without
+        rejection. Each cell is reconstructed by cutting the domain with the planes bisecting the
+        cell's particle and each of its neighbors. Each face of the cell is then triangulated as a
+        fan around its first vertex, and each triangle forms a tetrahedron with the cell's particle
+        position, which is always inside the cell. For each cell, the function stores the
+        vertices and, for each tetrahedron, the indices of its three face vertices and its
+        normalized cumulative volume. This typically requires around 1.6 kB per cell. The cells
+        are decomposed in parallel, using the threads offered by the specified parallel factory.
+        Calling this function more than once has no effect. Because it modifies the mesh, it must
+        be called during setup, before the mesh is used concurrently. */
+    void precomputeTetrahedra(ParallelFactory* factory);
+
     /** This function adds a density distribution accessed by functions such as density() and
         integratedDensity(). The first argument \em densityField specifies the index \f$g_d\f$ of
         the field that should be interpreted as a (not necessarily normalized) density distribution
@@ -152,6 +218,16 @@ public:
         search tree. */
     void treeStatistics(int& Ntrees, double& average, int& minimum, int& maximum) const;
 
+    /** This function verifies the tesselation against a serial construction. It adds the particles
+        to a Voro++ container configured in the same way as by buildMesh(), computes all cells
+        serially with the container's own compute object in the order of the Voro++ loop over all
+        particles, and compares the results with the stored tesselation. The function returns the
+        number of cells for which the volume, the centroid, the bounding box or the neighbor list
+        is not bitwise identical to the stored value, so that a return value of zero confirms that
+        the parallel construction reproduces the serial one exactly. The function is intended as a
+        regression check and is rather expensive, since it recomputes the complete tesselation. */
+    int serialDifferences() const;
+
     /** This function returns the cell index \f$0\le m \le N_{cells}-1\f$ for the cell containing
         the specified point \f${\bf{r}}\f$. If the point is outside the domain, the function
         returns -1. By definition of a Voronoi tesselation, the closest particle position
@@ -196,18 +272,21 @@ public:
         N_{cells}-1\f$, drawn from a uniform distribution. If the index is out of range a fatal
         error is thrown. The first argument provides the random generator to be used.
 
-        The function generates uniformly distributed random points in the enclosing cuboid
-        until one happens to be inside the cell. The candidate point is inside the cell if it is
-        closer to the cell's particle position than to any neighbor cell's particle positions.
+        If the cells have been decomposed into tetrahedra by the precomputeTetrahedra() function,
+        the function selects one of the cell's tetrahedra with a probability proportional to its
+        volume, through a binary search on the cumulative volumes, and then draws a uniform random
+        point in that tetrahedron. Otherwise, the function generates uniformly distributed random
+        points in the enclosing cuboid until one happens to be inside the cell. The candidate
+        point is inside the cell if it is closer to the cell's particle position than to any
+        neighbor cell's particle positions. For elongated cells, this may require many attempts.
     */
     Position randomPosition(Random* random, int m) const;
 
 private:
-    /** This function returns true if the specified point is closer to the particle
-        defining the cell with index \em m than to all of the particles defining the cells with the
-        indices in the list \em ids; otherwise it returns false. If the list \em ids contains the
-        neighbors of \em m then this function returns true if the point is inside cell \em m. */
-    bool isPointClosestTo(Vec r, int m, const std::vector<int> &ids) const;
+    /** This function returns true if the specified point is closer to the particle defining the
+        cell with index \em m than to all of the particles defining the neighbors of that cell, in
+        other words if the point is inside cell \em m; otherwise it returns false. */
+    bool isPointClosestTo(Vec r, int m) const;
 
 public:
     /** This function returns the value \f$F_g(m)\f$ of the specified field in the cell with given
@@ -354,6 +433,12 @@ public:
         position vectors for the wall plane in this last formula. For example, for the left wall
         with \f$m_i=-1\f$ one has \f$\mathbf{n}=(-1,0,0)\f$ and \f$\mathbf{p}=(x_\text{min},0,0)\f$
         so that \f[s_i=\frac{x_\text{min}-r_x}{k_x}.\f]
+
+        If the planes have been precomputed by the precomputeFaces() function, the intersection
+        for both neighbors and walls is calculated as \f[s_i=\frac{d-\mathbf{n}\cdot\mathbf{r}}
+        {\mathbf{n}\cdot\mathbf{k}}\f] with \f$d=\mathbf{n}\cdot\mathbf{p}\f$, using plane data
+        that are stored contiguously for the neighbors of each cell. This avoids retrieving the
+        particle positions of the neighbors, which are scattered in memory.
     */
     void path(DustGridPath* path) const;
 
@@ -381,7 +466,18 @@ private:
     int _nb;                                    // number of blocks in each dimension (limit for indices i,j,k)
     int _nb2;                                   // nb*nb
     int _nb3;                                   // nb*nb*nb
-    std::vector<VoronoiMesh_Private::VoronoiCell*> _cells;  // cell objects, indexed on m
+    std::vector<Vec> _rv;                       // particle positions, indexed on m
+    std::vector<double> _volumev;               // cell volumes, indexed on m
+    std::vector<Vec> _centroidv;                // cell centroids, indexed on m
+    std::vector<Box> _boxv;                     // cell bounding boxes, indexed on m
+    std::vector<size_t> _nbrindexv;             // the neighbors of cell m are stored in _nbrv[i]
+    std::vector<int> _nbrv;                     //   with _nbrindexv[m] <= i < _nbrindexv[m+1]; negative for walls
+    std::vector<double> _planev;                // nx,ny,nz,d for each item in _nbrv, or empty if not precomputed
+    std::vector<size_t> _vertexindexv;          // the vertices of cell m are stored in _vertexv[i]
+    std::vector<Vec> _vertexv;                  //   with _vertexindexv[m] <= i < _vertexindexv[m+1], relative to _rv[m]
+    std::vector<size_t> _tetindexv;             // the tetrahedra of cell m have index _tetindexv[m] <= t < _tetindexv[m+1]
+    std::vector<int> _tetv;                     // three vertex indices relative to _vertexindexv[m] for each tetrahedron
+    std::vector<double> _tetcumv;               // normalized cumulative volume for each tetrahedron
     std::vector< std::vector<int> > _blocklists;            // list of cell indices per block, indexed on i*_nb2+j*_nb+k
     std::vector< VoronoiMesh_Private::Node* > _blocktrees;  // root node of search tree or null for each block,
                                                             // indexed on i*_nb2+j*_nb+k
@@ -0,0 +1,111 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#include "ColumnBinaryFile.hpp"
+#include "FatalError.hpp"
+#include "FilePaths.hpp"
+#include "Log.hpp"
+#include "VoronoiMeshBinaryFile.hpp"
+
+////////////////////////////////////////////////////////////////////
+
+VoronoiMeshBinaryFile::VoronoiMeshBinaryFile()
+    : _coordinateUnits(0), _infile(0), _row(0)
+{
+}
+
+//////////////////////////////////////////////////////////////////////
+
+VoronoiMeshBinaryFile::~VoronoiMeshBinaryFile()
+{
+    close();
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void VoronoiMeshBinaryFile::setupSelfBefore()
+{
+    VoronoiMeshFile::setupSelfBefore();
+
+    // verify property values
+    if (_coordinateUnits <= 0) throw FATALERROR("Coordinate units should be positive");
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void VoronoiMeshBinaryFile::setCoordinateUnits(double value)
+{
+    _coordinateUnits = value;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+double VoronoiMeshBinaryFile::coordinateUnits() const
+{
+    return _coordinateUnits;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void VoronoiMeshBinaryFile::open()
+{
+    // open the data file
+    close();
+    QString filepath = find<FilePaths>()->input(_filename);
+    _infile = new ColumnBinaryFile(filepath);
+    find<Log>()->info("Reading Voronoi mesh data from binary file " + filepath + "...");
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void VoronoiMeshBinaryFile::close()
+{
+    delete _infile;
+    _infile = 0;
+    _row = 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+bool VoronoiMeshBinaryFile::read()
+{
+    if (!_infile || _row >= _infile->numRows())
+    {
+        _row = 0;
+        return false;
+    }
+    _row++;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+Vec VoronoiMeshBinaryFile::particle() const
+{
+    // verify the current record and the number of columns
+    if (!_row) throw FATALERROR("There is no current record in the Voronoi mesh data");
+    if (_infile->numColumns() < 3) throw FATALERROR("Insufficient number of particle coordinates in Voronoi mesh data");
+
+    // get the coordinate values and convert to SI units
+    size_t r = _row-1;
+    return Vec(_infile->value(r,0)*_coordinateUnits, _infile->value(r,1)*_coordinateUnits,
+               _infile->value(r,2)*_coordinateUnits);
+}
+
+//////////////////////////////////////////////////////////////////////
+
+double VoronoiMeshBinaryFile::value(int g) const
+{
+    // verify the current record and the index range
+    if (!_row) throw FATALERROR("There is no current record in the Voronoi mesh data");
+    if (g < 0) throw FATALERROR("Field index out of range");
+    if (static_cast<size_t>(g)+3 >= _infile->numColumns())
+        throw FATALERROR("Insufficient number of field values in Voronoi mesh data");
+
+    // get the appropriate column value
+    return _infile->value(_row-1, g+3);
+}
+
+//////////////////////////////////////////////////////////////////////
@@ -0,0 +1,92 @@
+/*//////////////////////////////////////////////////////////////////
+////       SKIRT -- an advanced radiative transfer code         ////
+////       © Astronomical Observatory, Ghent University         ////
+///////////////////////////////////////////////////////////////// */
+
+#ifndef VORONOIMESHBINARYFILE_HPP
+#define VORONOIMESHBINARYFILE_HPP
+
+#include "VoronoiMeshFile.hpp"
+class ColumnBinaryFile;
+
+////////////////////////////////////////////////////////////////////
+
+/** The VoronoiMeshBinaryFile class can read the relevant information on a cartesian
+    three-dimensional Voronoi mesh from a file in the column binary format described for the
+    ColumnBinaryFile class. The file is mapped into memory rather than parsed, which makes this
+    format much faster than the ASCII format for large meshes. Each row in the file represents a
+    particle record, and the columns have the same meaning as the numbers on a record line in the
+    format of the VoronoiMeshAsciiFile class: the first three columns provide the x,y,z
+    coordinates of the particle, and subsequent columns provide the \f$N_{fields}\f$ values of the
+    fields. A file in the ASCII format can be converted to the binary format with the command
+    line option <tt>-c</tt> of SKIRT. */
+class VoronoiMeshBinaryFile : public VoronoiMeshFile
+{
+    Q_OBJECT
+    Q_CLASSINFO("Title", "a Voronoi mesh data file in column binary format")
+
+    Q_CLASSINFO("Property", "coordinateUnits")
+    Q_CLASSINFO("Title", "the units in which the file specifies particle coordinates")
+    Q_CLASSINFO("Quantity", "length")
+    Q_CLASSINFO("MinValue", "0")
+    Q_CLASSINFO("Default", "1 pc")
+
+    //================= Construction - Destruction =================
+
+public:
+    /** The default constructor. */
+    Q_INVOKABLE VoronoiMeshBinaryFile();
+
+    /** The destructor closes the file if it is still open. */
+    ~VoronoiMeshBinaryFile();
+
+protected:
+    /** This function verifies the property values. */
+    virtual void setupSelfBefore();
+
+    //======== Setters & Getters for Discoverable Attributes =======
+
+public:
+    /** Sets the units in which the file specifies particle coordinates. */
+    Q_INVOKABLE void setCoordinateUnits(double value);
+
+    /** Returns the units in which the file specifies particle coordinates. */
+    Q_INVOKABLE double coordinateUnits() const;
+
+    //======================== Other Functions =======================
+
+public:
+    /** This function opens the Voronoi mesh data file and maps it into memory, or throws a fatal
+        error if the file can't be opened or is not a valid column binary file. It does not yet
+        read any records. */
+    void open();
+
+    /** This function closes the Voronoi mesh data file. */
+    void close();
+
+    /** This function advances to the next record in the file, and holds its information ready for
+        inspection through the other functions of this class. The function returns true if there
+        was a next record, or false if the end of the file was reached. */
+    bool read();
+
+    /** This function returns the coordinates of the particle (in SI units) for the current record.
+        If there is no current record, or if the file has less than three columns, a fatal error is
+        thrown. */
+    Vec particle() const;
+
+    /** This function returns the value \f$F_g\f$ of the field (in data file units) with given
+        zero-based index \f$0\le g \le N_{fields}-1\f$ for the current record. If there is no
+        current record, or if the index is out of range, a fatal error is thrown. */
+    double value(int g) const;
+
+    //========================= Data members =======================
+
+private:
+    double _coordinateUnits;     // the units in which the file specifies particle coordinates
+    ColumnBinaryFile* _infile;   // the input file, or null if the file is not open
+    size_t _row;                 // the index of the current record plus one, or zero if there is no current record
+};
+
+////////////////////////////////////////////////////////////////////
+
+#endif // VORONOIMESHBINARYFILE_HPP
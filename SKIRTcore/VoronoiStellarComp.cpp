@@ -11,6 +11,7 @@
 #include "FilePaths.hpp"
 #include "Log.hpp"
 #include "NR.hpp"
+#include "ParallelFactory.hpp"
 #include "PhotonPackage.hpp"
 #include "Random.hpp"
 #include "Units.hpp"
@@ -43,7 +44,8 @@ void VoronoiStellarComp::setupSelfBefore()
     _random = find<Random>();
 
     // import the Voronoi mesh
-    _mesh = new VoronoiMesh(_meshfile, QList<int>() << _densityIndex << _metallicityIndex << _ageIndex, extent());
+    _mesh = new VoronoiMesh(_meshfile, QList<int>() << _densityIndex << _metallicityIndex << _ageIndex, extent(),
+                            find<ParallelFactory>());
     find<Log>()->info("Voronoi mesh data was successfully imported: " + QString::number(_mesh->Ncells()) + " cells.");
 
     // construct the library of SED models
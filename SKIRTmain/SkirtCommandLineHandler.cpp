@@ -10,6 +10,7 @@
 #include <QSharedPointer>
 #include <QHostInfo>
 #include "Array.hpp"
+#include "ColumnBinaryFile.hpp"
 #include "CommandLineArguments.hpp"
 #include "Console.hpp"
 #include "ConsoleHierarchyCreator.hpp"
@@ -38,7 +39,7 @@
 namespace
 {
     // the allowed options list, in the format consumed by the CommandLineArguments constructor
-    static const char* allowedOptions = "-t* -s* -b -v -m -l* -e -i* -o* -k -r -x";
+    static const char* allowedOptions = "-t* -s* -b -v -m -l* -e -i* -o* -k -r -x -c*";
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -70,10 +71,12 @@ int SkirtCommandLineHandler::perform()
         // if there are no arguments at all --> interactive mode
         // if there is at least one file path argument --> batch mode
         // if the -x option is present --> export smile schema (undocumented option)
+        // if the -c option is present --> convert a column text file to binary format
         // otherwise --> error
         if (_args.isValid() && !_args.hasOptions() && !_args.hasFilepaths()) return doInteractive();
         if (_args.hasFilepaths()) return doBatch();
         if (_args.isPresent("-x")) return doSmileSchema();
+        if (_args.isPresent("-c")) return doConvert();
         _console.error("Invalid command line arguments");
         printHelp();
     }
@@ -188,6 +191,25 @@ int SkirtCommandLineHandler::doSmileSchema()
 
 ////////////////////////////////////////////////////////////////////
 
+int SkirtCommandLineHandler::doConvert()
+{
+    QString textpath = _args.value("-c");
+    QFileInfo info(textpath);
+    QString binarypath = info.dir().filePath(info.completeBaseName() + ".bin");
+    if (QFileInfo(binarypath).absoluteFilePath() == info.absoluteFilePath())
+        throw FATALERROR("The text file should not have the .bin filename extension");
+
+    _console.info("Converting column text file " + textpath + " to binary format...");
+    size_t Nrows, Ncols;
+    ColumnBinaryFile::convert(textpath, binarypath, Nrows, Ncols);
+    _console.info("  Number of rows: " + QString::number(Nrows));
+    _console.info("  Number of columns: " + QString::number(Ncols));
+    _console.info("Successfully created column binary file '" + binarypath + "'.");
+    return EXIT_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////
+
 QStringList SkirtCommandLineHandler::skifilesFor(QString filepath)
 {
     QStringList result;
@@ -374,6 +396,7 @@ void SkirtCommandLineHandler::printHelp()
     _console.warning("  skirt [-b] [-v] [-m] [-s <simulations>] [-t <threads>]");
     _console.warning("        [-k] [-i <dirpath>] [-o <dirpath>]");
     _console.warning("        [-r] {<filepath>}*");
+    _console.warning("To convert a column text file to binary:   skirt -c <filepath>");
     _console.warning("");
     _console.warning("  -b : forces brief console logging");
     _console.warning("  -v : forces verbose logging");
@@ -386,6 +409,7 @@ void SkirtCommandLineHandler::printHelp()
     _console.warning("  -i <dirpath> : the relative or absolute path for simulation input files");
     _console.warning("  -o <dirpath> : the relative or absolute path for simulation output files");
     _console.warning("  -r : causes recursive directory descent for all specified ski file paths");
+    _console.warning("  -c <filepath> : converts the specified column text file to binary format");
     _console.warning("  <filepath> : the relative or absolute file path for a ski file");
     _console.warning("               (the filename may contain ? and * wildcards)");
     _console.warning("");
@@ -82,6 +82,12 @@ private:
     /** This function exports a smile schema. This is an undocumented option. */
     int doSmileSchema();
 
+    /** This function converts the column text file specified with the -c option to the column
+        binary format described for the ColumnBinaryFile class. The binary file is placed next to
+        the text file, with the same name and the filename extension ".bin". The function returns
+        an appropriate application exit value. */
+    int doConvert();
+
     /** This function returns a list of ski filenames corresponding to the specified filepath,
         after processing any wildcards and performing recursive descent if so requested by the -r
         option. If the returned list is empty, the function logs an appropriate error message and